@@ -18,11 +18,20 @@
 //  limitations under the License.
 
 #import <Foundation/Foundation.h>
-#import <dispatch/dispatch.h>
+#import "Workers.h"
 
 
-@interface QueueController : NSObject
+@interface QueueController : NSObject {
+    Workers *workers;
+    BOOL suspended;
+}
 
-@property (assign) dispatch_queue_t senderQueue;
+@property (nonatomic, assign) int concurrency;
+@property (assign) BOOL pinned;
+
+- (id)initWithConcurrency:(int)concurrency pinned:(BOOL)pinned;
+- (BOOL)submit:(void (^)(void))block;
+- (void)suspend;
+- (void)resume;
 
 @end
@@ -18,24 +18,119 @@
 //  limitations under the License.
 
 #import "QueueController.h"
+#import <Block.h>
+
+//Workers are plain threads, with no autorelease pool of their own as a dispatch queue would have
+static void runBlock(void *context)
+{
+    void (^block)(void) = context;
+    
+    @autoreleasepool {
+        block();
+    }
+    Block_release(block);
+}
 
 @implementation QueueController
 
-@synthesize senderQueue = _senderQueue;
+//Cocoa must be told it is multithreaded before threads it did not start use it, by starting one NSThread
++ (void)becomeMultiThreaded:(id)unused
+{
+}
+
+@synthesize concurrency = _concurrency;
+@synthesize pinned = _pinned;
 
 - (id)init
+{
+    return [self initWithConcurrency:Workers_cpuCount() pinned:NO];
+}
+
+- (id)initWithConcurrency:(int)concurrency pinned:(BOOL)pinned
 {
     self = [super init];
     if (self) {
         // Initialization code here.
         
-        _senderQueue = dispatch_queue_create("senderQueue", NULL);
-        
+        _pinned = pinned;
+        [self setConcurrency:concurrency];
     
     }
     
     return self;
 }
 
+- (void)dealloc
+{
+    if (workers != NULL) {
+        Workers_destroy(workers);
+    }
+    [super dealloc];
+}
+
+//Replace the workers with a pool of the new size, the old workers finish their queue in the background
+//If the new pool cannot be started the old one is kept
+- (void)setConcurrency:(int)concurrency
+{
+    Workers *oldWorkers;
+    Workers *newWorkers;
+    
+    if (concurrency < 1 || (workers != NULL && concurrency == _concurrency)) {
+        return;
+    }
+    
+    if (![NSThread isMultiThreaded]) {
+        [NSThread detachNewThreadSelector:@selector(becomeMultiThreaded:) toTarget:[QueueController class] withObject:nil];
+    }
+    if ((newWorkers = Workers_create(concurrency, _pinned)) == NULL) {
+        NSLog(@"Could not start %d workers", concurrency);
+        return;
+    }
+    oldWorkers = workers;
+    workers = newWorkers;
+    _concurrency = concurrency;
+    if (suspended) {
+        Workers_pause(workers);
+    }
+    
+    if (oldWorkers != NULL) {
+        Workers_resume(oldWorkers);
+        dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+            Workers_wait(oldWorkers);
+            Workers_destroy(oldWorkers);
+        });
+    }
+}
+
+//Run the block on the next free worker
+//Returns NO if the block could not be queued, in which case it will never run
+- (BOOL)submit:(void (^)(void))block
+{
+    void (^copy)(void) = Block_copy(block);
+    
+    if (workers == NULL || Workers_submit(workers, runBlock, copy) != WORKERS_SUCCESS) {
+        Block_release(copy);
+        NSLog(@"Could not queue a sender, the workers are not running");
+        return NO;
+    }
+    return YES;
+}
+
+- (void)suspend
+{
+    suspended = YES;
+    if (workers != NULL) {
+        Workers_pause(workers);
+    }
+}
+
+- (void)resume
+{
+    suspended = NO;
+    if (workers != NULL) {
+        Workers_resume(workers);
+    }
+}
+
 
 @end
@@ -19,6 +19,8 @@
 
 #import <Cocoa/Cocoa.h>
 #import "MQTTClient.h"
+#import "Stats.h"
+#import "Scenario.h"
 
 @class ThreadSliderController;
 @class QueueController;
@@ -34,6 +36,9 @@
     NSTextField *ThreadCountTextField;
     NSButton *resumeButton;
     NSTextField *brokerTextField;
+    NSTextField *statsTextField;
+    Stats *stats;
+    Scenario *scenario;
 }
 
 @property (assign) Boolean stopped;
@@ -51,6 +56,7 @@
 @property (assign) IBOutlet NSButton *resumeButton;
 @property (assign) IBOutlet NSButton *appendCounterCheckBox;
 @property (assign) IBOutlet NSButton *retainMessageCheckBox;
+@property (assign) IBOutlet NSTextField *statsTextField;
 
 - (IBAction)stopButtonAction:(id)sender;
 - (IBAction)quitButtonAction:(id)sender;
@@ -60,6 +66,7 @@
 - (IBAction)resumeButtonAction:(id)sender;
 - (void)sendMQTTMessage:(int)queueIdentifier;
 - (void)updateUserInterface;
+- (void)updateStatistics:(NSTimer *)timer;
 
 
 @end
@@ -24,6 +24,8 @@
 #import <stdlib.h>
 #import "QueueController.h"
 #import "QualityOfServiceController.h"
+#import "LoadGenerator.h"
+#import "ConnectionPool.h"
 
 @implementation SimpleMessageAppDelegate;
 
@@ -38,6 +40,7 @@
 @synthesize resumeButton;
 @synthesize appendCounterCheckBox;
 @synthesize retainMessageCheckBox;
+@synthesize statsTextField;
 @synthesize queueController = _queueController;
 @synthesize qualityOfServiceController = _qualityOfServiceController;
 
@@ -54,25 +57,50 @@
     [self setThreadSliderController:athreadSliderControler];
     
     
-    //QueueController for dispatch queue
-    QueueController *aqueueController = [[QueueController alloc] init];
+    //QueueController running the senders on worker threads, pinned to CPUs if PinSenderThreads is set
+    QueueController *aqueueController = [[QueueController alloc] initWithConcurrency:Workers_cpuCount()
+                                                                               pinned:[[NSUserDefaults standardUserDefaults] boolForKey:@"PinSenderThreads"]];
     [self setQueueController:aqueueController];
     
     //QualityOfServiceController holding Quality of Service Level
     QualityOfServiceController *aqualityOfServiceController = [[QualityOfServiceController alloc] init];
     [self setQualityOfServiceController:aqualityOfServiceController];
     
+    //Counters fed by the senders, shown in the status line above the buttons and refreshed every second
+    stats = Stats_create();
+    [NSTimer scheduledTimerWithTimeInterval:1.0 target:self selector:@selector(updateStatistics:) userInfo:nil repeats:YES];
+    
+    //Replay the scenario file named by ScenarioFile in place of the topic, QoS and retain settings if it is set
+    NSString *scenarioFile = [[NSUserDefaults standardUserDefaults] stringForKey:@"ScenarioFile"];
+    if (scenarioFile != nil) {
+        char error[256];
+        
+        if (Scenario_load((char *)[scenarioFile fileSystemRepresentation], &scenario, error, sizeof(error)) != SCENARIO_SUCCESS) {
+            NSLog(@"Ignoring scenario: %s", error);
+        }
+    }
+    
 }
 
-volatile MQTTClient_deliveryToken deliveredtoken;
+- (void)applicationWillTerminate:(NSNotification *)aNotification
+{
+    //Close the connections kept open between Send presses
+    ConnectionPool_closeAll(TIMEOUT);
+    Scenario_destroy(scenario);
+}
 
 - (IBAction)sendButton:(id)sender {
     int i;
     
-    if([[targetField stringValue] length] != 0 && [[messageField stringValue] length] != 0  ) {
+    if(scenario != NULL || ([[targetField stringValue] length] != 0 && [[messageField stringValue] length] != 0)) {
                 
+        //One worker and one connection for each parallel sender, numbered 1 to the thread count
+        [self.queueController setConcurrency:[ThreadCountTextField intValue]];
+        
         for (i=1; i <= [ThreadCountTextField intValue]; i++){
-            dispatch_async([self.queueController senderQueue], ^{[self sendMQTTMessage:i];});
+            if (![self.queueController submit:^{[self sendMQTTMessage:i];}]) {
+                break;
+            }
         }
         
         }else{
@@ -92,96 +120,73 @@ volatile MQTTClient_deliveryToken deliveredtoken;
 
 - (IBAction)pauseButtonAction:(id)sender {
     [sendButton setEnabled:false];
-    dispatch_suspend([self.queueController senderQueue]);
+    [self.queueController suspend];
     [resumeButton setEnabled:true];
 }
 
 - (IBAction)resumeButtonAction:(id)sender {
-    dispatch_resume([self.queueController senderQueue]);
+    [self.queueController resume];
     [resumeButton setEnabled:false];
     [sendButton setEnabled:true];
 }
 
 - (void)sendMQTTMessage:(int)queueIdentifier {
 
-    int i;
-    //NSString *message;
-    Boolean appendmessage;
+    LoadGenerator_options options = LoadGenerator_options_initializer;
+    LoadGenerator_results results = LoadGenerator_results_initializer;
     
-    //TODO Add Mac Adrees or System UID to Client ID
-    char *client_id = [@"SimpleMessage-" stringByAppendingString:[NSString stringWithFormat:@"%d",queueIdentifier]];
-        
-    MQTTClient client;
-    MQTTClient_connectOptions conn_opts = MQTTClient_connectOptions_initializer;
-    MQTTClient_message pubmsg = MQTTClient_message_initializer;
-    MQTTClient_deliveryToken token;
-    int rc;
+    //With more than one worker, each gets a unique Client ID generated from this prefix
+    options.serverURI = (char *)[[brokerTextField stringValue] UTF8String];
+    options.clientId = CLIENTID;
+    options.topic = (char *)[[targetField stringValue] UTF8String];
+    options.message = (char *)[[messageField stringValue] UTF8String];
+    options.messages = [self.threadSliderController threadCount];
+    options.connections = [self.queueController concurrency];
     
-    char *chartopic = [[targetField stringValue] UTF8String];
+    //Append counter to message if checkbox is enabled
+    options.appendCounter = ([appendCounterCheckBox state] == NSOnState);
     
-    MQTTClient_create(&client, [[brokerTextField stringValue] UTF8String], CLIENTID,
-                      MQTTCLIENT_PERSISTENCE_NONE, NULL);
+    //Set Qualit of Service Level
+    options.qos = [self.qualityOfServiceController qualityOfServiceLevel];
     
-    conn_opts.keepAliveInterval = 20;
-    conn_opts.cleansession = 1;
+    //Set retain message if checkbox is enabled
+    options.retained = ([retainMessageCheckBox state] == NSOnState);
     
-    MQTTClient_setCallbacks(client, NULL, NULL, NULL, NULL);
+    options.disconnectTimeout = TIMEOUT;
     
-    if ((rc = MQTTClient_connect(client, &conn_opts)) != MQTTCLIENT_SUCCESS)
-    {
-        NSLog(@"Failed to connect!");
-    }    
-            
+    //Publish at a fixed rate per connection if MessagesPerSecond is set, as fast as possible otherwise
+    options.rate = [[NSUserDefaults standardUserDefaults] doubleForKey:@"MessagesPerSecond"];
     
-    NSString *message = [messageField stringValue];
+    //Stamp payloads for end-to-end latency measurement by simplemessage-bench -L if TimestampPayloads is set
+    options.stamped = [[NSUserDefaults standardUserDefaults] boolForKey:@"TimestampPayloads"];
     
-    //Append counter to message if checkbox is enabled
-    if ([appendCounterCheckBox state] == NSOnState){
-        appendmessage = true;
-    } else {
-        appendmessage = false;
-    }
+    //Keep up to AckWindow QoS 1/2 messages unacknowledged instead of waiting at the end of the batch
+    options.window = (int)[[NSUserDefaults standardUserDefaults] integerForKey:@"AckWindow"];
     
-    //Set Qualit of Service Level
-    pubmsg.qos = [self.qualityOfServiceController qualityOfServiceLevel];
+    //The scenario, if one was loaded, takes over from the topic, QoS, retain and message count
+    options.scenario = scenario;
     
+    results.stats = stats;
     
-    //Set retain message if checkbox is enabled
-    if ([retainMessageCheckBox state] == NSOnState){
-        pubmsg.retained = 1;
-    } else {
-        pubmsg.retained = 0;
+    if (LoadGenerator_sendBatch(&options, queueIdentifier, &results) != LOADGENERATOR_SUCCESS)
+    {
+        NSLog(@"Failed to connect!");
     }
     
-    deliveredtoken = 0;
-    
-    
-    for (i=1; i <= [self.threadSliderController threadCount]; i++){
-    
-        if(appendmessage == true){
-            
-            pubmsg.payload = [[[message stringByAppendingString:[NSString stringWithFormat:@"%s"," - "]] stringByAppendingString:[NSString stringWithFormat:@"%d",i]] UTF8String];
-            
-            pubmsg.payloadlen = (int)[[[message stringByAppendingString:[NSString stringWithFormat:@"%s"," - "]] stringByAppendingString:[NSString stringWithFormat:@"%d",i]] length];
+}
 
-            
-        } else {
-            pubmsg.payload = [message UTF8String];
-            pubmsg.payloadlen = (int)[message length];
-            
-        }
-        
-        MQTTClient_publishMessage(client, chartopic, &pubmsg, &token);
-                
-    
-    }
 
-    MQTTClient_disconnect(client, 10000);
-    MQTTClient_destroy(&client);
+- (void)updateStatistics:(NSTimer *)timer {
+    Stats_sample sample;
     
+    if (Stats_takeSample(stats, &sample, 1) == 1) {
+        [statsTextField setStringValue:[NSString stringWithFormat:@"Published %ld (%.0f/s)   Acked %ld (%.0f/s)   Failed %ld   In-flight %ld   Reconnects %ld",
+                                        sample.total.published, sample.delta.published / sample.interval,
+                                        sample.total.acked, sample.delta.acked / sample.interval,
+                                        sample.total.failed, sample.total.inflight, sample.total.reconnects]];
+    }
 }
 
-
 - (void)updateUserInterface {
     
     [self.parallelTextField setIntValue:[self.threadSliderController threadCount]];
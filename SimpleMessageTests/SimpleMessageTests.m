@@ -8,6 +8,146 @@
 
 #import "SimpleMessageTests.h"
 
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "AckWindow.h"
+#include "Clock.h"
+#include "LatencyMonitor.h"
+#include "MQTTClient.h"
+#include "MQTTProtocolClient.h"
+#include "Payload.h"
+#include "Resolver.h"
+#include "Scenario.h"
+#include "Socket.h"
+#include "SocketBuffer.h"
+#include "Thread.h"
+
+/**
+ * Stamp a payload and give it to the monitor as if it had arrived on topic lm/t at QoS 1,
+ * returning whether the monitor counted it
+ */
+static int recordStamp(LatencyMonitor* monitor, Payload* payload, uint32_t connection, uint32_t sequence)
+{
+    int len = Payload_render(payload, sequence);
+
+    Payload_stamp(payload, connection, sequence, Clock_now());
+    return LatencyMonitor_record(monitor, "lm/t", 0, 1, payload->buffer, len);
+}
+
+/**
+ * Append a message with the given id to one of a client's message lists and index it
+ */
+static void addMessage(Clients* client, int msgid, int inbound)
+{
+    List* list = (inbound) ? client->inboundMsgs : client->outboundMsgs;
+    Messages* m = malloc(sizeof(Messages));
+
+    memset(m, '\0', sizeof(Messages));
+    m->msgid = msgid;
+    ListAppend(list, m, sizeof(Messages));
+    if (inbound)
+        MQTTProtocol_indexInbound(client, list->last);
+    else
+        MQTTProtocol_indexOutbound(client, list->last);
+}
+
+/**
+ * Write text to a file in the temporary directory, returning its path
+ */
+static NSString* writeTemporaryFile(NSString* name, NSString* contents)
+{
+    NSString* path = [NSTemporaryDirectory() stringByAppendingPathComponent:name];
+    [contents writeToFile:path atomically:YES encoding:NSUTF8StringEncoding error:NULL];
+    return path;
+}
+
+/**
+ * Count the bytes of a buffer which have the given value
+ */
+static int countBytes(void* buf, int len, char c)
+{
+    int i, count = 0;
+
+    for (i = 0; i < len; ++i)
+        if (((char*)buf)[i] == c)
+            ++count;
+    return count;
+}
+
+/**
+ * Listen on an ephemeral port of the loopback interface, returning the socket and the port
+ */
+static int listenOnLoopback(int* port)
+{
+    struct sockaddr_in address;
+    socklen_t len = sizeof(address);
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+
+    memset(&address, '\0', sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(sock, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(sock, 1) != 0 ||
+            getsockname(sock, (struct sockaddr*)&address, &len) != 0)
+    {
+        close(sock);
+        return -1;
+    }
+    *port = ntohs(address.sin_port);
+    return sock;
+}
+
+/**
+ * Read whatever is waiting on a non-blocking socket and throw it away
+ */
+static void drainSocket(int sock)
+{
+    char buf[4096];
+
+    while (recv(sock, buf, sizeof(buf), 0) > 0)
+        ;
+}
+
+/**
+ * Act as a broker for one client on the listening socket given: accept its connection, and
+ * answer its CONNECT with a CONNACK and five QoS 0 publications to fb/t, whose payloads are
+ * m0 to m4, all in one write.  Then wait for the client to close the connection.
+ */
+static thread_return_type fakeBroker(void* listener)
+{
+    char buf[256];
+    int sock = accept(*(int*)listener, NULL, NULL), len = 0, i;
+
+    if (sock == -1)
+        return 0;
+    if (recv(sock, buf, sizeof(buf), 0) > 0)
+    {
+        buf[len++] = 0x20;
+        buf[len++] = 0x02;
+        buf[len++] = 0x00;
+        buf[len++] = 0x00;
+        for (i = 0; i < 5; ++i)
+        {
+            buf[len++] = 0x30;
+            buf[len++] = 2 + 4 + 2;
+            buf[len++] = 0x00;
+            buf[len++] = 0x04;
+            memcpy(&buf[len], "fb/t", 4);
+            len += 4;
+            buf[len++] = 'm';
+            buf[len++] = '0' + i;
+        }
+        send(sock, buf, len, 0);
+        while (recv(sock, buf, sizeof(buf), 0) > 0)
+            ;
+    }
+    close(sock);
+    return 0;
+}
+
 @implementation SimpleMessageTests
 
 - (void)setUp
@@ -24,9 +164,406 @@
     [super tearDown];
 }
 
-- (void)testExample
+// Each phase is copied from the one before it after the phase array grows, which used
+// to read the previous phase from the array the realloc had just freed
+- (void)testScenarioPhasesInheritFromPreviousPhase
+{
+    NSString* path = writeTemporaryFile(@"phases.scenario",
+        @"seed 1234\n"
+        @"phase warmup\n  duration 10\n  rate 50\n"
+        @"  topic sensors/{c}/temperature 8\n  topic alerts/{r:100} 1\n"
+        @"  size 32-256 9\n  size 4096 1\n  qos 0 80\n  qos 1 15\n  qos 2 5\n"
+        @"phase peak\n  messages 20000\n  rate 0\n"
+        @"phase cooldown\n  duration 5\n  rate 5\n");
+    Scenario* scenario = NULL;
+    char error[256];
+
+    STAssertEquals(Scenario_load((char*)[path fileSystemRepresentation], &scenario, error, sizeof(error)),
+                   SCENARIO_SUCCESS, @"load failed: %s", error);
+    STAssertEquals(scenario->phaseCount, 3, nil);
+    STAssertEquals(scenario->phases[2].topicCount, 2, nil);
+    STAssertEquals(scenario->phases[2].sizeCount, 2, nil);
+    STAssertEquals(scenario->phases[2].qos[2], 5, nil);
+    STAssertTrue(strcmp(scenario->phases[2].topics[1].topic, "alerts/{r:100}") == 0, nil);
+    STAssertEquals(scenario->phases[1].messages, 20000, nil);
+    Scenario_destroy(scenario);
+}
+
+// The connection number in a stamp comes from the network, and used to size the
+// sequence table unchecked
+- (void)testLatencyMonitorDropsStampsFromUnknownConnections
+{
+    LatencyMonitor* monitor = LatencyMonitor_create(2);
+    Payload* payload = Payload_create("hello", 0, 1);
+    LatencyMonitor_series* series = NULL;
+
+    STAssertFalse(recordStamp(monitor, payload, 0xFFFFFFFF, 1), nil);
+    STAssertFalse(recordStamp(monitor, payload, 0, 1), nil);
+    STAssertFalse(recordStamp(monitor, payload, 3, 1), nil);
+    STAssertEquals(LatencyMonitor_received(monitor), 0L, nil);
+    STAssertTrue(recordStamp(monitor, payload, 1, 1), nil);
+    STAssertTrue(recordStamp(monitor, payload, 2, 1), nil);
+    series = LatencyMonitor_getSeries(monitor);
+    STAssertEquals(series->lastCount, 2, nil);
+    STAssertEquals(series->received, 2L, nil);
+    Payload_destroy(payload);
+    LatencyMonitor_destroy(monitor);
+}
+
+// Each run numbers its messages from 1 again, which must not count as duplicates
+- (void)testLatencyMonitorSequencesRestartEachRun
+{
+    LatencyMonitor* monitor = LatencyMonitor_create(1);
+    Payload* payload = Payload_create("hello", 0, 1);
+    LatencyMonitor_series* series = NULL;
+
+    recordStamp(monitor, payload, 1, 1);
+    recordStamp(monitor, payload, 1, 2);
+    LatencyMonitor_resetSequences(monitor);
+    recordStamp(monitor, payload, 1, 1);
+    recordStamp(monitor, payload, 1, 3);
+    series = LatencyMonitor_getSeries(monitor);
+    STAssertEquals(series->received, 4L, nil);
+    STAssertEquals(series->duplicates, 0L, nil);
+    STAssertEquals(series->lost, 1L, nil);
+    Payload_destroy(payload);
+    LatencyMonitor_destroy(monitor);
+}
+
+// Removing a message must not hide the ones which collided with it in the index
+- (void)testOutboundIndexFindsCollidingMessagesAfterRemoval
+{
+    Clients client;
+
+    memset(&client, '\0', sizeof(Clients));
+    client.outboundMsgs = ListInitialize();
+    /* 1, 17 and 33 share a slot in the smallest index, and push 2 out of its own */
+    addMessage(&client, 1, 0);
+    addMessage(&client, 17, 0);
+    addMessage(&client, 33, 0);
+    addMessage(&client, 2, 0);
+    STAssertEquals(client.outboundIndexSize, 16, nil);
+    MQTTProtocol_removeOutbound(&client, MQTTProtocol_findOutbound(&client, 17));
+    STAssertTrue(MQTTProtocol_findOutbound(&client, 17) == NULL, nil);
+    STAssertTrue(MQTTProtocol_findOutbound(&client, 1) != NULL, nil);
+    STAssertTrue(MQTTProtocol_findOutbound(&client, 33) != NULL, nil);
+    STAssertTrue(MQTTProtocol_findOutbound(&client, 2) != NULL, nil);
+    MQTTProtocol_removeOutbound(&client, MQTTProtocol_findOutbound(&client, 1));
+    STAssertTrue(MQTTProtocol_findOutbound(&client, 33) != NULL, nil);
+    STAssertTrue(MQTTProtocol_findOutbound(&client, 2) != NULL, nil);
+    STAssertEquals(client.outboundMsgs->count, 2, nil);
+    ListFree(client.outboundMsgs);
+    free(client.outboundIndex);
+}
+
+// QoS 2 messages awaiting release are found by id, as outbound ones are
+- (void)testInboundIndexFindsMessagesById
+{
+    Clients client;
+
+    memset(&client, '\0', sizeof(Clients));
+    client.inboundMsgs = ListInitialize();
+    addMessage(&client, 5, 1);
+    addMessage(&client, 21, 1);
+    STAssertTrue(MQTTProtocol_findInbound(&client, 21) != NULL, nil);
+    MQTTProtocol_removeInbound(&client, MQTTProtocol_findInbound(&client, 5));
+    STAssertTrue(MQTTProtocol_findInbound(&client, 5) == NULL, nil);
+    STAssertTrue(MQTTProtocol_findInbound(&client, 21) != NULL, nil);
+    STAssertEquals(client.inboundMsgs->count, 1, nil);
+    ListFree(client.inboundMsgs);
+    free(client.inboundIndex);
+}
+
+// A late acknowledgement for an earlier batch's message must not free a place in the next window
+- (void)testAckWindowIgnoresAcksFromEarlierBatches
+{
+    AckWindow* window = AckWindow_create(1, NULL);
+
+    STAssertEquals(AckWindow_reserve(window, 0), ACKWINDOW_SUCCESS, nil);
+    STAssertEquals(AckWindow_sent(window, 7, Clock_now()), 0, nil);
+    STAssertEquals(AckWindow_deliveryComplete(window, 3), 0, nil);
+    STAssertEquals(AckWindow_acked(window), 0L, nil);
+    STAssertEquals(AckWindow_reserve(window, 0), ACKWINDOW_TIMEOUT, nil);
+    STAssertEquals(AckWindow_deliveryComplete(window, 7), 1, nil);
+    STAssertEquals(AckWindow_acked(window), 1L, nil);
+    STAssertEquals(AckWindow_drain(window, 0), ACKWINDOW_SUCCESS, nil);
+    AckWindow_destroy(window);
+}
+
+// The acknowledgement can arrive before MQTTClient_publish returns the token
+- (void)testAckWindowCountsAcksWhichBeatThePublisher
+{
+    AckWindow* window = AckWindow_create(1, NULL);
+
+    STAssertEquals(AckWindow_reserve(window, 0), ACKWINDOW_SUCCESS, nil);
+    STAssertEquals(AckWindow_deliveryComplete(window, 5), 0, nil);
+    STAssertEquals(AckWindow_sent(window, 5, Clock_now()), 1, nil);
+    STAssertEquals(AckWindow_acked(window), 1L, nil);
+    STAssertEquals(AckWindow_drain(window, 0), ACKWINDOW_SUCCESS, nil);
+    AckWindow_destroy(window);
+}
+
+
+// Output queued behind a partial write goes into a ring, which is handed back to writev in two
+// pieces once it wraps round its end, and grows without losing its order when it fills
+- (void)testOutputRingWrapsAroundItsEnd
+{
+    char a[3000], b[2000], c[3000];
+    iobuf in, out[2];
+    int sock = 5;
+
+    memset(a, 'a', sizeof(a));
+    memset(b, 'b', sizeof(b));
+    memset(c, 'c', sizeof(c));
+    SocketBuffer_initialize();
+    in.iov_base = a;
+    in.iov_len = sizeof(a);
+    STAssertEquals(SocketBuffer_queueWrite(sock, 1, &in, 0), 3000, nil);
+    STAssertEquals(SocketBuffer_wrote(sock, 2500), 500, nil);
+    in.iov_base = b;
+    in.iov_len = sizeof(b);
+    STAssertEquals(SocketBuffer_queueWrite(sock, 1, &in, 0), 2500, nil);
+
+    /* 500 bytes of a then 1096 of b up to the end of the 4096 byte ring, and the rest of b from its start */
+    STAssertEquals(SocketBuffer_getWrite(sock, out), 2, nil);
+    STAssertEquals((int)out[0].iov_len, 1596, nil);
+    STAssertEquals(countBytes(out[0].iov_base, 500, 'a'), 500, nil);
+    STAssertEquals(countBytes((char*)out[0].iov_base + 500, 1096, 'b'), 1096, nil);
+    STAssertEquals((int)out[1].iov_len, 904, nil);
+    STAssertEquals(countBytes(out[1].iov_base, 904, 'b'), 904, nil);
+
+    /* a partial write of the first piece */
+    STAssertEquals(SocketBuffer_wrote(sock, 1000), 1500, nil);
+    STAssertEquals(SocketBuffer_getWrite(sock, out), 2, nil);
+    STAssertEquals((int)out[0].iov_len, 596, nil);
+    STAssertEquals((int)out[1].iov_len, 904, nil);
+
+    /* more than the ring holds unwraps it into a larger one */
+    in.iov_base = c;
+    in.iov_len = sizeof(c);
+    STAssertEquals(SocketBuffer_queueWrite(sock, 1, &in, 0), 4500, nil);
+    STAssertEquals(SocketBuffer_getWrite(sock, out), 1, nil);
+    STAssertEquals((int)out[0].iov_len, 4500, nil);
+    STAssertEquals(countBytes(out[0].iov_base, 1500, 'b'), 1500, nil);
+    STAssertEquals(countBytes((char*)out[0].iov_base + 1500, 3000, 'c'), 3000, nil);
+
+    STAssertEquals(SocketBuffer_wrote(sock, 4500), 0, nil);
+    STAssertEquals(SocketBuffer_queuedWrites(sock), 0, nil);
+    STAssertEquals(SocketBuffer_getWrite(sock, out), 0, nil);
+    SocketBuffer_cleanup(sock);
+    SocketBuffer_terminate();
+}
+
+// A socket whose peer is not reading is full once its queued output reaches the high-water
+// mark, and stops being full when the queue has been written out
+- (void)testOutputFullFromHighWaterMarkUntilWritten
+{
+    struct timeval tv = {0, 100000};
+    char chunk[1024];
+    int port = 0, listener, peer, sock = -1, size = 4096, i;
+
+    memset(chunk, 'x', sizeof(chunk));
+    Socket_outInitialize(1);
+    Socket_setHighWaterMark(8192);
+    listener = listenOnLoopback(&port);
+    STAssertTrue(listener != -1, nil);
+    setsockopt(listener, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    Socket_new("127.0.0.1", port, &sock, NULL);
+    STAssertTrue(sock != -1, nil);
+    setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    peer = accept(listener, NULL, NULL);
+    STAssertTrue(peer != -1, nil);
+    fcntl(peer, F_SETFL, fcntl(peer, F_GETFL) | O_NONBLOCK);
+    for (i = 0; i < 10 && Socket_getReadySocket(0, 0, &tv) == 0; ++i)
+        ; /* the connect completes */
+    STAssertTrue(Socket_noPendingWrites(sock), nil);
+
+    for (i = 0; i < 10000 && !Socket_outputFull(sock); ++i)
+        Socket_putdatas(sock, chunk, sizeof(chunk), 0, NULL, NULL);
+    STAssertTrue(Socket_outputFull(sock), nil);
+    STAssertFalse(Socket_noPendingWrites(sock), nil);
+    STAssertTrue(SocketBuffer_queuedWrites(sock) >= 8192, nil);
+
+    for (i = 0; i < 1000 && !Socket_noPendingWrites(sock); ++i)
+    {
+        drainSocket(peer);
+        Socket_getReadySocket(0, 0, &tv);
+    }
+    STAssertTrue(Socket_noPendingWrites(sock), nil);
+    STAssertFalse(Socket_outputFull(sock), nil);
+    STAssertEquals(SocketBuffer_queuedWrites(sock), 0, nil);
+
+    Socket_close(sock);
+    close(peer);
+    close(listener);
+    Socket_setHighWaterMark(SOCKET_HIGH_WATER_MARK);
+    Socket_outTerminate();
+}
+
+
+// A packet which arrives in pieces is read from the socket's buffer once it is all there,
+// however it is split, and the packets which follow it are read one at a time afterwards
+- (void)testPacketsSplitAcrossReads
+{
+    char packet[10010], acks[] = {0x40, 0x02, 0x00, 0x07, 0x40, 0x02, 0x00, 0x08};
+    int fds[2], size = 65536, len = 0, rc = 0;
+    Publish* publish = NULL;
+    Puback* puback = NULL;
+
+    /* a QoS 0 publish to a/b with a payload larger than the read buffer */
+    packet[len++] = 0x30;
+    len += MQTTPacket_encode(&packet[len], 2 + 3 + 10000);
+    packet[len++] = 0x00;
+    packet[len++] = 0x03;
+    memcpy(&packet[len], "a/b", 3);
+    len += 3;
+    memset(&packet[len], 'p', 10000);
+    len += 10000;
+
+    Socket_outInitialize(1);
+    STAssertEquals(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0, nil);
+    setsockopt(fds[1], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    setsockopt(fds[0], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+
+    STAssertTrue(MQTTPacket_Factory(fds[0], &rc) == NULL, nil);
+    STAssertEquals(rc, TCPSOCKET_INTERRUPTED, nil);
+
+    /* the header byte alone, then part of the remaining length */
+    write(fds[1], packet, 1);
+    STAssertTrue(MQTTPacket_Factory(fds[0], &rc) == NULL, nil);
+    STAssertEquals(rc, TCPSOCKET_INTERRUPTED, nil);
+    write(fds[1], &packet[1], 1);
+    STAssertTrue(MQTTPacket_Factory(fds[0], &rc) == NULL, nil);
+    STAssertEquals(rc, TCPSOCKET_INTERRUPTED, nil);
+
+    /* part of the payload, then the rest of it followed by two acks */
+    write(fds[1], &packet[2], 3000);
+    STAssertTrue(MQTTPacket_Factory(fds[0], &rc) == NULL, nil);
+    STAssertEquals(rc, TCPSOCKET_INTERRUPTED, nil);
+    write(fds[1], &packet[3002], len - 3002);
+    write(fds[1], acks, sizeof(acks));
+
+    publish = MQTTPacket_Factory(fds[0], &rc);
+    STAssertTrue(publish != NULL, nil);
+    STAssertEquals(rc, TCPSOCKET_COMPLETE, nil);
+    STAssertTrue(strcmp(publish->topic, "a/b") == 0, nil);
+    STAssertEquals(publish->payloadlen, 10000, nil);
+    STAssertEquals(countBytes(publish->payload, publish->payloadlen, 'p'), 10000, nil);
+    MQTTPacket_freePublish(publish);
+
+    puback = MQTTPacket_Factory(fds[0], &rc);
+    STAssertTrue(puback != NULL && puback->msgId == 7, nil);
+    free(puback);
+    puback = MQTTPacket_Factory(fds[0], &rc);
+    STAssertTrue(puback != NULL && puback->msgId == 8, nil);
+    free(puback);
+    STAssertTrue(MQTTPacket_Factory(fds[0], &rc) == NULL, nil);
+    STAssertEquals(rc, TCPSOCKET_INTERRUPTED, nil);
+
+    Socket_close(fds[0]);
+    close(fds[1]);
+    Socket_outTerminate();
+}
+
+
+// A resolved name is answered from the cache until its time to live is up, and is then looked
+// up again.  A lookup fills in only the address of the family found, so the IPv6 address
+// returned for an IPv4 name shows whether the answer came from the cache.
+- (void)testResolverLookupExpires
 {
-    STFail(@"Unit tests are not implemented yet in SimpleMessageTests");
+    Resolver_address address;
+    struct in6_addr cached;
+
+    Resolver_initialize();
+    Resolver_setTTL(2);
+    memset(&address, '\0', sizeof(address));
+    STAssertEquals(Resolver_lookup("127.0.0.1", &address), 0, nil);
+    STAssertEquals(address.family, AF_INET, nil);
+    STAssertEquals(address.addr.s_addr, htonl(INADDR_LOOPBACK), nil);
+    cached = address.addr6;
+
+    memset(&address, 0xFF, sizeof(address));
+    STAssertEquals(Resolver_lookup("127.0.0.1", &address), 0, nil);
+    STAssertEquals(address.addr.s_addr, htonl(INADDR_LOOPBACK), nil);
+    STAssertTrue(memcmp(&address.addr6, &cached, sizeof(cached)) == 0, @"not answered from the cache");
+
+    sleep(3);
+    memset(&address, 0xFF, sizeof(address));
+    STAssertEquals(Resolver_lookup("127.0.0.1", &address), 0, nil);
+    STAssertEquals(address.addr.s_addr, htonl(INADDR_LOOPBACK), nil);
+    STAssertTrue(memcmp(&address.addr6, &cached, sizeof(cached)) != 0, @"answered from an expired entry");
+
+    /* with no time to live, every lookup goes to the resolver */
+    Resolver_setTTL(0);
+    memset(&address, 0xFF, sizeof(address));
+    STAssertEquals(Resolver_lookup("127.0.0.1", &address), 0, nil);
+    STAssertTrue(memcmp(&address.addr6, &cached, sizeof(cached)) != 0, nil);
+
+    Resolver_setTTL(RESOLVER_DEFAULT_TTL);
+    Resolver_terminate();
+}
+
+
+// receiveMany returns as many messages as there is room for, and otherwise those which have
+// arrived, without waiting out its timeout for the rest of the room to fill
+- (void)testReceiveManyReturnsTheMessagesWhichHaveArrived
+{
+    MQTTClient client = NULL;
+    MQTTClient_connectOptions opts = MQTTClient_connectOptions_initializer;
+    MQTTClient_message* messages[10];
+    char* topics[10];
+    int topicLens[10];
+    char uri[32];
+    int port = 0, listener, count = 0, i;
+    thread_type broker;
+    uint64_t start;
+
+    listener = listenOnLoopback(&port);
+    STAssertTrue(listener != -1, nil);
+    broker = Thread_start(fakeBroker, &listener);
+    sprintf(uri, "tcp://127.0.0.1:%d", port);
+    STAssertEquals(MQTTClient_create(&client, uri, "receiveMany", MQTTCLIENT_PERSISTENCE_NONE, NULL),
+                   MQTTCLIENT_SUCCESS, nil);
+    opts.keepAliveInterval = 20;
+    opts.cleansession = 1;
+    STAssertEquals(MQTTClient_connect(client, &opts), MQTTCLIENT_SUCCESS, nil);
+
+    /* only three of the five fit */
+    STAssertEquals(MQTTClient_receiveMany(client, 3, topics, topicLens, messages, &count, 5000L),
+                   MQTTCLIENT_SUCCESS, nil);
+    STAssertEquals(count, 3, nil);
+    for (i = 0; i < count; ++i)
+    {
+        STAssertTrue(strcmp(topics[i], "fb/t") == 0, nil);
+        STAssertEquals(messages[i]->payloadlen, 2, nil);
+        STAssertEquals(((char*)messages[i]->payload)[1], (char)('0' + i), nil);
+        MQTTClient_freeMessage(&messages[i]);
+        MQTTClient_free(topics[i]);
+    }
+
+    /* the other two are returned straight away, in their turn */
+    start = Clock_now();
+    STAssertEquals(MQTTClient_receiveMany(client, 10, topics, topicLens, messages, &count, 5000L),
+                   MQTTCLIENT_SUCCESS, nil);
+    STAssertTrue(Clock_now() - start < 1000 * CLOCK_NANOS_PER_MILLI, nil);
+    STAssertEquals(count, 2, nil);
+    for (i = 0; i < count; ++i)
+    {
+        STAssertEquals(((char*)messages[i]->payload)[1], (char)('3' + i), nil);
+        MQTTClient_freeMessage(&messages[i]);
+        MQTTClient_free(topics[i]);
+    }
+
+    /* and then there are none */
+    STAssertEquals(MQTTClient_receiveMany(client, 10, topics, topicLens, messages, &count, 100L),
+                   MQTTCLIENT_SUCCESS, nil);
+    STAssertEquals(count, 0, nil);
+
+    MQTTClient_disconnect(client, 0);
+    MQTTClient_destroy(&client);
+    pthread_join(broker, NULL);
+    close(listener);
 }
 
 @end
@@ -0,0 +1,526 @@
+//
+//  simplemessage-bench.c
+//  SimpleMessage
+//
+//  Copyright 2012 Dominik Zajac (dc-square GmbH)
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+/**
+ * @file
+ * \brief Headless load generator
+ *
+ * Runs the same connect/publish/disconnect loop as the Send button, driven from the
+ * command line, so that load can be generated from hosts without a window server.
+ */
+
+#include "LoadGenerator.h"
+#include "Clock.h"
+#include "ClientId.h"
+#include "ConnectionPool.h"
+#include "ConnectionStorm.h"
+#include "LatencyMonitor.h"
+#include "PingPong.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+
+void usage(char* name)
+{
+	fprintf(stderr, "usage: %s -t topic -m message [options]\n", name);
+	fprintf(stderr, "       %s -f scenario [options]\n", name);
+	fprintf(stderr, "       %s -C sessions [storm options]\n", name);
+	fprintf(stderr, "       %s -G count [options]\n", name);
+	fprintf(stderr, "  -b uri        broker address (default tcp://localhost:1883)\n");
+	fprintf(stderr, "  -i clientid   MQTT client identifier (default SimpleMessage)\n");
+	fprintf(stderr, "  -t topic      topic to publish to\n");
+	fprintf(stderr, "  -m message    message text\n");
+	fprintf(stderr, "  -c count      number of connections (default 1)\n");
+	fprintf(stderr, "  -n count      messages per connection (default 1)\n");
+	fprintf(stderr, "  -q qos        quality of service 0, 1 or 2 (default 0)\n");
+	fprintf(stderr, "  -r            set the retained flag\n");
+	fprintf(stderr, "  -a            append a counter to each message\n");
+	fprintf(stderr, "  -k seconds    keep alive interval (default 20)\n");
+	fprintf(stderr, "  -w count      connections driven at the same time (default all)\n");
+	fprintf(stderr, "  -p            pin each worker thread to a CPU\n");
+	fprintf(stderr, "  -j count      network I/O threads, each serving a share of the connections (default 1)\n");
+	fprintf(stderr, "  -J count      threads calling the message callbacks, in order for each connection (default none)\n");
+	fprintf(stderr, "  -O            with -J, deliver in order for each topic rather than each connection\n");
+	fprintf(stderr, "  -s rate       messages per second on each connection (default unlimited)\n");
+	fprintf(stderr, "  -S rate       messages per second across the connections publishing at once (default unlimited)\n");
+	fprintf(stderr, "  -W count      QoS 1/2: keep up to count messages unacknowledged per connection\n");
+	fprintf(stderr, "  -B count      publish count messages at a time with one MQTTClient_publishMany call\n");
+	fprintf(stderr, "  -L            measure end-to-end latency with a subscriber on this host\n");
+	fprintf(stderr, "  -R count      repeat the run, reusing the open connections (default 1)\n");
+	fprintf(stderr, "  -I seconds    write counters and per second rates at this interval\n");
+	fprintf(stderr, "  -F format     counter output format, csv or json (default csv)\n");
+	fprintf(stderr, "  -P            write counters for each connection as well as the total\n");
+	fprintf(stderr, "  -z file       write the counters to this file; by default they go to standard\n");
+	fprintf(stderr, "                output and the run summary to standard error\n");
+	fprintf(stderr, "  -f file       replay a scenario file in place of -t, -q, -r, -a, -n, -s and -S;\n");
+	fprintf(stderr, "                -m, if given, is the text payloads are filled with\n");
+	fprintf(stderr, "  -e seed       replay the scenario with this seed in place of its own\n");
+	fprintf(stderr, "  -o file       record the scenario as run, seed included, to this file\n");
+	fprintf(stderr, "  -T threads    thread sweep: run with 1, 2, 4 ... up to threads connections, each\n");
+	fprintf(stderr, "                driven by its own thread, and print the throughput of each step\n");
+	fprintf(stderr, "  -Y usecs      busy poll: spin rather than sleep waiting for the network, and set\n");
+	fprintf(stderr, "                SO_BUSY_POLL to usecs on each connection; with -G the pinger spins too\n");
+	fprintf(stderr, "  -D seconds    keep resolved broker addresses this long, 0 to resolve on every\n");
+	fprintf(stderr, "                connect (default 60)\n");
+	fprintf(stderr, "connection storm:\n");
+	fprintf(stderr, "  -C sessions   open this many sessions, each with a unique client identifier\n");
+	fprintf(stderr, "  -x rate       connects per second at the start (default all at once)\n");
+	fprintf(stderr, "  -X rate       connects per second at the end of the ramp (default the start rate)\n");
+	fprintf(stderr, "  -U seconds    ramp duration (default 0)\n");
+	fprintf(stderr, "  -H seconds    keep the sessions open for this long (default 0)\n");
+	fprintf(stderr, "  -w count      connects in progress at once (default 64)\n");
+	fprintf(stderr, "ping-pong:\n");
+	fprintf(stderr, "  -G count      time count round trips, one at a time, between a client publishing to\n");
+	fprintf(stderr, "                topic/ping and one echoing to topic/pong; -t, -m and -q apply\n");
+}
+
+
+/**
+ * Print a latency distribution in milliseconds
+ * @param file where to print
+ * @param label what was measured
+ * @param histogram the recorded latencies in nanoseconds
+ */
+void printLatency(FILE* file, char* label, Histogram* histogram)
+{
+	double ms = (double)CLOCK_NANOS_PER_MILLI;
+
+	fprintf(file, "%-12s p50 %.3f  p90 %.3f  p99 %.3f  p99.9 %.3f  max %.3f ms\n", label,
+		Histogram_percentile(histogram, 50.0) / ms, Histogram_percentile(histogram, 90.0) / ms,
+		Histogram_percentile(histogram, 99.0) / ms, Histogram_percentile(histogram, 99.9) / ms,
+		histogram->max / ms);
+}
+
+
+/**
+ * Wait for the subscriber to receive what was published, giving up once nothing has
+ * arrived for a second
+ * @param monitor the latency monitor
+ * @param expected the number of messages published
+ */
+void awaitMonitor(LatencyMonitor* monitor, long expected)
+{
+	long received = -1;
+	uint64_t progress = Clock_now();
+
+	while (LatencyMonitor_received(monitor) < expected)
+	{
+		if (LatencyMonitor_received(monitor) != received)
+		{
+			received = LatencyMonitor_received(monitor);
+			progress = Clock_now();
+		}
+		else if (Clock_now() - progress > CLOCK_NANOS_PER_SECOND)
+			break;
+		Clock_sleepUntil(Clock_now() + 10 * CLOCK_NANOS_PER_MILLI);
+	}
+}
+
+
+/**
+ * Print the end-to-end latencies for each topic and QoS
+ * @param file where to print
+ * @param monitor the latency monitor, stopped
+ * @param published the number of messages published
+ * @param sequenced boolean - each connection published every message to the same topic
+ * with the same QoS, so gaps in a series' sequence numbers are lost messages.  Otherwise
+ * only the total received is meaningful.
+ */
+void printMonitor(FILE* file, LatencyMonitor* monitor, long published, int sequenced)
+{
+	LatencyMonitor_series* series = NULL;
+
+	if (!sequenced)
+		fprintf(file, "end-to-end:  %ld of %ld received\n", LatencyMonitor_received(monitor), published);
+	for (series = LatencyMonitor_getSeries(monitor); series != NULL; series = series->next)
+	{
+		if (sequenced)
+			fprintf(file, "end-to-end:  %s qos %d: %ld received, %ld lost, %ld duplicate\n", series->topic, series->qos,
+				series->received, series->lost, series->duplicates);
+		else
+			fprintf(file, "end-to-end:  %s qos %d: %ld received\n", series->topic, series->qos, series->received);
+		printLatency(file, "", series->latency);
+	}
+}
+
+
+/**
+ * Allow as many open descriptors as the hard limit permits, for storms of sessions
+ */
+void raiseFileLimit(void)
+{
+	struct rlimit limit;
+
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+	{
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+}
+
+
+/**
+ * Run a connection storm and print the connect latency distribution
+ * @return the process exit code
+ */
+int storm(ConnectionStorm_options* options)
+{
+	ConnectionStorm_results results = ConnectionStorm_results_initializer;
+	int rc;
+
+	if (options->endRate == 0.0)
+		options->endRate = options->startRate;
+	raiseFileLimit();
+	results.latency = Histogram_create();
+	rc = ConnectionStorm_run(options, &results);
+	if (rc == CONNECTIONSTORM_BAD_OPTIONS)
+	{
+		fprintf(stderr, "sessions must be between 1 and %d\n", CONNECTIONSTORM_MAX_SESSIONS);
+		Histogram_destroy(results.latency);
+		return 2;
+	}
+
+	printf("sessions:    %d connected, %d failed\n", results.connected, results.failed);
+	printf("elapsed:     %.3f s\n", Clock_seconds(results.elapsed));
+	printf("connects:    %.1f /sec\n", (results.elapsed > 0) ? results.connected / Clock_seconds(results.elapsed) : 0.0);
+	printLatency(stdout, "connect:", results.latency);
+	Histogram_destroy(results.latency);
+	return (rc == CONNECTIONSTORM_SUCCESS) ? 0 : 1;
+}
+
+
+/**
+ * Run a ping-pong test and print the round trip latency distribution
+ * @return the process exit code
+ */
+int pingPong(PingPong_options* options)
+{
+	PingPong_results results = PingPong_results_initializer;
+	int rc;
+
+	/* each packet of a round trip waits for the one before it, so with Nagle's algorithm on
+	 * the test would time the delayed acknowledgements rather than the round trips */
+	MQTTClient_setNoDelay(1);
+	results.latency = Histogram_create();
+	rc = PingPong_run(options, &results);
+	if (rc == PINGPONG_BAD_OPTIONS)
+	{
+		fprintf(stderr, "the round trip count must be at least 1, and the qos 0, 1 or 2\n");
+		Histogram_destroy(results.latency);
+		return 2;
+	}
+
+	printf("round trips: %d completed, %d lost\n", results.completed, results.lost);
+	printf("elapsed:     %.3f s\n", Clock_seconds(results.elapsed));
+	printf("rate:        %.1f round trips/sec\n", (results.elapsed > 0) ? results.completed / Clock_seconds(results.elapsed) : 0.0);
+	printLatency(stdout, "round trip:", results.latency);
+	Histogram_destroy(results.latency);
+	return (rc == PINGPONG_SUCCESS) ? 0 : 1;
+}
+
+
+/**
+ * Run the same load with a doubling number of connections, each driven by its own thread,
+ * and print the aggregate throughput of each run, and its ratio to that of a single thread
+ * @return the process exit code
+ */
+int scale(LoadGenerator_options* options, int maxThreads)
+{
+	double base = 0.0;
+	int failed = 0;
+	int threads = 1;
+
+	printf("%7s  %12s  %7s\n", "threads", "msgs/sec", "speedup");
+	while (1)
+	{
+		LoadGenerator_results results = LoadGenerator_results_initializer;
+		double throughput;
+
+		options->connections = options->concurrency = threads;
+		if (LoadGenerator_run(options, &results) != LOADGENERATOR_SUCCESS || results.failed > 0)
+			failed = 1;
+		throughput = LoadGenerator_throughput(&results);
+		if (threads == 1)
+			base = throughput;
+		printf("%7d  %12.1f  %6.2fx\n", threads, throughput, (base > 0.0) ? throughput / base : 0.0);
+		fflush(stdout);
+		if (threads == maxThreads)
+			break;
+		threads = (threads * 2 < maxThreads) ? threads * 2 : maxThreads;
+	}
+	ConnectionPool_closeAll(options->disconnectTimeout);
+	return failed;
+}
+
+
+int main(int argc, char** argv)
+{
+	ConnectionStorm_options stormOptions = ConnectionStorm_options_initializer;
+	PingPong_options pingOptions = PingPong_options_initializer;
+	LoadGenerator_options options = LoadGenerator_options_initializer;
+	LatencyMonitor* monitor = NULL;
+	long published = 0L;
+	int runs = 1;
+	int stormMode = 0;
+	int pingMode = 0;
+	int scaleThreads = 0;
+	double statsInterval = 0.0;
+	int statsFormat = STATS_CSV;
+	int statsPerConnection = 0;
+	char* scenarioFile = NULL;
+	char* seed = NULL;
+	char* record = NULL;
+	char* statsFile = NULL;
+	FILE* statsOut = stdout;
+	FILE* summary = stdout;
+	char error[256];
+	Stats* stats = NULL;
+	Stats_reporter* reporter = NULL;
+	int failed = 0;
+	int callbackThreads = 0;
+	int callbackOrder = MQTTCLIENT_ORDER_CLIENT;
+	int opt, i, rc;
+
+	options.serverURI = "tcp://localhost:1883";
+	while ((opt = getopt(argc, argv, "b:i:t:m:c:n:q:rak:w:pj:J:Os:S:W:B:LR:I:F:Pz:f:e:o:T:C:x:X:U:H:G:Y:D:h")) != -1)
+	{
+		switch (opt)
+		{
+			case 'b': options.serverURI = optarg; break;
+			case 'i': options.clientId = optarg; break;
+			case 't': options.topic = optarg; break;
+			case 'm': options.message = optarg; break;
+			case 'c': options.connections = atoi(optarg); break;
+			case 'n': options.messages = atoi(optarg); break;
+			case 'q': options.qos = atoi(optarg); break;
+			case 'r': options.retained = 1; break;
+			case 'a': options.appendCounter = 1; break;
+			case 'k': options.keepAliveInterval = stormOptions.keepAliveInterval = atoi(optarg); break;
+			case 'w': options.concurrency = stormOptions.concurrency = atoi(optarg); break;
+			case 'p': options.pinned = 1; break;
+			case 'j':
+				if (MQTTClient_setIOThreads(atoi(optarg)) != MQTTCLIENT_SUCCESS)
+				{
+					fprintf(stderr, "the number of I/O threads must be at least 1\n");
+					return 2;
+				}
+				break;
+			case 'J': callbackThreads = atoi(optarg); break;
+			case 'O': callbackOrder = MQTTCLIENT_ORDER_TOPIC; break;
+			case 's': options.rate = atof(optarg); break;
+			case 'S': options.totalRate = atof(optarg); break;
+			case 'W': options.window = atoi(optarg); break;
+			case 'B': options.batch = atoi(optarg); break;
+			case 'L': options.stamped = 1; break;
+			case 'R': runs = atoi(optarg); break;
+			case 'I': statsInterval = atof(optarg); break;
+			case 'F': statsFormat = (strcmp(optarg, "json") == 0) ? STATS_JSON : STATS_CSV; break;
+			case 'P': statsPerConnection = 1; break;
+			case 'z': statsFile = optarg; break;
+			case 'f': scenarioFile = optarg; break;
+			case 'e': seed = optarg; break;
+			case 'o': record = optarg; break;
+			case 'T': scaleThreads = atoi(optarg); break;
+			case 'C': stormOptions.sessions = atoi(optarg); stormMode = 1; break;
+			case 'x': stormOptions.startRate = atof(optarg); break;
+			case 'X': stormOptions.endRate = atof(optarg); break;
+			case 'U': stormOptions.ramp = atof(optarg); break;
+			case 'H': stormOptions.hold = atof(optarg); break;
+			case 'G': pingOptions.count = atoi(optarg); pingMode = 1; break;
+			case 'Y':
+				if (MQTTClient_setBusyPoll(atoi(optarg)) != MQTTCLIENT_SUCCESS)
+				{
+					fprintf(stderr, "the busy poll time must be 0 or more\n");
+					return 2;
+				}
+				pingOptions.spin = 1;
+				break;
+			case 'D':
+				if (MQTTClient_setResolverCacheTTL(atoi(optarg)) != MQTTCLIENT_SUCCESS)
+				{
+					fprintf(stderr, "the resolver cache time must be 0 or more\n");
+					return 2;
+				}
+				break;
+			default:
+				usage(argv[0]);
+				return 2;
+		}
+	}
+
+	if (MQTTClient_setCallbackThreads(callbackThreads, callbackOrder) != MQTTCLIENT_SUCCESS)
+	{
+		fprintf(stderr, "the number of callback threads must be 0 or more\n");
+		return 2;
+	}
+
+	if (stormMode)
+	{
+		stormOptions.serverURI = options.serverURI;
+		stormOptions.clientId = options.clientId;
+		return storm(&stormOptions);
+	}
+
+	if (pingMode)
+	{
+		pingOptions.serverURI = options.serverURI;
+		pingOptions.clientId = options.clientId;
+		pingOptions.qos = options.qos;
+		if (options.topic)
+			pingOptions.topic = options.topic;
+		if (options.message)
+			pingOptions.message = options.message;
+		return pingPong(&pingOptions);
+	}
+
+	if (scenarioFile)
+	{
+		if (Scenario_load(scenarioFile, &options.scenario, error, sizeof(error)) != SCENARIO_SUCCESS)
+		{
+			fprintf(stderr, "%s\n", error);
+			return 2;
+		}
+		if (seed)
+			options.scenario->seed = strtoull(seed, NULL, 0);
+		if (record)
+		{
+			FILE* file = fopen(record, "w");
+
+			if (file == NULL)
+			{
+				fprintf(stderr, "%s: cannot open\n", record);
+				return 2;
+			}
+			Scenario_write(file, options.scenario);
+			fclose(file);
+		}
+	}
+
+	if (LoadGenerator_validate(&options) != LOADGENERATOR_SUCCESS || runs < 1 || scaleThreads < 0)
+	{
+		usage(argv[0]);
+		return 2;
+	}
+
+	if (scaleThreads > 0)
+	{
+		rc = scale(&options, scaleThreads);
+		Scenario_destroy(options.scenario);
+		return rc;
+	}
+
+	if (statsInterval > 0.0)
+	{
+		/* keep the counters on standard output parseable as CSV or JSON lines */
+		if (statsFile == NULL)
+			summary = stderr;
+		else if ((statsOut = fopen(statsFile, "w")) == NULL)
+		{
+			fprintf(stderr, "%s: cannot open\n", statsFile);
+			Scenario_destroy(options.scenario);
+			return 2;
+		}
+	}
+
+	if (options.stamped)
+	{
+		char clientId[CLIENTID_MAX_LEN + 1];
+		char* filter = (options.scenario) ? "#" : options.topic;
+
+		if (snprintf(clientId, sizeof(clientId), "%s-monitor", options.clientId) >= (int)sizeof(clientId))
+		{
+			fprintf(stderr, "client id %s is too long to name the monitor after, the limit is %d characters\n",
+				options.clientId, CLIENTID_MAX_LEN - (int)strlen("-monitor"));
+			return 2;
+		}
+		monitor = LatencyMonitor_create(options.connections);
+		if (LatencyMonitor_start(monitor, options.serverURI, clientId, filter, 2) != LATENCYMONITOR_SUCCESS)
+		{
+			fprintf(stderr, "could not subscribe to %s\n", filter);
+			LatencyMonitor_destroy(monitor);
+			return 1;
+		}
+	}
+
+	if (statsInterval > 0.0)
+	{
+		stats = Stats_create();
+		reporter = Stats_startReporter(stats, statsOut, statsFormat, statsInterval, statsPerConnection);
+	}
+
+	for (i = 1; i <= runs; i++)
+	{
+		LoadGenerator_results results = LoadGenerator_results_initializer;
+
+		if (monitor && i > 1)
+		{
+			/* the connections number their messages from 1 again, so finish with the last run's first */
+			awaitMonitor(monitor, published);
+			LatencyMonitor_resetSequences(monitor);
+		}
+		results.stats = stats;
+		results.latency = Histogram_create();
+		results.ackLatency = Histogram_create();
+		rc = LoadGenerator_run(&options, &results);
+		if (runs > 1)
+			fprintf(summary, "run %d\n", i);
+		if (options.scenario)
+			fprintf(summary, "scenario:    %s, seed %llu\n", options.scenario->name, (unsigned long long)options.scenario->seed);
+		fprintf(summary, "connections: %d (%d failed)\n", results.connections, results.connectFailures);
+		fprintf(summary, "messages:    %ld published, %ld failed\n", results.published, results.failed);
+		fprintf(summary, "elapsed:     %.3f s\n", Clock_seconds(results.elapsed));
+		fprintf(summary, "throughput:  %.1f msgs/sec sent\n", LoadGenerator_throughput(&results));
+		if (options.scenario == NULL && LoadGenerator_connectionRate(&options) > 0.0)
+			fprintf(summary, "target:      %.1f msgs/sec\n", LoadGenerator_targetRate(&options));
+		printLatency(summary, LoadGenerator_batched(&options) ? "batch latency:" : "latency:", results.latency);
+		if ((options.scenario ? options.scenario->maxQos : options.qos) > 0 && options.window > 0)
+		{
+			fprintf(summary, "acked:       %ld, %.1f msgs/sec\n", results.acked, LoadGenerator_ackedThroughput(&results));
+			printLatency(summary, "ack latency:", results.ackLatency);
+		}
+		Histogram_destroy(results.latency);
+		Histogram_destroy(results.ackLatency);
+		published += results.published;
+		if (rc != LOADGENERATOR_SUCCESS || results.failed > 0)
+			failed = 1;
+	}
+
+	if (reporter)
+		Stats_stopReporter(reporter);
+
+	if (monitor)
+	{
+		awaitMonitor(monitor, published);
+		LatencyMonitor_stop(monitor);
+		printMonitor(summary, monitor, published, options.scenario == NULL);
+		LatencyMonitor_destroy(monitor);
+	}
+
+	ConnectionPool_closeAll(options.disconnectTimeout);
+	if (stats)
+		Stats_destroy(stats);
+	if (statsOut != stdout)
+		fclose(statsOut);
+	Scenario_destroy(options.scenario);
+
+	return failed;
+}
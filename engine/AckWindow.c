@@ -0,0 +1,289 @@
+//
+//  AckWindow.c
+//  SimpleMessage
+//
+//  Copyright 2012 Dominik Zajac (dc-square GmbH)
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+/**
+ * @file
+ * \brief Limit on unacknowledged QoS 1 and 2 publishes, with acknowledgement latency
+ *
+ * A publisher reserves a place in the window before each publish and the client
+ * library's deliveryComplete callback frees it again when the PUBACK or PUBCOMP
+ * arrives, so at most the window size of messages are outstanding at once.  The time
+ * from each publish to its acknowledgement is recorded.
+ *
+ * Send times are kept in a table indexed by message id.  The client library hands out
+ * message ids in sequence, so with the table at least four times the window size
+ * outstanding ids do not collide; if they ever do, the older message's latency is not
+ * recorded.
+ * The acknowledgement can be processed before MQTTClient_publish has returned the token
+ * to the publisher, so either side may find the other has already filled in its slot.
+ *
+ * A pooled connection carries on from one batch to the next, so acknowledgements for
+ * messages an earlier batch gave up waiting for can arrive at a later batch's window.  An
+ * acknowledgement is therefore only counted once it is matched with a token this window
+ * was given by AckWindow_sent; one which never is, and which would otherwise free a place
+ * for a message still outstanding, is left waiting in its slot until the slot is reused.
+ */
+
+#include "AckWindow.h"
+#include "Clock.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MIN_SLOTS 64
+
+typedef struct
+{
+	MQTTClient_deliveryToken token;	/**< 0 for an empty slot */
+	uint64_t sent;					/**< when the publish started, 0 if not yet known */
+	uint64_t acked;					/**< when the acknowledgement arrived, 0 if not yet */
+} AckWindow_slot;
+
+struct AckWindow
+{
+	pthread_mutex_t mutex;
+	pthread_cond_t changed;			/**< signalled as acknowledgements arrive */
+	int size;
+	int inflight;
+	long acked;
+	Histogram* latency;
+	int slotCount;					/**< a power of two */
+	AckWindow_slot* slots;
+};
+
+
+/**
+ * Create a window
+ * @param size the maximum number of unacknowledged messages
+ * @param latency if not NULL, records nanoseconds from publish to acknowledgement
+ * @return the window
+ */
+AckWindow* AckWindow_create(int size, Histogram* latency)
+{
+	AckWindow* window = malloc(sizeof(AckWindow));
+
+	memset(window, '\0', sizeof(AckWindow));
+	pthread_mutex_init(&window->mutex, NULL);
+	pthread_cond_init(&window->changed, NULL);
+	window->size = size;
+	window->latency = latency;
+	window->slotCount = MIN_SLOTS;
+	while (window->slotCount < size * 4)
+		window->slotCount *= 2;
+	window->slots = calloc(window->slotCount, sizeof(AckWindow_slot));
+	return window;
+}
+
+
+void AckWindow_destroy(AckWindow* window)
+{
+	pthread_cond_destroy(&window->changed);
+	pthread_mutex_destroy(&window->mutex);
+	free(window->slots);
+	free(window);
+}
+
+
+/**
+ * Take a place in the window, waiting for an acknowledgement if it is full
+ * @param window the window
+ * @param timeout milliseconds to wait for a place
+ * @return ACKWINDOW_SUCCESS, or ACKWINDOW_TIMEOUT if the window stayed full
+ */
+int AckWindow_reserve(AckWindow* window, int timeout)
+{
+	struct timespec deadline;
+	int rc = ACKWINDOW_SUCCESS;
+
+	Clock_deadline(&deadline, timeout * CLOCK_NANOS_PER_MILLI);
+	pthread_mutex_lock(&window->mutex);
+	while (window->inflight >= window->size)
+	{
+		if (pthread_cond_timedwait(&window->changed, &window->mutex, &deadline) == ETIMEDOUT)
+		{
+			rc = ACKWINDOW_TIMEOUT;
+			goto exit;
+		}
+	}
+	++(window->inflight);
+exit:
+	pthread_mutex_unlock(&window->mutex);
+	return rc;
+}
+
+
+/**
+ * Give back a place taken by AckWindow_reserve when the publish failed
+ * @param window the window
+ */
+void AckWindow_cancel(AckWindow* window)
+{
+	pthread_mutex_lock(&window->mutex);
+	--(window->inflight);
+	pthread_cond_broadcast(&window->changed);
+	pthread_mutex_unlock(&window->mutex);
+}
+
+
+/**
+ * Count a message as acknowledged and free its place.  Must be called with the mutex held.
+ * @param window the window
+ * @param slot the message's slot, emptied
+ * @param latency nanoseconds from publish to acknowledgement
+ */
+static void AckWindow_complete(AckWindow* window, AckWindow_slot* slot, uint64_t latency)
+{
+	if (window->latency)
+		Histogram_record(window->latency, latency);
+	slot->token = 0;
+	++(window->acked);
+	if (window->inflight > 0)
+		--(window->inflight);
+	pthread_cond_broadcast(&window->changed);
+}
+
+
+/**
+ * Note the token of a message which has been published
+ * @param window the window
+ * @param token the token returned by MQTTClient_publish
+ * @param sent the time the publish started, from Clock_now
+ * @return 1 if the message's acknowledgement had already arrived and is counted now, else 0
+ */
+int AckWindow_sent(AckWindow* window, MQTTClient_deliveryToken token, uint64_t sent)
+{
+	AckWindow_slot* slot = &window->slots[token & (window->slotCount - 1)];
+	int rc = 0;
+
+	pthread_mutex_lock(&window->mutex);
+	if (slot->token == token && slot->acked != 0)
+	{	/* the acknowledgement beat us here */
+		AckWindow_complete(window, slot, (slot->acked > sent) ? slot->acked - sent : 0);
+		rc = 1;
+	}
+	else
+	{
+		slot->token = token;
+		slot->sent = sent;
+		slot->acked = 0;
+	}
+	pthread_mutex_unlock(&window->mutex);
+	return rc;
+}
+
+
+/**
+ * Note an acknowledgement, from the client library's deliveryComplete callback
+ * @param window the window
+ * @param token the token of the acknowledged message
+ * @return 1 if the message was published through this window and is counted now, 0 if it
+ * is not known yet, either because MQTTClient_publish has not returned its token or
+ * because it was published by an earlier batch
+ */
+int AckWindow_deliveryComplete(AckWindow* window, MQTTClient_deliveryToken token)
+{
+	AckWindow_slot* slot = &window->slots[token & (window->slotCount - 1)];
+	uint64_t now = Clock_now();
+	int rc = 0;
+
+	pthread_mutex_lock(&window->mutex);
+	if (slot->token == token && slot->sent != 0)
+	{
+		AckWindow_complete(window, slot, now - slot->sent);
+		rc = 1;
+	}
+	else if (slot->token == 0 || slot->sent == 0)
+	{	/* keep it for AckWindow_sent, without displacing a message still outstanding */
+		slot->token = token;
+		slot->sent = 0;
+		slot->acked = now;
+	}
+	pthread_mutex_unlock(&window->mutex);
+	return rc;
+}
+
+
+/**
+ * Wait for every outstanding message to be acknowledged
+ * @param window the window
+ * @param timeout milliseconds to wait
+ * @return ACKWINDOW_SUCCESS, or ACKWINDOW_TIMEOUT if messages were still outstanding
+ */
+int AckWindow_drain(AckWindow* window, int timeout)
+{
+	struct timespec deadline;
+	int rc = ACKWINDOW_SUCCESS;
+
+	Clock_deadline(&deadline, timeout * CLOCK_NANOS_PER_MILLI);
+	pthread_mutex_lock(&window->mutex);
+	while (window->inflight > 0)
+	{
+		if (pthread_cond_timedwait(&window->changed, &window->mutex, &deadline) == ETIMEDOUT)
+		{
+			rc = ACKWINDOW_TIMEOUT;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&window->mutex);
+	return rc;
+}
+
+
+/**
+ * Number of acknowledgements received
+ * @param window the window
+ * @return the count
+ */
+long AckWindow_acked(AckWindow* window)
+{
+	long acked;
+
+	pthread_mutex_lock(&window->mutex);
+	acked = window->acked;
+	pthread_mutex_unlock(&window->mutex);
+	return acked;
+}
+
+
+/**
+ * Wait for another acknowledgement to arrive
+ * @param window the window
+ * @param acked the count from AckWindow_acked to wait to change
+ * @param timeout milliseconds to wait
+ * @return ACKWINDOW_SUCCESS, or ACKWINDOW_TIMEOUT if none arrived
+ */
+int AckWindow_awaitAck(AckWindow* window, long acked, int timeout)
+{
+	struct timespec deadline;
+	int rc = ACKWINDOW_SUCCESS;
+
+	Clock_deadline(&deadline, timeout * CLOCK_NANOS_PER_MILLI);
+	pthread_mutex_lock(&window->mutex);
+	while (window->acked == acked)
+	{
+		if (pthread_cond_timedwait(&window->changed, &window->mutex, &deadline) == ETIMEDOUT)
+		{
+			rc = ACKWINDOW_TIMEOUT;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&window->mutex);
+	return rc;
+}
@@ -0,0 +1,44 @@
+//
+//  AckWindow.h
+//  SimpleMessage
+//
+//  Copyright 2012 Dominik Zajac (dc-square GmbH)
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+#if !defined(ACKWINDOW_H)
+#define ACKWINDOW_H
+
+#include <stdint.h>
+
+#include "Histogram.h"
+#include "MQTTClient.h"
+
+/** Return code: the wait completed */
+#define ACKWINDOW_SUCCESS 0
+/** Return code: no acknowledgement arrived within the timeout */
+#define ACKWINDOW_TIMEOUT -1
+
+typedef struct AckWindow AckWindow;
+
+AckWindow* AckWindow_create(int size, Histogram* latency);
+void AckWindow_destroy(AckWindow* window);
+int AckWindow_reserve(AckWindow* window, int timeout);
+void AckWindow_cancel(AckWindow* window);
+int AckWindow_sent(AckWindow* window, MQTTClient_deliveryToken token, uint64_t sent);
+int AckWindow_deliveryComplete(AckWindow* window, MQTTClient_deliveryToken token);
+int AckWindow_drain(AckWindow* window, int timeout);
+long AckWindow_acked(AckWindow* window);
+int AckWindow_awaitAck(AckWindow* window, long acked, int timeout);
+
+#endif
@@ -0,0 +1,81 @@
+//
+//  ClientId.c
+//  SimpleMessage
+//
+//  Copyright 2012 Dominik Zajac (dc-square GmbH)
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+/**
+ * @file
+ * \brief Generated MQTT client identifiers
+ *
+ * A broker allows one session per client identifier and disconnects the older one when
+ * the same identifier connects again, so every connection a run opens needs its own.
+ * Identifiers are the prefix, a token which differs between processes, and the
+ * connection number, e.g. "SimpleMessage-3fa9c-12".  The token keeps simultaneous runs,
+ * from one host or several, apart.  The prefix is shortened if necessary to keep within
+ * the MQTT 3.1 limit of 23 characters.
+ */
+
+#include "ClientId.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+static pthread_once_t token_once = PTHREAD_ONCE_INIT;
+static unsigned int token = 0;
+
+
+static void ClientId_initToken(void)
+{
+	struct timeval now;
+	char host[64] = "";
+	unsigned int hash = 2166136261U;
+	size_t i;
+
+	gettimeofday(&now, NULL);
+	gethostname(host, sizeof(host) - 1);
+	for (i = 0; host[i]; i++)
+		hash = (hash ^ (unsigned char)host[i]) * 16777619U;
+	hash ^= (unsigned int)getpid() * 2654435761U;
+	hash ^= (unsigned int)now.tv_sec ^ ((unsigned int)now.tv_usec << 12);
+	token = hash & 0xFFFFF;
+}
+
+
+/**
+ * Make the client identifier for one connection of a run
+ * @param prefix the identifier the user asked for
+ * @param number the connection number
+ * @param buffer receives the identifier
+ * @param size size of buffer, at least CLIENTID_MAX_LEN + 1 to hold a full length identifier
+ */
+void ClientId_generate(char* prefix, int number, char* buffer, size_t size)
+{
+	char suffix[CLIENTID_MAX_LEN + 1];
+	int prefixlen, suffixlen;
+
+	pthread_once(&token_once, ClientId_initToken);
+	suffixlen = snprintf(suffix, sizeof(suffix), "-%05x-%d", token, number);
+	prefixlen = CLIENTID_MAX_LEN - suffixlen;
+	if (prefixlen > (int)strlen(prefix))
+		prefixlen = (int)strlen(prefix);
+	if (prefixlen < 0)
+		prefixlen = 0;
+	snprintf(buffer, size, "%.*s%s", prefixlen, prefix, suffix);
+}
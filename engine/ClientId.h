@@ -0,0 +1,29 @@
+//
+//  ClientId.h
+//  SimpleMessage
+//
+//  Copyright 2012 Dominik Zajac (dc-square GmbH)
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+#if !defined(CLIENTID_H)
+#define CLIENTID_H
+
+#include <stddef.h>
+
+/** MQTT 3.1 limits client identifiers to 23 characters */
+#define CLIENTID_MAX_LEN 23
+
+void ClientId_generate(char* prefix, int number, char* buffer, size_t size);
+
+#endif
@@ -0,0 +1,107 @@
+//
+//  Clock.c
+//  SimpleMessage
+//
+//  Copyright 2012 Dominik Zajac (dc-square GmbH)
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+/**
+ * @file
+ * \brief Monotonic clock used for all engine timing
+ *
+ * Wall clock time (gettimeofday) can step while a run is in progress, so the engine
+ * measures elapsed time and latencies with the platform monotonic clock instead.
+ */
+
+#include "Clock.h"
+
+#include <sys/time.h>
+#include <time.h>
+#if defined(__APPLE__)
+#include <mach/mach_time.h>
+#endif
+
+
+/**
+ * Read the monotonic clock
+ * @return nanoseconds since an arbitrary, fixed starting point
+ */
+uint64_t Clock_now(void)
+{
+#if defined(__APPLE__)
+	static mach_timebase_info_data_t timebase = {0, 0};
+
+	if (timebase.denom == 0)
+		mach_timebase_info(&timebase);
+	return mach_absolute_time() * timebase.numer / timebase.denom;
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * CLOCK_NANOS_PER_SECOND + ts.tv_nsec;
+#endif
+}
+
+
+/**
+ * Convert a nanosecond interval to seconds
+ * @param nanos the interval in nanoseconds
+ * @return the interval in seconds
+ */
+double Clock_seconds(uint64_t nanos)
+{
+	return (double)nanos / CLOCK_NANOS_PER_SECOND;
+}
+
+
+/**
+ * Sleep until the monotonic clock reaches a given time.  Returns at once if it has
+ * already passed.
+ * @param deadline the time to wake, as returned by Clock_now
+ */
+void Clock_sleepUntil(uint64_t deadline)
+{
+	uint64_t now;
+
+	while ((now = Clock_now()) < deadline)
+	{
+		struct timespec interval;
+		uint64_t remaining = deadline - now;
+
+		interval.tv_sec = (time_t)(remaining / CLOCK_NANOS_PER_SECOND);
+		interval.tv_nsec = (long)(remaining % CLOCK_NANOS_PER_SECOND);
+		nanosleep(&interval, NULL);
+	}
+}
+
+
+/**
+ * Work out the absolute time an interval from now expires, in the form
+ * pthread_cond_timedwait wants, which is measured against the realtime clock
+ * @param deadline receives the expiry time
+ * @param nanos the interval in nanoseconds
+ */
+void Clock_deadline(struct timespec* deadline, uint64_t nanos)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	deadline->tv_sec = now.tv_sec + (time_t)(nanos / CLOCK_NANOS_PER_SECOND);
+	deadline->tv_nsec = now.tv_usec * 1000L + (long)(nanos % CLOCK_NANOS_PER_SECOND);
+	if (deadline->tv_nsec >= (long)CLOCK_NANOS_PER_SECOND)
+	{
+		++(deadline->tv_sec);
+		deadline->tv_nsec -= (long)CLOCK_NANOS_PER_SECOND;
+	}
+}
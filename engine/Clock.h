@@ -0,0 +1,33 @@
+//
+//  Clock.h
+//  SimpleMessage
+//
+//  Copyright 2012 Dominik Zajac (dc-square GmbH)
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+#if !defined(CLOCK_H)
+#define CLOCK_H
+
+#include <stdint.h>
+#include <time.h>
+
+#define CLOCK_NANOS_PER_MILLI 1000000ULL
+#define CLOCK_NANOS_PER_SECOND 1000000000ULL
+
+uint64_t Clock_now(void);
+double Clock_seconds(uint64_t nanos);
+void Clock_sleepUntil(uint64_t deadline);
+void Clock_deadline(struct timespec* deadline, uint64_t nanos);
+
+#endif
@@ -0,0 +1,366 @@
+//
+//  ConnectionPool.c
+//  SimpleMessage
+//
+//  Copyright 2012 Dominik Zajac (dc-square GmbH)
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+/**
+ * @file
+ * \brief Live MQTT connections kept between runs
+ *
+ * Creating, connecting and disconnecting a client for every batch costs more than the
+ * publishes themselves when batches are small, and the disconnect timeout holds up
+ * whichever queue the batch is running on.  Handles are therefore kept here, keyed by
+ * broker URI and client identifier, and handed out again to later batches.  A handle
+ * which has lost its connection is reconnected when it is next acquired.
+ *
+ * Every pooled handle has a messageArrived callback set, which makes the client library
+ * read all the pooled sockets on its one background thread.  Without it, each thread
+ * calling into the library runs its own select over every socket and can consume
+ * packets meant for another thread's connection.
+ *
+ * Callbacks can only be set before a handle connects, so the deliveryComplete callback
+ * is the pool's own, passing each acknowledgement on to every batch holding the handle
+ * which has asked for them.  A handle can be held by more than one batch, and a token
+ * does not say which of them published it, so each is expected to ignore tokens it does
+ * not know, as AckWindow does.
+ * The in-flight limit is likewise fixed at connect, so a connected handle asked for with a
+ * different limit is disconnected and connected again with the new one.
+ */
+
+#include "ConnectionPool.h"
+#include "Thread.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/** milliseconds for in-flight messages to complete before reconnecting with a new limit */
+#define RECONNECT_TIMEOUT 1000
+
+/**
+ * A batch's deliveryComplete callback
+ */
+typedef struct ConnectionPool_callback
+{
+	MQTTClient_deliveryComplete* dc;
+	void* context;
+	struct ConnectionPool_callback* next;
+} ConnectionPool_callback;
+
+/**
+ * One pooled connection
+ */
+typedef struct ConnectionPool_entry
+{
+	char* serverURI;
+	char* clientId;
+	MQTTClient client;
+	mutex_type mutex;		/**< serializes (re)connection of this handle */
+	int users;				/**< number of batches currently holding the handle */
+	int connects;			/**< successful connects, so that reconnects can be told apart */
+	int maxInflight;		/**< the in-flight limit the handle was last connected with */
+	mutex_type callback_mutex;	/**< guards callbacks, which the library thread reads */
+	ConnectionPool_callback* callbacks;
+	struct ConnectionPool_entry* next;
+} ConnectionPool_entry;
+
+static ConnectionPool_entry* entries = NULL;
+
+static mutex_type pool_mutex = NULL;
+
+
+/**
+ * Lock the pool.  The pool has no initialization call, so the first caller creates the
+ * mutex; should two race to do so, the loser's mutex is destroyed.
+ */
+static void ConnectionPool_lock(void)
+{
+	if (pool_mutex == NULL)
+	{
+		mutex_type mutex = Thread_create_mutex();
+
+#if defined(WIN32)
+		if (InterlockedCompareExchangePointer((PVOID*)&pool_mutex, mutex, NULL) != NULL)
+#else
+		if (__sync_val_compare_and_swap(&pool_mutex, NULL, mutex) != NULL)
+#endif
+			Thread_destroy_mutex(mutex);
+	}
+	Thread_lock_mutex(pool_mutex);
+}
+
+
+/**
+ * The load generator does not subscribe, so anything which does arrive is discarded
+ */
+static int ConnectionPool_messageArrived(void* context, char* topicName, int topicLen, MQTTClient_message* message)
+{
+	MQTTClient_freeMessage(&message);
+	MQTTClient_free(topicName);
+	return 1;
+}
+
+
+static void ConnectionPool_deliveryComplete(void* context, MQTTClient_deliveryToken token)
+{
+	ConnectionPool_entry* entry = context;
+	ConnectionPool_callback* callback = NULL;
+
+	Thread_lock_mutex(entry->callback_mutex);
+	for (callback = entry->callbacks; callback != NULL; callback = callback->next)
+		(*callback->dc)(callback->context, token);
+	Thread_unlock_mutex(entry->callback_mutex);
+}
+
+
+/**
+ * The in-flight limit the client library applies for a set of connect options
+ */
+static int ConnectionPool_maxInflight(MQTTClient_connectOptions* options)
+{
+	if (options->struct_version >= 1 && options->maxInflight > 0)
+		return options->maxInflight;
+	return (options->reliable) ? 1 : 10;
+}
+
+
+/**
+ * Find the entry for a broker URI and client identifier, creating it if there is none.
+ * Must be called with the pool mutex held.
+ * @param serverURI the broker address
+ * @param clientId the MQTT client identifier
+ * @return the entry, or NULL if a client handle could not be created
+ */
+static ConnectionPool_entry* ConnectionPool_find(char* serverURI, char* clientId)
+{
+	ConnectionPool_entry* entry = NULL;
+
+	for (entry = entries; entry != NULL; entry = entry->next)
+	{
+		if (strcmp(entry->serverURI, serverURI) == 0 && strcmp(entry->clientId, clientId) == 0)
+			goto exit;
+	}
+
+	entry = malloc(sizeof(ConnectionPool_entry));
+	memset(entry, '\0', sizeof(ConnectionPool_entry));
+	if (MQTTClient_create(&entry->client, serverURI, clientId, MQTTCLIENT_PERSISTENCE_NONE, NULL)
+			!= MQTTCLIENT_SUCCESS)
+	{
+		free(entry);
+		entry = NULL;
+		goto exit;
+	}
+	MQTTClient_setCallbacks(entry->client, entry, NULL, ConnectionPool_messageArrived, ConnectionPool_deliveryComplete);
+	entry->callback_mutex = Thread_create_mutex();
+	entry->serverURI = strdup(serverURI);
+	entry->clientId = strdup(clientId);
+	entry->mutex = Thread_create_mutex();
+	entry->next = entries;
+	entries = entry;
+exit:
+	return entry;
+}
+
+
+/**
+ * Get a connected client handle for a broker URI and client identifier.  An existing
+ * handle is reused if there is one; it is connected first if it is not connected, or if
+ * it was connected with a different in-flight limit and no one else holds it.
+ * Each successful acquire must be matched by a ConnectionPool_release.
+ * @param serverURI the broker address
+ * @param clientId the MQTT client identifier
+ * @param options the connect options to use if the handle has to be (re)connected
+ * @param client set to the connected handle
+ * @return CONNECTIONPOOL_SUCCESS, CONNECTIONPOOL_RECONNECTED or CONNECTIONPOOL_FAILURE
+ */
+int ConnectionPool_acquire(char* serverURI, char* clientId, MQTTClient_connectOptions* options,
+		MQTTClient* client)
+{
+	ConnectionPool_entry* entry = NULL;
+	int maxInflight = ConnectionPool_maxInflight(options);
+	int shared = 0;
+	int rc = CONNECTIONPOOL_FAILURE;
+
+	ConnectionPool_lock();
+	if ((entry = ConnectionPool_find(serverURI, clientId)) != NULL)
+		shared = (++(entry->users) > 1);
+	Thread_unlock_mutex(pool_mutex);
+	if (entry == NULL)
+		goto exit;
+
+	Thread_lock_mutex(entry->mutex);
+	if (MQTTClient_isConnected(entry->client))
+	{
+		if (entry->maxInflight == maxInflight || shared)
+			rc = CONNECTIONPOOL_SUCCESS;
+		else
+		{
+			MQTTClient_disconnect(entry->client, RECONNECT_TIMEOUT);
+			if (MQTTClient_connect(entry->client, options) == MQTTCLIENT_SUCCESS)
+			{
+				entry->maxInflight = maxInflight;
+				rc = CONNECTIONPOOL_SUCCESS;
+			}
+		}
+	}
+	else if (MQTTClient_connect(entry->client, options) == MQTTCLIENT_SUCCESS)
+	{
+		entry->maxInflight = maxInflight;
+		rc = (entry->connects++ > 0) ? CONNECTIONPOOL_RECONNECTED : CONNECTIONPOOL_SUCCESS;
+	}
+	Thread_unlock_mutex(entry->mutex);
+
+	if (rc != CONNECTIONPOOL_FAILURE)
+		*client = entry->client;
+	else
+		ConnectionPool_release(entry->client);
+exit:
+	return rc;
+}
+
+
+/**
+ * Find the entry holding a client handle
+ * @param client a handle returned by ConnectionPool_acquire
+ * @return the entry, or NULL if the handle is not pooled
+ */
+static ConnectionPool_entry* ConnectionPool_entryFor(MQTTClient client)
+{
+	ConnectionPool_entry* entry = NULL;
+
+	ConnectionPool_lock();
+	for (entry = entries; entry != NULL; entry = entry->next)
+	{
+		if (entry->client == client)
+			break;
+	}
+	Thread_unlock_mutex(pool_mutex);
+	return entry;
+}
+
+
+/**
+ * Add a function to be called as each QoS 1 or 2 message on a handle completes.  It is
+ * called on the client library's thread, for the messages of every batch holding the
+ * handle.  Each added callback must be removed with ConnectionPool_removeDeliveryComplete
+ * before the handle is released.  Must not be called from a callback.
+ * @param client a handle returned by ConnectionPool_acquire
+ * @param dc the callback
+ * @param context passed to the callback, and identifies it for removal
+ */
+void ConnectionPool_addDeliveryComplete(MQTTClient client, MQTTClient_deliveryComplete* dc, void* context)
+{
+	ConnectionPool_entry* entry = ConnectionPool_entryFor(client);
+	ConnectionPool_callback* callback = NULL;
+
+	if (entry == NULL)
+		return;
+	callback = malloc(sizeof(ConnectionPool_callback));
+	callback->dc = dc;
+	callback->context = context;
+	Thread_lock_mutex(entry->callback_mutex);
+	callback->next = entry->callbacks;
+	entry->callbacks = callback;
+	Thread_unlock_mutex(entry->callback_mutex);
+}
+
+
+/**
+ * Remove a callback added by ConnectionPool_addDeliveryComplete.  Once this returns the
+ * callback is not running and will not be called again, so its context can be freed.
+ * Must not be called from a callback.
+ * @param client a handle returned by ConnectionPool_acquire
+ * @param context the context the callback was added with
+ */
+void ConnectionPool_removeDeliveryComplete(MQTTClient client, void* context)
+{
+	ConnectionPool_entry* entry = ConnectionPool_entryFor(client);
+	ConnectionPool_callback** link = NULL;
+	ConnectionPool_callback* callback = NULL;
+
+	if (entry == NULL)
+		return;
+	Thread_lock_mutex(entry->callback_mutex);
+	for (link = &entry->callbacks; (callback = *link) != NULL; link = &callback->next)
+	{
+		if (callback->context == context)
+		{
+			*link = callback->next;
+			free(callback);
+			break;
+		}
+	}
+	Thread_unlock_mutex(entry->callback_mutex);
+}
+
+
+/**
+ * Hand a client handle back to the pool.  The connection is left open for the next user.
+ * @param client a handle returned by ConnectionPool_acquire
+ */
+void ConnectionPool_release(MQTTClient client)
+{
+	ConnectionPool_entry* entry = NULL;
+
+	ConnectionPool_lock();
+	for (entry = entries; entry != NULL; entry = entry->next)
+	{
+		if (entry->client == client)
+		{
+			--(entry->users);
+			break;
+		}
+	}
+	Thread_unlock_mutex(pool_mutex);
+}
+
+
+/**
+ * Disconnect and destroy every handle in the pool which is not currently acquired.
+ * Call when the application terminates or at the end of a headless run.
+ * @param timeout milliseconds to allow each client to complete in-flight messages
+ */
+void ConnectionPool_closeAll(int timeout)
+{
+	ConnectionPool_entry** link = &entries;
+	ConnectionPool_entry* entry = NULL;
+
+	ConnectionPool_lock();
+	while ((entry = *link) != NULL)
+	{
+		if (entry->users > 0)
+		{
+			link = &entry->next;
+			continue;
+		}
+		*link = entry->next;
+		if (MQTTClient_isConnected(entry->client))
+			MQTTClient_disconnect(entry->client, timeout);
+		MQTTClient_destroy(&entry->client);
+		while (entry->callbacks)
+		{	/* left behind by a holder which did not remove its callback */
+			ConnectionPool_callback* callback = entry->callbacks;
+
+			entry->callbacks = callback->next;
+			free(callback);
+		}
+		Thread_destroy_mutex(entry->mutex);
+		Thread_destroy_mutex(entry->callback_mutex);
+		free(entry->serverURI);
+		free(entry->clientId);
+		free(entry);
+	}
+	Thread_unlock_mutex(pool_mutex);
+}
@@ -0,0 +1,38 @@
+//
+//  ConnectionPool.h
+//  SimpleMessage
+//
+//  Copyright 2012 Dominik Zajac (dc-square GmbH)
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+#if !defined(CONNECTIONPOOL_H)
+#define CONNECTIONPOOL_H
+
+#include "MQTTClient.h"
+
+/** Return code: a connected handle was returned */
+#define CONNECTIONPOOL_SUCCESS 0
+/** Return code: the handle could not be created or connected */
+#define CONNECTIONPOOL_FAILURE -1
+/** Return code: a connected handle was returned, after re-establishing a dropped connection */
+#define CONNECTIONPOOL_RECONNECTED 1
+
+int ConnectionPool_acquire(char* serverURI, char* clientId, MQTTClient_connectOptions* options,
+		MQTTClient* client);
+void ConnectionPool_addDeliveryComplete(MQTTClient client, MQTTClient_deliveryComplete* dc, void* context);
+void ConnectionPool_removeDeliveryComplete(MQTTClient client, void* context);
+void ConnectionPool_release(MQTTClient client);
+void ConnectionPool_closeAll(int timeout);
+
+#endif
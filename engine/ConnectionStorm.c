@@ -0,0 +1,208 @@
+//
+//  ConnectionStorm.c
+//  SimpleMessage
+//
+//  Copyright 2012 Dominik Zajac (dc-square GmbH)
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+/**
+ * @file
+ * \brief Many sessions connecting at a controlled rate
+ *
+ * Simulates a fleet of devices reconnecting after an outage.  Each session has its own
+ * generated client identifier, so the broker keeps them all.  The calling thread hands
+ * out connects on a schedule following the rate ramp, and a pool of workers carries them
+ * out, timing each MQTTClient_connect from the TCP connect to the CONNACK.
+ *
+ * Where the client library's socket layer is built on select, the number of sessions is
+ * limited to what fits in an fd_set; see CONNECTIONSTORM_MAX_SESSIONS.
+ */
+
+#include "ConnectionStorm.h"
+#include "ClientId.h"
+#include "Clock.h"
+#include "MQTTClient.h"
+#include "Workers.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * One session of the storm
+ */
+typedef struct
+{
+	ConnectionStorm_options* options;
+	MQTTClient client;
+	int number;
+	int rc;
+	uint64_t latency;
+	uint64_t completed;
+} ConnectionStorm_session;
+
+
+/**
+ * The storm does not subscribe, but a messageArrived callback puts the client library's
+ * socket reads on its background thread, which is required with many threads connecting
+ */
+static int ConnectionStorm_messageArrived(void* context, char* topicName, int topicLen, MQTTClient_message* message)
+{
+	MQTTClient_freeMessage(&message);
+	MQTTClient_free(topicName);
+	return 1;
+}
+
+
+static void ConnectionStorm_connect(void* context)
+{
+	ConnectionStorm_session* session = context;
+	ConnectionStorm_options* options = session->options;
+	MQTTClient_connectOptions conn_opts = MQTTClient_connectOptions_initializer;
+	char clientId[CLIENTID_MAX_LEN + 1];
+	uint64_t start;
+
+	session->rc = CONNECTIONSTORM_FAILURE;
+	ClientId_generate(options->clientId, session->number, clientId, sizeof(clientId));
+	if (MQTTClient_create(&session->client, options->serverURI, clientId, MQTTCLIENT_PERSISTENCE_NONE, NULL)
+			!= MQTTCLIENT_SUCCESS)
+	{
+		session->client = NULL;
+		goto exit;
+	}
+	MQTTClient_setCallbacks(session->client, NULL, NULL, ConnectionStorm_messageArrived, NULL);
+
+	conn_opts.keepAliveInterval = options->keepAliveInterval;
+	conn_opts.cleansession = options->cleansession;
+	start = Clock_now();
+	if (MQTTClient_connect(session->client, &conn_opts) == MQTTCLIENT_SUCCESS)
+	{
+		session->completed = Clock_now();
+		session->latency = session->completed - start;
+		session->rc = CONNECTIONSTORM_SUCCESS;
+	}
+exit:
+	return;
+}
+
+
+/**
+ * The connect rate a given time into the storm
+ */
+static double ConnectionStorm_rate(ConnectionStorm_options* options, double t)
+{
+	if (t >= options->ramp)
+		return options->endRate;
+	return options->startRate + (options->endRate - options->startRate) * t / options->ramp;
+}
+
+
+/**
+ * Check that an options structure describes a storm which can be run
+ * @param options the storm options
+ * @return CONNECTIONSTORM_SUCCESS or CONNECTIONSTORM_BAD_OPTIONS
+ */
+int ConnectionStorm_validate(ConnectionStorm_options* options)
+{
+	int rc = CONNECTIONSTORM_BAD_OPTIONS;
+
+	if (options == NULL || options->serverURI == NULL || options->clientId == NULL)
+		goto exit;
+	if (options->sessions < 1 || options->sessions > CONNECTIONSTORM_MAX_SESSIONS)
+		goto exit;
+	if (options->concurrency < 1 || options->startRate < 0.0 || options->endRate < 0.0)
+		goto exit;
+	if (options->ramp < 0.0 || options->hold < 0.0)
+		goto exit;
+	if (options->startRate > 0.0 && options->endRate == 0.0 && options->ramp > 0.0)
+		goto exit;		/* the rate would ramp down to nothing */
+	rc = CONNECTIONSTORM_SUCCESS;
+exit:
+	return rc;
+}
+
+
+/**
+ * Open all the sessions on the rate schedule, hold them open, then disconnect them
+ * @param options the storm options
+ * @param results the storm results
+ * @return CONNECTIONSTORM_SUCCESS, CONNECTIONSTORM_FAILURE if any session did not connect
+ * or CONNECTIONSTORM_BAD_OPTIONS
+ */
+int ConnectionStorm_run(ConnectionStorm_options* options, ConnectionStorm_results* results)
+{
+	ConnectionStorm_session* sessions = NULL;
+	Workers* workers = NULL;
+	uint64_t start, due, last = 0;
+	double t = 0.0;
+	int i, rc;
+
+	if ((rc = ConnectionStorm_validate(options)) != CONNECTIONSTORM_SUCCESS)
+		goto exit;
+	if ((workers = Workers_create(options->concurrency, 0)) == NULL)
+	{
+		rc = CONNECTIONSTORM_FAILURE;
+		goto exit;
+	}
+
+	sessions = calloc(options->sessions, sizeof(ConnectionStorm_session));
+	start = Clock_now();
+	for (i = 0; i < options->sessions; i++)
+	{
+		double rate = ConnectionStorm_rate(options, t);
+
+		sessions[i].options = options;
+		sessions[i].number = i + 1;
+		if (rate > 0.0)
+		{
+			due = start + (uint64_t)(t * CLOCK_NANOS_PER_SECOND);
+			Clock_sleepUntil(due);
+			t += 1.0 / rate;
+		}
+		Workers_submit(workers, ConnectionStorm_connect, &sessions[i]);
+	}
+	Workers_wait(workers);
+
+	for (i = 0; i < options->sessions; i++)
+	{
+		if (sessions[i].rc == CONNECTIONSTORM_SUCCESS)
+		{
+			++(results->connected);
+			if (results->latency)
+				Histogram_record(results->latency, sessions[i].latency);
+			if (sessions[i].completed > last)
+				last = sessions[i].completed;
+		}
+		else
+		{
+			++(results->failed);
+			rc = CONNECTIONSTORM_FAILURE;
+		}
+	}
+	results->elapsed = (last > start) ? last - start : 0;
+
+	Clock_sleepUntil(Clock_now() + (uint64_t)(options->hold * CLOCK_NANOS_PER_SECOND));
+
+	for (i = 0; i < options->sessions; i++)
+	{
+		if (sessions[i].client == NULL)
+			continue;
+		if (MQTTClient_isConnected(sessions[i].client))
+			MQTTClient_disconnect(sessions[i].client, 0);
+		MQTTClient_destroy(&sessions[i].client);
+	}
+	free(sessions);
+	Workers_destroy(workers);
+exit:
+	return rc;
+}
@@ -0,0 +1,78 @@
+//
+//  ConnectionStorm.h
+//  SimpleMessage
+//
+//  Copyright 2012 Dominik Zajac (dc-square GmbH)
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+#if !defined(CONNECTIONSTORM_H)
+#define CONNECTIONSTORM_H
+
+#include <stdint.h>
+#include <sys/select.h>
+
+#include "Histogram.h"
+
+/** Return code: every session connected */
+#define CONNECTIONSTORM_SUCCESS 0
+/** Return code: one or more sessions could not connect */
+#define CONNECTIONSTORM_FAILURE -1
+/** Return code: the options structure is incomplete or out of range */
+#define CONNECTIONSTORM_BAD_OPTIONS -2
+
+/**
+ * The most sessions in one storm.  On Linux the client library waits for its sockets with
+ * epoll, so the open file limit is the only limit; elsewhere it uses select, and the sessions
+ * must fit in an fd_set with descriptors to spare for stdio, the subscriber and so on.
+ */
+#if defined(__linux__) && !defined(NO_EPOLL)
+#define CONNECTIONSTORM_MAX_SESSIONS 1000000
+#else
+#define CONNECTIONSTORM_MAX_SESSIONS (FD_SETSIZE - 32)
+#endif
+
+/**
+ * How many sessions to open and how fast.  The connect rate ramps linearly from startRate
+ * to endRate over the first ramp seconds, then stays at endRate.
+ */
+typedef struct
+{
+	char* serverURI;		/**< broker address */
+	char* clientId;			/**< prefix of the generated client identifiers */
+	int sessions;			/**< number of sessions to open */
+	int concurrency;		/**< connects in progress at once */
+	double startRate;		/**< connects per second at the start, 0 for all at once */
+	double endRate;			/**< connects per second at the end of the ramp */
+	double ramp;			/**< seconds over which the rate changes */
+	double hold;			/**< seconds to keep the sessions open once all have connected */
+	int keepAliveInterval;	/**< MQTT keep alive in seconds */
+	int cleansession;		/**< boolean - MQTT clean session flag */
+} ConnectionStorm_options;
+
+#define ConnectionStorm_options_initializer { NULL, "SimpleMessage", 1, 64, 0.0, 0.0, 0.0, 0.0, 60, 1 }
+
+typedef struct
+{
+	int connected;			/**< sessions which connected */
+	int failed;				/**< sessions which did not */
+	uint64_t elapsed;		/**< nanoseconds from the first connect to the last completing */
+	Histogram* latency;		/**< if not NULL, nanoseconds for each MQTTClient_connect: TCP and CONNACK */
+} ConnectionStorm_results;
+
+#define ConnectionStorm_results_initializer { 0, 0, 0ULL, NULL }
+
+int ConnectionStorm_validate(ConnectionStorm_options* options);
+int ConnectionStorm_run(ConnectionStorm_options* options, ConnectionStorm_results* results);
+
+#endif
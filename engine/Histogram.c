@@ -0,0 +1,187 @@
+//
+//  Histogram.c
+//  SimpleMessage
+//
+//  Copyright 2012 Dominik Zajac (dc-square GmbH)
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+/**
+ * @file
+ * \brief Latency distribution recording
+ *
+ * Values below HISTOGRAM_SUB_BUCKETS are counted exactly.  Above that, each power of two
+ * range is split into HISTOGRAM_SUB_BUCKETS / 2 equal buckets, so a reported percentile
+ * is within about 3% of the true value however large it is.  Recording is a few shifts and an
+ * increment, cheap enough to do for every message.
+ */
+
+#include "Histogram.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/** log2 of HISTOGRAM_SUB_BUCKETS */
+#define SUB_BUCKET_BITS 6
+
+
+/**
+ * Find the bucket for a value
+ * @param value the value
+ * @param magnitude set to the power of two bucket
+ * @param sub set to the linear bucket within it
+ */
+static void Histogram_index(uint64_t value, int* magnitude, int* sub)
+{
+	int bits = 0;
+
+	while (bits < 64 && (value >> bits) >= HISTOGRAM_SUB_BUCKETS)
+		++bits;
+	if (bits >= HISTOGRAM_MAGNITUDES)
+	{
+		*magnitude = HISTOGRAM_MAGNITUDES - 1;
+		*sub = HISTOGRAM_SUB_BUCKETS - 1;
+	}
+	else
+	{
+		*magnitude = bits;
+		*sub = (int)(value >> bits);
+	}
+}
+
+
+/**
+ * The highest value which is counted in a bucket
+ */
+static uint64_t Histogram_value(int magnitude, int sub)
+{
+	return (((uint64_t)sub + 1) << magnitude) - 1;
+}
+
+
+/**
+ * Allocate an empty histogram
+ * @return the histogram
+ */
+Histogram* Histogram_create(void)
+{
+	Histogram* histogram = malloc(sizeof(Histogram));
+
+	Histogram_reset(histogram);
+	return histogram;
+}
+
+
+void Histogram_destroy(Histogram* histogram)
+{
+	free(histogram);
+}
+
+
+/**
+ * Discard all recorded values
+ * @param histogram the histogram
+ */
+void Histogram_reset(Histogram* histogram)
+{
+	memset(histogram, '\0', sizeof(Histogram));
+	histogram->min = UINT64_MAX;
+}
+
+
+/**
+ * Count one value
+ * @param histogram the histogram
+ * @param value the value, normally nanoseconds
+ */
+void Histogram_record(Histogram* histogram, uint64_t value)
+{
+	int magnitude, sub;
+
+	Histogram_index(value, &magnitude, &sub);
+	++(histogram->buckets[magnitude][sub]);
+	++(histogram->count);
+	histogram->total += (double)value;
+	if (value < histogram->min)
+		histogram->min = value;
+	if (value > histogram->max)
+		histogram->max = value;
+}
+
+
+/**
+ * Add the values recorded in one histogram to another
+ * @param to the histogram to add to
+ * @param from the histogram to add
+ */
+void Histogram_merge(Histogram* to, Histogram* from)
+{
+	int i, j;
+
+	if (from->count == 0)
+		return;
+	for (i = 0; i < HISTOGRAM_MAGNITUDES; i++)
+		for (j = 0; j < HISTOGRAM_SUB_BUCKETS; j++)
+			to->buckets[i][j] += from->buckets[i][j];
+	to->count += from->count;
+	to->total += from->total;
+	if (from->min < to->min)
+		to->min = from->min;
+	if (from->max > to->max)
+		to->max = from->max;
+}
+
+
+/**
+ * The value below which a given percentage of the recorded values fall
+ * @param histogram the histogram
+ * @param percentile the percentage, 0 to 100
+ * @return the value, 0 if nothing has been recorded
+ */
+uint64_t Histogram_percentile(Histogram* histogram, double percentile)
+{
+	uint64_t rank, seen = 0;
+	int i, j;
+
+	if (histogram->count == 0)
+		return 0;
+	if (percentile >= 100.0)
+		return histogram->max;
+
+	rank = (uint64_t)(histogram->count * percentile / 100.0);
+	if (rank < 1)
+		rank = 1;
+	for (i = 0; i < HISTOGRAM_MAGNITUDES; i++)
+	{
+		for (j = 0; j < HISTOGRAM_SUB_BUCKETS; j++)
+		{
+			if ((seen += histogram->buckets[i][j]) >= rank)
+			{
+				uint64_t value = Histogram_value(i, j);
+				return (value > histogram->max) ? histogram->max : value;
+			}
+		}
+	}
+	return histogram->max;
+}
+
+
+/**
+ * The arithmetic mean of the recorded values
+ * @param histogram the histogram
+ * @return the mean, 0 if nothing has been recorded
+ */
+double Histogram_mean(Histogram* histogram)
+{
+	return (histogram->count > 0) ? histogram->total / histogram->count : 0.0;
+}
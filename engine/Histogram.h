@@ -0,0 +1,49 @@
+//
+//  Histogram.h
+//  SimpleMessage
+//
+//  Copyright 2012 Dominik Zajac (dc-square GmbH)
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+#if !defined(HISTOGRAM_H)
+#define HISTOGRAM_H
+
+#include <stdint.h>
+
+/** linear sub-buckets per power of two; values are kept to within 2/HISTOGRAM_SUB_BUCKETS */
+#define HISTOGRAM_SUB_BUCKETS 64
+/** powers of two covered: values up to 2^(HISTOGRAM_MAGNITUDES + 5) nanoseconds, about 39 hours */
+#define HISTOGRAM_MAGNITUDES 42
+
+/**
+ * Counts of recorded values in log-linear buckets, in the manner of an HDR histogram
+ */
+typedef struct
+{
+	uint64_t count;
+	uint64_t min;
+	uint64_t max;
+	double total;
+	uint64_t buckets[HISTOGRAM_MAGNITUDES][HISTOGRAM_SUB_BUCKETS];
+} Histogram;
+
+Histogram* Histogram_create(void);
+void Histogram_destroy(Histogram* histogram);
+void Histogram_reset(Histogram* histogram);
+void Histogram_record(Histogram* histogram, uint64_t value);
+void Histogram_merge(Histogram* to, Histogram* from);
+uint64_t Histogram_percentile(Histogram* histogram, double percentile);
+double Histogram_mean(Histogram* histogram);
+
+#endif
@@ -0,0 +1,269 @@
+//
+//  LatencyMonitor.c
+//  SimpleMessage
+//
+//  Copyright 2012 Dominik Zajac (dc-square GmbH)
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+/**
+ * @file
+ * \brief Companion subscriber measuring end-to-end latency
+ *
+ * Subscribes to the topics a run publishes to and reads the latency stamp (see Payload.c)
+ * from each message as it arrives on the client library's messageArrived callback.  The
+ * publishers stamp the time each message was due, so the latency recorded covers any
+ * delay in publishing as well as the trip through the broker.  It must run on the same
+ * host as the publishers, because the stamps are monotonic clock readings.
+ */
+
+#include "LatencyMonitor.h"
+#include "Clock.h"
+#include "Payload.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct LatencyMonitor
+{
+	MQTTClient client;
+	pthread_mutex_t mutex;	/**< the series are updated on the client library's thread */
+	LatencyMonitor_series* series;
+	long received;
+	int connections;		/**< the number of publishing connections, which stamps are checked against */
+};
+
+
+/**
+ * Find the series for a topic and QoS, creating it if there is none.  Must be called with
+ * the monitor mutex held.
+ */
+static LatencyMonitor_series* LatencyMonitor_find(LatencyMonitor* monitor, char* topic, int topicLen, int qos)
+{
+	LatencyMonitor_series* series = NULL;
+	size_t len = (topicLen > 0) ? (size_t)topicLen : strlen(topic);
+
+	for (series = monitor->series; series != NULL; series = series->next)
+	{
+		if (series->qos == qos && strlen(series->topic) == len && memcmp(series->topic, topic, len) == 0)
+			goto exit;
+	}
+
+	series = malloc(sizeof(LatencyMonitor_series));
+	memset(series, '\0', sizeof(LatencyMonitor_series));
+	series->topic = malloc(len + 1);
+	memcpy(series->topic, topic, len);
+	series->topic[len] = '\0';
+	series->qos = qos;
+	series->latency = Histogram_create();
+	series->lastCount = monitor->connections;
+	series->last = malloc(series->lastCount * sizeof(uint32_t));
+	memset(series->last, '\0', series->lastCount * sizeof(uint32_t));
+	series->next = monitor->series;
+	monitor->series = series;
+exit:
+	return series;
+}
+
+
+/**
+ * Track the sequence numbers from one publishing connection, numbered from 1 to
+ * series->lastCount
+ */
+static void LatencyMonitor_sequence(LatencyMonitor_series* series, uint32_t connection, uint32_t sequence)
+{
+	uint32_t* last = &series->last[connection - 1];
+
+	if (sequence <= *last)
+		++(series->duplicates);
+	else
+	{
+		series->lost += sequence - *last - 1;
+		*last = sequence;
+	}
+}
+
+
+/**
+ * Record the latency stamp of a message.  A message without a stamp, or with a stamp from a
+ * connection number outside the run's 1 to connections, is not counted.
+ * @param monitor the monitor
+ * @param topicName the topic the message arrived on
+ * @param topicLen the length of topicName, or 0 if it is null terminated
+ * @param qos the QoS the message was delivered with
+ * @param payload the message payload
+ * @param payloadlen the length of the payload
+ * @return boolean - whether the message was counted
+ */
+int LatencyMonitor_record(LatencyMonitor* monitor, char* topicName, int topicLen, int qos, void* payload, int payloadlen)
+{
+	uint64_t now = Clock_now();
+	uint32_t connection, sequence;
+	uint64_t due;
+	LatencyMonitor_series* series = NULL;
+
+	/* the connection number comes off the wire, so it must not size or index anything unchecked */
+	if (!Payload_readStamp(payload, payloadlen, &connection, &sequence, &due) ||
+		connection == 0 || connection > (uint32_t)monitor->connections)
+		return 0;
+
+	pthread_mutex_lock(&monitor->mutex);
+	series = LatencyMonitor_find(monitor, topicName, topicLen, qos);
+	++(series->received);
+	++(monitor->received);
+	Histogram_record(series->latency, (now > due) ? now - due : 0);
+	LatencyMonitor_sequence(series, connection, sequence);
+	pthread_mutex_unlock(&monitor->mutex);
+	return 1;
+}
+
+
+static int LatencyMonitor_messageArrived(void* context, char* topicName, int topicLen, MQTTClient_message* message)
+{
+	/* a retained message may be left over from an earlier run */
+	if (!message->retained)
+		LatencyMonitor_record(context, topicName, topicLen, message->qos, message->payload, message->payloadlen);
+	MQTTClient_freeMessage(&message);
+	MQTTClient_free(topicName);
+	return 1;
+}
+
+
+/**
+ * Create a monitor, which records nothing until it is started
+ * @param connections the number of connections publishing stamped messages, which number
+ * them from 1
+ * @return the monitor
+ */
+LatencyMonitor* LatencyMonitor_create(int connections)
+{
+	LatencyMonitor* monitor = malloc(sizeof(LatencyMonitor));
+
+	memset(monitor, '\0', sizeof(LatencyMonitor));
+	pthread_mutex_init(&monitor->mutex, NULL);
+	monitor->connections = (connections > 0) ? connections : 0;
+	return monitor;
+}
+
+
+/**
+ * Connect a subscriber and start recording latencies
+ * @param monitor the monitor
+ * @param serverURI the broker address
+ * @param clientId the MQTT client identifier for the subscriber
+ * @param topicFilter the topics to subscribe to
+ * @param qos the maximum QoS to subscribe with; use 2 to see each publisher's QoS
+ * @return LATENCYMONITOR_SUCCESS or LATENCYMONITOR_FAILURE
+ */
+int LatencyMonitor_start(LatencyMonitor* monitor, char* serverURI, char* clientId, char* topicFilter, int qos)
+{
+	MQTTClient_connectOptions conn_opts = MQTTClient_connectOptions_initializer;
+	int rc = LATENCYMONITOR_FAILURE;
+
+	if (MQTTClient_create(&monitor->client, serverURI, clientId, MQTTCLIENT_PERSISTENCE_NONE, NULL) != MQTTCLIENT_SUCCESS)
+	{
+		monitor->client = NULL;
+		goto exit;
+	}
+	MQTTClient_setCallbacks(monitor->client, monitor, NULL, LatencyMonitor_messageArrived, NULL);
+
+	conn_opts.cleansession = 1;
+	if (MQTTClient_connect(monitor->client, &conn_opts) != MQTTCLIENT_SUCCESS)
+		goto exit;
+	if (MQTTClient_subscribe(monitor->client, topicFilter, qos) != MQTTCLIENT_SUCCESS)
+		goto exit;
+	rc = LATENCYMONITOR_SUCCESS;
+exit:
+	return rc;
+}
+
+
+/**
+ * Number of stamped messages received so far
+ * @param monitor the monitor
+ * @return the count
+ */
+long LatencyMonitor_received(LatencyMonitor* monitor)
+{
+	long received;
+
+	pthread_mutex_lock(&monitor->mutex);
+	received = monitor->received;
+	pthread_mutex_unlock(&monitor->mutex);
+	return received;
+}
+
+
+/**
+ * Forget the sequence numbers seen so far, for a new run whose connections number their
+ * messages from the start again.  The latencies and counts carry on accumulating.
+ * @param monitor the monitor
+ */
+void LatencyMonitor_resetSequences(LatencyMonitor* monitor)
+{
+	LatencyMonitor_series* series = NULL;
+
+	pthread_mutex_lock(&monitor->mutex);
+	for (series = monitor->series; series != NULL; series = series->next)
+		memset(series->last, '\0', series->lastCount * sizeof(uint32_t));
+	pthread_mutex_unlock(&monitor->mutex);
+}
+
+
+/**
+ * The recorded series.  Only stable once the monitor has been stopped.
+ * @param monitor the monitor
+ * @return the first series, or NULL if nothing was received
+ */
+LatencyMonitor_series* LatencyMonitor_getSeries(LatencyMonitor* monitor)
+{
+	return monitor->series;
+}
+
+
+/**
+ * Disconnect the subscriber.  The series remain readable until LatencyMonitor_destroy.
+ * @param monitor the monitor
+ */
+void LatencyMonitor_stop(LatencyMonitor* monitor)
+{
+	if (monitor->client == NULL)
+		return;
+	if (MQTTClient_isConnected(monitor->client))
+		MQTTClient_disconnect(monitor->client, 0);
+	MQTTClient_destroy(&monitor->client);
+	monitor->client = NULL;
+}
+
+
+/**
+ * Stop the monitor if it is running and free it and its series
+ * @param monitor the monitor
+ */
+void LatencyMonitor_destroy(LatencyMonitor* monitor)
+{
+	LatencyMonitor_series* series = NULL;
+
+	LatencyMonitor_stop(monitor);
+	while ((series = monitor->series) != NULL)
+	{
+		monitor->series = series->next;
+		Histogram_destroy(series->latency);
+		free(series->last);
+		free(series->topic);
+		free(series);
+	}
+	pthread_mutex_destroy(&monitor->mutex);
+	free(monitor);
+}
@@ -0,0 +1,59 @@
+//
+//  LatencyMonitor.h
+//  SimpleMessage
+//
+//  Copyright 2012 Dominik Zajac (dc-square GmbH)
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+#if !defined(LATENCYMONITOR_H)
+#define LATENCYMONITOR_H
+
+#include <stdint.h>
+
+#include "Histogram.h"
+#include "MQTTClient.h"
+
+/** Return code: the monitor is connected and subscribed */
+#define LATENCYMONITOR_SUCCESS 0
+/** Return code: the monitor could not connect or subscribe */
+#define LATENCYMONITOR_FAILURE -1
+
+/**
+ * End-to-end latencies of the stamped messages received on one topic at one QoS
+ */
+typedef struct LatencyMonitor_series
+{
+	char* topic;
+	int qos;				/**< the QoS the message was delivered with */
+	long received;			/**< stamped messages received */
+	long lost;				/**< gaps in the per-connection sequence numbers */
+	long duplicates;		/**< sequence numbers received again, or out of order */
+	Histogram* latency;		/**< nanoseconds from the publisher's due time to arrival */
+	uint32_t* last;			/**< highest sequence number seen, indexed by publishing connection number - 1 */
+	int lastCount;			/**< entries in last, one for each publishing connection */
+	struct LatencyMonitor_series* next;
+} LatencyMonitor_series;
+
+typedef struct LatencyMonitor LatencyMonitor;
+
+LatencyMonitor* LatencyMonitor_create(int connections);
+int LatencyMonitor_start(LatencyMonitor* monitor, char* serverURI, char* clientId, char* topicFilter, int qos);
+int LatencyMonitor_record(LatencyMonitor* monitor, char* topicName, int topicLen, int qos, void* payload, int payloadlen);
+long LatencyMonitor_received(LatencyMonitor* monitor);
+void LatencyMonitor_resetSequences(LatencyMonitor* monitor);
+LatencyMonitor_series* LatencyMonitor_getSeries(LatencyMonitor* monitor);
+void LatencyMonitor_stop(LatencyMonitor* monitor);
+void LatencyMonitor_destroy(LatencyMonitor* monitor);
+
+#endif
@@ -0,0 +1,694 @@
+//
+//  LoadGenerator.c
+//  SimpleMessage
+//
+//  Copyright 2012 Dominik Zajac (dc-square GmbH)
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+/**
+ * @file
+ * \brief The connect/publish/disconnect loop behind the Send button
+ *
+ * Plain C so that it can be driven from the Cocoa application and from the
+ * headless simplemessage-bench tool alike.
+ */
+
+#include "LoadGenerator.h"
+#include "AckWindow.h"
+#include "ClientId.h"
+#include "Clock.h"
+#include "ConnectionPool.h"
+#include "MQTTClient.h"
+#include "Payload.h"
+#include "Workers.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+
+/**
+ * Check that an options structure describes a run which can be started
+ * @param options the run options
+ * @return LOADGENERATOR_SUCCESS or LOADGENERATOR_BAD_OPTIONS
+ */
+int LoadGenerator_validate(LoadGenerator_options* options)
+{
+	int rc = LOADGENERATOR_BAD_OPTIONS;
+
+	if (options == NULL || options->serverURI == NULL || options->clientId == NULL)
+		goto exit;
+	if (options->scenario == NULL && (options->topic == NULL || strlen(options->topic) == 0))
+		goto exit;
+	if (options->scenario == NULL && (options->message == NULL || strlen(options->message) == 0))
+		goto exit;
+	if (options->connections < 1 || options->messages < 0)
+		goto exit;
+	if (options->qos < 0 || options->qos > 2)
+		goto exit;
+	if (options->concurrency < 0 || options->rate < 0.0 || options->totalRate < 0.0 || options->window < 0 || options->window > 65535 || options->batch < 0)
+		goto exit;
+	rc = LOADGENERATOR_SUCCESS;
+exit:
+	return rc;
+}
+
+
+/**
+ * What the deliveryComplete callback needs to update for a batch
+ */
+typedef struct
+{
+	AckWindow* window;
+	Stats_counters* counters;
+} LoadGenerator_acks;
+
+
+static void LoadGenerator_deliveryComplete(void* context, MQTTClient_deliveryToken token)
+{
+	LoadGenerator_acks* acks = context;
+
+	if (AckWindow_deliveryComplete(acks->window, token) && acks->counters)
+	{
+		Stats_acked(acks->counters);
+		Stats_inflight(acks->counters, -1);
+	}
+}
+
+
+/**
+ * The number of connections publishing at the same time, which share the aggregate rate
+ * @param options the run options
+ * @return the lesser of the connections and the concurrency
+ */
+static int LoadGenerator_active(LoadGenerator_options* options)
+{
+	if (options->concurrency > 0 && options->concurrency < options->connections)
+		return options->concurrency;
+	return options->connections;
+}
+
+
+static double LoadGenerator_shareRate(double rate, double totalRate, int active)
+{
+	if (totalRate > 0.0)
+	{
+		double share = totalRate / active;
+
+		if (rate == 0.0 || share < rate)
+			rate = share;
+	}
+	return rate;
+}
+
+
+/**
+ * The rate at which each connection should publish, taking both the per connection and
+ * the aggregate limits into account
+ * @param options the run options
+ * @return messages per second, or 0 for as fast as possible
+ */
+double LoadGenerator_connectionRate(LoadGenerator_options* options)
+{
+	return LoadGenerator_shareRate(options->rate, options->totalRate, LoadGenerator_active(options));
+}
+
+
+/**
+ * The aggregate rate the run aims for, across the connections publishing at the same time
+ * @param options the run options
+ * @return messages per second, or 0 for as fast as possible
+ */
+double LoadGenerator_targetRate(LoadGenerator_options* options)
+{
+	return LoadGenerator_connectionRate(options) * LoadGenerator_active(options);
+}
+
+
+/**
+ * Whether the connections publish options->batch messages at a time with
+ * MQTTClient_publishMany, rather than one by one
+ * @param options the run options
+ * @return boolean
+ */
+int LoadGenerator_batched(LoadGenerator_options* options)
+{
+	return options->scenario == NULL && options->batch > 1 && LoadGenerator_connectionRate(options) == 0.0 &&
+			(options->qos == 0 || options->window == 0) && !options->retained;
+}
+
+
+/**
+ * The number of messages a connection will send, as far as it is known in advance
+ * @param options the run options
+ * @param phase with a scenario, the first phase to count
+ * @return the number of messages; scenario phases which last for a duration count as none
+ */
+static int LoadGenerator_planned(LoadGenerator_options* options, int phase)
+{
+	int count = 0;
+
+	if (options->scenario == NULL)
+		return options->messages;
+	for (; phase < options->scenario->phaseCount; phase++)
+		count += options->scenario->phases[phase].messages;
+	return count;
+}
+
+
+/**
+ * Everything one connection needs while it publishes
+ */
+typedef struct
+{
+	LoadGenerator_options* options;
+	LoadGenerator_results* results;
+	int connection;
+	MQTTClient client;
+	AckWindow* window;
+	Stats_counters* counters;
+	Payload* payload;
+	MQTTClient_deliveryToken token;	/**< the last QoS 1 or 2 message published */
+} LoadGenerator_sender;
+
+
+/**
+ * Publish with MQTTClient_publishAsync, so that when the client's in-flight limit is
+ * reached the publisher waits on its own window, and carries on as soon as the next
+ * acknowledgement arrives, rather than the client library sleeping
+ * @return the MQTTClient_publishAsync return code; MQTTCLIENT_FAILURE if the message
+ * could not be accepted within the disconnect timeout
+ */
+static int LoadGenerator_publishWindowed(LoadGenerator_sender* sender, AckWindow* window, char* topic,
+		int payloadlen, int qos, int retained, MQTTClient_deliveryToken* token)
+{
+	uint64_t deadline = Clock_now() + sender->options->disconnectTimeout * CLOCK_NANOS_PER_MILLI;
+	int rc;
+
+	while (1)
+	{
+		long acked = AckWindow_acked(window);
+
+		rc = MQTTClient_publishAsync(sender->client, topic, payloadlen, sender->payload->buffer,
+				qos, retained, token);
+		if (rc != MQTTCLIENT_WOULD_BLOCK)
+			break;
+		if (Clock_now() >= deadline)
+		{
+			rc = MQTTCLIENT_FAILURE;
+			break;
+		}
+		/* output still being written is not signalled by an acknowledgement, so don't wait long */
+		AckWindow_awaitAck(window, acked, 1);
+	}
+	return rc;
+}
+
+
+/**
+ * Publish one message from the sender's payload
+ * @param sender the connection
+ * @param topic the topic
+ * @param payloadlen bytes of the payload to send
+ * @param qos the QoS
+ * @param retained boolean - set the retained flag
+ * @param sequence the message number on this connection, for the latency stamp
+ * @param due the time the message was scheduled for
+ * @return LOADGENERATOR_SUCCESS, or LOADGENERATOR_FAILURE if the acknowledgement window
+ * stayed full for so long that the connection should be given up
+ */
+static int LoadGenerator_publish(LoadGenerator_sender* sender, char* topic, int payloadlen, int qos,
+		int retained, unsigned int sequence, uint64_t due)
+{
+	LoadGenerator_results* results = sender->results;
+	Stats_counters* counters = sender->counters;
+	AckWindow* window = (qos > 0) ? sender->window : NULL;
+	MQTTClient_deliveryToken token = 0;
+	uint64_t sent;
+	int rc;
+
+	if (window && AckWindow_reserve(window, sender->options->disconnectTimeout) != ACKWINDOW_SUCCESS)
+		return LOADGENERATOR_FAILURE;
+
+	Payload_stamp(sender->payload, sender->connection, sequence, due);
+	if (window && counters)
+		Stats_inflight(counters, 1);
+	sent = Clock_now();
+	if (window)
+		rc = LoadGenerator_publishWindowed(sender, window, topic, payloadlen, qos, retained, &token);
+	else
+		rc = MQTTClient_publish(sender->client, topic, payloadlen, sender->payload->buffer,
+				qos, retained, &token);
+	if (rc == MQTTCLIENT_SUCCESS)
+	{
+		++(results->published);
+		if (counters)
+			Stats_published(counters, payloadlen);
+		if (qos > 0)
+			sender->token = token;
+		if (window && AckWindow_sent(window, token, sent) && counters)
+		{
+			Stats_acked(counters);
+			Stats_inflight(counters, -1);
+		}
+		if (results->latency)
+			Histogram_record(results->latency, Clock_now() - due);
+	}
+	else
+	{
+		++(results->failed);
+		if (counters)
+			Stats_failed(counters, 1);
+		if (window)
+		{
+			AckWindow_cancel(window);
+			if (counters)
+				Stats_inflight(counters, -1);
+		}
+	}
+	return LOADGENERATOR_SUCCESS;
+}
+
+
+static void LoadGenerator_giveUp(LoadGenerator_sender* sender, int count)
+{
+	sender->results->failed += count;
+	if (sender->counters)
+		Stats_failed(sender->counters, count);
+}
+
+
+/**
+ * Publish the configured message, topic and QoS options->messages times, options->batch
+ * messages at a time, each batch with one call of MQTTClient_publishMany.  Each message
+ * of a batch has its own payload buffer, as they are all written together.  The latency
+ * is recorded once for each batch, as its messages are all handed over together.
+ * @return LOADGENERATOR_SUCCESS, or LOADGENERATOR_FAILURE if there was no memory for the
+ * batch, in which case nothing has been sent
+ */
+static int LoadGenerator_sendBatches(LoadGenerator_sender* sender)
+{
+	LoadGenerator_options* options = sender->options;
+	LoadGenerator_results* results = sender->results;
+	int size = options->batch;
+	Payload** payloads = malloc(sizeof(Payload*) * size);
+	char** topics = malloc(sizeof(char*) * size);
+	void** buffers = malloc(sizeof(void*) * size);
+	int* lens = malloc(sizeof(int) * size);
+	int* qoss = malloc(sizeof(int) * size);
+	MQTTClient_deliveryToken* tokens = malloc(sizeof(MQTTClient_deliveryToken) * size);
+	int rc = LOADGENERATOR_FAILURE;
+	int i, j;
+
+	if (payloads == NULL || topics == NULL || buffers == NULL || lens == NULL || qoss == NULL || tokens == NULL)
+	{
+		size = 0;
+		goto exit;
+	}
+
+	for (j = 0; j < size; j++)
+	{
+		payloads[j] = Payload_create(options->message, options->appendCounter, options->stamped);
+		topics[j] = options->topic;
+		buffers[j] = payloads[j]->buffer;
+		qoss[j] = options->qos;
+	}
+
+	for (i = 1; i <= options->messages; i += size)
+	{
+		int count = (options->messages - i + 1 < size) ? options->messages - i + 1 : size;
+		uint64_t due = Clock_now();
+
+		for (j = 0; j < count; j++)
+		{
+			lens[j] = Payload_render(payloads[j], i + j);
+			Payload_stamp(payloads[j], sender->connection, i + j, due);
+		}
+		if (MQTTClient_publishMany(sender->client, count, topics, buffers, lens, qoss, tokens) == MQTTCLIENT_SUCCESS)
+		{
+			uint64_t latency = Clock_now() - due;
+
+			results->published += count;
+			if (sender->counters)
+			{
+				for (j = 0; j < count; j++)
+					Stats_published(sender->counters, lens[j]);
+			}
+			if (options->qos > 0)
+				sender->token = tokens[count - 1];
+			if (results->latency)
+				Histogram_record(results->latency, latency);
+		}
+		else
+		{
+			results->failed += count;
+			if (sender->counters)
+				Stats_failed(sender->counters, count);
+		}
+	}
+	rc = LOADGENERATOR_SUCCESS;
+
+exit:
+	for (j = 0; j < size; j++)
+		Payload_destroy(payloads[j]);
+	free(payloads);
+	free(topics);
+	free(buffers);
+	free(lens);
+	free(qoss);
+	free(tokens);
+	return rc;
+}
+
+
+/**
+ * Publish the configured message, topic and QoS options->messages times
+ */
+static void LoadGenerator_sendMessages(LoadGenerator_sender* sender)
+{
+	LoadGenerator_options* options = sender->options;
+	double rate = LoadGenerator_connectionRate(options);
+	uint64_t start = Clock_now();
+	uint64_t due;
+	int i;
+
+	if (LoadGenerator_batched(options))
+	{
+		if (LoadGenerator_sendBatches(sender) != LOADGENERATOR_SUCCESS)
+			LoadGenerator_giveUp(sender, options->messages);
+		return;
+	}
+
+	for (i = 1; i <= options->messages; i++)
+	{
+		if (rate > 0.0)
+		{
+			due = start + (uint64_t)((i - 1) * (CLOCK_NANOS_PER_SECOND / rate));
+			Clock_sleepUntil(due);
+		}
+		else
+			due = Clock_now();
+
+		if (LoadGenerator_publish(sender, options->topic, Payload_render(sender->payload, i),
+				options->qos, options->retained, i, due) != LOADGENERATOR_SUCCESS)
+		{	/* nothing has been acknowledged for a long time, so give up on this connection */
+			LoadGenerator_giveUp(sender, options->messages - i + 1);
+			break;
+		}
+	}
+}
+
+
+/**
+ * Replay the phases of options->scenario.  Each phase's schedule starts when the phase
+ * does, and a phase which lasts for a duration sends the messages due before it ends.
+ */
+static void LoadGenerator_sendScenario(LoadGenerator_sender* sender)
+{
+	LoadGenerator_options* options = sender->options;
+	Scenario* scenario = options->scenario;
+	Scenario_stream stream;
+	Scenario_message message;
+	unsigned int sequence = 0;
+	int payloadlen;
+	int p, n;
+
+	Scenario_startStream(scenario, sender->connection, &stream);
+	for (p = 0; p < scenario->phaseCount; p++)
+	{
+		Scenario_phase* phase = &scenario->phases[p];
+		double rate = LoadGenerator_shareRate(phase->rate, phase->totalRate, LoadGenerator_active(options));
+		uint64_t start = Clock_now();
+		uint64_t end = start + (uint64_t)(phase->duration * CLOCK_NANOS_PER_SECOND);
+		uint64_t due;
+
+		for (n = 1; phase->messages == 0 || n <= phase->messages; n++)
+		{
+			if (rate > 0.0)
+				due = start + (uint64_t)((n - 1) * (CLOCK_NANOS_PER_SECOND / rate));
+			else
+				due = Clock_now();
+			if (phase->messages == 0 && due >= end)
+				break;
+			Clock_sleepUntil(due);
+
+			Scenario_draw(phase, &stream, &message);
+			payloadlen = message.size;
+			if (options->stamped && payloadlen < PAYLOAD_STAMP_LEN)
+				payloadlen = PAYLOAD_STAMP_LEN;
+			if (LoadGenerator_publish(sender, message.topic, payloadlen, message.qos, message.retained,
+					++sequence, due) != LOADGENERATOR_SUCCESS)
+			{
+				LoadGenerator_giveUp(sender, ((phase->messages > 0) ? phase->messages - n + 1 : 1)
+						+ LoadGenerator_planned(options, p + 1));
+				return;
+			}
+		}
+	}
+}
+
+
+/**
+ * Publish the configured messages on one connection.  The connection is taken from the
+ * pool, and opened only if it is not already open.
+ *
+ * With a rate set, message i is due at i / rate seconds after the first, whether or not
+ * earlier messages went out on time, and latency is measured from that due time.  A
+ * broker which stalls therefore shows up as latency for every message held up behind
+ * the stall, not just the one which was waiting when it happened.
+ *
+ * With a window set, QoS 1 and 2 messages are pipelined: up to the window size may be
+ * unacknowledged at once, and the batch waits for an acknowledgement whenever the window
+ * is full.  The window is also passed to the client library as its in-flight limit.
+ *
+ * With a batch size set, and no rate, window or retained flag, messages are published in groups with
+ * MQTTClient_publishMany, so that each group goes out in as few writes as possible.
+ *
+ * With a scenario set, its phases are replayed in place of the topic, message, QoS,
+ * retained flag, message count and rates of the options.
+ * @param options the run options
+ * @param connection the 1-based number of this connection within the run; when a run has
+ * more than one connection it is used to generate a unique client identifier
+ * @param results counters to add this connection's figures to
+ * @return LOADGENERATOR_SUCCESS, or LOADGENERATOR_FAILURE if the connection could not
+ * be established
+ */
+int LoadGenerator_sendBatch(LoadGenerator_options* options, int connection, LoadGenerator_results* results)
+{
+	MQTTClient_connectOptions conn_opts = MQTTClient_connectOptions_initializer;
+	LoadGenerator_sender sender;
+	LoadGenerator_acks acks;
+	char generatedId[CLIENTID_MAX_LEN + 1];
+	char* clientId = options->clientId;
+	int qos = (options->scenario) ? options->scenario->maxQos : options->qos;
+	uint64_t start;
+	int rc;
+
+	memset(&sender, '\0', sizeof(sender));
+	sender.options = options;
+	sender.results = results;
+	sender.connection = connection;
+	++(results->connections);
+	if (results->stats)
+		sender.counters = Stats_connection(results->stats, connection);
+	if (options->connections > 1)
+	{
+		ClientId_generate(options->clientId, connection, generatedId, sizeof(generatedId));
+		clientId = generatedId;
+	}
+
+	conn_opts.keepAliveInterval = options->keepAliveInterval;
+	conn_opts.cleansession = 1;
+	if (options->window > 1)
+	{
+		conn_opts.reliable = 0;
+		conn_opts.maxInflight = options->window;
+	}
+	else if (options->batch > 1 && options->window == 0)
+	{	/* let a whole batch of QoS 1 and 2 messages be in flight */
+		conn_opts.reliable = 0;
+		conn_opts.maxInflight = (options->batch > 65535) ? 65535 : options->batch;
+	}
+	if ((rc = ConnectionPool_acquire(options->serverURI, clientId, &conn_opts, &sender.client)) == CONNECTIONPOOL_FAILURE)
+	{
+		rc = LOADGENERATOR_FAILURE;
+		++(results->connectFailures);
+		LoadGenerator_giveUp(&sender, LoadGenerator_planned(options, 0));
+		goto exit;
+	}
+	if (rc == CONNECTIONPOOL_RECONNECTED && sender.counters)
+		Stats_reconnected(sender.counters);
+
+	if (qos > 0 && options->window > 0)
+	{
+		sender.window = AckWindow_create(options->window, results->ackLatency);
+		acks.window = sender.window;
+		acks.counters = sender.counters;
+		ConnectionPool_addDeliveryComplete(sender.client, LoadGenerator_deliveryComplete, &acks);
+	}
+
+	start = Clock_now();
+	if (options->scenario)
+	{
+		sender.payload = Payload_createSized(options->message ? options->message : "",
+				options->scenario->maxSize, options->stamped);
+		LoadGenerator_sendScenario(&sender);
+	}
+	else
+	{
+		sender.payload = Payload_create(options->message, options->appendCounter, options->stamped);
+		LoadGenerator_sendMessages(&sender);
+	}
+	if (Clock_now() - start > results->sendElapsed)
+		results->sendElapsed = Clock_now() - start;
+
+	Payload_destroy(sender.payload);
+	/* the connection stays open, so wait here for the flows disconnect used to complete */
+	if (sender.window)
+	{
+		AckWindow_drain(sender.window, options->disconnectTimeout);
+		/* acks is on this stack, so make sure the library thread is done with it */
+		ConnectionPool_removeDeliveryComplete(sender.client, &acks);
+		results->acked += AckWindow_acked(sender.window);
+		AckWindow_destroy(sender.window);
+	}
+	else if (sender.token != 0)
+		MQTTClient_waitForCompletion(sender.client, sender.token, options->disconnectTimeout);
+	ConnectionPool_release(sender.client);
+	rc = LOADGENERATOR_SUCCESS;
+exit:
+	return rc;
+}
+
+
+/**
+ * One connection's share of a run
+ */
+typedef struct
+{
+	LoadGenerator_options* options;
+	int connection;
+	int rc;
+	LoadGenerator_results results;
+} LoadGenerator_batch;
+
+
+static void LoadGenerator_runBatch(void* context)
+{
+	LoadGenerator_batch* batch = context;
+
+	batch->rc = LoadGenerator_sendBatch(batch->options, batch->connection, &batch->results);
+}
+
+
+/**
+ * Run all the configured connections, up to options->concurrency of them at the same time
+ * @param options the run options
+ * @param results counters for the whole run
+ * @return LOADGENERATOR_SUCCESS, LOADGENERATOR_FAILURE if any connection failed or
+ * LOADGENERATOR_BAD_OPTIONS
+ */
+int LoadGenerator_run(LoadGenerator_options* options, LoadGenerator_results* results)
+{
+	LoadGenerator_batch* batches = NULL;
+	Workers* workers = NULL;
+	uint64_t start;
+	int i, rc;
+
+	if ((rc = LoadGenerator_validate(options)) != LOADGENERATOR_SUCCESS)
+		goto exit;
+
+	workers = Workers_create((options->concurrency > 0) ? options->concurrency : options->connections,
+			options->pinned);
+	if (workers == NULL)
+	{
+		rc = LOADGENERATOR_FAILURE;
+		goto exit;
+	}
+	batches = calloc(options->connections, sizeof(LoadGenerator_batch));
+
+	start = Clock_now();
+	for (i = 0; i < options->connections; i++)
+	{
+		LoadGenerator_results initial = LoadGenerator_results_initializer;
+
+		batches[i].options = options;
+		batches[i].connection = i + 1;
+		batches[i].results = initial;
+		batches[i].results.stats = results->stats;
+		if (results->latency)
+			batches[i].results.latency = Histogram_create();
+		if (results->ackLatency)
+			batches[i].results.ackLatency = Histogram_create();
+		Workers_submit(workers, LoadGenerator_runBatch, &batches[i]);
+	}
+	Workers_wait(workers);
+	results->elapsed = Clock_now() - start;
+
+	for (i = 0; i < options->connections; i++)
+	{
+		results->connections += batches[i].results.connections;
+		results->connectFailures += batches[i].results.connectFailures;
+		results->published += batches[i].results.published;
+		results->failed += batches[i].results.failed;
+		results->acked += batches[i].results.acked;
+		if (batches[i].results.sendElapsed > results->sendElapsed)
+			results->sendElapsed = batches[i].results.sendElapsed;
+		if (results->ackLatency)
+		{
+			Histogram_merge(results->ackLatency, batches[i].results.ackLatency);
+			Histogram_destroy(batches[i].results.ackLatency);
+		}
+		if (results->latency)
+		{
+			Histogram_merge(results->latency, batches[i].results.latency);
+			Histogram_destroy(batches[i].results.latency);
+		}
+		if (batches[i].rc != LOADGENERATOR_SUCCESS)
+			rc = LOADGENERATOR_FAILURE;
+	}
+	/* connections which take turns publish one after another, so time the whole run */
+	if (LoadGenerator_active(options) < options->connections)
+		results->sendElapsed = 0ULL;
+	free(batches);
+	Workers_destroy(workers);
+exit:
+	return rc;
+}
+
+
+/**
+ * Published messages per second while a run was sending
+ * @param results the run results
+ * @return the message rate, or 0 if nothing was timed
+ */
+double LoadGenerator_throughput(LoadGenerator_results* results)
+{
+	uint64_t elapsed = (results->sendElapsed > 0) ? results->sendElapsed : results->elapsed;
+
+	return (elapsed > 0) ? results->published / Clock_seconds(elapsed) : 0.0;
+}
+
+
+/**
+ * Acknowledged messages per second over a whole run, including the wait for the last
+ * acknowledgements
+ * @param results the run results
+ * @return the message rate, or 0 if nothing was timed
+ */
+double LoadGenerator_ackedThroughput(LoadGenerator_results* results)
+{
+	return (results->elapsed > 0) ? results->acked / Clock_seconds(results->elapsed) : 0.0;
+}
@@ -0,0 +1,102 @@
+//
+//  LoadGenerator.h
+//  SimpleMessage
+//
+//  Copyright 2012 Dominik Zajac (dc-square GmbH)
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+#if !defined(LOADGENERATOR_H)
+#define LOADGENERATOR_H
+
+#include <stdint.h>
+
+#include "Histogram.h"
+#include "Scenario.h"
+#include "Stats.h"
+
+/** Return code: the run completed, although individual messages may have failed */
+#define LOADGENERATOR_SUCCESS 0
+/** Return code: one or more connections could not be established */
+#define LOADGENERATOR_FAILURE -1
+/** Return code: the options structure is incomplete or out of range */
+#define LOADGENERATOR_BAD_OPTIONS -2
+
+/**
+ * What to send, where to send it and how often.  This is everything the Send button
+ * used to read from the window, so the same run can be driven from the UI or headless.
+ */
+typedef struct
+{
+	char* serverURI;		/**< broker address, e.g. tcp://localhost:1883 */
+	char* clientId;			/**< MQTT client identifier, or the prefix of generated ones (see ClientId.h)
+								 when there are several connections */
+	char* topic;			/**< topic to publish to */
+	char* message;			/**< message text, UTF-8 */
+	int connections;		/**< number of connections to open */
+	int messages;			/**< number of messages to publish on each connection */
+	int qos;				/**< MQTT QoS, 0, 1 or 2 */
+	int retained;			/**< boolean - set the MQTT retained flag */
+	int appendCounter;		/**< boolean - append " - <n>" to each message */
+	int keepAliveInterval;	/**< MQTT keep alive in seconds */
+	int disconnectTimeout;	/**< milliseconds to wait for in-flight messages at the end of a batch */
+	int concurrency;		/**< connections driven at the same time, 0 for all of them */
+	int pinned;				/**< boolean - pin each worker thread to a CPU */
+	double rate;			/**< messages per second on each connection, 0 for as fast as possible */
+	double totalRate;		/**< messages per second across the connections publishing at once, 0 for no limit */
+	int stamped;			/**< boolean - start each payload with a latency stamp, see Payload.h */
+	int window;				/**< QoS 1 and 2: unacknowledged messages allowed on each connection, up to 65535,
+								 0 to wait for acknowledgements only at the end of the batch */
+	int batch;				/**< messages handed to MQTTClient_publishMany at once, 0 or 1 to publish
+								 them one by one; only used without a scenario, rate, window or retained flag,
+								 see LoadGenerator_batched */
+	Scenario* scenario;		/**< if not NULL, the message mix and rates to replay in place of topic,
+								 message, messages, qos, retained, appendCounter, rate and totalRate;
+								 message, if set, is the text payloads are filled with */
+} LoadGenerator_options;
+
+#define LoadGenerator_options_initializer { NULL, "SimpleMessage", NULL, NULL, 1, 1, 0, 0, 0, 20, 10000, 0, 0, 0.0, 0.0, 0, 0, 0, NULL }
+
+/**
+ * Counters collected over a run
+ */
+typedef struct
+{
+	int connections;		/**< connections attempted */
+	int connectFailures;	/**< connections which could not be established */
+	long published;			/**< messages accepted by MQTTClient_publish */
+	long failed;			/**< messages which could not be published */
+	long acked;				/**< QoS 1 and 2 messages acknowledged, counted when a window is set */
+	uint64_t elapsed;		/**< run time in nanoseconds, including waiting for acknowledgements */
+	uint64_t sendElapsed;	/**< nanoseconds from the first publish to the last, longest connection; 0 when
+								 connections take turns */
+	Histogram* latency;		/**< if not NULL, nanoseconds from each message's scheduled send time
+								 until MQTTClient_publish returned; when batched, one value for each
+								 batch, until MQTTClient_publishMany returned */
+	Histogram* ackLatency;	/**< if not NULL and a window is set, nanoseconds from publish to
+								 PUBACK (QoS 1) or PUBCOMP (QoS 2) */
+	Stats* stats;			/**< if not NULL, live counters updated as the run goes */
+} LoadGenerator_results;
+
+#define LoadGenerator_results_initializer { 0, 0, 0L, 0L, 0L, 0ULL, 0ULL, NULL, NULL, NULL }
+
+int LoadGenerator_validate(LoadGenerator_options* options);
+int LoadGenerator_sendBatch(LoadGenerator_options* options, int connection, LoadGenerator_results* results);
+int LoadGenerator_run(LoadGenerator_options* options, LoadGenerator_results* results);
+double LoadGenerator_throughput(LoadGenerator_results* results);
+double LoadGenerator_ackedThroughput(LoadGenerator_results* results);
+double LoadGenerator_connectionRate(LoadGenerator_options* options);
+double LoadGenerator_targetRate(LoadGenerator_options* options);
+int LoadGenerator_batched(LoadGenerator_options* options);
+
+#endif
@@ -0,0 +1,205 @@
+//
+//  Payload.c
+//  SimpleMessage
+//
+//  Copyright 2012 Dominik Zajac (dc-square GmbH)
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+/**
+ * @file
+ * \brief Message payloads built without allocating per message
+ *
+ * The message text and separator are copied into one buffer when the batch starts.  For
+ * each message only the counter digits are written, directly after them.  Lengths are
+ * in bytes of UTF-8, which is what goes on the wire.
+ *
+ * For end-to-end latency measurement a payload can start with a binary stamp: the magic
+ * bytes "SMts", then the publishing connection number, the message sequence number and
+ * the monotonic clock time the message was due, all big-endian.  The clock is only
+ * comparable between processes on the same host.
+ */
+
+#include "Payload.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define STAMP_MAGIC "SMts"
+#define STAMP_MAGIC_LEN 4
+#define COUNTER_SEPARATOR " - "
+/** the largest unsigned int has 10 digits */
+#define COUNTER_DIGITS 10
+
+
+static void writeInt(char* buffer, uint64_t value, int len)
+{
+	while (len-- > 0)
+	{
+		buffer[len] = (char)(value & 0xFF);
+		value >>= 8;
+	}
+}
+
+
+static uint64_t readInt(unsigned char* buffer, int len)
+{
+	uint64_t value = 0;
+	int i;
+
+	for (i = 0; i < len; i++)
+		value = (value << 8) | buffer[i];
+	return value;
+}
+
+
+/**
+ * Render the fixed part of a payload
+ * @param message the message text, UTF-8
+ * @param appendCounter boolean - reserve room for a counter after the text
+ * @param stamped boolean - reserve room for a latency stamp before the text
+ * @return the payload
+ */
+Payload* Payload_create(char* message, int appendCounter, int stamped)
+{
+	Payload* payload = malloc(sizeof(Payload));
+	size_t messagelen = strlen(message);
+	char* text = NULL;
+
+	payload->appendCounter = appendCounter;
+	payload->stamped = stamped;
+	payload->prefixlen = (int)messagelen + (stamped ? PAYLOAD_STAMP_LEN : 0);
+	payload->buffer = malloc(payload->prefixlen + sizeof(COUNTER_SEPARATOR) + COUNTER_DIGITS);
+	text = payload->buffer;
+	if (stamped)
+	{
+		memset(payload->buffer, '\0', PAYLOAD_STAMP_LEN);
+		memcpy(payload->buffer, STAMP_MAGIC, STAMP_MAGIC_LEN);
+		text += PAYLOAD_STAMP_LEN;
+	}
+	memcpy(text, message, messagelen);
+	if (appendCounter)
+	{
+		memcpy(&text[messagelen], COUNTER_SEPARATOR, sizeof(COUNTER_SEPARATOR) - 1);
+		payload->prefixlen += sizeof(COUNTER_SEPARATOR) - 1;
+	}
+	return payload;
+}
+
+
+/**
+ * Render a payload of a given size, for runs which vary the payload size.  Each message
+ * sends the first n bytes of it, n up to the size.
+ * @param pattern text repeated to fill the payload, UTF-8; if empty the payload is zeros
+ * @param size the payload size in bytes; a stamped payload is at least PAYLOAD_STAMP_LEN
+ * @param stamped boolean - start the payload with a latency stamp
+ * @return the payload
+ */
+Payload* Payload_createSized(char* pattern, int size, int stamped)
+{
+	Payload* payload = malloc(sizeof(Payload));
+	size_t patternlen = strlen(pattern);
+	int offset = 0;
+
+	if (stamped && size < PAYLOAD_STAMP_LEN)
+		size = PAYLOAD_STAMP_LEN;
+	payload->appendCounter = 0;
+	payload->stamped = stamped;
+	payload->prefixlen = size;
+	payload->buffer = malloc(size + 1);
+	memset(payload->buffer, '\0', size + 1);
+	if (stamped)
+	{
+		memcpy(payload->buffer, STAMP_MAGIC, STAMP_MAGIC_LEN);
+		offset = PAYLOAD_STAMP_LEN;
+	}
+	while (patternlen > 0 && offset < size)
+	{
+		int len = (size - offset < (int)patternlen) ? size - offset : (int)patternlen;
+
+		memcpy(&payload->buffer[offset], pattern, len);
+		offset += len;
+	}
+	return payload;
+}
+
+
+void Payload_destroy(Payload* payload)
+{
+	free(payload->buffer);
+	free(payload);
+}
+
+
+/**
+ * Write the counter for one message into the payload buffer
+ * @param payload the payload
+ * @param counter the message number, ignored if the payload has no counter
+ * @return the payload length in bytes; the bytes are in payload->buffer
+ */
+int Payload_render(Payload* payload, unsigned int counter)
+{
+	char digits[COUNTER_DIGITS];
+	int count = 0;
+
+	if (!payload->appendCounter)
+		return payload->prefixlen;
+
+	do
+	{
+		digits[COUNTER_DIGITS - ++count] = (char)('0' + counter % 10);
+		counter /= 10;
+	}
+	while (counter > 0);
+	memcpy(&payload->buffer[payload->prefixlen], &digits[COUNTER_DIGITS - count], count);
+	return payload->prefixlen + count;
+}
+
+
+/**
+ * Write the latency stamp for one message into a stamped payload
+ * @param payload the payload
+ * @param connection the number of the publishing connection
+ * @param sequence the message number on that connection
+ * @param timestamp the monotonic time the message was due, from Clock_now
+ */
+void Payload_stamp(Payload* payload, uint32_t connection, uint32_t sequence, uint64_t timestamp)
+{
+	if (!payload->stamped)
+		return;
+	writeInt(&payload->buffer[STAMP_MAGIC_LEN], connection, 4);
+	writeInt(&payload->buffer[STAMP_MAGIC_LEN + 4], sequence, 4);
+	writeInt(&payload->buffer[STAMP_MAGIC_LEN + 8], timestamp, 8);
+}
+
+
+/**
+ * Read the latency stamp from a received message
+ * @param data the message payload
+ * @param len the payload length
+ * @param connection set to the number of the publishing connection
+ * @param sequence set to the message number on that connection
+ * @param timestamp set to the monotonic time the message was due
+ * @return boolean - the payload was stamped
+ */
+int Payload_readStamp(void* data, int len, uint32_t* connection, uint32_t* sequence, uint64_t* timestamp)
+{
+	unsigned char* bytes = data;
+
+	if (len < PAYLOAD_STAMP_LEN || memcmp(bytes, STAMP_MAGIC, STAMP_MAGIC_LEN) != 0)
+		return 0;
+	*connection = (uint32_t)readInt(&bytes[STAMP_MAGIC_LEN], 4);
+	*sequence = (uint32_t)readInt(&bytes[STAMP_MAGIC_LEN + 4], 4);
+	*timestamp = readInt(&bytes[STAMP_MAGIC_LEN + 8], 8);
+	return 1;
+}
@@ -0,0 +1,45 @@
+//
+//  Payload.h
+//  SimpleMessage
+//
+//  Copyright 2012 Dominik Zajac (dc-square GmbH)
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+#if !defined(PAYLOAD_H)
+#define PAYLOAD_H
+
+#include <stdint.h>
+
+/** bytes of latency stamp at the start of a stamped payload */
+#define PAYLOAD_STAMP_LEN 20
+
+/**
+ * A message payload rendered once, with an optional counter written in place per message
+ */
+typedef struct
+{
+	char* buffer;			/**< the prefix, followed by room for the counter */
+	int prefixlen;			/**< bytes of stamp and message text, plus the separator if there is a counter */
+	int appendCounter;		/**< boolean - append " - <n>" */
+	int stamped;			/**< boolean - the payload starts with a latency stamp */
+} Payload;
+
+Payload* Payload_create(char* message, int appendCounter, int stamped);
+Payload* Payload_createSized(char* pattern, int size, int stamped);
+void Payload_destroy(Payload* payload);
+int Payload_render(Payload* payload, unsigned int counter);
+void Payload_stamp(Payload* payload, uint32_t connection, uint32_t sequence, uint64_t timestamp);
+int Payload_readStamp(void* data, int len, uint32_t* connection, uint32_t* sequence, uint64_t* timestamp);
+
+#endif
@@ -0,0 +1,276 @@
+//
+//  PingPong.c
+//  SimpleMessage
+//
+//  Copyright 2012 Dominik Zajac (dc-square GmbH)
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+/**
+ * @file
+ * \brief Round trip latency between two clients
+ *
+ * One client publishes a ping and waits for it to come back; the other echoes each ping
+ * it receives from its messageArrived callback.  A round trip is two passes through the
+ * broker and two through the client library's network threads, which is what busy polling
+ * (see MQTTClient_setBusyPoll) is meant to speed up.  With the spin option the pinger also
+ * waits for each pong by spinning, so that no thread on the path sleeps.
+ *
+ * Each ping carries its sequence number, so that a pong which arrives after its round
+ * trip has timed out is recognised and dropped.
+ */
+
+#include "PingPong.h"
+#include "ClientId.h"
+#include "Clock.h"
+#include "MQTTClient.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * The two clients and the state they share
+ */
+typedef struct
+{
+	PingPong_options* options;
+	MQTTClient pinger;
+	MQTTClient echo;
+	char* pingTopic;
+	char* pongTopic;
+	pthread_mutex_t mutex;
+	pthread_cond_t arrived;		/**< signalled when the pong awaited arrives */
+	uint32_t awaited;			/**< sequence number of the ping in flight */
+	int received;				/**< boolean - the pong awaited has arrived, guarded by mutex */
+} PingPong_session;
+
+
+/**
+ * Echo a ping back on the pong topic
+ */
+static int PingPong_echo(void* context, char* topicName, int topicLen, MQTTClient_message* message)
+{
+	PingPong_session* session = context;
+
+	MQTTClient_publish(session->echo, session->pongTopic, message->payloadlen, message->payload,
+		session->options->qos, 0, NULL);
+	MQTTClient_freeMessage(&message);
+	MQTTClient_free(topicName);
+	return 1;
+}
+
+
+/**
+ * Note the arrival of a pong, if it is the one awaited
+ */
+static int PingPong_pong(void* context, char* topicName, int topicLen, MQTTClient_message* message)
+{
+	PingPong_session* session = context;
+
+	pthread_mutex_lock(&session->mutex);
+	if (message->payloadlen >= (int)sizeof(uint32_t) &&
+			memcmp(message->payload, &session->awaited, sizeof(uint32_t)) == 0)
+	{
+		session->received = 1;
+		pthread_cond_signal(&session->arrived);
+	}
+	pthread_mutex_unlock(&session->mutex);
+	MQTTClient_freeMessage(&message);
+	MQTTClient_free(topicName);
+	return 1;
+}
+
+
+/**
+ * Check whether the pong awaited has arrived
+ */
+static int PingPong_received(PingPong_session* session)
+{
+	int rc;
+
+	pthread_mutex_lock(&session->mutex);
+	rc = session->received;
+	pthread_mutex_unlock(&session->mutex);
+	return rc;
+}
+
+
+/**
+ * Wait for the pong awaited, by spinning or sleeping
+ * @return boolean - whether the pong arrived within the timeout
+ */
+static int PingPong_awaitPong(PingPong_session* session)
+{
+	int timeout = session->options->timeout;
+
+	if (session->options->spin)
+	{
+		uint64_t deadline = Clock_now() + timeout * CLOCK_NANOS_PER_MILLI;
+
+		while (!PingPong_received(session) && Clock_now() < deadline)
+			sched_yield();
+	}
+	else
+	{
+		struct timespec deadline;
+
+		Clock_deadline(&deadline, timeout * CLOCK_NANOS_PER_MILLI);
+		pthread_mutex_lock(&session->mutex);
+		while (!session->received)
+		{
+			if (pthread_cond_timedwait(&session->arrived, &session->mutex, &deadline) == ETIMEDOUT)
+				break;
+		}
+		pthread_mutex_unlock(&session->mutex);
+	}
+	return PingPong_received(session);
+}
+
+
+/**
+ * Create, connect and subscribe one of the two clients
+ * @return MQTTCLIENT_SUCCESS or an MQTT client error code; the client is created if not NULL
+ */
+static int PingPong_connect(PingPong_session* session, MQTTClient* client, int number, char* topic,
+	MQTTClient_messageArrived* ma)
+{
+	PingPong_options* options = session->options;
+	MQTTClient_connectOptions conn_opts = MQTTClient_connectOptions_initializer;
+	char clientId[CLIENTID_MAX_LEN + 1];
+	int rc;
+
+	ClientId_generate(options->clientId, number, clientId, sizeof(clientId));
+	if ((rc = MQTTClient_create(client, options->serverURI, clientId, MQTTCLIENT_PERSISTENCE_NONE, NULL))
+			!= MQTTCLIENT_SUCCESS)
+	{
+		*client = NULL;
+		goto exit;
+	}
+	MQTTClient_setCallbacks(*client, session, NULL, ma, NULL);
+	conn_opts.cleansession = 1;
+	if ((rc = MQTTClient_connect(*client, &conn_opts)) == MQTTCLIENT_SUCCESS)
+		rc = MQTTClient_subscribe(*client, topic, options->qos);
+exit:
+	return rc;
+}
+
+
+/**
+ * Check that an options structure describes a run which can be made
+ * @param options the ping-pong options
+ * @return PINGPONG_SUCCESS or PINGPONG_BAD_OPTIONS
+ */
+int PingPong_validate(PingPong_options* options)
+{
+	int rc = PINGPONG_BAD_OPTIONS;
+
+	if (options == NULL || options->serverURI == NULL || options->clientId == NULL)
+		goto exit;
+	if (options->topic == NULL || options->message == NULL)
+		goto exit;
+	if (options->count < 1 || options->qos < 0 || options->qos > 2 || options->timeout < 1)
+		goto exit;
+	rc = PINGPONG_SUCCESS;
+exit:
+	return rc;
+}
+
+
+/**
+ * Connect the pinger and the echo, time each round trip in turn, then disconnect them
+ * @param options the ping-pong options
+ * @param results the ping-pong results
+ * @return PINGPONG_SUCCESS, PINGPONG_FAILURE or PINGPONG_BAD_OPTIONS
+ */
+int PingPong_run(PingPong_options* options, PingPong_results* results)
+{
+	PingPong_session session;
+	char* payload = NULL;
+	int payloadlen, len, i, rc;
+	uint64_t start, last = 0;
+
+	if ((rc = PingPong_validate(options)) != PINGPONG_SUCCESS)
+		goto exit;
+
+	memset(&session, '\0', sizeof(session));
+	session.options = options;
+	pthread_mutex_init(&session.mutex, NULL);
+	pthread_cond_init(&session.arrived, NULL);
+	len = strlen(options->topic) + 6;
+	session.pingTopic = malloc(len);
+	session.pongTopic = malloc(len);
+	snprintf(session.pingTopic, len, "%s/ping", options->topic);
+	snprintf(session.pongTopic, len, "%s/pong", options->topic);
+	payloadlen = sizeof(uint32_t) + strlen(options->message);
+	payload = malloc(payloadlen);
+	memcpy(payload + sizeof(uint32_t), options->message, payloadlen - sizeof(uint32_t));
+
+	rc = PINGPONG_FAILURE;
+	if (PingPong_connect(&session, &session.echo, 2, session.pingTopic, PingPong_echo) != MQTTCLIENT_SUCCESS ||
+			PingPong_connect(&session, &session.pinger, 1, session.pongTopic, PingPong_pong) != MQTTCLIENT_SUCCESS)
+		goto disconnect;
+
+	rc = PINGPONG_SUCCESS;
+	start = Clock_now();
+	for (i = 0; i < options->count; i++)
+	{
+		uint32_t sequence = (uint32_t)i;
+		uint64_t sent;
+
+		pthread_mutex_lock(&session.mutex);
+		session.awaited = sequence;
+		session.received = 0;
+		pthread_mutex_unlock(&session.mutex);
+		memcpy(payload, &sequence, sizeof(sequence));
+		sent = Clock_now();
+		if (MQTTClient_publish(session.pinger, session.pingTopic, payloadlen, payload, options->qos, 0, NULL)
+				== MQTTCLIENT_SUCCESS && PingPong_awaitPong(&session))
+		{
+			last = Clock_now();
+			++(results->completed);
+			if (results->latency)
+				Histogram_record(results->latency, last - sent);
+		}
+		else
+		{
+			++(results->lost);
+			rc = PINGPONG_FAILURE;
+		}
+	}
+	results->elapsed = (last > start) ? last - start : 0;
+
+disconnect:
+	if (session.pinger)
+	{
+		if (MQTTClient_isConnected(session.pinger))
+			MQTTClient_disconnect(session.pinger, 0);
+		MQTTClient_destroy(&session.pinger);
+	}
+	if (session.echo)
+	{
+		if (MQTTClient_isConnected(session.echo))
+			MQTTClient_disconnect(session.echo, 0);
+		MQTTClient_destroy(&session.echo);
+	}
+	free(payload);
+	free(session.pingTopic);
+	free(session.pongTopic);
+	pthread_cond_destroy(&session.arrived);
+	pthread_mutex_destroy(&session.mutex);
+exit:
+	return rc;
+}
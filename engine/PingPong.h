@@ -0,0 +1,64 @@
+//
+//  PingPong.h
+//  SimpleMessage
+//
+//  Copyright 2012 Dominik Zajac (dc-square GmbH)
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+#if !defined(PINGPONG_H)
+#define PINGPONG_H
+
+#include <stdint.h>
+
+#include "Histogram.h"
+
+/** Return code: every round trip completed */
+#define PINGPONG_SUCCESS 0
+/** Return code: the clients could not connect, or one or more round trips timed out */
+#define PINGPONG_FAILURE -1
+/** Return code: the options structure is incomplete or out of range */
+#define PINGPONG_BAD_OPTIONS -2
+
+/**
+ * What to bounce between the two clients.  Pings are published to topic/ping, and echoed
+ * back to topic/pong.
+ */
+typedef struct
+{
+	char* serverURI;		/**< broker address */
+	char* clientId;			/**< prefix of the client identifiers of the pinger and the echo */
+	char* topic;			/**< prefix of the ping and pong topics */
+	char* message;			/**< payload text */
+	int count;				/**< number of round trips */
+	int qos;				/**< QoS of the pings and the pongs */
+	int timeout;			/**< milliseconds to wait for each pong */
+	int spin;				/**< boolean - wait for each pong by spinning rather than sleeping */
+} PingPong_options;
+
+#define PingPong_options_initializer { NULL, "SimpleMessage", "SimpleMessage/pingpong", "ping", 1000, 0, 1000, 0 }
+
+typedef struct
+{
+	int completed;			/**< round trips whose pong arrived */
+	int lost;				/**< round trips which timed out */
+	uint64_t elapsed;		/**< nanoseconds from the first ping to the last pong */
+	Histogram* latency;		/**< if not NULL, nanoseconds for each round trip */
+} PingPong_results;
+
+#define PingPong_results_initializer { 0, 0, 0ULL, NULL }
+
+int PingPong_validate(PingPong_options* options);
+int PingPong_run(PingPong_options* options, PingPong_results* results);
+
+#endif
@@ -0,0 +1,563 @@
+//
+//  Scenario.c
+//  SimpleMessage
+//
+//  Copyright 2012 Dominik Zajac (dc-square GmbH)
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+/**
+ * @file
+ * \brief Scenario files: a replayable mix of topics, payload sizes, QoS and rates
+ *
+ * A scenario file is plain text, one setting per line, with # starting a comment:
+ *
+ * <pre>
+ * seed 1234
+ * phase warmup
+ *   duration 10
+ *   rate 50
+ *   topic sensors/{c}/temperature 8
+ *   topic alerts/{r:100} 1
+ *   size 32-256 9
+ *   size 4096 1
+ *   qos 0 80
+ *   qos 1 15
+ *   qos 2 5
+ *   retain 0.01
+ * phase peak
+ *   messages 20000
+ *   rate 0
+ * </pre>
+ *
+ * A phase ends after a duration in seconds or a number of messages on each connection.
+ * Rates are messages per second on each connection (rate) or across the ones publishing
+ * at once (totalrate), 0 for as fast as possible.  Distributions are lists of weighted entries;
+ * a weight defaults to 1.  A size is a fixed number of bytes or a uniform range.  In a
+ * topic, {c} is replaced by the connection number and {r:N} by a random number below N.
+ * Topics may not contain spaces.
+ *
+ * Settings before the first phase apply to every phase.  Each phase starts as a copy of
+ * the one before it, and the first topic, size or qos line in a phase replaces the
+ * inherited list rather than adding to it.
+ *
+ * Every choice is made from a random stream per connection, seeded from the scenario seed
+ * and the connection number, so the same seed sends the same messages in the same order
+ * on each connection whatever the timing of the run.  Scenario_write records the
+ * scenario with all inheritance resolved and the seed it was run with.
+ */
+
+#include "Scenario.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define LINE_MAX_LEN 1024
+#define WHITESPACE " \t\r\n"
+
+
+/**
+ * splitmix64, used to turn the seed and connection number into a stream state
+ */
+static uint64_t mix(uint64_t x)
+{
+	x += 0x9E3779B97F4A7C15ULL;
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+	return x ^ (x >> 31);
+}
+
+
+/**
+ * xorshift64*: the next number in a stream
+ */
+static uint64_t next(Scenario_stream* stream)
+{
+	uint64_t x = stream->state;
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	stream->state = x;
+	return x * 0x2545F4914F6CDD1DULL;
+}
+
+
+/**
+ * A random number from 0 to limit - 1
+ */
+static uint32_t below(Scenario_stream* stream, uint32_t limit)
+{
+	return (uint32_t)(((next(stream) >> 32) * limit) >> 32);
+}
+
+
+static int pick(Scenario_choice* choices, int count, Scenario_stream* stream)
+{
+	int total = 0;
+	int i, n;
+
+	for (i = 0; i < count; i++)
+		total += choices[i].weight;
+	n = (int)below(stream, (uint32_t)total);
+	for (i = 0; i < count - 1; i++)
+	{
+		if (n < choices[i].weight)
+			break;
+		n -= choices[i].weight;
+	}
+	return i;
+}
+
+
+/**
+ * Start a connection's random stream
+ * @param scenario the scenario
+ * @param connection the 1-based connection number
+ * @param stream the stream to start
+ */
+void Scenario_startStream(Scenario* scenario, int connection, Scenario_stream* stream)
+{
+	stream->state = mix(scenario->seed ^ mix((uint64_t)connection));
+	if (stream->state == 0)
+		stream->state = 1;		/* xorshift never leaves zero */
+	stream->connection = connection;
+}
+
+
+static void expandTopic(char* template, Scenario_stream* stream, char* topic)
+{
+	char* end = &topic[SCENARIO_MAX_TOPIC_LEN - 1];
+	char* p = template;
+	unsigned long limit;
+	char* close;
+
+	while (*p && topic < end)
+	{
+		if (strncmp(p, "{c}", 3) == 0)
+		{
+			topic += snprintf(topic, end - topic + 1, "%d", stream->connection);
+			p += 3;
+		}
+		else if (strncmp(p, "{r:", 3) == 0 && (limit = strtoul(&p[3], &close, 10)) > 0 && *close == '}')
+		{
+			topic += snprintf(topic, end - topic + 1, "%u", below(stream, (uint32_t)limit));
+			p = close + 1;
+		}
+		else
+			*topic++ = *p++;
+		if (topic > end)
+			topic = end;
+	}
+	*topic = '\0';
+}
+
+
+/**
+ * Choose the next message of a phase.  The choices are made in a fixed order, so the
+ * result depends only on the stream.
+ * @param phase the phase being run
+ * @param stream the connection's random stream
+ * @param message set to the topic, size, QoS and retained flag of the message
+ */
+void Scenario_draw(Scenario_phase* phase, Scenario_stream* stream, Scenario_message* message)
+{
+	Scenario_choice* size;
+	int qos = (int)below(stream, (uint32_t)(phase->qos[0] + phase->qos[1] + phase->qos[2]));
+
+	expandTopic(phase->topics[pick(phase->topics, phase->topicCount, stream)].topic, stream, message->topic);
+	size = &phase->sizes[pick(phase->sizes, phase->sizeCount, stream)];
+	message->size = size->size;
+	if (size->sizeMax > size->size)
+		message->size += (int)below(stream, (uint32_t)(size->sizeMax - size->size + 1));
+	message->qos = (qos < phase->qos[0]) ? 0 : (qos < phase->qos[0] + phase->qos[1]) ? 1 : 2;
+	message->retained = (phase->retained > 0.0 && (next(stream) >> 11) * (1.0 / 9007199254740992.0) < phase->retained);
+}
+
+
+static void freeChoices(Scenario_choice* choices, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+		free(choices[i].topic);
+	free(choices);
+}
+
+
+static void freePhase(Scenario_phase* phase)
+{
+	free(phase->name);
+	freeChoices(phase->topics, phase->topicCount);
+	free(phase->sizes);
+}
+
+
+/**
+ * Copy a phase, so that the next phase can inherit its settings
+ */
+static void copyPhase(Scenario_phase* to, Scenario_phase* from, char* name)
+{
+	int i;
+
+	*to = *from;
+	to->name = strdup(name);
+	to->topics = malloc(sizeof(Scenario_choice) * (from->topicCount + 1));
+	for (i = 0; i < from->topicCount; i++)
+	{
+		to->topics[i] = from->topics[i];
+		to->topics[i].topic = strdup(from->topics[i].topic);
+	}
+	to->sizes = malloc(sizeof(Scenario_choice) * (from->sizeCount + 1));
+	memcpy(to->sizes, from->sizes, sizeof(Scenario_choice) * from->sizeCount);
+}
+
+
+static Scenario_choice* addChoice(Scenario_choice** choices, int* count)
+{
+	Scenario_choice* choice;
+
+	*choices = realloc(*choices, sizeof(Scenario_choice) * (*count + 1));
+	choice = &(*choices)[(*count)++];
+	memset(choice, '\0', sizeof(Scenario_choice));
+	return choice;
+}
+
+
+static int parseWeight(char* word, int* weight)
+{
+	char* end;
+	long value;
+
+	if (word == NULL)
+	{
+		*weight = 1;
+		return 1;
+	}
+	value = strtol(word, &end, 10);
+	if (*end != '\0' || value < 0 || value > 1000000)
+		return 0;
+	*weight = (int)value;
+	return 1;
+}
+
+
+static int parseDouble(char* word, double* value)
+{
+	char* end;
+
+	if (word == NULL)
+		return 0;
+	*value = strtod(word, &end);
+	return *end == '\0' && *value >= 0.0;
+}
+
+
+/**
+ * Apply one setting to a phase
+ * @param phase the phase
+ * @param key the setting name
+ * @param value the first word after the name
+ * @param weight the second word after the name, or NULL
+ * @param replacing flags for the lists which have not yet been set in this phase, cleared
+ * as each list is started
+ * @return an error message, or NULL if the setting was applied
+ */
+static char* applySetting(Scenario_phase* phase, char* key, char* value, char* weight, int* replacing)
+{
+	Scenario_choice* choice;
+	char* end;
+	long number;
+	int w;
+
+	if (value == NULL)
+		return "missing value";
+	if (strcmp(key, "duration") == 0)
+	{
+		if (!parseDouble(value, &phase->duration))
+			return "duration must be a number of seconds";
+		phase->messages = 0;
+	}
+	else if (strcmp(key, "messages") == 0)
+	{
+		number = strtol(value, &end, 10);
+		if (*end != '\0' || number <= 0 || number > 0x7FFFFFFF)
+			return "messages must be a positive number";
+		phase->messages = (int)number;
+		phase->duration = 0.0;
+	}
+	else if (strcmp(key, "rate") == 0)
+	{
+		if (!parseDouble(value, &phase->rate))
+			return "rate must be a number of messages per second";
+	}
+	else if (strcmp(key, "totalrate") == 0)
+	{
+		if (!parseDouble(value, &phase->totalRate))
+			return "totalrate must be a number of messages per second";
+	}
+	else if (strcmp(key, "retain") == 0)
+	{
+		if (!parseDouble(value, &phase->retained) || phase->retained > 1.0)
+			return "retain must be a probability from 0 to 1";
+	}
+	else if (strcmp(key, "topic") == 0)
+	{
+		if (!parseWeight(weight, &w))
+			return "bad weight";
+		if (strlen(value) >= SCENARIO_MAX_TOPIC_LEN)
+			return "topic too long";
+		if (replacing[0])
+		{
+			freeChoices(phase->topics, phase->topicCount);
+			phase->topics = NULL;
+			phase->topicCount = replacing[0] = 0;
+		}
+		choice = addChoice(&phase->topics, &phase->topicCount);
+		choice->topic = strdup(value);
+		choice->weight = w;
+	}
+	else if (strcmp(key, "size") == 0)
+	{
+		long sizeMax;
+
+		if (!parseWeight(weight, &w))
+			return "bad weight";
+		number = strtol(value, &end, 10);
+		sizeMax = (*end == '-') ? strtol(&end[1], &end, 10) : number;
+		if (*end != '\0' || number < 0 || sizeMax < number || sizeMax > SCENARIO_MAX_PAYLOAD)
+			return "size must be a number of bytes or a range min-max";
+		if (replacing[1])
+			phase->sizeCount = replacing[1] = 0;
+		choice = addChoice(&phase->sizes, &phase->sizeCount);
+		choice->size = (int)number;
+		choice->sizeMax = (int)sizeMax;
+		choice->weight = w;
+	}
+	else if (strcmp(key, "qos") == 0)
+	{
+		if (!parseWeight(weight, &w))
+			return "bad weight";
+		if (strcmp(value, "0") != 0 && strcmp(value, "1") != 0 && strcmp(value, "2") != 0)
+			return "qos must be 0, 1 or 2";
+		if (replacing[2])
+			phase->qos[0] = phase->qos[1] = phase->qos[2] = replacing[2] = 0;
+		phase->qos[value[0] - '0'] = w;
+	}
+	else
+		return "unknown setting";
+	return NULL;
+}
+
+
+static char* checkPhase(Scenario_phase* phase)
+{
+	int total = 0;
+	int i;
+
+	if (phase->duration == 0.0 && phase->messages == 0)
+		return "needs a duration or a number of messages";
+	if (phase->topicCount == 0)
+		return "needs at least one topic";
+	if (phase->sizeCount == 0)
+		return "needs at least one size";
+	for (i = 0; i < phase->topicCount; i++)
+		total += phase->topics[i].weight;
+	if (total == 0)
+		return "topic weights are all zero";
+	for (total = i = 0; i < phase->sizeCount; i++)
+		total += phase->sizes[i].weight;
+	if (total == 0)
+		return "size weights are all zero";
+	if (phase->qos[0] + phase->qos[1] + phase->qos[2] == 0)
+		return "qos weights are all zero";
+	return NULL;
+}
+
+
+/**
+ * Load a scenario file
+ * @param filename the file to read
+ * @param scenario set to the scenario, which must be freed with Scenario_destroy
+ * @param error filled in with a description of what is wrong with the file, if it
+ * cannot be loaded
+ * @param errorlen the size of the error buffer
+ * @return SCENARIO_SUCCESS, SCENARIO_FAILURE if the file could not be read or
+ * SCENARIO_BAD_FILE if its contents are not valid
+ */
+int Scenario_load(char* filename, Scenario** scenario, char* error, size_t errorlen)
+{
+	Scenario_phase defaults;
+	Scenario_phase* phase = &defaults;
+	Scenario* s = NULL;
+	char line[LINE_MAX_LEN];
+	char* message = NULL;
+	Scenario_phase* invalid = NULL;
+	int replacing[3] = { 1, 1, 1 };
+	int lineno = 0;
+	int rc = SCENARIO_SUCCESS;
+	FILE* file;
+	int i;
+
+	if ((file = fopen(filename, "r")) == NULL)
+	{
+		snprintf(error, errorlen, "%s: cannot open", filename);
+		return SCENARIO_FAILURE;
+	}
+
+	memset(&defaults, '\0', sizeof(defaults));
+	defaults.name = strdup("default");
+	defaults.qos[0] = 1;
+	s = malloc(sizeof(Scenario));
+	memset(s, '\0', sizeof(Scenario));
+	s->name = strdup(filename);
+
+	while (message == NULL && fgets(line, sizeof(line), file) != NULL)
+	{
+		char* save = NULL;
+		char* key;
+		char* value;
+		char* weight;
+		char* extra;
+
+		++lineno;
+		if ((key = strchr(line, '#')) != NULL)
+			*key = '\0';
+		if ((key = strtok_r(line, WHITESPACE, &save)) == NULL)
+			continue;
+		value = strtok_r(NULL, WHITESPACE, &save);
+		weight = strtok_r(NULL, WHITESPACE, &save);
+		extra = strtok_r(NULL, WHITESPACE, &save);
+		if (extra != NULL)
+			message = "too many values";
+		else if (strcmp(key, "seed") == 0)
+		{
+			char* end;
+
+			if (phase != &defaults)
+				message = "seed must come before the first phase";
+			else if (value == NULL || (s->seed = strtoull(value, &end, 0), *end != '\0'))
+				message = "seed must be a number";
+		}
+		else if (strcmp(key, "phase") == 0)
+		{
+			if (phase != &defaults && (message = checkPhase(phase)) != NULL)
+			{
+				invalid = phase;
+				break;
+			}
+			/* the realloc can move the phases, so find the previous one again afterwards */
+			s->phases = realloc(s->phases, sizeof(Scenario_phase) * (s->phaseCount + 1));
+			if (phase != &defaults)
+				phase = &s->phases[s->phaseCount - 1];
+			copyPhase(&s->phases[s->phaseCount], phase, value ? value : "");
+			phase = &s->phases[s->phaseCount++];
+			replacing[0] = replacing[1] = replacing[2] = 1;
+		}
+		else
+			message = applySetting(phase, key, value, weight, replacing);
+	}
+	fclose(file);
+
+	if (message == NULL && s->phaseCount == 0)
+		message = "no phases";
+	else if (message == NULL && (message = checkPhase(phase)) != NULL)
+		invalid = phase;
+	if (message)
+	{
+		if (invalid)
+			snprintf(error, errorlen, "%s: phase %s %s", filename, invalid->name, message);
+		else
+			snprintf(error, errorlen, "%s:%d: %s", filename, lineno, message);
+		rc = SCENARIO_BAD_FILE;
+		Scenario_destroy(s);
+		s = NULL;
+		goto exit;
+	}
+
+	for (i = 0; i < s->phaseCount; i++)
+	{
+		int j;
+
+		for (j = 0; j < s->phases[i].sizeCount; j++)
+		{
+			if (s->phases[i].sizes[j].sizeMax > s->maxSize)
+				s->maxSize = s->phases[i].sizes[j].sizeMax;
+		}
+		for (j = 2; j > s->maxQos; j--)
+		{
+			if (s->phases[i].qos[j] > 0)
+				s->maxQos = j;
+		}
+	}
+exit:
+	freePhase(&defaults);
+	*scenario = s;
+	return rc;
+}
+
+
+void Scenario_destroy(Scenario* scenario)
+{
+	int i;
+
+	if (scenario == NULL)
+		return;
+	for (i = 0; i < scenario->phaseCount; i++)
+		freePhase(&scenario->phases[i]);
+	free(scenario->phases);
+	free(scenario->name);
+	free(scenario);
+}
+
+
+/**
+ * Record a scenario as a scenario file, with every phase written out in full and the
+ * seed it was run with, so that the run can be repeated exactly
+ * @param file the file to write to
+ * @param scenario the scenario
+ */
+void Scenario_write(FILE* file, Scenario* scenario)
+{
+	int i, j;
+
+	fprintf(file, "# recorded from %s\n", scenario->name);
+	fprintf(file, "seed %llu\n", (unsigned long long)scenario->seed);
+	for (i = 0; i < scenario->phaseCount; i++)
+	{
+		Scenario_phase* phase = &scenario->phases[i];
+
+		fprintf(file, "phase %s\n", phase->name);
+		if (phase->messages > 0)
+			fprintf(file, "\tmessages %d\n", phase->messages);
+		else
+			fprintf(file, "\tduration %.9g\n", phase->duration);
+		fprintf(file, "\trate %.9g\n", phase->rate);
+		fprintf(file, "\ttotalrate %.9g\n", phase->totalRate);
+		for (j = 0; j < phase->topicCount; j++)
+			fprintf(file, "\ttopic %s %d\n", phase->topics[j].topic, phase->topics[j].weight);
+		for (j = 0; j < phase->sizeCount; j++)
+		{
+			if (phase->sizes[j].sizeMax > phase->sizes[j].size)
+				fprintf(file, "\tsize %d-%d %d\n", phase->sizes[j].size, phase->sizes[j].sizeMax, phase->sizes[j].weight);
+			else
+				fprintf(file, "\tsize %d %d\n", phase->sizes[j].size, phase->sizes[j].weight);
+		}
+		for (j = 0; j < 3; j++)
+		{
+			if (phase->qos[j] > 0)
+				fprintf(file, "\tqos %d %d\n", j, phase->qos[j]);
+		}
+		fprintf(file, "\tretain %.9g\n", phase->retained);
+	}
+}
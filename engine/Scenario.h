@@ -0,0 +1,107 @@
+//
+//  Scenario.h
+//  SimpleMessage
+//
+//  Copyright 2012 Dominik Zajac (dc-square GmbH)
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+#if !defined(SCENARIO_H)
+#define SCENARIO_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/** Return code: success */
+#define SCENARIO_SUCCESS 0
+/** Return code: the scenario file could not be read */
+#define SCENARIO_FAILURE -1
+/** Return code: the scenario file has a syntax error or a value out of range */
+#define SCENARIO_BAD_FILE -2
+
+/** the longest topic a scenario will produce, after substitution */
+#define SCENARIO_MAX_TOPIC_LEN 256
+/** the largest payload size a scenario may ask for */
+#define SCENARIO_MAX_PAYLOAD 268435455
+
+/**
+ * One weighted entry of a distribution
+ */
+typedef struct
+{
+	char* topic;			/**< topic template, for topic distributions */
+	int size;				/**< payload size in bytes, for size distributions */
+	int sizeMax;			/**< largest size of a uniform range, equal to size for a fixed size */
+	int weight;				/**< relative weight */
+} Scenario_choice;
+
+/**
+ * A period of a run with one message mix and rate
+ */
+typedef struct
+{
+	char* name;				/**< phase name, for reports */
+	double duration;		/**< seconds the phase lasts, 0 if it ends after a number of messages */
+	int messages;			/**< messages on each connection, 0 if it ends after a duration */
+	double rate;			/**< messages per second on each connection, 0 for as fast as possible */
+	double totalRate;		/**< messages per second across the connections publishing at once, 0 for no limit */
+	int topicCount;			/**< entries in topics */
+	Scenario_choice* topics;	/**< topic distribution */
+	int sizeCount;			/**< entries in sizes */
+	Scenario_choice* sizes;	/**< payload size distribution */
+	int qos[3];				/**< relative weights of QoS 0, 1 and 2 */
+	double retained;		/**< probability of setting the retained flag, 0 to 1 */
+} Scenario_phase;
+
+/**
+ * A complete message mix, loaded from a scenario file
+ */
+typedef struct
+{
+	char* name;				/**< file the scenario was loaded from */
+	uint64_t seed;			/**< seed of every connection's random stream */
+	int phaseCount;			/**< entries in phases */
+	Scenario_phase* phases;	/**< phases, run in order */
+	int maxSize;			/**< largest payload size of any phase */
+	int maxQos;				/**< highest QoS of any phase with a non-zero weight */
+} Scenario;
+
+/**
+ * A connection's position in its random stream.  Each connection has its own stream,
+ * derived from the scenario seed and the connection number, so the messages a connection
+ * sends do not depend on how the connections were scheduled.
+ */
+typedef struct
+{
+	uint64_t state;
+	int connection;
+} Scenario_stream;
+
+/**
+ * One message drawn from a phase's distributions
+ */
+typedef struct
+{
+	char topic[SCENARIO_MAX_TOPIC_LEN];
+	int size;
+	int qos;
+	int retained;
+} Scenario_message;
+
+int Scenario_load(char* filename, Scenario** scenario, char* error, size_t errorlen);
+void Scenario_destroy(Scenario* scenario);
+void Scenario_write(FILE* file, Scenario* scenario);
+void Scenario_startStream(Scenario* scenario, int connection, Scenario_stream* stream);
+void Scenario_draw(Scenario_phase* phase, Scenario_stream* stream, Scenario_message* message);
+
+#endif
@@ -0,0 +1,400 @@
+//
+//  Stats.c
+//  SimpleMessage
+//
+//  Copyright 2012 Dominik Zajac (dc-square GmbH)
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+/**
+ * @file
+ * \brief Live counters for long runs
+ *
+ * Each connection has its own set of counters, found by connection number, which the
+ * threads driving it update without taking a lock.  Sampling sums them and works out
+ * how much each has changed since the previous sample, which gives per-second rollups
+ * for the window, or for the reporter thread to write out as CSV or JSON lines while a
+ * headless run is in progress.
+ */
+
+#include "Stats.h"
+#include "Clock.h"
+#include "Thread.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define STATS_ADD(field, n) __sync_fetch_and_add(&(field), (n))
+#define STATS_READ(field) __sync_fetch_and_add(&(field), 0)
+
+/** connection slots added at a time */
+#define STATS_GROWTH 64
+
+struct Stats
+{
+	pthread_mutex_t mutex;		/**< guards the connection table, not the counters */
+	uint64_t start;
+	uint64_t lastSample;
+	int count;					/**< connection slots allocated */
+	Stats_counters** connections;	/**< indexed by connection number - 1 */
+	Stats_counters* previous;	/**< totals at the last sample, 0 is the sum */
+	int previousCount;
+};
+
+struct Stats_reporter
+{
+	Stats* stats;
+	FILE* file;
+	int format;
+	uint64_t interval;
+	int perConnection;
+	int stopping;
+	pthread_mutex_t mutex;
+	pthread_cond_t stop;
+	thread_type thread;
+};
+
+
+/**
+ * Create an empty set of statistics.  The clock for elapsed times starts now.
+ * @return the statistics
+ */
+Stats* Stats_create(void)
+{
+	Stats* stats = malloc(sizeof(Stats));
+
+	memset(stats, '\0', sizeof(Stats));
+	pthread_mutex_init(&stats->mutex, NULL);
+	stats->start = stats->lastSample = Clock_now();
+	return stats;
+}
+
+
+void Stats_destroy(Stats* stats)
+{
+	int i;
+
+	for (i = 0; i < stats->count; i++)
+		free(stats->connections[i]);
+	free(stats->connections);
+	free(stats->previous);
+	pthread_mutex_destroy(&stats->mutex);
+	free(stats);
+}
+
+
+/**
+ * Get the counters for a connection, creating them the first time it is asked for.
+ * The pointer stays valid until the statistics are destroyed.
+ * @param stats the statistics
+ * @param connection the connection number, from 1
+ * @return the counters
+ */
+Stats_counters* Stats_connection(Stats* stats, int connection)
+{
+	Stats_counters* counters = NULL;
+
+	pthread_mutex_lock(&stats->mutex);
+	if (connection > stats->count)
+	{
+		int count = ((connection + STATS_GROWTH - 1) / STATS_GROWTH) * STATS_GROWTH;
+
+		stats->connections = realloc(stats->connections, count * sizeof(Stats_counters*));
+		memset(&stats->connections[stats->count], '\0', (count - stats->count) * sizeof(Stats_counters*));
+		stats->count = count;
+	}
+	if ((counters = stats->connections[connection - 1]) == NULL)
+	{
+		counters = stats->connections[connection - 1] = malloc(sizeof(Stats_counters));
+		memset(counters, '\0', sizeof(Stats_counters));
+	}
+	pthread_mutex_unlock(&stats->mutex);
+	return counters;
+}
+
+
+/**
+ * The highest connection number which has counters
+ * @param stats the statistics
+ * @return the connection count
+ */
+int Stats_connectionCount(Stats* stats)
+{
+	int count;
+
+	pthread_mutex_lock(&stats->mutex);
+	for (count = stats->count; count > 0 && stats->connections[count - 1] == NULL; count--)
+		;
+	pthread_mutex_unlock(&stats->mutex);
+	return count;
+}
+
+
+void Stats_published(Stats_counters* counters, int bytes)
+{
+	STATS_ADD(counters->published, 1);
+	STATS_ADD(counters->bytes, bytes);
+}
+
+
+void Stats_acked(Stats_counters* counters)
+{
+	STATS_ADD(counters->acked, 1);
+}
+
+
+void Stats_failed(Stats_counters* counters, long count)
+{
+	STATS_ADD(counters->failed, count);
+}
+
+
+void Stats_inflight(Stats_counters* counters, int change)
+{
+	STATS_ADD(counters->inflight, change);
+}
+
+
+void Stats_reconnected(Stats_counters* counters)
+{
+	STATS_ADD(counters->reconnects, 1);
+}
+
+
+static void Stats_read(Stats_counters* counters, Stats_counters* into)
+{
+	into->published = STATS_READ(counters->published);
+	into->acked = STATS_READ(counters->acked);
+	into->failed = STATS_READ(counters->failed);
+	into->bytes = STATS_READ(counters->bytes);
+	into->inflight = STATS_READ(counters->inflight);
+	into->reconnects = STATS_READ(counters->reconnects);
+}
+
+
+static void Stats_add(Stats_counters* to, Stats_counters* from)
+{
+	to->published += from->published;
+	to->acked += from->acked;
+	to->failed += from->failed;
+	to->bytes += from->bytes;
+	to->inflight += from->inflight;
+	to->reconnects += from->reconnects;
+}
+
+
+static void Stats_subtract(Stats_counters* result, Stats_counters* now, Stats_counters* before)
+{
+	result->published = now->published - before->published;
+	result->acked = now->acked - before->acked;
+	result->failed = now->failed - before->failed;
+	result->bytes = now->bytes - before->bytes;
+	result->inflight = now->inflight;
+	result->reconnects = now->reconnects - before->reconnects;
+}
+
+
+/**
+ * Take a sample of the counters.  Changes are measured from the previous call, so there
+ * should be only one caller taking samples from a set of statistics.
+ * @param stats the statistics
+ * @param samples receives the sum over all connections first, then each connection in
+ * turn, as far as there is room
+ * @param max the number of samples there is room for
+ * @return the number of samples filled in
+ */
+int Stats_takeSample(Stats* stats, Stats_sample* samples, int max)
+{
+	Stats_counters sum, current;
+	uint64_t now = Clock_now();
+	double interval;
+	int i, count = 0;
+
+	pthread_mutex_lock(&stats->mutex);
+	if (stats->previousCount < stats->count + 1)
+	{
+		stats->previous = realloc(stats->previous, (stats->count + 1) * sizeof(Stats_counters));
+		memset(&stats->previous[stats->previousCount], '\0',
+				(stats->count + 1 - stats->previousCount) * sizeof(Stats_counters));
+		stats->previousCount = stats->count + 1;
+	}
+	interval = Clock_seconds(now - stats->lastSample);
+	stats->lastSample = now;
+
+	memset(&sum, '\0', sizeof(sum));
+	count = (max > 0) ? 1 : 0;
+	for (i = 0; i < stats->count; i++)
+	{
+		if (stats->connections[i] == NULL)
+			continue;
+		Stats_read(stats->connections[i], &current);
+		Stats_add(&sum, &current);
+		if (count < max)
+		{
+			Stats_sample* sample = &samples[count++];
+
+			sample->connection = i + 1;
+			sample->elapsed = Clock_seconds(now - stats->start);
+			sample->interval = interval;
+			sample->total = current;
+			Stats_subtract(&sample->delta, &current, &stats->previous[i + 1]);
+		}
+		stats->previous[i + 1] = current;
+	}
+	if (max > 0)
+	{
+		samples[0].connection = 0;
+		samples[0].elapsed = Clock_seconds(now - stats->start);
+		samples[0].interval = interval;
+		samples[0].total = sum;
+		Stats_subtract(&samples[0].delta, &sum, &stats->previous[0]);
+	}
+	stats->previous[0] = sum;
+	pthread_mutex_unlock(&stats->mutex);
+	return count;
+}
+
+
+/**
+ * Write the column names, for CSV output
+ * @param file where to write
+ * @param format STATS_CSV or STATS_JSON; JSON lines need no header
+ */
+void Stats_writeHeader(FILE* file, int format)
+{
+	if (format == STATS_CSV)
+		fprintf(file, "elapsed,connection,published,acked,failed,bytes,inflight,reconnects,"
+				"published_per_sec,acked_per_sec,failed_per_sec,bytes_per_sec\n");
+}
+
+
+/**
+ * Write one sample as a line of CSV or JSON
+ * @param file where to write
+ * @param format STATS_CSV or STATS_JSON
+ * @param sample the sample
+ */
+void Stats_write(FILE* file, int format, Stats_sample* sample)
+{
+	double interval = (sample->interval > 0.0) ? sample->interval : 1.0;
+
+	if (format == STATS_JSON)
+		fprintf(file, "{\"elapsed\":%.3f,\"connection\":%d,\"published\":%ld,\"acked\":%ld,\"failed\":%ld,"
+				"\"bytes\":%lld,\"inflight\":%ld,\"reconnects\":%ld,\"published_per_sec\":%.1f,"
+				"\"acked_per_sec\":%.1f,\"failed_per_sec\":%.1f,\"bytes_per_sec\":%.1f}\n",
+				sample->elapsed, sample->connection, sample->total.published, sample->total.acked,
+				sample->total.failed, sample->total.bytes, sample->total.inflight, sample->total.reconnects,
+				sample->delta.published / interval, sample->delta.acked / interval,
+				sample->delta.failed / interval, sample->delta.bytes / interval);
+	else
+		fprintf(file, "%.3f,%d,%ld,%ld,%ld,%lld,%ld,%ld,%.1f,%.1f,%.1f,%.1f\n",
+				sample->elapsed, sample->connection, sample->total.published, sample->total.acked,
+				sample->total.failed, sample->total.bytes, sample->total.inflight, sample->total.reconnects,
+				sample->delta.published / interval, sample->delta.acked / interval,
+				sample->delta.failed / interval, sample->delta.bytes / interval);
+}
+
+
+/**
+ * Sample the statistics and write the result, every connection or just the sum
+ */
+static void Stats_report(Stats_reporter* reporter)
+{
+	int max = reporter->perConnection ? Stats_connectionCount(reporter->stats) + 1 : 1;
+	Stats_sample* samples = malloc(max * sizeof(Stats_sample));
+	int i, count;
+
+	count = Stats_takeSample(reporter->stats, samples, max);
+	for (i = 0; i < count; i++)
+		Stats_write(reporter->file, reporter->format, &samples[i]);
+	fflush(reporter->file);
+	free(samples);
+}
+
+
+static thread_return_type Stats_reporterMain(void* n)
+{
+	Stats_reporter* reporter = n;
+	uint64_t next = Clock_now();
+
+	pthread_mutex_lock(&reporter->mutex);
+	while (!reporter->stopping)
+	{
+		struct timespec deadline;
+		uint64_t wait;
+
+		next += reporter->interval;
+		wait = (next > Clock_now()) ? next - Clock_now() : 0;
+		Clock_deadline(&deadline, wait);
+		if (pthread_cond_timedwait(&reporter->stop, &reporter->mutex, &deadline) == 0 && reporter->stopping)
+			break;
+		pthread_mutex_unlock(&reporter->mutex);
+		Stats_report(reporter);
+		pthread_mutex_lock(&reporter->mutex);
+	}
+	pthread_mutex_unlock(&reporter->mutex);
+	return 0;
+}
+
+
+/**
+ * Start a thread writing samples at a fixed interval
+ * @param stats the statistics
+ * @param file where to write
+ * @param format STATS_CSV or STATS_JSON
+ * @param interval seconds between samples
+ * @param perConnection boolean - write a line for each connection as well as the sum
+ * @return the reporter, or NULL if the thread could not be started
+ */
+Stats_reporter* Stats_startReporter(Stats* stats, FILE* file, int format, double interval, int perConnection)
+{
+	Stats_reporter* reporter = malloc(sizeof(Stats_reporter));
+
+	memset(reporter, '\0', sizeof(Stats_reporter));
+	reporter->stats = stats;
+	reporter->file = file;
+	reporter->format = format;
+	reporter->interval = (uint64_t)(interval * CLOCK_NANOS_PER_SECOND);
+	reporter->perConnection = perConnection;
+	pthread_mutex_init(&reporter->mutex, NULL);
+	pthread_cond_init(&reporter->stop, NULL);
+	Stats_writeHeader(file, format);
+	if ((reporter->thread = Thread_start(Stats_reporterMain, reporter)) == 0)
+	{
+		pthread_cond_destroy(&reporter->stop);
+		pthread_mutex_destroy(&reporter->mutex);
+		free(reporter);
+		reporter = NULL;
+	}
+	return reporter;
+}
+
+
+/**
+ * Stop the reporter thread, writing a last sample covering the time since the previous one
+ * @param reporter the reporter
+ */
+void Stats_stopReporter(Stats_reporter* reporter)
+{
+	pthread_mutex_lock(&reporter->mutex);
+	reporter->stopping = 1;
+	pthread_cond_signal(&reporter->stop);
+	pthread_mutex_unlock(&reporter->mutex);
+	pthread_join(reporter->thread, NULL);
+	Stats_report(reporter);
+
+	pthread_cond_destroy(&reporter->stop);
+	pthread_mutex_destroy(&reporter->mutex);
+	free(reporter);
+}
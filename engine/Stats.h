@@ -0,0 +1,77 @@
+//
+//  Stats.h
+//  SimpleMessage
+//
+//  Copyright 2012 Dominik Zajac (dc-square GmbH)
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+#if !defined(STATS_H)
+#define STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/** Output format for Stats_write: comma separated values, with a header line first */
+#define STATS_CSV 0
+/** Output format for Stats_write: one JSON object per line */
+#define STATS_JSON 1
+
+/**
+ * Counters for one connection, or the sum over all of them.  Updated by the sender
+ * threads and the client library's thread as messages go out and are acknowledged.
+ */
+typedef struct
+{
+	long published;			/**< messages accepted by MQTTClient_publish */
+	long acked;				/**< QoS 1 and 2 messages acknowledged, when a window is set */
+	long failed;			/**< messages which could not be published */
+	long long bytes;		/**< payload bytes published */
+	long inflight;			/**< messages published and not yet acknowledged, when a window is set */
+	long reconnects;		/**< times a dropped connection was re-established */
+} Stats_counters;
+
+/**
+ * The counters at one moment, and how much they changed since the previous sample
+ */
+typedef struct
+{
+	int connection;			/**< connection number, 0 for the sum over all connections */
+	double elapsed;			/**< seconds since the statistics were created */
+	double interval;		/**< seconds since the previous sample */
+	Stats_counters total;
+	Stats_counters delta;	/**< change over the interval; inflight is the current value */
+} Stats_sample;
+
+typedef struct Stats Stats;
+typedef struct Stats_reporter Stats_reporter;
+
+Stats* Stats_create(void);
+void Stats_destroy(Stats* stats);
+Stats_counters* Stats_connection(Stats* stats, int connection);
+int Stats_connectionCount(Stats* stats);
+
+void Stats_published(Stats_counters* counters, int bytes);
+void Stats_acked(Stats_counters* counters);
+void Stats_failed(Stats_counters* counters, long count);
+void Stats_inflight(Stats_counters* counters, int change);
+void Stats_reconnected(Stats_counters* counters);
+
+int Stats_takeSample(Stats* stats, Stats_sample* samples, int max);
+void Stats_writeHeader(FILE* file, int format);
+void Stats_write(FILE* file, int format, Stats_sample* sample);
+
+Stats_reporter* Stats_startReporter(Stats* stats, FILE* file, int format, double interval, int perConnection);
+void Stats_stopReporter(Stats_reporter* reporter);
+
+#endif
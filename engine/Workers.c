@@ -0,0 +1,314 @@
+//
+//  Workers.c
+//  SimpleMessage
+//
+//  Copyright 2012 Dominik Zajac (dc-square GmbH)
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+/**
+ * @file
+ * \brief A fixed set of threads taking tasks from a shared queue
+ *
+ * A serial dispatch queue runs the Send button's connections one after another.  This
+ * pool runs up to its concurrency level of them at the same time, each worker thread
+ * optionally pinned to its own CPU.  Pausing stops workers taking new tasks; tasks
+ * already running complete, as with dispatch_suspend.
+ */
+
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
+
+#include "Workers.h"
+#include "Thread.h"
+
+#include <stdlib.h>
+#include <string.h>
+#if !defined(WIN32)
+#include <unistd.h>
+#endif
+#if defined(__APPLE__)
+#include <mach/mach.h>
+#include <mach/thread_policy.h>
+#endif
+
+/** milliseconds between checks of the pool state while waiting, should a wakeup be missed */
+#define WAIT_INTERVAL 1000L
+
+/**
+ * A queued task
+ */
+typedef struct Workers_item
+{
+	Workers_task* task;
+	void* context;
+	struct Workers_item* next;
+} Workers_item;
+
+/**
+ * Per thread data
+ */
+typedef struct
+{
+	Workers* workers;
+	int number;				/**< 1 to concurrency */
+	thread_type thread;
+} Workers_thread;
+
+struct Workers
+{
+	mutex_type mutex;
+	cond_type work;			/**< signalled when a task is queued, or on resume or destroy */
+	cond_type idle;			/**< signalled when a task finishes */
+	Workers_item* head;
+	Workers_item* tail;
+	int concurrency;
+	int pinned;				/**< boolean - pin each worker to a CPU */
+	int paused;				/**< boolean - do not start new tasks */
+	int stopping;			/**< boolean - threads should exit */
+	int running;			/**< number of tasks currently executing */
+	Workers_thread* threads;
+};
+
+
+/**
+ * Number of CPUs currently online
+ * @return the CPU count, at least 1
+ */
+int Workers_cpuCount(void)
+{
+#if defined(WIN32)
+	SYSTEM_INFO info;
+	long cpus;
+
+	GetSystemInfo(&info);
+	cpus = info.dwNumberOfProcessors;
+#else
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+
+	return (cpus > 0) ? (int)cpus : 1;
+}
+
+
+/**
+ * Pin the calling thread to one CPU.  On Mac OS X there is no hard affinity, so each
+ * worker is given its own affinity tag, which asks the scheduler to keep them apart.
+ * @param worker the worker number
+ */
+static void Workers_pin(int worker)
+{
+#if defined(__linux__)
+	cpu_set_t cpus;
+
+	CPU_ZERO(&cpus);
+	CPU_SET((worker - 1) % Workers_cpuCount(), &cpus);
+	pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+#elif defined(__APPLE__)
+	thread_affinity_policy_data_t policy = { worker };
+
+	thread_policy_set(pthread_mach_thread_np(pthread_self()), THREAD_AFFINITY_POLICY,
+			(thread_policy_t)&policy, THREAD_AFFINITY_POLICY_COUNT);
+#elif defined(WIN32)
+	SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << ((worker - 1) % Workers_cpuCount()));
+#endif
+}
+
+
+static thread_return_type Workers_main(void* n)
+{
+	Workers_thread* self = n;
+	Workers* workers = self->workers;
+
+	if (workers->pinned)
+		Workers_pin(self->number);
+
+	Thread_lock_mutex(workers->mutex);
+	while (1)
+	{
+		Workers_item* item = NULL;
+
+		while (!workers->stopping && (workers->paused || workers->head == NULL))
+			Thread_wait_cond(workers->work, workers->mutex, WAIT_INTERVAL);
+		if (workers->stopping)
+			break;
+
+		item = workers->head;
+		if ((workers->head = item->next) == NULL)
+			workers->tail = NULL;
+		++(workers->running);
+		Thread_unlock_mutex(workers->mutex);
+
+		(*item->task)(item->context);
+		free(item);
+
+		Thread_lock_mutex(workers->mutex);
+		--(workers->running);
+		Thread_signal_cond(workers->idle);
+	}
+	Thread_unlock_mutex(workers->mutex);
+	return 0;
+}
+
+
+/**
+ * Start a worker pool
+ * @param concurrency the number of worker threads, i.e. how many tasks may run at once
+ * @param pinned boolean - pin each worker thread to a CPU
+ * @return the pool, or NULL if concurrency is less than 1 or the threads could not be started
+ */
+Workers* Workers_create(int concurrency, int pinned)
+{
+	Workers* workers = NULL;
+	int i;
+
+	if (concurrency < 1)
+		goto exit;
+
+	workers = malloc(sizeof(Workers));
+	memset(workers, '\0', sizeof(Workers));
+	workers->mutex = Thread_create_mutex();
+	workers->work = Thread_create_cond();
+	workers->idle = Thread_create_cond();
+	workers->concurrency = concurrency;
+	workers->pinned = pinned;
+	workers->threads = malloc(sizeof(Workers_thread) * concurrency);
+	for (i = 0; i < concurrency; i++)
+	{
+		workers->threads[i].workers = workers;
+		workers->threads[i].number = i + 1;
+		if ((workers->threads[i].thread = Thread_start(Workers_main, &workers->threads[i])) == 0)
+		{
+			workers->concurrency = i;
+			Workers_destroy(workers);
+			workers = NULL;
+			goto exit;
+		}
+	}
+exit:
+	return workers;
+}
+
+
+/**
+ * Queue a task to be run by the next free worker
+ * @param workers the pool
+ * @param task the function to run
+ * @param context passed to the task
+ * @return WORKERS_SUCCESS or WORKERS_FAILURE
+ */
+int Workers_submit(Workers* workers, Workers_task* task, void* context)
+{
+	Workers_item* item = NULL;
+	int rc = WORKERS_FAILURE;
+
+	Thread_lock_mutex(workers->mutex);
+	if (workers->stopping)
+		goto exit;
+
+	item = malloc(sizeof(Workers_item));
+	item->task = task;
+	item->context = context;
+	item->next = NULL;
+	if (workers->tail)
+		workers->tail->next = item;
+	else
+		workers->head = item;
+	workers->tail = item;
+	Thread_signal_cond(workers->work);
+	rc = WORKERS_SUCCESS;
+exit:
+	Thread_unlock_mutex(workers->mutex);
+	return rc;
+}
+
+
+/**
+ * Stop workers taking new tasks.  Tasks already running are not interrupted.
+ * @param workers the pool
+ */
+void Workers_pause(Workers* workers)
+{
+	Thread_lock_mutex(workers->mutex);
+	workers->paused = 1;
+	Thread_unlock_mutex(workers->mutex);
+}
+
+
+/**
+ * Let workers take tasks again after Workers_pause
+ * @param workers the pool
+ */
+void Workers_resume(Workers* workers)
+{
+	Thread_lock_mutex(workers->mutex);
+	workers->paused = 0;
+	Thread_signal_cond(workers->work);
+	Thread_unlock_mutex(workers->mutex);
+}
+
+
+/**
+ * Wait until the queue is empty and no task is running
+ * @param workers the pool
+ */
+void Workers_wait(Workers* workers)
+{
+	Thread_lock_mutex(workers->mutex);
+	while (workers->head != NULL || workers->running > 0)
+		Thread_wait_cond(workers->idle, workers->mutex, WAIT_INTERVAL);
+	Thread_unlock_mutex(workers->mutex);
+}
+
+
+/**
+ * Stop the worker threads and free the pool.  Tasks still queued are discarded; running
+ * tasks are waited for.
+ * @param workers the pool
+ */
+void Workers_destroy(Workers* workers)
+{
+	Workers_item* item = NULL;
+	int i;
+
+	Thread_lock_mutex(workers->mutex);
+	workers->stopping = 1;
+	Thread_signal_cond(workers->work);
+	Thread_unlock_mutex(workers->mutex);
+
+	for (i = 0; i < workers->concurrency; i++)
+		Thread_join(workers->threads[i].thread);
+
+	while ((item = workers->head) != NULL)
+	{
+		workers->head = item->next;
+		free(item);
+	}
+	Thread_destroy_cond(workers->idle);
+	Thread_destroy_cond(workers->work);
+	Thread_destroy_mutex(workers->mutex);
+	free(workers->threads);
+	free(workers);
+}
+
+
+/**
+ * Number of worker threads in a pool
+ * @param workers the pool
+ * @return the concurrency level
+ */
+int Workers_concurrency(Workers* workers)
+{
+	return workers->concurrency;
+}
@@ -0,0 +1,43 @@
+//
+//  Workers.h
+//  SimpleMessage
+//
+//  Copyright 2012 Dominik Zajac (dc-square GmbH)
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+#if !defined(WORKERS_H)
+#define WORKERS_H
+
+/** Return code: the task was queued */
+#define WORKERS_SUCCESS 0
+/** Return code: the worker pool is shutting down or the task could not be queued */
+#define WORKERS_FAILURE -1
+
+/**
+ * A unit of work.  Anything it needs, such as which connection to use, is in its context.
+ */
+typedef void Workers_task(void* context);
+
+typedef struct Workers Workers;
+
+Workers* Workers_create(int concurrency, int pinned);
+int Workers_submit(Workers* workers, Workers_task* task, void* context);
+void Workers_pause(Workers* workers);
+void Workers_resume(Workers* workers);
+void Workers_wait(Workers* workers);
+void Workers_destroy(Workers* workers);
+int Workers_concurrency(Workers* workers);
+int Workers_cpuCount(void);
+
+#endif
@@ -152,12 +152,17 @@ typedef struct
 	int maxInflightMessages;
 	time_t lastContact;
 	willMessages* will;
-	List* inboundMsgs;
+	List* inboundMsgs;				/**< QoS 2 messages received and not yet released */
+	ListElement** inboundIndex;		/**< inboundMsgs elements hashed by message id, see MQTTProtocol_findInbound */
+	int inboundIndexSize;			/**< number of slots in inboundIndex, a power of 2 */
 	List* outboundMsgs;				/**< in flight */
+	ListElement** outboundIndex;	/**< outboundMsgs elements hashed by message id, see MQTTProtocol_findOutbound */
+	int outboundIndexSize;			/**< number of slots in outboundIndex, a power of 2 */
 	List* messageQueue;
 	void* phandle;  /* the persistence handle */
 	MQTTClient_persistence* persistence; /* a persistence implementation */
 	int connectOptionsVersion;
+	void* context; /**< the API handle this client belongs to */
 } Clients;
 
 int clientIDCompare(void* a, void* b);
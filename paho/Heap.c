@@ -52,6 +52,13 @@ typedef struct
 
 static List heap = {NULL, NULL, NULL};
 
+#if defined(WIN32)
+mutex_type heap_mutex;
+#else
+static pthread_mutex_t heap_mutex_store = PTHREAD_MUTEX_INITIALIZER;
+static mutex_type heap_mutex = &heap_mutex_store;
+#endif
+
 /**
  * Allocates a block of memory.  A direct replacement for malloc, but keeps track of items
  * allocated in a list, so that free can check that a item is being freed correctly and that
@@ -116,10 +123,12 @@ void* mymalloc(char* file, int line, size_t size)
 		free(s);
 		return NULL;
 	}
+	Thread_lock_mutex(heap_mutex);
 	ListAppendNoMalloc(&heap, s, e, sizeof(ListElement));
 	state.current_size += size;
 	if (state.current_size > state.max_size)
 		state.max_size = state.current_size;
+	Thread_unlock_mutex(heap_mutex);
 	return s->ptr;
 }
 
@@ -145,7 +154,11 @@ int ptrCompare(void* a, void* b)
  */
 void* Heap_findItem(void* p)
 {
-	ListElement* e = ListFindItem(&heap, p, ptrCompare);
+	ListElement* e = NULL;
+
+	Thread_lock_mutex(heap_mutex);
+	e = ListFindItem(&heap, p, ptrCompare);
+	Thread_unlock_mutex(heap_mutex);
 	return (e == NULL) ? NULL : e->content;
 }
 
@@ -160,20 +173,27 @@ void* Heap_findItem(void* p)
 void Internal_heap_unlink(char* file, int line, void* p)
 {
 	ListElement* e = NULL;
+	size_t size = 0;
 
-	if ((e = ListFindItem(&heap, p, ptrCompare)) == NULL)
-		Log(LOG_ERROR, -1, "Failed to remove heap item at file %s line %d", file, line);
-	else
+	/* the heap lock is not held while logging, as the trace buffer may itself allocate */
+	Thread_lock_mutex(heap_mutex);
+	if ((e = ListFindItem(&heap, p, ptrCompare)) != NULL)
 	{
 		storageElement* s = (storageElement*)(heap.current->content);
-		Log(TRACE_MAX, -1, "Freeing %d bytes in heap at file %s line %d, heap use now %d bytes",
-											 s->size, file, line, state.current_size);
+		size = s->size;
 		free(s->file);
 		if (s->stack)
 			free(s->stack);
 		state.current_size -= s->size;
 		ListRemoveCurrentItem(&heap);
 	}
+	Thread_unlock_mutex(heap_mutex);
+
+	if (e == NULL)
+		Log(LOG_ERROR, -1, "Failed to remove heap item at file %s line %d", file, line);
+	else
+		Log(TRACE_MAX, -1, "Freeing %d bytes in heap at file %s line %d, heap use now %d bytes",
+											 size, file, line, state.current_size);
 }
 
 
@@ -217,11 +237,10 @@ void myfree(char* file, int line, void* p)
 void *myrealloc(char* file, int line, void* p, size_t size)
 {
 	void* rc = NULL;
+	ListElement* e = NULL;
 
-	ListElement* e = ListFindItem(&heap, p, ptrCompare);
-	if (e == NULL)
-		Log(LOG_ERROR, -1, "Failed to reallocate heap item at file %s line %d", file, line);
-	else
+	Thread_lock_mutex(heap_mutex);
+	if ((e = ListFindItem(&heap, p, ptrCompare)) != NULL)
 	{
 		storageElement* s = (storageElement*)(heap.current->content);
 		state.current_size += size - s->size;
@@ -238,6 +257,10 @@ void *myrealloc(char* file, int line, void* p, size_t size)
 			s->stack = StackTrace_get(Thread_getid());
 		}
 	}
+	Thread_unlock_mutex(heap_mutex);
+
+	if (e == NULL)
+		Log(LOG_ERROR, -1, "Failed to reallocate heap item at file %s line %d", file, line);
 	return rc;
 }
 
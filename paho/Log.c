@@ -17,6 +17,7 @@
 #include "Messages.h"
 #include "LinkedList.h"
 #include "StackTrace.h"
+#include "Thread.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -85,23 +86,29 @@ struct timeb ts, last_ts;
 #endif
 static char msg_buf[512];
 
+#if defined(WIN32)
+mutex_type log_mutex;
+#else
+static pthread_mutex_t log_mutex_store = PTHREAD_MUTEX_INITIALIZER;
+static mutex_type log_mutex = &log_mutex_store;
+#endif
+
 
 int Log_initialize()
 {
 	int rc = -1;
 	char* envval = NULL;
-
-	if ((trace_queue = malloc(sizeof(traceEntry) * trace_settings.max_trace_entries)) == NULL)
-		return rc;
-	trace_queue_size = trace_settings.max_trace_entries;
+	int tracing = 0;
 
 	if ((envval = getenv("MQTT_C_CLIENT_TRACE")) != NULL && strlen(envval) > 0)
 	{
+		tracing = 1;
 		if (strcmp(envval, "ON") == 0 || (trace_destination = fopen(envval, "wt")) == NULL)
 			trace_destination = stdout;
 	}
 	if ((envval = getenv("MQTT_C_CLIENT_TRACE_LEVEL")) != NULL && strlen(envval) > 0)
 	{
+		tracing = 1;
 		if (strcmp(envval, "MAXIMUM") == 0 || strcmp(envval, "TRACE_MAXIMUM") == 0)
 			trace_settings.trace_level = TRACE_MAXIMUM;
 		else if (strcmp(envval, "MEDIUM") == 0 || strcmp(envval, "TRACE_MEDIUM") == 0)
@@ -111,12 +118,23 @@ int Log_initialize()
 		else if (strcmp(envval, "PROTOCOL") == 0  || strcmp(envval, "TRACE_PROTOCOL") == 0)
 			trace_output_level = TRACE_PROTOCOL;
 	}
+
+	/* Every function entry and exit is recorded in the trace buffer, which all threads share.
+	 * Only keep one if trace has been asked for, so that untraced clients don't serialize on it.
+	 */
+	if (tracing)
+	{
+		if ((trace_queue = malloc(sizeof(traceEntry) * trace_settings.max_trace_entries)) == NULL)
+			return rc;
+		trace_queue_size = trace_settings.max_trace_entries;
+	}
 	return rc;
 }
 
 
 void Log_terminate()
 {
+	Thread_lock_mutex(log_mutex);
 	free(trace_queue);
 	trace_queue = NULL;
 	trace_queue_size = 0;
@@ -130,6 +148,7 @@ void Log_terminate()
 	next_index = 0;
 	trace_output_level = -1;
 	sametime_count = 0;
+	Thread_unlock_mutex(log_mutex);
 }
 
 
@@ -267,18 +286,23 @@ void Log(int log_level, int msgno, char* format, ...)
 	char* temp = NULL;
 	static char msg_buf[512];
 
-	if (log_level >= trace_settings.trace_level)
+	if (log_level >= trace_settings.trace_level && trace_queue != NULL)
 	{
 		va_list args;
 
 		if (format == NULL && (temp = Messages_get(msgno, log_level)) != NULL)
 			format = temp;
 
-		va_start(args, format);
-		vsnprintf(msg_buf, sizeof(msg_buf), format, args);
+		Thread_lock_mutex(log_mutex);
+		if (trace_queue != NULL) /* again, now that Log_terminate can't free it */
+		{
+			va_start(args, format);
+			vsnprintf(msg_buf, sizeof(msg_buf), format, args);
 
-		Log_trace(log_level, msg_buf);
-		va_end(args);
+			Log_trace(log_level, msg_buf);
+			va_end(args);
+		}
+		Thread_unlock_mutex(log_mutex);
 	}
 
 	/*if (log_level >= LOG_ERROR)
@@ -305,12 +329,20 @@ void Log_stackTrace(int log_level, int msgno, int thread_id, int current_depth,
 {
 	traceEntry *cur_entry = NULL;
 
+	/* the unlocked look at trace_queue only keeps untraced clients from serializing on
+	 * log_mutex; it is checked again under the lock before it is used */
 	if (trace_queue == NULL)
 		return;
 
 	if (log_level < trace_settings.trace_level)
 		return;
 
+	Thread_lock_mutex(log_mutex);
+	if (trace_queue == NULL)
+	{
+		Thread_unlock_mutex(log_mutex);
+		return;
+	}
 	cur_entry = Log_pretrace();
 
 	memcpy(&(cur_entry->ts), &ts, sizeof(ts));
@@ -330,6 +362,7 @@ void Log_stackTrace(int log_level, int msgno, int thread_id, int current_depth,
 	}
 
 	Log_posttrace(log_level, cur_entry);
+	Thread_unlock_mutex(log_mutex);
 }
 
 
@@ -27,7 +27,7 @@ map LOG_LEVELS
 }
 BE*/
 
-enum {
+enum LOG_LEVELS {
 	TRACE_MAXIMUM = 1,
 	TRACE_MEDIUM,
 	TRACE_MINIMUM,
@@ -35,7 +35,7 @@ enum {
 	LOG_ERROR,
 	LOG_SEVERE,
 	LOG_FATAL,
-} Log_levels;
+};
 
 
 /*BE
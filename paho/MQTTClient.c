@@ -26,10 +26,12 @@
 #include "MQTTProtocolOut.h"
 #include "Thread.h"
 #include "SocketBuffer.h"
+#include "Resolver.h"
 #include "StackTrace.h"
 #include "Heap.h"
 
 #define URI_TCP "tcp://"
+#define POLL_WAIT 10L /* the longest, in ms, an API call waits for another thread reading its shard */
 
 #define BUILD_TIMESTAMP __DATE__ " " __TIME__ /* __TIMESTAMP__ */
 #define CLIENT_VERSION "1.0.0.7" /* __VERSION__ */
@@ -47,9 +49,24 @@ ClientStates* bstate = &ClientState;
 
 MQTTProtocol state;
 
+/*
+ * Locking: each handle has its own mutex guarding its Clients structure, and
+ * mqttclient_mutex guards only what is shared - the handles and bstate->clients lists
+ * and the background thread state.  A handle's mutex may be held when taking
+ * mqttclient_mutex, but not the other way round, and no more than one handle's mutex
+ * is held at a time.
+ */
 #if defined(WIN32)
-static mutex_type mqttclient_mutex = NULL;
+mutex_type mqttclient_mutex = NULL;
+static cond_type run_cond = NULL;
+static cond_type unpin_cond = NULL;
 extern mutex_type stack_mutex;
+extern mutex_type heap_mutex;
+extern mutex_type log_mutex;
+extern mutex_type socket_mutex;
+extern mutex_type socketbuffer_mutex;
+extern mutex_type resolver_mutex;
+extern cond_type resolver_cond;
 BOOL APIENTRY DllMain(HANDLE hModule,
                       DWORD  ul_reason_for_call,
                       LPVOID lpReserved)
@@ -62,6 +79,14 @@ BOOL APIENTRY DllMain(HANDLE hModule,
 			{
 				mqttclient_mutex = CreateMutex(NULL, 0, NULL);
 				stack_mutex = CreateMutex(NULL, 0, NULL);
+				heap_mutex = CreateMutex(NULL, 0, NULL);
+				log_mutex = CreateMutex(NULL, 0, NULL);
+				socket_mutex = CreateMutex(NULL, 0, NULL);
+				socketbuffer_mutex = CreateMutex(NULL, 0, NULL);
+				resolver_mutex = CreateMutex(NULL, 0, NULL);
+				run_cond = Thread_create_cond();
+				unpin_cond = Thread_create_cond();
+				resolver_cond = Thread_create_cond();
 			}
 		case DLL_THREAD_ATTACH:
 			Log(TRACE_MAX, -1, "DLL thread attach");
@@ -74,33 +99,66 @@ BOOL APIENTRY DllMain(HANDLE hModule,
 }
 #else
 static pthread_mutex_t mqttclient_mutex_store = PTHREAD_MUTEX_INITIALIZER;
-static mutex_type mqttclient_mutex = &mqttclient_mutex_store;
+mutex_type mqttclient_mutex = &mqttclient_mutex_store;
+static pthread_cond_t run_cond_store = PTHREAD_COND_INITIALIZER;
+static cond_type run_cond = &run_cond_store; /* signalled with mqttclient_mutex when the run thread ends */
+static pthread_cond_t unpin_cond_store = PTHREAD_COND_INITIALIZER;
+static cond_type unpin_cond = &unpin_cond_store; /* signalled with mqttclient_mutex when a closing handle is unpinned */
 #define WINAPI
 #endif
 
 static volatile int initialized = 0;
 static List* handles = NULL;
 static time_t last;
-static int running = 0;
-static int tostop = 0;
-static thread_id_type run_id = 0;
+static time_t last_retry;
+static int running = 0; /* the number of background threads running, guarded by mqttclient_mutex */
+static int tostop = 0; /* set to stop the background threads, guarded by mqttclient_mutex */
+static int ioThreads = 1; /* the number of background threads, one for each socket shard */
+static thread_id_type* run_ids = NULL;
+static thread_type* run_threads = NULL; /* the background threads, to be joined when they stop */
+static int* polling = NULL; /* for each shard, whether an API call is reading it, guarded by mqttclient_mutex */
 
 MQTTPacket* MQTTClient_waitfor(MQTTClient handle, int packet_type, int* rc, long timeout);
 int MQTTClient_receiveOrComplete(MQTTClient handle, char** topicName, int* topicLen, MQTTClient_message** message,
 											 unsigned long timeout, MQTTPacket** packetaddr);
-MQTTPacket* MQTTClient_cycle(int* sock, unsigned long timeout, int* rc);
+MQTTPacket* MQTTClient_cycle(int shard, int* sock, unsigned long timeout, int* rc);
 int MQTTClient_cleanSession(Clients* client);
 void MQTTClient_stop();
 int MQTTClient_disconnect_internal(MQTTClient handle, int timeout);
+static void MQTTClient_writeComplete(int socket);
 
+/**
+ * An inbound message waiting to be delivered.  The message comes first, so that the entry is
+ * freed with the message once the message has been given to the application.
+ */
 typedef struct
 {
-	MQTTClient_message* msg;
+	MQTTClient_message msg;
 	char* topicName;
 	int topicLen;
+	char* buffer; /* the input buffer the payload is in, or NULL if the payload was allocated on its own */
+	void* handle; /* the handle the message is for, while it waits for a callback worker */
 } qEntry;
 
 
+/**
+ * A thread which calls messageArrived, for the messages given to it in order
+ */
+typedef struct
+{
+	mutex_type mutex; /* guards queue */
+	cond_type cond; /* signalled when a message is added to queue, or the worker is to stop */
+	List* queue; /* the qEntrys waiting for the callback */
+	int stop; /* set under mutex to make the worker end once its queue is empty */
+	thread_id_type id;
+	thread_type thread;
+} callbackWorker;
+
+static int callbackThreads = 0; /* the number of callback workers, 0 to call messageArrived from the background threads */
+static int callbackOrder = MQTTCLIENT_ORDER_CLIENT;
+static callbackWorker* workers = NULL;
+
+
 typedef struct
 {
 	char* serverURI;
@@ -110,6 +168,12 @@ typedef struct
 	MQTTClient_deliveryComplete* dc;
 	void* context;
 
+	mutex_type mutex; /* guards c and the rest of this structure */
+	int users; /* threads working on this handle without holding mutex, guarded by mqttclient_mutex */
+	int closing; /* set when the handle is being destroyed, after which it can't be pinned, guarded by mqttclient_mutex */
+	cond_type cond; /* signalled under mutex when an ack arrives, a pending write completes or the
+						client disconnects, so API calls waiting for one of those can wake up */
+
 	sem_type connect_sem;
 	int rc; /* getsockopt return code in connect */
 	sem_type connack_sem;
@@ -142,7 +206,7 @@ START_TIME_TYPE MQTTClient_start_clock(void)
 #define START_TIME_TYPE struct timespec
 START_TIME_TYPE MQTTClient_start_clock(void)
 {
-	static struct timespec start;
+	struct timespec start;
 	clock_gettime(CLOCK_REALTIME, &start);
 	return start;
 }
@@ -150,7 +214,7 @@ START_TIME_TYPE MQTTClient_start_clock(void)
 #define START_TIME_TYPE struct timeval
 START_TIME_TYPE MQTTClient_start_clock(void)
 {
-	static struct timeval start;
+	struct timeval start;
 	gettimeofday(&start, NULL);
 	return start;
 }
@@ -212,7 +276,26 @@ int MQTTClient_create(MQTTClient* handle, char* serverURI, char* clientId,
 		#endif
 		Log_initialize();
 		bstate->clients = ListInitialize();
-		Socket_outInitialize();
+		Socket_outInitialize(ioThreads);
+		Socket_setWriteCompleteCallback(MQTTClient_writeComplete);
+		run_ids = malloc(sizeof(thread_id_type) * ioThreads);
+		memset(run_ids, '\0', sizeof(thread_id_type) * ioThreads);
+		run_threads = malloc(sizeof(thread_type) * ioThreads);
+		polling = malloc(sizeof(int) * ioThreads);
+		memset(polling, '\0', sizeof(int) * ioThreads);
+		if (callbackThreads > 0)
+		{
+			int i;
+
+			workers = malloc(sizeof(callbackWorker) * callbackThreads);
+			for (i = 0; i < callbackThreads; ++i)
+			{
+				workers[i].mutex = Thread_create_mutex();
+				workers[i].cond = Thread_create_cond();
+				workers[i].queue = ListInitialize();
+				workers[i].id = 0;
+			}
+		}
 		handles = ListInitialize();
 		initialized = 1;
 	}
@@ -232,6 +315,9 @@ int MQTTClient_create(MQTTClient* handle, char* serverURI, char* clientId,
 	m->c->messageQueue = ListInitialize();
 	m->c->clientID = malloc(strlen(clientId)+1);
 	strcpy(m->c->clientID, clientId);
+	m->c->context = m;
+	m->mutex = Thread_create_mutex();
+	m->cond = Thread_create_cond();
 	m->connect_sem = Thread_create_sem();
 	m->connack_sem = Thread_create_sem();
 	m->suback_sem = Thread_create_sem();
@@ -252,6 +338,92 @@ exit:
 }
 
 
+int MQTTClient_setIOThreads(int count)
+{
+	int rc = MQTTCLIENT_SUCCESS;
+
+	FUNC_ENTRY;
+	Thread_lock_mutex(mqttclient_mutex);
+	if (count < 1 || initialized)
+		rc = MQTTCLIENT_FAILURE;
+	else
+		ioThreads = count;
+	Thread_unlock_mutex(mqttclient_mutex);
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+int MQTTClient_setCallbackThreads(int count, int order)
+{
+	int rc = MQTTCLIENT_SUCCESS;
+
+	FUNC_ENTRY;
+	Thread_lock_mutex(mqttclient_mutex);
+	if (count < 0 || initialized || (order != MQTTCLIENT_ORDER_CLIENT && order != MQTTCLIENT_ORDER_TOPIC))
+		rc = MQTTCLIENT_FAILURE;
+	else
+	{
+		callbackThreads = count;
+		callbackOrder = order;
+	}
+	Thread_unlock_mutex(mqttclient_mutex);
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+int MQTTClient_setOutputHighWaterMark(int bytes)
+{
+	int rc = MQTTCLIENT_SUCCESS;
+
+	FUNC_ENTRY;
+	if (bytes < 1)
+		rc = MQTTCLIENT_FAILURE;
+	else
+		Socket_setHighWaterMark(bytes);
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+int MQTTClient_setBusyPoll(int usecs)
+{
+	int rc = MQTTCLIENT_SUCCESS;
+
+	FUNC_ENTRY;
+	if (usecs < 0)
+		rc = MQTTCLIENT_FAILURE;
+	else
+		Socket_setBusyPoll(usecs);
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+int MQTTClient_setNoDelay(int on)
+{
+	FUNC_ENTRY;
+	Socket_setNoDelay(on != 0);
+	FUNC_EXIT;
+	return MQTTCLIENT_SUCCESS;
+}
+
+
+int MQTTClient_setResolverCacheTTL(int seconds)
+{
+	int rc = MQTTCLIENT_SUCCESS;
+
+	FUNC_ENTRY;
+	if (seconds < 0)
+		rc = MQTTCLIENT_FAILURE;
+	else
+		Resolver_setTTL(seconds);
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
 void MQTTClient_terminate(void)
 {
 	FUNC_ENTRY;
@@ -261,6 +433,25 @@ void MQTTClient_terminate(void)
 		ListFree(bstate->clients);
 		ListFree(handles);
 		handles = NULL;
+		free(run_ids);
+		run_ids = NULL;
+		free(run_threads);
+		run_threads = NULL;
+		free(polling);
+		polling = NULL;
+		if (workers)
+		{
+			int i;
+
+			for (i = 0; i < callbackThreads; ++i)
+			{
+				Thread_destroy_mutex(workers[i].mutex);
+				Thread_destroy_cond(workers[i].cond);
+				ListFree(workers[i].queue);
+			}
+			free(workers);
+			workers = NULL;
+		}
 		Socket_outTerminate();
 		#if defined(HEAP_H)
 			Heap_terminate();
@@ -272,6 +463,21 @@ void MQTTClient_terminate(void)
 }
 
 
+/**
+ * Free the topic and payload of a message which is not going to be delivered.  The entry
+ * itself is left to the caller.
+ * @param qe the message
+ */
+static void MQTTClient_freeEntryData(qEntry* qe)
+{
+	free(qe->topicName);
+	if (qe->buffer)
+		SocketBuffer_release(qe->buffer);
+	else
+		free(qe->msg.payload);
+}
+
+
 void MQTTClient_emptyMessageQueue(Clients* client)
 {
 	FUNC_ENTRY;
@@ -280,12 +486,7 @@ void MQTTClient_emptyMessageQueue(Clients* client)
 	{
 		ListElement* current = NULL;
 		while (ListNextElement(client->messageQueue, &current))
-		{
-			qEntry* qe = (qEntry*)(current->content);
-			free(qe->topicName);
-			free(qe->msg->payload);
-			free(qe->msg);
-		}
+			MQTTClient_freeEntryData((qEntry*)(current->content));
 		ListEmpty(client->messageQueue);
 	}
 	FUNC_EXIT;
@@ -302,26 +503,44 @@ void MQTTClient_destroy(MQTTClient* handle)
 	if (m == NULL)
 		goto exit;
 
+	/* once the handle is off the lists and closing no other thread can find it, so wait for
+	 * any which already had to finish with it before its socket is closed */
+	ListDetach(handles, m);
+	if (m->c && !ListDetach(bstate->clients, m->c))
+		Log(LOG_ERROR, 0, NULL);
+	m->closing = 1;
+	while (m->users > 0)
+		Thread_wait_cond(unpin_cond, mqttclient_mutex, 100L);
+
 	if (m->c)
 	{
 		int saved_socket = m->c->socket;
 		char* saved_clientid = malloc(strlen(m->c->clientID)+1);
 		strcpy(saved_clientid, m->c->clientID);
+		if (saved_socket > 0)
+		{
+			/* destroyed without being disconnected: the socket must not lead to the handle any more */
+			Socket_close(saved_socket);
+			m->c->socket = 0;
+		}
 #if !defined(NO_PERSISTENCE)
 		MQTTPersistence_close(m->c);
 #endif
 		MQTTClient_emptyMessageQueue(m->c);
 		MQTTProtocol_freeClient(m->c);
-		if (!ListRemove(bstate->clients, m->c))
-			Log(LOG_ERROR, 0, NULL);
-		else
-			Log(TRACE_MIN, 1, NULL, saved_clientid, saved_socket);
+		free(m->c);
+		Log(TRACE_MIN, 1, NULL, saved_clientid, saved_socket);
 		free(saved_clientid);
 	}
 	if (m->serverURI)
 		free(m->serverURI);
-	if (!ListRemove(handles, m))
-		Log(LOG_ERROR, -1, "free error");
+	Thread_destroy_sem(m->connect_sem);
+	Thread_destroy_sem(m->connack_sem);
+	Thread_destroy_sem(m->suback_sem);
+	Thread_destroy_sem(m->unsuback_sem);
+	Thread_destroy_cond(m->cond);
+	Thread_destroy_mutex(m->mutex);
+	free(m);
 	*handle = NULL;
 	if (bstate->clients->count == 0)
 		MQTTClient_terminate();
@@ -339,9 +558,14 @@ exit:
 #endif
 void MQTTClient_freeMessage(MQTTClient_message** message)
 {
+	qEntry* qe = (qEntry*)*message;
+
 	FUNC_ENTRY;
-	free((*message)->payload);
-	free(*message);
+	if (qe->buffer)
+		SocketBuffer_release(qe->buffer);
+	else
+		free(qe->msg.payload);
+	free(qe);
 	*message = NULL;
 	FUNC_EXIT;
 }
@@ -367,14 +591,15 @@ int MQTTClient_deliverMessage(int rc, MQTTClients* m, char** topicName, int* top
 	qEntry* qe = (qEntry*)(m->c->messageQueue->first->content);
 
 	FUNC_ENTRY;
-	*message = qe->msg;
+	*message = &qe->msg;
 	*topicName = qe->topicName;
 	*topicLen = qe->topicLen;
 	if (strlen(*topicName) != *topicLen)
 		rc = MQTTCLIENT_TOPICNAME_TRUNCATED;
-	ListRemove(m->c->messageQueue, m->c->messageQueue->first->content);
-	Heap_unlink(__FILE__, __LINE__, (*message)->payload);
-	Heap_unlink(__FILE__, __LINE__, *message);
+	ListDetach(m->c->messageQueue, qe);
+	if (qe->buffer == NULL)
+		Heap_unlink(__FILE__, __LINE__, (*message)->payload);
+	Heap_unlink(__FILE__, __LINE__, qe);
 	Heap_unlink(__FILE__, __LINE__, *topicName);
 	FUNC_EXIT_RC(rc);
 	return rc;
@@ -382,216 +607,634 @@ int MQTTClient_deliverMessage(int rc, MQTTClients* m, char** topicName, int* top
 
 
 /**
- * List callback function for comparing clients by socket
- * @param a first integer value
- * @param b second integer value
- * @return boolean indicating whether a and b are equal
+ * Find the handle which owns a socket, and stop it from being destroyed until
+ * MQTTClient_unpin is called.  The handle's own mutex is not taken.
+ * @param sock the socket
+ * @return the handle, or NULL if no handle owns the socket
  */
-int clientSockCompare(void* a, void* b)
+static MQTTClients* MQTTClient_pin(int sock)
 {
-	MQTTClients* m = (MQTTClients*)a;
-	return m->c->socket == *(int*)b;
+	MQTTClients* m = NULL;
+	Clients* client = NULL;
+
+	Thread_lock_mutex(mqttclient_mutex);
+	if (sock > 0 && handles != NULL && (client = Socket_getOwner(sock)) != NULL &&
+		!((MQTTClients*)(client->context))->closing)
+	{
+		m = (MQTTClients*)(client->context);
+		++(m->users);
+	}
+	Thread_unlock_mutex(mqttclient_mutex);
+	return m;
 }
 
 
 /**
- * Wrapper function to call connection lost on a separate thread.  A separate thread is needed to allow the
- * connectionLost function to make API calls (e.g. connect)
- * @param context a pointer to the relevant client
- * @return thread_return_type standard thread return value - not used here
+ * Let a handle be destroyed again, once every thread which pinned it has unpinned it.  The
+ * last to do so wakes MQTTClient_destroy if it is waiting.  Called with mqttclient_mutex held.
+ * @param m the handle
  */
-thread_return_type WINAPI connectionLost_call(void* context)
+static void MQTTClient_unpin_locked(MQTTClients* m)
 {
-	MQTTClients* m = (MQTTClients*)context;
-
-	(*(m->cl))(m->context, NULL);
-	return 0;
+	if (--(m->users) == 0 && m->closing)
+		Thread_signal_cond(unpin_cond);
 }
 
 
-/* This is the thread function that handles the calling of callback functions if set */
-thread_return_type WINAPI MQTTClient_run(void* n)
+static void MQTTClient_unpin(MQTTClients* m)
 {
-	long timeout = 10L; /* first time in we have a small timeout.  Gets things started more quickly */
+	Thread_lock_mutex(mqttclient_mutex);
+	MQTTClient_unpin_locked(m);
+	Thread_unlock_mutex(mqttclient_mutex);
+}
 
-	FUNC_ENTRY;
-	running = 1;
-	run_id = Thread_getid();
 
-	Thread_lock_mutex(mqttclient_mutex);
-	while (!tostop)
+/**
+ * Wake any API calls waiting for the output queued on this socket to be written, or to
+ * drop below the high-water mark
+ * @param socket the socket whose queued output has drained
+ */
+static void MQTTClient_writeComplete(int socket)
+{
+	MQTTClients* m = MQTTClient_pin(socket);
+
+	if (m)
 	{
-		int rc = SOCKET_ERROR;
-		int sock = -1;
-		MQTTClients* m = NULL;
-		MQTTPacket* pack = NULL;
+		Thread_lock_mutex(m->mutex);
+		Thread_signal_cond(m->cond);
+		Thread_unlock_mutex(m->mutex);
+		MQTTClient_unpin(m);
+	}
+}
 
-		Thread_unlock_mutex(mqttclient_mutex);
-		pack = MQTTClient_cycle(&sock, timeout, &rc);
-		Thread_lock_mutex(mqttclient_mutex);
-		if (tostop)
-			break;
-		timeout = 1000L;
 
-		/* find client corresponding to socket */
-		if (ListFindItem(handles, &sock, clientSockCompare) == NULL)
-		{
-			/* assert: should not happen */
-			continue;
-		}
-		m = (MQTTClient)(handles->current->content);
-		if (m == NULL)
-		{
-			/* assert: should not happen */
-			continue;
-		}
-		if (rc == SOCKET_ERROR)
-		{
-			Thread_unlock_mutex(mqttclient_mutex);
-			MQTTClient_disconnect_internal(m, 0);
-			Thread_lock_mutex(mqttclient_mutex);
-		}
-		else
-		{
-			if (m->c->messageQueue->count > 0)
-			{
-				qEntry* qe = (qEntry*)(m->c->messageQueue->first->content);
-				int topicLen = qe->topicLen;
-				void* payload_ptr = qe->msg->payload; /* saved so we can unlink it after a successful messageArrived call,
-														because it is held in a structure which might be freed */
+/**
+ * Whether the background threads are running, for a caller not holding mqttclient_mutex
+ * @return boolean
+ */
+static int MQTTClient_isRunning(void)
+{
+	int rc;
 
-				if (strlen(qe->topicName) == topicLen)
-					topicLen = 0;
+	Thread_lock_mutex(mqttclient_mutex);
+	rc = (running > 0);
+	Thread_unlock_mutex(mqttclient_mutex);
+	return rc;
+}
 
-				Log(TRACE_MIN, -1, "Calling messageArrived for client %s, queue depth %d",
-					m->c->clientID, m->c->messageQueue->count);
-				Thread_unlock_mutex(mqttclient_mutex);
-				rc = (*(m->ma))(m->context, qe->topicName, topicLen, qe->msg);
-				Thread_lock_mutex(mqttclient_mutex);
-				/* if 0 (false) is returned by the callback then it failed, so we don't remove the message from
-				 * the queue, and it will be retried later.  If 1 is returned then the message data may have been freed,
-				 * so we must be careful how we use it.
-				 */
-				if (rc)
-				{
-					Heap_unlink(__FILE__, __LINE__, qe->topicName);
-					Heap_unlink(__FILE__, __LINE__, payload_ptr);
-					Heap_unlink(__FILE__, __LINE__, qe->msg);
-					ListRemove(m->c->messageQueue, qe);
-				}
-				else
-					Log(TRACE_MIN, -1, "False returned from messageArrived for client %s, message remains on queue",
-						m->c->clientID);
-			}
-			if (pack)
-			{
-				if (pack->header.bits.type == CONNACK)
-				{
-					Log(TRACE_MIN, -1, "Posting connack semaphore for client %s", m->c->clientID);
-					m->pack = pack;
-					Thread_post_sem(m->connack_sem);
-				}
-				else if (pack->header.bits.type == SUBACK)
-				{
-					Log(TRACE_MIN, -1, "Posting suback semaphore for client %s", m->c->clientID);
-					m->pack = pack;
-					Thread_post_sem(m->suback_sem);
-				}
-				else if (pack->header.bits.type == UNSUBACK)
-				{
-					Log(TRACE_MIN, -1, "Posting unsuback semaphore for client %s", m->c->clientID);
-					m->pack = pack;
-					Thread_post_sem(m->unsuback_sem);
-				}
-			}
-			else if (m->c->connect_state == 1 && !Thread_check_sem(m->connect_sem))
-			{
-				int error;
-				socklen_t len = sizeof(error);
 
-				if ((m->rc = getsockopt(m->c->socket, SOL_SOCKET, SO_ERROR, (char*)&error, &len)) == 0)
-					m->rc = error;
-				Log(TRACE_MIN, -1, "Posting connect semaphore for client %s rc %d", m->c->clientID, m->rc);
-				Thread_post_sem(m->connect_sem);
-			}
-		}
-	}
-	run_id = 0;
-	running = 0;
+/**
+ * Whether the background threads have been told to stop, for one of them to check
+ * @return boolean
+ */
+static int MQTTClient_stopping(void)
+{
+	int rc;
+
+	Thread_lock_mutex(mqttclient_mutex);
+	rc = tostop;
 	Thread_unlock_mutex(mqttclient_mutex);
-	FUNC_EXIT;
-	return 0;
+	return rc;
 }
 
 
-void MQTTClient_stop()
+/**
+ * Find the socket shard a client's network work is done on
+ * @param m the handle
+ * @return the shard number
+ */
+static int MQTTClient_shard(MQTTClients* m)
 {
-	int rc = 0;
+	int sock = m->c->socket;
 
-	FUNC_ENTRY;
-	if (running == 1 && tostop == 0 && Thread_getid() != run_id)
-	{
-		int conn_count = 0;
-		ListElement* current = NULL;
+	return (sock > 0) ? Socket_shardOf(sock) : 0;
+}
 
-		if (handles != NULL)
+
+/**
+ * Pass on a packet read from a client's socket which the reader does not handle itself, to
+ * the call waiting for it in MQTTClient_waitfor, or tell that call that the client's TCP
+ * connect has completed.  Any API call waiting on the handle is woken.  Called with the
+ * handle locked.
+ * @param m the handle
+ * @param pack the packet, or NULL if the socket was only found to be ready
+ */
+static void MQTTClient_handOver(MQTTClients* m, MQTTPacket* pack)
+{
+	if (pack)
+	{
+		if (pack->header.bits.type == CONNACK)
 		{
-			/* find out how many handles are still connected */
-			while (ListNextElement(handles, &current))
-			{
-				if (((MQTTClients*)(current->content))->c->connect_state > 0 ||
-						((MQTTClients*)(current->content))->c->connected)
-					++conn_count;
-			}
+			Log(TRACE_MIN, -1, "Posting connack semaphore for client %s", m->c->clientID);
+			m->pack = pack;
+			Thread_post_sem(m->connack_sem);
 		}
-		Log(TRACE_MIN, -1, "Conn_count is %d", conn_count);
-		/* stop the background thread, if we are the last one to be using it */
-		if (conn_count == 0)
+		else if (pack->header.bits.type == SUBACK)
 		{
-			int count = 0;
-			tostop = 1;
-			while (running && ++count < 100)
-			{
-				Thread_unlock_mutex(mqttclient_mutex);
-				Log(TRACE_MIN, -1, "sleeping");
-				MQTTClient_sleep(100L);
-				Thread_lock_mutex(mqttclient_mutex);
-			}
-			rc = 1;
-			tostop = 0;
+			Log(TRACE_MIN, -1, "Posting suback semaphore for client %s", m->c->clientID);
+			m->pack = pack;
+			Thread_post_sem(m->suback_sem);
+		}
+		else if (pack->header.bits.type == UNSUBACK)
+		{
+			Log(TRACE_MIN, -1, "Posting unsuback semaphore for client %s", m->c->clientID);
+			m->pack = pack;
+			Thread_post_sem(m->unsuback_sem);
 		}
 	}
-	FUNC_EXIT_RC(rc);
+	else if (m->c->connect_state == 1 && !Thread_check_sem(m->connect_sem))
+	{
+		int error;
+		socklen_t len = sizeof(error);
+
+		if ((m->rc = getsockopt(m->c->socket, SOL_SOCKET, SO_ERROR, (char*)&error, &len)) == 0)
+			m->rc = error;
+		Log(TRACE_MIN, -1, "Posting connect semaphore for client %s rc %d", m->c->clientID, m->rc);
+		Thread_post_sem(m->connect_sem);
+	}
+	Thread_signal_cond(m->cond);
 }
 
 
-int MQTTClient_setCallbacks(MQTTClient handle, void* context, MQTTClient_connectionLost* cl,
-														MQTTClient_messageArrived* ma, MQTTClient_deliveryComplete* dc)
+/**
+ * Claim the reading of a shard's sockets for an API call, when there are no background
+ * threads to read them.  Only one thread reads a shard at a time, so that each packet is
+ * read by one thread, which passes it on to the handle it is for.
+ * @param shard the socket shard
+ * @return boolean, whether the caller now reads the shard
+ */
+static int MQTTClient_startPolling(int shard)
 {
-	int rc = MQTTCLIENT_SUCCESS;
-	MQTTClients* m = handle;
+	int rc = 0;
 
-	FUNC_ENTRY;
 	Thread_lock_mutex(mqttclient_mutex);
-
-	if (m == NULL || ma == NULL || m->c->connect_state != 0)
-		rc = MQTTCLIENT_FAILURE;
-	else
-	{
-		m->context = context;
-		m->cl = cl;
-		m->ma = ma;
-		m->dc = dc;
-	}
-
+	if (!running && polling && !polling[shard])
+		rc = polling[shard] = 1;
 	Thread_unlock_mutex(mqttclient_mutex);
-	FUNC_EXIT_RC(rc);
 	return rc;
 }
 
 
-void MQTTProtocol_closeSession(Clients* client, int sendwill)
-{
+/**
+ * Give up the reading of a shard claimed with MQTTClient_startPolling
+ * @param shard the socket shard
+ */
+static void MQTTClient_stopPolling(int shard)
+{
+	Thread_lock_mutex(mqttclient_mutex);
+	if (polling)
+		polling[shard] = 0;
+	Thread_unlock_mutex(mqttclient_mutex);
+}
+
+
+/**
+ * Do the network work an API call is waiting for.  If no other thread is reading the
+ * shard, the caller reads and processes whatever is ready on it, waiting up to timeout for
+ * something to arrive, and passes on anything it reads for other handles.  Otherwise it
+ * waits on its own handle, which the reading thread signals.  Without the background
+ * threads that wait is bounded, so that the caller takes over the reading when the other
+ * thread stops.  A client whose socket has failed is disconnected, unless it is the caller's.
+ * @param shard the socket shard of m, or the one to read if m is NULL
+ * @param m the handle, locked by the caller, or NULL
+ * @param timeout the maximum time to wait in milliseconds
+ * @return SOCKET_ERROR if the socket of m has failed, otherwise TCPSOCKET_COMPLETE
+ */
+static int MQTTClient_poll(int shard, MQTTClients* m, unsigned long timeout)
+{
+	MQTTPacket* pack = NULL;
+	MQTTClients* owner = NULL;
+	int sock = -1;
+	int rc = TCPSOCKET_COMPLETE;
+	int failed = 0;
+
+	if (!MQTTClient_startPolling(shard))
+	{
+		if (!MQTTClient_isRunning() && timeout > POLL_WAIT)
+			timeout = POLL_WAIT;
+		if (m)
+			Thread_wait_cond(m->cond, m->mutex, timeout);
+		else
+			MQTTClient_sleep(timeout);
+		goto exit;
+	}
+
+	if (m)
+		Thread_unlock_mutex(m->mutex);
+	pack = MQTTClient_cycle(shard, &sock, timeout, &rc);
+	MQTTClient_stopPolling(shard);
+	if ((owner = MQTTClient_pin(sock)) != NULL)
+	{
+		if (rc != SOCKET_ERROR)
+		{
+			Thread_lock_mutex(owner->mutex);
+			MQTTClient_handOver(owner, pack);
+			Thread_unlock_mutex(owner->mutex);
+		}
+		else if (owner == m)
+			failed = 1;
+		else
+		{
+			int disconnecting;
+
+			Thread_lock_mutex(owner->mutex);
+			disconnecting = (owner->c->connect_state == -2);
+			Thread_unlock_mutex(owner->mutex);
+			if (!disconnecting)
+				MQTTClient_disconnect_internal(owner, 0);
+		}
+		MQTTClient_unpin(owner);
+	}
+	if (m)
+		Thread_lock_mutex(m->mutex);
+exit:
+	return failed ? SOCKET_ERROR : TCPSOCKET_COMPLETE;
+}
+
+
+/**
+ * Wait, with the handle locked, for something to happen which may end a wait on this
+ * client: an acknowledgement, a pending write finishing, or the client disconnecting.
+ * With the background threads running, the one serving the client's socket signals the
+ * handle; otherwise the caller does the network work itself, or waits for the thread doing
+ * it for its shard to signal the handle.  Either way the wait ends as soon as there is
+ * something to look at, and the caller checks again what it is waiting for.
+ * @param m the handle, locked by the caller
+ * @param timeout the maximum time to wait in milliseconds
+ */
+static void MQTTClient_waitEvent(MQTTClients* m, unsigned long timeout)
+{
+	if (MQTTClient_poll(MQTTClient_shard(m), m, timeout) == SOCKET_ERROR && m->c->connect_state != -2)
+	{
+		Thread_unlock_mutex(m->mutex);
+		MQTTClient_disconnect_internal(m, 0);
+		Thread_lock_mutex(m->mutex);
+	}
+}
+
+
+/**
+ * Find the client state which owns a socket, by looking the socket up in the socket layer's
+ * table rather than searching the clients.  Called from the protocol layer, which already
+ * holds the owning handle's mutex.
+ * @param sock the socket
+ * @return the client, or NULL if no client owns the socket
+ */
+Clients* MQTTProtocol_findClient(int sock)
+{
+	return (Clients*)Socket_getOwner(sock);
+}
+
+
+/**
+ * Wrapper function to call connection lost on a separate thread.  A separate thread is needed to allow the
+ * connectionLost function to make API calls (e.g. connect)
+ * @param context a pointer to the relevant client
+ * @return thread_return_type standard thread return value - not used here
+ */
+thread_return_type WINAPI connectionLost_call(void* context)
+{
+	MQTTClients* m = (MQTTClients*)context;
+
+	(*(m->cl))(m->context, NULL);
+	return 0;
+}
+
+
+/**
+ * Check whether the calling thread is one of the background threads
+ * @return boolean
+ */
+static int MQTTClient_isRunThread(void)
+{
+	thread_id_type self = Thread_getid();
+	int i;
+
+	for (i = 0; run_ids && i < ioThreads; ++i)
+	{
+		if (run_ids[i] == self)
+			return 1;
+	}
+	for (i = 0; workers && i < callbackThreads; ++i)
+	{
+		if (workers[i].id == self)
+			return 1;
+	}
+	return 0;
+}
+
+
+/**
+ * Hand all the messages queued for a client to the callback workers.  A message goes to the
+ * worker chosen by its client or its topic, so the messages for each client or topic are
+ * delivered in the order they arrived.  Called with the handle locked.
+ * @param m the handle
+ */
+static void MQTTClient_dispatch(MQTTClients* m)
+{
+	Thread_lock_mutex(mqttclient_mutex);
+	m->users += m->c->messageQueue->count; /* each worker unpins the handle once its message is delivered */
+	Thread_unlock_mutex(mqttclient_mutex);
+	while (m->c->messageQueue->count > 0)
+	{
+		qEntry* qe = (qEntry*)(m->c->messageQueue->first->content);
+		unsigned long key = 0L;
+		callbackWorker* w = NULL;
+
+		ListDetach(m->c->messageQueue, qe);
+		if (callbackOrder == MQTTCLIENT_ORDER_TOPIC)
+		{
+			char* p = qe->topicName;
+
+			while (*p)
+				key = key * 31 + (unsigned char)*p++;
+		}
+		else
+			key = (unsigned long)(size_t)m >> 4;
+		w = &workers[key % callbackThreads];
+		qe->handle = m;
+
+		Thread_lock_mutex(w->mutex);
+		ListAppend(w->queue, qe, sizeof(qEntry));
+		if (w->queue->count == 1)
+			Thread_signal_cond(w->cond); /* the worker only waits when it has nothing to do */
+		Thread_unlock_mutex(w->mutex);
+	}
+}
+
+
+/**
+ * Call messageArrived for a message on a callback worker.  If the application refuses the
+ * message, it is offered again, holding up the messages behind it, until it is accepted or
+ * the client is disconnected.
+ * @param qe the message
+ */
+static void MQTTClient_deliver(qEntry* qe)
+{
+	MQTTClients* m = qe->handle;
+	char* topicName = qe->topicName;
+	int topicLen = qe->topicLen;
+	void* payload_ptr = (qe->buffer) ? NULL : qe->msg.payload; /* saved so we can unlink it after a successful
+												messageArrived call, because it is held in a structure which might be freed */
+
+	FUNC_ENTRY;
+	if (strlen(topicName) == topicLen)
+		topicLen = 0;
+	while (1)
+	{
+		int connected = 0;
+
+		if ((*(m->ma))(m->context, topicName, topicLen, &qe->msg))
+		{
+			Heap_unlink(__FILE__, __LINE__, topicName);
+			if (payload_ptr)
+				Heap_unlink(__FILE__, __LINE__, payload_ptr);
+			Heap_unlink(__FILE__, __LINE__, qe);
+			break;
+		}
+		Thread_lock_mutex(m->mutex);
+		if (m->c->connected)
+		{
+			Log(TRACE_MIN, -1, "False returned from messageArrived for client %s, message will be retried", m->c->clientID);
+			/* nothing says when the application will take the message, so it is offered again after
+			 * a while, but the client's condition is signalled by a disconnect, which ends the wait */
+			Thread_wait_cond(m->cond, m->mutex, 100L);
+		}
+		connected = m->c->connected;
+		Thread_unlock_mutex(m->mutex);
+		if (!connected)
+		{
+			Log(TRACE_MIN, -1, "False returned from messageArrived for client %s, which is disconnected, message discarded",
+				m->c->clientID);
+			MQTTClient_freeEntryData(qe);
+			free(qe);
+			break;
+		}
+	}
+	MQTTClient_unpin(m);
+	FUNC_EXIT;
+}
+
+
+/* The thread function of a callback worker, which calls messageArrived for the messages given to it in
+ * turn.  n is the number of the worker.  When stopped, a worker finishes the messages it has first */
+thread_return_type WINAPI MQTTClient_callbackWorker(void* n)
+{
+	callbackWorker* w = &workers[(int)(size_t)n];
+
+	FUNC_ENTRY;
+	Thread_lock_mutex(mqttclient_mutex);
+	w->id = Thread_getid();
+	Thread_unlock_mutex(mqttclient_mutex);
+
+	Thread_lock_mutex(w->mutex);
+	while (w->queue->count > 0 || !w->stop)
+	{
+		qEntry* qe = NULL;
+
+		if (w->queue->count == 0)
+		{
+			Thread_wait_cond(w->cond, w->mutex, 1000L);
+			continue;
+		}
+		qe = (qEntry*)(w->queue->first->content);
+		ListDetach(w->queue, qe);
+		Thread_unlock_mutex(w->mutex);
+		MQTTClient_deliver(qe);
+		Thread_lock_mutex(w->mutex);
+	}
+	Thread_unlock_mutex(w->mutex);
+
+	Thread_lock_mutex(mqttclient_mutex);
+	w->id = 0;
+	--running;
+	Thread_signal_cond(run_cond);
+	Thread_unlock_mutex(mqttclient_mutex);
+	FUNC_EXIT;
+	return 0;
+}
+
+
+/* This is the thread function that handles the calling of callback functions if set.  There is one
+ * for each socket shard, and n is the number of the shard whose sockets it reads and writes */
+thread_return_type WINAPI MQTTClient_run(void* n)
+{
+	int shard = (int)(size_t)n;
+	long timeout = 10L; /* first time in we have a small timeout.  Gets things started more quickly */
+
+	FUNC_ENTRY;
+	Thread_lock_mutex(mqttclient_mutex);
+	run_ids[shard] = Thread_getid();
+	Thread_unlock_mutex(mqttclient_mutex);
+
+	while (!MQTTClient_stopping())
+	{
+		int rc = SOCKET_ERROR;
+		int sock = -1;
+		MQTTClients* m = NULL;
+		MQTTPacket* pack = NULL;
+
+		pack = MQTTClient_cycle(shard, &sock, timeout, &rc);
+		if (MQTTClient_stopping())
+			break;
+		timeout = 1000L;
+
+		/* find client corresponding to socket */
+		if ((m = MQTTClient_pin(sock)) == NULL)
+		{
+			/* assert: should not happen */
+			continue;
+		}
+		if (rc == SOCKET_ERROR)
+			MQTTClient_disconnect_internal(m, 0);
+		else
+		{
+			Thread_lock_mutex(m->mutex);
+			if (m->ma == NULL)
+				; /* the application takes this client's messages with MQTTClient_receive */
+			else if (workers)
+				MQTTClient_dispatch(m);
+			/* deliver everything queued, unless the application refuses a message */
+			else while (m->c->messageQueue->count > 0)
+			{
+				qEntry* qe = (qEntry*)(m->c->messageQueue->first->content);
+				int topicLen = qe->topicLen;
+				char* topicName = qe->topicName;
+				void* payload_ptr = (qe->buffer) ? NULL : qe->msg.payload; /* saved so we can unlink it after a successful
+												messageArrived call, because it is held in a structure which might be freed */
+
+				if (strlen(qe->topicName) == topicLen)
+					topicLen = 0;
+
+				Log(TRACE_MIN, -1, "Calling messageArrived for client %s, queue depth %d",
+					m->c->clientID, m->c->messageQueue->count);
+				Thread_unlock_mutex(m->mutex);
+				rc = (*(m->ma))(m->context, topicName, topicLen, &qe->msg);
+				Thread_lock_mutex(m->mutex);
+				/* if 0 (false) is returned by the callback then it failed, so we don't remove the message from
+				 * the queue, and it will be retried later.  If 1 is returned then the message data may have been freed,
+				 * so we must be careful how we use it.
+				 */
+				if (rc)
+				{
+					Heap_unlink(__FILE__, __LINE__, topicName);
+					if (payload_ptr)
+						Heap_unlink(__FILE__, __LINE__, payload_ptr);
+					Heap_unlink(__FILE__, __LINE__, qe);
+					ListDetach(m->c->messageQueue, qe);
+				}
+				else
+				{
+					Log(TRACE_MIN, -1, "False returned from messageArrived for client %s, message remains on queue",
+						m->c->clientID);
+					break;
+				}
+			}
+			MQTTClient_handOver(m, pack);
+			Thread_unlock_mutex(m->mutex);
+		}
+		MQTTClient_unpin(m);
+	}
+	Thread_lock_mutex(mqttclient_mutex);
+	run_ids[shard] = 0;
+	--running;
+	Thread_signal_cond(run_cond);
+	Thread_unlock_mutex(mqttclient_mutex);
+	FUNC_EXIT;
+	return 0;
+}
+
+
+void MQTTClient_stop()
+{
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if (running > 0 && tostop == 0 && !MQTTClient_isRunThread())
+	{
+		int conn_count = 0;
+		ListElement* current = NULL;
+
+		if (handles != NULL)
+		{
+			/* find out how many handles are still connected */
+			while (ListNextElement(handles, &current))
+			{
+				if (((MQTTClients*)(current->content))->c->connect_state > 0 ||
+						((MQTTClients*)(current->content))->c->connected)
+					++conn_count;
+			}
+		}
+		Log(TRACE_MIN, -1, "Conn_count is %d", conn_count);
+		/* stop the background threads, if we are the last one to be using them */
+		if (conn_count == 0)
+		{
+			int count = 0, i;
+
+			tostop = 1;
+			for (i = 0; workers && i < callbackThreads; ++i)
+			{
+				Thread_lock_mutex(workers[i].mutex);
+				workers[i].stop = 1;
+				Thread_signal_cond(workers[i].cond);
+				Thread_unlock_mutex(workers[i].mutex);
+			}
+			while (running && ++count < 100)
+			{
+				Log(TRACE_MIN, -1, "waiting for %d background threads to stop", running);
+				Thread_wait_cond(run_cond, mqttclient_mutex, 100L);
+			}
+			if (running == 0)
+			{
+				/* they have finished with mqttclient_mutex, so can be joined while it is held */
+				for (i = 0; i < ioThreads; ++i)
+					Thread_join(run_threads[i]);
+				for (i = 0; workers && i < callbackThreads; ++i)
+					Thread_join(workers[i].thread);
+				rc = 1;
+			}
+			else
+				Log(LOG_ERROR, -1, "%d background threads did not stop", running);
+			tostop = 0;
+		}
+	}
+	FUNC_EXIT_RC(rc);
+}
+
+
+int MQTTClient_setCallbacks(MQTTClient handle, void* context, MQTTClient_connectionLost* cl,
+														MQTTClient_messageArrived* ma, MQTTClient_deliveryComplete* dc)
+{
+	int rc = MQTTCLIENT_SUCCESS;
+	MQTTClients* m = handle;
+
+	FUNC_ENTRY;
+	if (m == NULL || ma == NULL)
+	{
+		rc = MQTTCLIENT_FAILURE;
+		goto exit;
+	}
+	Thread_lock_mutex(m->mutex);
+
+	if (m->c->connect_state != 0)
+		rc = MQTTCLIENT_FAILURE;
+	else
+	{
+		m->context = context;
+		m->cl = cl;
+		m->ma = ma;
+		m->dc = dc;
+	}
+
+	Thread_unlock_mutex(m->mutex);
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+void MQTTProtocol_closeSession(Clients* client, int sendwill)
+{
 	FUNC_ENTRY;
 	client->good = 0;
 	if (client->socket > 0)
@@ -621,7 +1264,9 @@ int MQTTClient_cleanSession(Clients* client)
 	rc = MQTTPersistence_clear(client);
 #endif
 	MQTTProtocol_emptyMessageList(client->inboundMsgs);
+	MQTTProtocol_reindexInbound(client);
 	MQTTProtocol_emptyMessageList(client->outboundMsgs);
+	MQTTProtocol_reindexOutbound(client);
 	MQTTClient_emptyMessageQueue(client);
 	client->msgID = 0;
 	FUNC_EXIT_RC(rc);
@@ -636,19 +1281,24 @@ void Protocol_processPublication(Publish* publish, Clients* client)
 
 	FUNC_ENTRY;
 	qe = malloc(sizeof(qEntry));
-	mm = malloc(sizeof(MQTTClient_message));
-
-	qe->msg = mm;
+	mm = &qe->msg;
+	memcpy(mm->struct_id, "MQTM", 4);
+	mm->struct_version = 0;
 
 	qe->topicName = publish->topic;
 	qe->topicLen = publish->topiclen;
 	publish->topic = NULL;
 
 	/* If the message is QoS 2, then we have already stored the incoming payload
-	 * in an allocated buffer, so we don't need to copy again.
+	 * in an allocated buffer, so we don't need to copy again.  Otherwise the payload
+	 * is still in the socket's input buffer, which the message keeps hold of until it
+	 * is freed, rather than having the payload copied out.
 	 */
+	qe->buffer = NULL;
 	if (publish->header.bits.qos == 2)
 		mm->payload = publish->payload;
+	else if ((qe->buffer = SocketBuffer_hold(client->socket, publish->payload)) != NULL)
+		mm->payload = publish->payload;
 	else
 	{
 		mm->payload = malloc(publish->payloadlen);
@@ -664,7 +1314,7 @@ void Protocol_processPublication(Publish* publish, Clients* client)
 		mm->dup = publish->header.bits.dup;
 	mm->msgid = publish->msgId;
 
-	ListAppend(client->messageQueue, qe, sizeof(qe) + sizeof(mm) + mm->payloadlen + strlen(qe->topicName)+1);
+	ListAppend(client->messageQueue, qe, sizeof(qEntry) + mm->payloadlen + strlen(qe->topicName)+1);
 	FUNC_EXIT;
 }
 
@@ -677,7 +1327,7 @@ int MQTTClient_connect(MQTTClient handle, MQTTClient_connectOptions* options)
 	long millisecsTimeout = 30000L;
 
 	FUNC_ENTRY;
-	Thread_lock_mutex(mqttclient_mutex);
+	Thread_lock_mutex(m->mutex);
 
 	if (options == NULL)
 	{
@@ -685,7 +1335,7 @@ int MQTTClient_connect(MQTTClient handle, MQTTClient_connectOptions* options)
 		goto exit;
 	}
 
-	if (strncmp(options->struct_id, "MQTC", 4) != 0 || options->struct_version != 0)
+	if (strncmp(options->struct_id, "MQTC", 4) != 0 || (options->struct_version != 0 && options->struct_version != 1))
 	{
 		rc = MQTTCLIENT_BAD_STRUCTURE;
 		goto exit;
@@ -709,20 +1359,29 @@ int MQTTClient_connect(MQTTClient handle, MQTTClient_connectOptions* options)
 
 	millisecsTimeout = options->connectTimeout * 1000;
 	start = MQTTClient_start_clock();
+	Thread_lock_mutex(mqttclient_mutex);
 	if (m->ma && !running)
 	{
-		Thread_start(MQTTClient_run, handle);
-		if (MQTTClient_elapsed(start) >= millisecsTimeout)
+		int i;
+
+		running = ioThreads + callbackThreads; /* so that a concurrent connect doesn't start more threads */
+		for (i = 0; i < ioThreads; ++i)
+			run_threads[i] = Thread_start(MQTTClient_run, (void*)(size_t)i);
+		for (i = 0; i < callbackThreads; ++i)
 		{
-			rc = SOCKET_ERROR;
-			goto exit;
+			workers[i].stop = 0;
+			workers[i].thread = Thread_start(MQTTClient_callbackWorker, (void*)(size_t)i);
 		}
-		MQTTClient_sleep(100L);
+		Thread_unlock_mutex(mqttclient_mutex);
 	}
+	else
+		Thread_unlock_mutex(mqttclient_mutex);
 
 	m->c->keepAliveInterval = options->keepAliveInterval;
 	m->c->cleansession = options->cleansession;
 	m->c->maxInflightMessages = (options->reliable) ? 1 : 10;
+	if (options->struct_version >= 1 && options->maxInflight > 0)
+		m->c->maxInflightMessages = (options->maxInflight > MAX_MSG_ID) ? MAX_MSG_ID : options->maxInflight;
 
 	if (options->will && options->will->struct_version == 0)
 	{
@@ -749,9 +1408,9 @@ int MQTTClient_connect(MQTTClient handle, MQTTClient_connectOptions* options)
 
 	if (m->c->connect_state == 1)
 	{
-		Thread_unlock_mutex(mqttclient_mutex);
+		Thread_unlock_mutex(m->mutex);
 		MQTTClient_waitfor(handle, CONNECT, &rc, millisecsTimeout - MQTTClient_elapsed(start));
-		Thread_lock_mutex(mqttclient_mutex);
+		Thread_lock_mutex(m->mutex);
 		if (rc != 0)
 		{
 			rc = SOCKET_ERROR;
@@ -770,9 +1429,9 @@ int MQTTClient_connect(MQTTClient handle, MQTTClient_connectOptions* options)
 	{
 		MQTTPacket* pack = NULL;
 
-		Thread_unlock_mutex(mqttclient_mutex);
+		Thread_unlock_mutex(m->mutex);
 		pack = MQTTClient_waitfor(handle, CONNACK, &rc, millisecsTimeout - MQTTClient_elapsed(start));
-		Thread_lock_mutex(mqttclient_mutex);
+		Thread_lock_mutex(m->mutex);
 		if (pack == NULL)
 			rc = SOCKET_ERROR;
 		else
@@ -795,7 +1454,7 @@ int MQTTClient_connect(MQTTClient handle, MQTTClient_connectOptions* options)
 						Messages* m = (Messages*)(outcurrent->content);
 						m->lastTouch = 0;
 					}
-					MQTTProtocol_retry(m->c->lastContact, 1);
+					MQTTProtocol_retry(m->c->lastContact, m->c, 1);
 					if (m->c->connected != 1)
 						rc = MQTTCLIENT_DISCONNECTED;
 				}
@@ -807,9 +1466,9 @@ int MQTTClient_connect(MQTTClient handle, MQTTClient_connectOptions* options)
 
 	if (rc == SOCKET_ERROR || rc == MQTTCLIENT_PERSISTENCE_ERROR)
 	{
-		Thread_unlock_mutex(mqttclient_mutex);
+		Thread_unlock_mutex(m->mutex);
 		MQTTClient_disconnect(handle, 0); /* not "internal" because we don't want to call connection lost */
-		Thread_lock_mutex(mqttclient_mutex);
+		Thread_lock_mutex(m->mutex);
 	}
 
 exit:
@@ -818,7 +1477,7 @@ exit:
 		free(m->c->will);
 		m->c->will = NULL;
 	}
-	Thread_unlock_mutex(mqttclient_mutex);
+	Thread_unlock_mutex(m->mutex);
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
@@ -832,31 +1491,32 @@ int MQTTClient_disconnect1(MQTTClient handle, int timeout, int internal)
 	int was_connected = 0;
 
 	FUNC_ENTRY;
-	Thread_lock_mutex(mqttclient_mutex);
-
 	if (m == NULL || m->c == NULL)
 	{
 		rc = MQTTCLIENT_FAILURE;
 		goto exit;
 	}
+	Thread_lock_mutex(m->mutex);
 	if (m->c->connected == 0)
 	{
 		rc = MQTTCLIENT_DISCONNECTED;
-		goto exit;
+		goto unlock;
 	}
 	was_connected = m->c->connected; /* should be 1 */
 	start = MQTTClient_start_clock();
 	m->c->connect_state = -2; /* indicate disconnecting */
-	while (m->c->inboundMsgs->count > 0 || m->c->outboundMsgs->count > 0)
-	{	/* wait for all inflight message flows to finish, up to timeout */
-		if (MQTTClient_elapsed(start) >= timeout)
+	while (m->c->inboundMsgs->count > 0 || m->c->outboundMsgs->count > 0 ||
+			!Socket_noPendingWrites(m->c->socket))
+	{	/* wait for all inflight message flows to finish, and queued output to be written, up to timeout */
+		long elapsed = MQTTClient_elapsed(start);
+
+		if (elapsed >= timeout)
 			break;
-		Thread_unlock_mutex(mqttclient_mutex);
-		MQTTClient_yield();
-		Thread_lock_mutex(mqttclient_mutex);
+		MQTTClient_waitEvent(m, timeout - elapsed);
 	}
 
 	MQTTProtocol_closeSession(m->c, 0);
+	Thread_signal_cond(m->cond);
 
 	if (Thread_check_sem(m->connect_sem))
 		Thread_post_sem(m->connect_sem);
@@ -867,14 +1527,17 @@ int MQTTClient_disconnect1(MQTTClient handle, int timeout, int internal)
 	if (Thread_check_sem(m->unsuback_sem))
 		Thread_post_sem(m->unsuback_sem);
 
+unlock:
+	Thread_unlock_mutex(m->mutex);
 exit:
+	Thread_lock_mutex(mqttclient_mutex);
 	MQTTClient_stop();
-	if (internal && m->cl && was_connected)
+	Thread_unlock_mutex(mqttclient_mutex);
+	if (internal && was_connected && m->cl)
 	{
 		Log(TRACE_MIN, -1, "Calling connectionLost for client %s", m->c->clientID);
 		Thread_start(connectionLost_call, m);
 	}
-	Thread_unlock_mutex(mqttclient_mutex);
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
@@ -898,10 +1561,12 @@ int MQTTClient_isConnected(MQTTClient handle)
 	int rc = 0;
 
 	FUNC_ENTRY;
-	Thread_lock_mutex(mqttclient_mutex);
 	if (m && m->c)
+	{
+		Thread_lock_mutex(m->mutex);
 		rc = m->c->connected;
-	Thread_unlock_mutex(mqttclient_mutex);
+		Thread_unlock_mutex(m->mutex);
+	}
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
@@ -916,24 +1581,24 @@ int MQTTClient_subscribeMany(MQTTClient handle, int count, char** topic, int* qo
 	int rc = MQTTCLIENT_FAILURE;
 
 	FUNC_ENTRY;
-	Thread_lock_mutex(mqttclient_mutex);
-
 	if (m == NULL || m->c == NULL)
 	{
 		rc = MQTTCLIENT_FAILURE;
 		goto exit;
 	}
+	Thread_lock_mutex(m->mutex);
+
 	if (m->c->connected == 0)
 	{
 		rc = MQTTCLIENT_DISCONNECTED;
-		goto exit;
+		goto unlock;
 	}
 	for (i = 0; i < count; i++)
 	{
 		if (!UTF8_validateString(topic[i]))
 		{
 			rc = MQTTCLIENT_BAD_UTF8_STRING;
-			goto exit;
+			goto unlock;
 		}
 	}
 
@@ -950,9 +1615,9 @@ int MQTTClient_subscribeMany(MQTTClient handle, int count, char** topic, int* qo
 	{
 		MQTTPacket* pack = NULL;
 
-		Thread_unlock_mutex(mqttclient_mutex);
+		Thread_unlock_mutex(m->mutex);
 		pack = MQTTClient_waitfor(handle, SUBACK, &rc, 10000L);
-		Thread_lock_mutex(mqttclient_mutex);
+		Thread_lock_mutex(m->mutex);
 		if (pack != NULL)
 		{
 			rc = MQTTProtocol_handleSubacks(pack, m->c->socket);
@@ -964,15 +1629,16 @@ int MQTTClient_subscribeMany(MQTTClient handle, int count, char** topic, int* qo
 
 	if (rc == SOCKET_ERROR)
 	{
-		Thread_unlock_mutex(mqttclient_mutex);
+		Thread_unlock_mutex(m->mutex);
 		MQTTClient_disconnect_internal(handle, 0);
-		Thread_lock_mutex(mqttclient_mutex);
+		Thread_lock_mutex(m->mutex);
 	}
 	else if (rc == TCPSOCKET_COMPLETE)
 		rc = MQTTCLIENT_SUCCESS;
 
+unlock:
+	Thread_unlock_mutex(m->mutex);
 exit:
-	Thread_unlock_mutex(mqttclient_mutex);
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
@@ -997,17 +1663,17 @@ int MQTTClient_unsubscribeMany(MQTTClient handle, int count, char** topic)
 	int rc = SOCKET_ERROR;
 
 	FUNC_ENTRY;
-	Thread_lock_mutex(mqttclient_mutex);
-
 	if (m == NULL || m->c == NULL)
 	{
 		rc = MQTTCLIENT_FAILURE;
 		goto exit;
 	}
+	Thread_lock_mutex(m->mutex);
+
 	if (m->c->connected == 0)
 	{
 		rc = MQTTCLIENT_DISCONNECTED;
-		goto exit;
+		goto unlock;
 	}
 
 	for (i = 0; i < count; i++)
@@ -1015,7 +1681,7 @@ int MQTTClient_unsubscribeMany(MQTTClient handle, int count, char** topic)
 		if (!UTF8_validateString(topic[i]))
 		{
 			rc = MQTTCLIENT_BAD_UTF8_STRING;
-			goto exit;
+			goto unlock;
 		}
 	}
 
@@ -1028,9 +1694,9 @@ int MQTTClient_unsubscribeMany(MQTTClient handle, int count, char** topic)
 	{
 		MQTTPacket* pack = NULL;
 
-		Thread_unlock_mutex(mqttclient_mutex);
+		Thread_unlock_mutex(m->mutex);
 		pack = MQTTClient_waitfor(handle, UNSUBACK, &rc, 10000L);
-		Thread_lock_mutex(mqttclient_mutex);
+		Thread_lock_mutex(m->mutex);
 		if (pack != NULL)
 		{
 			rc = MQTTProtocol_handleUnsubacks(pack, m->c->socket);
@@ -1042,13 +1708,14 @@ int MQTTClient_unsubscribeMany(MQTTClient handle, int count, char** topic)
 
 	if (rc == SOCKET_ERROR)
 	{
-		Thread_unlock_mutex(mqttclient_mutex);
+		Thread_unlock_mutex(m->mutex);
 		MQTTClient_disconnect_internal(handle, 0);
-		Thread_lock_mutex(mqttclient_mutex);
+		Thread_lock_mutex(m->mutex);
 	}
 
+unlock:
+	Thread_unlock_mutex(m->mutex);
 exit:
-	Thread_unlock_mutex(mqttclient_mutex);
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
@@ -1058,53 +1725,140 @@ int MQTTClient_unsubscribe(MQTTClient handle, char* topic)
 {
 	int rc = 0;
 
-	FUNC_ENTRY;
-	rc = MQTTClient_unsubscribeMany(handle, 1, &topic);
+	FUNC_ENTRY;
+	rc = MQTTClient_unsubscribeMany(handle, 1, &topic);
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+int MQTTClient_publish(MQTTClient handle, char* topicName, int payloadlen, void* payload,
+							 int qos, int retained, MQTTClient_deliveryToken* deliveryToken)
+{
+	int rc = MQTTCLIENT_SUCCESS;
+	MQTTClients* m = handle;
+	Messages* msg = NULL;
+	Publish* p = NULL;
+	int blocked = 0;
+
+	FUNC_ENTRY;
+	if (m == NULL || m->c == NULL)
+	{
+		rc = MQTTCLIENT_FAILURE;
+		goto exit;
+	}
+	Thread_lock_mutex(m->mutex);
+
+	if (m->c->connected == 0)
+		rc = MQTTCLIENT_DISCONNECTED;
+	else if (!UTF8_validateString(topicName))
+		rc = MQTTCLIENT_BAD_UTF8_STRING;
+	if (rc != MQTTCLIENT_SUCCESS)
+		goto unlock;
+
+	/* If outbound queue is full, or the socket has too much output queued, block until it is not */
+	while (m->c->outboundMsgs->count >= m->c->maxInflightMessages || Socket_outputFull(m->c->socket))
+	{
+		if (blocked == 0)
+		{
+			blocked = 1;
+			Log(TRACE_MIN, -1, "Blocking publish on queue full for client %s", m->c->clientID);
+		}
+		MQTTClient_waitEvent(m, 1000L);
+		if (m->c->connected == 0)
+		{
+			rc = MQTTCLIENT_FAILURE;
+			goto unlock;
+		}
+	}
+	if (blocked == 1)
+		Log(TRACE_MIN, -1, "Resuming publish now queue not full for client %s", m->c->clientID);
+
+	p = malloc(sizeof(Publish));
+
+	p->payload = payload;
+	p->payloadlen = payloadlen;
+	p->topic = topicName;
+	p->msgId = -1;
+
+	/* whatever of the packet could not be written straight away has been copied to the socket's
+	 * output queue, so there is no need to wait for it here */
+	rc = MQTTProtocol_startPublish(m->c, p, qos, retained, &msg);
+
+	if (deliveryToken && qos > 0)
+		*deliveryToken = msg->msgid;
+
+	free(p);
+
+	if (rc == SOCKET_ERROR)
+	{
+		Thread_unlock_mutex(m->mutex);
+		MQTTClient_disconnect_internal(handle, 0);
+		Thread_lock_mutex(m->mutex);
+		/* Return success for qos > 0 as the send will be retried automatically */
+		rc = (qos > 0) ? MQTTCLIENT_SUCCESS : MQTTCLIENT_FAILURE;
+	}
+
+unlock:
+	Thread_unlock_mutex(m->mutex);
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+
+int MQTTClient_publishMessage(MQTTClient handle, char* topicName, MQTTClient_message* message,
+															 MQTTClient_deliveryToken* deliveryToken)
+{
+	int rc = MQTTCLIENT_SUCCESS;
+
+	FUNC_ENTRY;
+	if (message == NULL)
+	{
+		rc = MQTTCLIENT_NULL_PARAMETER;
+		goto exit;
+	}
+
+	if (strncmp(message->struct_id, "MQTM", 4) != 0 || message->struct_version != 0)
+	{
+		rc = MQTTCLIENT_BAD_STRUCTURE;
+		goto exit;
+	}
+
+	rc = MQTTClient_publish(handle, topicName, message->payloadlen, message->payload,
+								message->qos, message->retained, deliveryToken);
+exit:
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
 
 
-int MQTTClient_publish(MQTTClient handle, char* topicName, int payloadlen, void* payload,
+int MQTTClient_publishAsync(MQTTClient handle, char* topicName, int payloadlen, void* payload,
 							 int qos, int retained, MQTTClient_deliveryToken* deliveryToken)
 {
 	int rc = MQTTCLIENT_SUCCESS;
 	MQTTClients* m = handle;
 	Messages* msg = NULL;
 	Publish* p = NULL;
-	int blocked = 0;
 
 	FUNC_ENTRY;
-	Thread_lock_mutex(mqttclient_mutex);
-
 	if (m == NULL || m->c == NULL)
+	{
 		rc = MQTTCLIENT_FAILURE;
-	else if (m->c->connected == 0)
+		goto exit;
+	}
+	Thread_lock_mutex(m->mutex);
+
+	if (m->c->connected == 0)
 		rc = MQTTCLIENT_DISCONNECTED;
 	else if (!UTF8_validateString(topicName))
 		rc = MQTTCLIENT_BAD_UTF8_STRING;
+	else if ((qos > 0 && m->c->outboundMsgs->count >= m->c->maxInflightMessages) ||
+			Socket_outputFull(m->c->socket))
+		rc = MQTTCLIENT_WOULD_BLOCK;
 	if (rc != MQTTCLIENT_SUCCESS)
-		goto exit;
-
-	/* If outbound queue is full, block until it is not */
-	while (m->c->outboundMsgs->count >= m->c->maxInflightMessages)
-	{
-		if (blocked == 0)
-		{
-			blocked = 1;
-			Log(TRACE_MIN, -1, "Blocking publish on queue full for client %s", m->c->clientID);
-		}
-		Thread_unlock_mutex(mqttclient_mutex);
-		MQTTClient_yield();
-		Thread_lock_mutex(mqttclient_mutex);
-		if (m->c->connected == 0)
-		{
-			rc = MQTTCLIENT_FAILURE;
-			goto exit;
-		}
-	}
-	if (blocked == 1)
-		Log(TRACE_MIN, -1, "Resuming publish now queue not full for client %s", m->c->clientID);
+		goto unlock;
 
 	p = malloc(sizeof(Publish));
 
@@ -1115,22 +1869,6 @@ int MQTTClient_publish(MQTTClient handle, char* topicName, int payloadlen, void*
 
 	rc = MQTTProtocol_startPublish(m->c, p, qos, retained, &msg);
 
-	/* If the packet was partially written to the socket, wait for it to complete.
-	 * However, if the client is disconnected during this time and qos is not 0, still return success, as
-	 * the packet has already been written to persistence and assigned a message id so will
-	 * be sent when the client next connects.
-	 */
-	if (rc == TCPSOCKET_INTERRUPTED)
-	{
-		while (m->c->connected == 1 && SocketBuffer_getWrite(m->c->socket))
-		{
-			Thread_unlock_mutex(mqttclient_mutex);
-			MQTTClient_yield();
-			Thread_lock_mutex(mqttclient_mutex);
-		}
-		rc = (qos > 0 || m->c->connected == 1) ? MQTTCLIENT_SUCCESS : MQTTCLIENT_FAILURE;
-	}
-
 	if (deliveryToken && qos > 0)
 		*deliveryToken = msg->msgid;
 
@@ -1138,41 +1876,117 @@ int MQTTClient_publish(MQTTClient handle, char* topicName, int payloadlen, void*
 
 	if (rc == SOCKET_ERROR)
 	{
-		Thread_unlock_mutex(mqttclient_mutex);
+		Thread_unlock_mutex(m->mutex);
 		MQTTClient_disconnect_internal(handle, 0);
-		Thread_lock_mutex(mqttclient_mutex);
+		Thread_lock_mutex(m->mutex);
 		/* Return success for qos > 0 as the send will be retried automatically */
 		rc = (qos > 0) ? MQTTCLIENT_SUCCESS : MQTTCLIENT_FAILURE;
 	}
 
+unlock:
+	Thread_unlock_mutex(m->mutex);
 exit:
-	Thread_unlock_mutex(mqttclient_mutex);
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
 
 
-
-int MQTTClient_publishMessage(MQTTClient handle, char* topicName, MQTTClient_message* message,
-															 MQTTClient_deliveryToken* deliveryToken)
+int MQTTClient_publishMany(MQTTClient handle, int count, char** topics, void** payloads, int* payloadlens,
+							 int* qoss, MQTTClient_deliveryToken* deliveryTokens)
 {
 	int rc = MQTTCLIENT_SUCCESS;
+	MQTTClients* m = handle;
+	Messages** msgs = NULL;
+	Publish* p = NULL;
+	int maxBatch = SOCKET_MAX_BUFFERS / 4;
+	int i = 0, j;
 
 	FUNC_ENTRY;
-	if (message == NULL)
+	if (m == NULL || m->c == NULL)
+	{
+		rc = MQTTCLIENT_FAILURE;
+		goto exit;
+	}
+	if (count < 0 || (count > 0 && (topics == NULL || payloads == NULL || payloadlens == NULL || qoss == NULL)))
 	{
 		rc = MQTTCLIENT_NULL_PARAMETER;
 		goto exit;
 	}
+	Thread_lock_mutex(m->mutex);
 
-	if (strncmp(message->struct_id, "MQTM", 4) != 0 || message->struct_version != 0)
+	if (m->c->connected == 0)
+		rc = MQTTCLIENT_DISCONNECTED;
+	for (j = 0; j < count && rc == MQTTCLIENT_SUCCESS; ++j)
 	{
-		rc = MQTTCLIENT_BAD_STRUCTURE;
-		goto exit;
+		if (!UTF8_validateString(topics[j]))
+			rc = MQTTCLIENT_BAD_UTF8_STRING;
 	}
+	if (rc != MQTTCLIENT_SUCCESS)
+		goto unlock;
 
-	rc = MQTTClient_publish(handle, topicName, message->payloadlen, message->payload,
-								message->qos, message->retained, deliveryToken);
+	if (count < maxBatch)
+		maxBatch = count;
+	p = malloc(sizeof(Publish) * (maxBatch + 1));
+	msgs = malloc(sizeof(Messages*) * (maxBatch + 1));
+
+	while (i < count)
+	{
+		int n = 0, inflight;
+
+		/* wait for earlier output to drop below the high-water mark and for room in the in-flight window */
+		while (m->c->connected == 1 && (Socket_outputFull(m->c->socket) ||
+				(qoss[i] > 0 && m->c->outboundMsgs->count >= m->c->maxInflightMessages)))
+		{
+			MQTTClient_waitEvent(m, 1000L);
+		}
+		if (m->c->connected == 0)
+		{
+			rc = MQTTCLIENT_FAILURE;
+			break;
+		}
+
+		inflight = m->c->outboundMsgs->count;
+		while (i + n < count && n < maxBatch && (qoss[i + n] == 0 || inflight < m->c->maxInflightMessages))
+		{
+			if (qoss[i + n] > 0)
+				++inflight;
+			p[n].payload = payloads[i + n];
+			p[n].payloadlen = payloadlens[i + n];
+			p[n].topic = topics[i + n];
+			p[n].msgId = -1;
+			++n;
+		}
+
+		rc = MQTTProtocol_startPublishes(m->c, n, p, &qoss[i], msgs);
+
+		if (deliveryTokens)
+		{
+			for (j = 0; j < n; ++j)
+				deliveryTokens[i + j] = (qoss[i + j] > 0) ? msgs[j]->msgid : 0;
+		}
+		i += n;
+
+		if (rc == SOCKET_ERROR)
+		{
+			int stored = (i == count);
+
+			/* QoS 1 and 2 messages already accepted are sent again when the client reconnects */
+			for (j = i - n; j < i && stored; ++j)
+				stored = (qoss[j] > 0);
+			Thread_unlock_mutex(m->mutex);
+			MQTTClient_disconnect_internal(handle, 0);
+			Thread_lock_mutex(m->mutex);
+			rc = (stored) ? MQTTCLIENT_SUCCESS : MQTTCLIENT_FAILURE;
+			break;
+		}
+		rc = MQTTCLIENT_SUCCESS;
+	}
+
+	free(p);
+	free(msgs);
+
+unlock:
+	Thread_unlock_mutex(m->mutex);
 exit:
 	FUNC_EXIT_RC(rc);
 	return rc;
@@ -1182,25 +1996,156 @@ exit:
 void MQTTClient_retry(void)
 {
 	time_t now;
+	int keepalive = 0;
+	MQTTClients** pinned = NULL;
+	int count = 0;
+	int i;
 
 	FUNC_ENTRY;
 	time(&(now));
-	if (difftime(now, last) > 5)
+	/* take a snapshot of the handles, so that each can be worked on under its own lock */
+	Thread_lock_mutex(mqttclient_mutex);
+	if (handles != NULL && difftime(now, last_retry) >= 1)
+	{
+		ListElement* current = NULL;
+
+		last_retry = now;
+		if (difftime(now, last) > 5)
+		{
+			last = now;
+			keepalive = 1;
+		}
+		pinned = malloc(sizeof(MQTTClients*) * (handles->count + 1));
+		while (ListNextElement(handles, &current))
+		{
+			pinned[count] = (MQTTClients*)(current->content);
+			++(pinned[count++]->users);
+		}
+	}
+	Thread_unlock_mutex(mqttclient_mutex);
+
+	for (i = 0; i < count; ++i)
 	{
-		time(&(last));
-		MQTTProtocol_keepalive(now);
-		MQTTProtocol_retry(now, 1);
+		MQTTClients* m = pinned[i];
+
+		Thread_lock_mutex(m->mutex);
+		if (keepalive)
+			MQTTProtocol_keepalive(now, m->c);
+		MQTTProtocol_retry(now, m->c, keepalive);
+		Thread_unlock_mutex(m->mutex);
+	}
+
+	if (pinned)
+	{
+		Thread_lock_mutex(mqttclient_mutex);
+		for (i = 0; i < count; ++i)
+			MQTTClient_unpin_locked(pinned[i]);
+		Thread_unlock_mutex(mqttclient_mutex);
+		free(pinned);
 	}
-	else
-		MQTTProtocol_retry(now, 0);
 	FUNC_EXIT;
 }
 
 
-MQTTPacket* MQTTClient_cycle(int* sock, unsigned long timeout, int* rc)
+/**
+ * Read one packet from a client's socket, and handle it if it is an acknowledgement or a
+ * publication.  Called with the handle locked.
+ * @param m the handle
+ * @param sock the socket
+ * @param rc the completion code, returned
+ * @param msgid set to the message id of a delivery the packet completed, otherwise left alone
+ * @return the packet if it is one of the others, to be dealt with by the caller, or NULL
+ */
+static MQTTPacket* MQTTClient_readPacket_locked(MQTTClients* m, int sock, int* rc, int* msgid)
+{
+	MQTTPacket* pack = NULL;
+
+	FUNC_ENTRY;
+	if (m->c->connect_state == 1)
+		*rc = 0;  /* waiting for connect state to clear */
+	else
+		pack = MQTTPacket_Factory(sock, rc);
+	if (pack)
+	{
+		int freed = 1;
+
+		/* Note that these handle... functions free the packet structure that they are dealing with */
+		if (pack->header.bits.type == PUBLISH)
+			*rc = MQTTProtocol_handlePublishes(pack, sock);
+		else if (pack->header.bits.type == PUBACK || pack->header.bits.type == PUBCOMP)
+		{
+			*msgid = ((Ack*)pack)->msgId;
+			*rc = (pack->header.bits.type == PUBCOMP) ?
+					MQTTProtocol_handlePubcomps(pack, sock) : MQTTProtocol_handlePubacks(pack, sock);
+		}
+		else if (pack->header.bits.type == PUBREC)
+			*rc = MQTTProtocol_handlePubrecs(pack, sock);
+		else if (pack->header.bits.type == PUBREL)
+			*rc = MQTTProtocol_handlePubrels(pack, sock);
+		else if (pack->header.bits.type == PINGRESP)
+			*rc = MQTTProtocol_handlePingresps(pack, sock);
+		else
+			freed = 0;
+		if (freed)
+		{
+			pack = NULL;
+			Thread_signal_cond(m->cond); /* an in-flight message may have completed */
+		}
+	}
+	FUNC_EXIT_RC(*rc);
+	return pack;
+}
+
+
+/**
+ * Call the deliveryComplete callback of a client, if it has one.  Called without the
+ * handle locked, so that the callback can use the API.
+ * @param m the handle
+ * @param msgid the message id of the completed delivery
+ */
+static void MQTTClient_callDeliveryComplete(MQTTClients* m, int msgid)
+{
+	if (m->dc)
+	{
+		Log(TRACE_MIN, -1, "Calling deliveryComplete for client %s, msgid %d", m->c->clientID, msgid);
+		(*(m->dc))(m->context, msgid);
+	}
+}
+
+
+/**
+ * Read one packet from a socket which is ready, and handle it if it is an acknowledgement
+ * or a publication
+ * @param sock the socket
+ * @param rc the completion code, returned
+ * @return the packet if it is one of the others, to be dealt with by the caller, or NULL
+ */
+static MQTTPacket* MQTTClient_readPacket(int sock, int* rc)
+{
+	MQTTPacket* pack = NULL;
+	MQTTClients* m = NULL;
+	int msgid = -1;
+
+	FUNC_ENTRY;
+	if ((m = MQTTClient_pin(sock)) == NULL)
+		*rc = 0; /* the handle is being destroyed */
+	else
+	{
+		Thread_lock_mutex(m->mutex);
+		pack = MQTTClient_readPacket_locked(m, sock, rc, &msgid);
+		Thread_unlock_mutex(m->mutex);
+		if (msgid != -1)
+			MQTTClient_callDeliveryComplete(m, msgid);
+		MQTTClient_unpin(m);
+	}
+	FUNC_EXIT_RC(*rc);
+	return pack;
+}
+
+
+MQTTPacket* MQTTClient_cycle(int shard, int* sock, unsigned long timeout, int* rc)
 {
 	struct timeval tp = {0L, 0L};
-	static Ack ack;
 	MQTTPacket* pack = NULL;
 
 	FUNC_ENTRY;
@@ -1211,52 +2156,10 @@ MQTTPacket* MQTTClient_cycle(int* sock, unsigned long timeout, int* rc)
 	}
 
 	/* 0 from getReadySocket indicates no work to do, -1 == error, but can happen normally */
-	*sock = Socket_getReadySocket(0, &tp);
-	Thread_lock_mutex(mqttclient_mutex);
+	*sock = Socket_getReadySocket(shard, 0, &tp);
 	if (*sock > 0)
-	{
-		MQTTClients* m = NULL;
-		if (ListFindItem(handles, sock, clientSockCompare) != NULL)
-			m = (MQTTClient)(handles->current->content);
-		if (m != NULL && m->c->connect_state == 1)
-			*rc = 0;  /* waiting for connect state to clear */
-		else
-			pack = MQTTPacket_Factory(*sock, rc);
-		if (pack)
-		{
-			int freed = 1;
-
-			/* Note that these handle... functions free the packet structure that they are dealing with */
-			if (pack->header.bits.type == PUBLISH)
-				*rc = MQTTProtocol_handlePublishes(pack, *sock);
-			else if (pack->header.bits.type == PUBACK || pack->header.bits.type == PUBCOMP)
-			{
-				int msgid;
-
-				ack = (pack->header.bits.type == PUBCOMP) ? *(Pubcomp*)pack : *(Puback*)pack;
-				msgid = ack.msgId;
-				*rc = (pack->header.bits.type == PUBCOMP) ?
-						MQTTProtocol_handlePubcomps(pack, *sock) : MQTTProtocol_handlePubacks(pack, *sock);
-				if (m && m->dc)
-				{
-					Log(TRACE_MIN, -1, "Calling deliveryComplete for client %s, msgid %d", m->c->clientID, msgid);
-					(*(m->dc))(m->context, msgid);
-				}
-			}
-			else if (pack->header.bits.type == PUBREC)
-				*rc = MQTTProtocol_handlePubrecs(pack, *sock);
-			else if (pack->header.bits.type == PUBREL)
-				*rc = MQTTProtocol_handlePubrels(pack, *sock);
-			else if (pack->header.bits.type == PINGRESP)
-				*rc = MQTTProtocol_handlePingresps(pack, *sock);
-			else
-				freed = 0;
-			if (freed)
-				pack = NULL;
-		}
-	}
+		pack = MQTTClient_readPacket(*sock, rc);
 	MQTTClient_retry();
-	Thread_unlock_mutex(mqttclient_mutex);
 	FUNC_EXIT;
 	return pack;
 }
@@ -1275,50 +2178,58 @@ MQTTPacket* MQTTClient_waitfor(MQTTClient handle, int packet_type, int* rc, long
 		goto exit;
 	}
 
-	if (running)
+	if (MQTTClient_isRunning())
 	{
+		if (timeout < 0L)
+			timeout = 0L;
 		if (packet_type == CONNECT)
 		{
-			if ((*rc = Thread_wait_sem(m->connect_sem)) == 0)
+			if ((*rc = Thread_wait_sem(m->connect_sem, timeout)) == 0)
 				*rc = m->rc;
 		}
 		else if (packet_type == CONNACK)
-			*rc = Thread_wait_sem(m->connack_sem);
+			*rc = Thread_wait_sem(m->connack_sem, timeout);
 		else if (packet_type == SUBACK)
-			*rc = Thread_wait_sem(m->suback_sem);
+			*rc = Thread_wait_sem(m->suback_sem, timeout);
 		else if (packet_type == UNSUBACK)
-			*rc = Thread_wait_sem(m->unsuback_sem);
+			*rc = Thread_wait_sem(m->unsuback_sem, timeout);
 		if (*rc == 0 && packet_type != CONNECT && m->pack == NULL)
 			Log(TRACE_MIN, -1, "waitfor unexpectedly is NULL for client %s, packet_type %d", m->c->clientID, packet_type);
 		pack = m->pack;
 	}
 	else
 	{
+		sem_type sem = m->connect_sem;
+		int shard = 0;
+
+		if (packet_type == CONNACK)
+			sem = m->connack_sem;
+		else if (packet_type == SUBACK)
+			sem = m->suback_sem;
+		else if (packet_type == UNSUBACK)
+			sem = m->unsuback_sem;
+		/* whichever thread reads the packet hands it over with the semaphore, as the background threads do */
+		Thread_lock_mutex(m->mutex);
+		shard = MQTTClient_shard(m);
 		*rc = TCPSOCKET_COMPLETE;
-		while (1)
+		while (Thread_wait_sem(sem, 0L) != 0)
 		{
-			int sock = -1;
-			pack = MQTTClient_cycle(&sock, 100L, rc);
-			if (sock == m->c->socket)
-			{
-				if (pack && (pack->header.bits.type == packet_type))
-					break;
-				if (m->c->connect_state == 1)
-				{
-					int error;
-					socklen_t len = sizeof(error);
+			long elapsed = MQTTClient_elapsed(start);
 
-					if ((*rc = getsockopt(m->c->socket, SOL_SOCKET, SO_ERROR, (char*)&error, &len)) == 0)
-					  *rc = error;
-					break;
-				}
-			}
-			else if (MQTTClient_elapsed(start) > timeout)
+			if (elapsed >= timeout || MQTTClient_poll(shard, m, timeout - elapsed) == SOCKET_ERROR)
 			{
-				pack = NULL;
+				*rc = SOCKET_ERROR;
 				break;
 			}
 		}
+		if (*rc == TCPSOCKET_COMPLETE)
+		{
+			if (packet_type == CONNECT)
+				*rc = m->rc;
+			else
+				pack = m->pack;
+		}
+		Thread_unlock_mutex(m->mutex);
 	}
 
 exit:
@@ -1334,6 +2245,7 @@ int MQTTClient_receive(MQTTClient handle, char** topicName, int* topicLen, MQTTC
 	START_TIME_TYPE start = MQTTClient_start_clock();
 	unsigned long elapsed = 0L;
 	MQTTClients* m = handle;
+	int shard = 0;
 
 	FUNC_ENTRY;
 	if (m == NULL || m->c == NULL)
@@ -1341,8 +2253,10 @@ int MQTTClient_receive(MQTTClient handle, char** topicName, int* topicLen, MQTTC
 		rc = MQTTCLIENT_FAILURE;
 		goto exit;
 	}
+	Thread_lock_mutex(m->mutex);
 	if (m->c->connected == 0)
 	{
+		Thread_unlock_mutex(m->mutex);
 		rc = MQTTCLIENT_DISCONNECTED;
 		goto exit;
 	}
@@ -1353,27 +2267,21 @@ int MQTTClient_receive(MQTTClient handle, char** topicName, int* topicLen, MQTTC
 	/* if there is already a message waiting, don't hang around but still do some packet handling */
 	if (m->c->messageQueue->count > 0)
 		timeout = 0L;
+	shard = MQTTClient_shard(m);
 
 	elapsed = MQTTClient_elapsed(start);
 	do
 	{
-		int sock = 0;
-		MQTTClient_cycle(&sock, (timeout > elapsed) ? timeout - elapsed : 0L, &rc);
-
-	
-		if (rc == SOCKET_ERROR)
-		{
-			if (ListFindItem(handles, &sock, clientSockCompare) && 	/* find client corresponding to socket */
-			  (MQTTClient)(handles->current->content) == handle)
-				break; /* there was an error on the socket we are interested in */
-		}
-
+		/* stop if there was an error on the socket we are interested in */
+		if ((rc = MQTTClient_poll(shard, m, (timeout > elapsed) ? timeout - elapsed : 0L)) == SOCKET_ERROR)
+			break;
 		elapsed = MQTTClient_elapsed(start);
 	}
 	while (elapsed < timeout && m->c->messageQueue->count == 0);
 
 	if (m->c->messageQueue->count > 0)
 		rc = MQTTClient_deliverMessage(rc, m, topicName, topicLen, message);
+	Thread_unlock_mutex(m->mutex);
 
 	if (rc == SOCKET_ERROR)
 		MQTTClient_disconnect_internal(handle, 0);
@@ -1384,35 +2292,117 @@ exit:
 }
 
 
-void MQTTClient_yield(void)
+int MQTTClient_receiveMany(MQTTClient handle, int max, char** topicNames, int* topicLens, MQTTClient_message** messages,
+											 int* count, unsigned long timeout)
 {
+	int rc = TCPSOCKET_COMPLETE;
 	START_TIME_TYPE start = MQTTClient_start_clock();
 	unsigned long elapsed = 0L;
-	unsigned long timeout = 100L;
-	int rc = 0;
+	MQTTClients* m = handle;
+	int shard = 0;
+	int sock = 0;
+	int msgid = -1;
+	int truncated = 0;
 
 	FUNC_ENTRY;
-	if (running)
+	if (m == NULL || m->c == NULL || max < 1 || count == NULL)
+	{
+		rc = MQTTCLIENT_FAILURE;
+		goto exit;
+	}
+	*count = 0;
+	Thread_lock_mutex(m->mutex);
+	if (m->c->connected == 0)
 	{
-		MQTTClient_sleep(timeout);
+		Thread_unlock_mutex(m->mutex);
+		rc = MQTTCLIENT_DISCONNECTED;
 		goto exit;
 	}
 
+	/* if there is already a message waiting, don't hang around but still do some packet handling */
+	if (m->c->messageQueue->count > 0)
+		timeout = 0L;
+	shard = MQTTClient_shard(m);
+	sock = m->c->socket;
+
 	elapsed = MQTTClient_elapsed(start);
 	do
 	{
-		int sock = -1;
-		MQTTClient_cycle(&sock, (timeout > elapsed) ? timeout - elapsed : 0L, &rc);
-		if (rc == SOCKET_ERROR && ListFindItem(handles, &sock, clientSockCompare))
+		/* stop if there was an error on the socket we are interested in */
+		if ((rc = MQTTClient_poll(shard, m, (timeout > elapsed) ? timeout - elapsed : 0L)) == SOCKET_ERROR)
+			break;
+		elapsed = MQTTClient_elapsed(start);
+	}
+	while (elapsed < timeout && m->c->messageQueue->count == 0);
+
+	/* carry on reading publications for as long as they are already waiting on the socket,
+	 * without checking its readiness each time, unless another thread is reading the shard.
+	 * The handle stays locked throughout, so the queue can be looked at between packets. */
+	if (rc != SOCKET_ERROR && m->c->messageQueue->count > 0 && MQTTClient_startPolling(shard))
+	{
+		while (rc != SOCKET_ERROR && m->c->messageQueue->count < max && !Socket_outputFull(sock))
 		{
-			MQTTClients* m = (MQTTClient)(handles->current->content);
-			if (m->c->connect_state != -2)
-				MQTTClient_disconnect_internal(m, 0);
+			int queued = m->c->messageQueue->count;
+			MQTTPacket* pack = MQTTClient_readPacket_locked(m, sock, &rc, &msgid);
+
+			if (pack)
+				MQTTClient_handOver(m, pack); /* a connack, suback or unsuback someone is waiting for */
+			if (pack || msgid != -1 || m->c->messageQueue->count == queued)
+				break;
 		}
-		elapsed = MQTTClient_elapsed(start);
+		MQTTClient_stopPolling(shard);
+	}
+
+	while (*count < max && m->c->messageQueue->count > 0)
+	{
+		if (MQTTClient_deliverMessage(MQTTCLIENT_SUCCESS, m, &topicNames[*count], &topicLens[*count],
+				&messages[*count]) == MQTTCLIENT_TOPICNAME_TRUNCATED)
+			truncated = 1;
+		++(*count);
 	}
-	while (elapsed < timeout);
+	Thread_unlock_mutex(m->mutex);
+	if (msgid != -1)
+		MQTTClient_callDeliveryComplete(m, msgid);
+
+	if (rc == SOCKET_ERROR)
+		MQTTClient_disconnect_internal(handle, 0);
+	else if (truncated)
+		rc = MQTTCLIENT_TOPICNAME_TRUNCATED;
+	else
+		rc = MQTTCLIENT_SUCCESS;
+
 exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+void MQTTClient_yield(void)
+{
+	START_TIME_TYPE start = MQTTClient_start_clock();
+	unsigned long elapsed = 0L;
+	unsigned long timeout = 100L;
+
+	FUNC_ENTRY;
+	/* the background threads do the work while they run; if they stop, it is done here */
+	Thread_lock_mutex(mqttclient_mutex);
+	while (running > 0 && elapsed < timeout)
+	{
+		Thread_wait_cond(run_cond, mqttclient_mutex, timeout - elapsed);
+		elapsed = MQTTClient_elapsed(start);
+	}
+	Thread_unlock_mutex(mqttclient_mutex);
+
+	while (elapsed < timeout)
+	{
+		int shard;
+
+		/* only wait on the last shard, having looked at what is ready on the others */
+		for (shard = 0; shard < Socket_shards() - 1; ++shard)
+			MQTTClient_poll(shard, NULL, 0L);
+		MQTTClient_poll(shard, NULL, timeout - elapsed);
+		elapsed = MQTTClient_elapsed(start);
+	}
 	FUNC_EXIT;
 }
 
@@ -1432,41 +2422,40 @@ int MQTTClient_waitForCompletion(MQTTClient handle, MQTTClient_deliveryToken mdt
 	MQTTClients* m = handle;
 
 	FUNC_ENTRY;
-	Thread_lock_mutex(mqttclient_mutex);
-
 	if (m == NULL || m->c == NULL)
 	{
 		rc = MQTTCLIENT_FAILURE;
 		goto exit;
 	}
+	Thread_lock_mutex(m->mutex);
+
 	if (m->c->connected == 0)
 	{
 		rc = MQTTCLIENT_DISCONNECTED;
-		goto exit;
+		goto unlock;
 	}
 
-	if (ListFindItem(m->c->outboundMsgs, &mdt, messageIDCompare) == NULL)
+	if (MQTTProtocol_findOutbound(m->c, mdt) == NULL)
 	{
 		rc = MQTTCLIENT_SUCCESS; /* well we couldn't find it */
-		goto exit;
+		goto unlock;
 	}
 
 	elapsed = MQTTClient_elapsed(start);
 	while (elapsed < timeout)
 	{
-		Thread_unlock_mutex(mqttclient_mutex);
-		MQTTClient_yield();
-		Thread_lock_mutex(mqttclient_mutex);
-		if (ListFindItem(m->c->outboundMsgs, &mdt, messageIDCompare) == NULL)
+		MQTTClient_waitEvent(m, timeout - elapsed);
+		if (MQTTProtocol_findOutbound(m->c, mdt) == NULL)
 		{
 			rc = MQTTCLIENT_SUCCESS; /* well we couldn't find it */
-			goto exit;
+			goto unlock;
 		}
 		elapsed = MQTTClient_elapsed(start);
 	}
 
+unlock:
+	Thread_unlock_mutex(m->mutex);
 exit:
-	Thread_unlock_mutex(mqttclient_mutex);
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
@@ -1479,13 +2468,12 @@ int MQTTClient_getPendingDeliveryTokens(MQTTClient handle, MQTTClient_deliveryTo
 	*tokens = NULL;
 
 	FUNC_ENTRY;
-	Thread_lock_mutex(mqttclient_mutex);
-
 	if (m == NULL)
 	{
 		rc = MQTTCLIENT_FAILURE;
 		goto exit;
 	}
+	Thread_lock_mutex(m->mutex);
 
 	if (m->c && m->c->outboundMsgs->count > 0)
 	{
@@ -1501,9 +2489,9 @@ int MQTTClient_getPendingDeliveryTokens(MQTTClient handle, MQTTClient_deliveryTo
 		}
 		(*tokens)[count] = -1;
 	}
+	Thread_unlock_mutex(m->mutex);
 
 exit:
-	Thread_unlock_mutex(mqttclient_mutex);
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
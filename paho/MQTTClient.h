@@ -112,6 +112,13 @@
  * and version number.
  */
 #define MQTTCLIENT_BAD_STRUCTURE -8
+/**
+ * Return code: MQTTClient_publishAsync() could not accept the message without
+ * waiting, because the in-flight window is full or the output queued on the
+ * connection has reached the high-water mark (see
+ * MQTTClient_setOutputHighWaterMark()).  Nothing was published; try again later.
+ */
+#define MQTTCLIENT_WOULD_BLOCK -9
 
 /**
  * A handle representing an MQTT client. A valid client handle is available
@@ -338,6 +345,104 @@ DLLExport int MQTTClient_setCallbacks(MQTTClient handle, void* context, MQTTClie
 DLLExport int MQTTClient_create(MQTTClient* handle, char* serverURI, char* clientId,
 		int persistence_type, void* persistence_context);
 
+/**
+ * This function sets the number of background threads which do the network work and call
+ * the callbacks of clients which have set them (see MQTTClient_setCallbacks()).  Each
+ * client's connection is served by one of the threads, so the callbacks for a client are
+ * always called in order, but the callbacks of different clients may be called
+ * concurrently.  Clients with no callbacks set still do their network work within
+ * their own API calls.  The default is one thread.  This function must be called
+ * before the first call of MQTTClient_create().
+ * @param count The number of threads, at least 1.
+ * @return ::MQTTCLIENT_SUCCESS if the number of threads was set, otherwise
+ * ::MQTTCLIENT_FAILURE.
+ */
+DLLExport int MQTTClient_setIOThreads(int count);
+
+/**
+ * Callback ordering for MQTTClient_setCallbackThreads(): the messages for each client
+ * are delivered in order.
+ */
+#define MQTTCLIENT_ORDER_CLIENT 0
+/**
+ * Callback ordering for MQTTClient_setCallbackThreads(): the messages on each topic are
+ * delivered in order, but messages for one client on different topics can be delivered
+ * at the same time.
+ */
+#define MQTTCLIENT_ORDER_TOPIC 1
+
+/**
+ * This function sets the number of threads which call the messageArrived callback (see
+ * MQTTClient_setCallbacks()). By default there are none, and the callback is called
+ * by the background threads which also do the network work, so a slow callback delays
+ * acknowledgements and pings. With callback threads, received messages are handed to
+ * them instead, and a callback which returns false holds up only the messages behind
+ * it on the same thread. The connectionLost and deliveryComplete callbacks are not
+ * affected. This function must be called before the first call of MQTTClient_create().
+ * @param count The number of threads, or 0 for none.
+ * @param order ::MQTTCLIENT_ORDER_CLIENT or ::MQTTCLIENT_ORDER_TOPIC, to choose which
+ * messages are always delivered in the order they arrived.
+ * @return ::MQTTCLIENT_SUCCESS if the number of threads was set, otherwise
+ * ::MQTTCLIENT_FAILURE.
+ */
+DLLExport int MQTTClient_setCallbackThreads(int count, int order);
+
+/**
+ * This function sets how many bytes of output can be queued on a connection before
+ * the client stops taking on more work for it. Packets which cannot be written to the
+ * network straight away are copied to a queue for the connection and written in the
+ * background, so publishing does not wait for the network. Once the queue reaches the
+ * high-water mark, MQTTClient_publish() and MQTTClient_publishMany() wait for it to
+ * drain, MQTTClient_publishAsync() returns ::MQTTCLIENT_WOULD_BLOCK, and no more
+ * packets are read from the connection. The default is 64 kilobytes. This function can
+ * be called at any time, and applies to all clients.
+ * @param bytes The high-water mark in bytes, at least 1.
+ * @return ::MQTTCLIENT_SUCCESS if the mark was set, otherwise ::MQTTCLIENT_FAILURE.
+ */
+DLLExport int MQTTClient_setOutputHighWaterMark(int bytes);
+
+/**
+ * This function turns on busy polling, for applications which would rather keep a
+ * processor busy than add the latency of sleeping in the kernel. Wherever the client
+ * would wait for the network, it spins instead, checking the sockets without blocking
+ * until they are ready or the wait times out. Connections made afterwards also have
+ * Nagle's algorithm and delayed acknowledgements turned off, and SO_BUSY_POLL set where
+ * the system supports it, which may need privileges to take effect. Each thread doing
+ * network work keeps a processor busy, so this only lowers latency when there are
+ * processors to spare: spinning threads give way to others which are ready to run, but
+ * on a machine with fewer processors than busy threads it can be slower than sleeping.
+ * Busy polling is off by default.
+ * @param usecs The SO_BUSY_POLL time in microseconds, for which the kernel polls the
+ * network device for data on each read, or 0 to turn busy polling off.
+ * @return ::MQTTCLIENT_SUCCESS if the setting was changed, otherwise ::MQTTCLIENT_FAILURE.
+ */
+DLLExport int MQTTClient_setBusyPoll(int usecs);
+
+/**
+ * This function turns Nagle's algorithm off, setting TCP_NODELAY on the connections made
+ * afterwards, so that each packet is sent as soon as it is written instead of being held
+ * back while earlier data is unacknowledged. That matters for request and response
+ * traffic such as a QoS 2 exchange, where each packet waits for the one before it, and
+ * costs more, smaller, TCP segments under load. Busy polling (see
+ * MQTTClient_setBusyPoll()) turns Nagle's algorithm off regardless. It is on by default.
+ * @param on Non-zero to set TCP_NODELAY on new connections, 0 to leave Nagle's
+ * algorithm on.
+ * @return ::MQTTCLIENT_SUCCESS.
+ */
+DLLExport int MQTTClient_setNoDelay(int on);
+
+/**
+ * This function sets how long the address a broker's host name resolves to is kept
+ * for. Resolved names are shared by all the clients in the process, and while a name
+ * is being looked up, other clients connecting to the same host wait for that lookup
+ * rather than making their own, so many clients reconnecting at once look the name up
+ * only once. A failed lookup is not kept. The default is 60 seconds. This function can
+ * be called at any time; names already resolved keep the time they were given.
+ * @param seconds The time to live in seconds, or 0 to look the name up on every connect.
+ * @return ::MQTTCLIENT_SUCCESS if the time was set, otherwise ::MQTTCLIENT_FAILURE.
+ */
+DLLExport int MQTTClient_setResolverCacheTTL(int seconds);
+
 /**
  * MQTTClient_willOptions defines the MQTT "Last Will and Testament" (LWT) settings for
  * the client. In the event that a client unexpectedly loses its connection to
@@ -391,7 +496,7 @@ typedef struct
 {
 	/** The eyecatcher for this structure.  must be MQTC. */
 	char struct_id[4];
-	/** The version number of this structure.  Must be 0 */
+	/** The version number of this structure.  Must be 0 or 1.  0 signifies no maxInflight */
 	int struct_version;
 	/** The "keep alive" interval, measured in seconds, defines the maximum time
       * that should pass without communication between the client and the server
@@ -461,9 +566,17 @@ typedef struct
 	 * The time interval in seconds
 	 */
 	int retryInterval;
+	/**
+	 * The maximum number of QoS 1 and 2 messages which can be in-flight at once,
+	 * up to 65535, the number of message ids available.  If greater than 0, this
+	 * overrides the limit set by <i>reliable</i>.  A large window lets a publisher
+	 * keep sending over a link with a long round trip time, rather than waiting
+	 * for acknowledgements.
+	 */
+	int maxInflight;
 } MQTTClient_connectOptions;
 
-#define MQTTClient_connectOptions_initializer { "MQTC", 0, 60, 1, 1, NULL, NULL, NULL, 30, 20 }
+#define MQTTClient_connectOptions_initializer { "MQTC", 1, 60, 1, 1, NULL, NULL, NULL, 30, 20, 0 }
 
 /**
   * This function attempts to connect a previously-created client (see
@@ -624,6 +737,67 @@ DLLExport int MQTTClient_publish(MQTTClient handle, char* topicName, int payload
   */
 DLLExport int MQTTClient_publishMessage(MQTTClient handle, char* topicName, MQTTClient_message* msg, MQTTClient_deliveryToken* dt);
 
+/** 
+  * This function publishes a message like MQTTClient_publish(), but never
+  * waits.  If the message cannot be accepted straight away, because the maximum
+  * number of QoS1 and QoS2 messages are already in flight or the output queued
+  * on the connection has reached the high-water mark (see
+  * MQTTClient_setOutputHighWaterMark()), ::MQTTCLIENT_WOULD_BLOCK is returned
+  * and nothing is published.  A packet which is only partly written is copied
+  * and finished in the background, so the payload can be reused as soon as this
+  * function returns.
+  *
+  * Completion of QoS1 and QoS2 messages is reported through the
+  * MQTTClient_deliveryComplete() callback, so MQTTClient_setCallbacks() should
+  * be called before MQTTClient_connect().  Without callbacks, outstanding
+  * writes and acknowledgements are only processed while the application calls
+  * MQTTClient_yield() or MQTTClient_receive().
+  * @param handle A valid client handle from a successful call to 
+  * MQTTClient_create(). 
+  * @param topicName The topic associated with this message.
+  * @param payloadlen The length of the payload in bytes.
+  * @param payload A pointer to the byte array payload of the message.
+  * @param qos The @ref qos of the message.
+  * @param retained The retained flag for the message.
+  * @param dt A pointer to an ::MQTTClient_deliveryToken. For QoS1 and QoS2
+  * this is populated with a token representing the message when the function
+  * returns successfully. If your application does not use delivery tokens, set
+  * this argument to NULL.
+  * @return ::MQTTCLIENT_SUCCESS if the message is accepted for publication,
+  * ::MQTTCLIENT_WOULD_BLOCK if it could not be accepted without waiting.
+  * Another error code is returned if there was a problem accepting the message.
+  */
+DLLExport int MQTTClient_publishAsync(MQTTClient handle, char* topicName, int payloadlen, void* payload, int qos, int retained,
+																 MQTTClient_deliveryToken* dt);
+
+/** 
+  * This function publishes a batch of messages, none of them retained, as
+  * MQTTClient_publish() would publish each in turn, but writes as many of
+  * the packets as possible to the network in one system call.  This saves most
+  * of the per message cost of sending small messages.  QoS1 and QoS2 messages
+  * are persisted and tracked individually, and each gets its own delivery
+  * token.  As with MQTTClient_publish(), the function waits while the maximum
+  * number of messages are in flight, and while the output queued on the
+  * connection is at the high-water mark (see MQTTClient_setOutputHighWaterMark()).
+  * @param handle A valid client handle from a successful call to 
+  * MQTTClient_create(). 
+  * @param count The number of messages.
+  * @param topics An array of length <i>count</i> of the topics of the messages.
+  * @param payloads An array of length <i>count</i> of pointers to the payloads.
+  * @param payloadlens An array of length <i>count</i> of the payload lengths.
+  * @param qos An array of length <i>count</i> of the @ref qos of each message.
+  * @param dts An array of length <i>count</i> of ::MQTTClient_deliveryToken.
+  * This is populated with a token for each message when the function returns
+  * successfully, 0 for QoS0 messages.  If your application does not use
+  * delivery tokens, set this argument to NULL.
+  * @return ::MQTTCLIENT_SUCCESS if all the messages are accepted for
+  * publication.  An error code is returned if there was a problem accepting
+  * them, in which case messages earlier in the batch may already have been
+  * published.
+  */
+DLLExport int MQTTClient_publishMany(MQTTClient handle, int count, char** topics, void** payloads, int* payloadlens, int* qos,
+																 MQTTClient_deliveryToken* dts);
+
 
 /**
   * This function is called by the client application to synchronize execution
@@ -705,10 +879,47 @@ DLLExport void MQTTClient_yield(void);
 DLLExport int MQTTClient_receive(MQTTClient handle, char** topicName, int* topicLen, MQTTClient_message** message,
 		unsigned long timeout);
 
+/**
+  * This function performs a synchronous receive of up to <i>max</i> incoming
+  * messages at once. It waits, like MQTTClient_receive(), until a message
+  * arrives or the specified timeout expires. It then returns the message
+  * together with any others which have already arrived or are already waiting
+  * to be read from the network, up to <i>max</i> in all, in the order they
+  * arrived. A consumer of a high rate of messages makes fewer calls, each of
+  * which does less work per message, than with MQTTClient_receive().
+  *
+  * <b>Important note:</b> The application must free the memory allocated
+  * to each topic and message when processing is complete (see
+  * MQTTClient_freeMessage() and MQTTClient_free()).
+  * @param handle A valid client handle from a successful call to 
+  * MQTTClient_create().
+  * @param max The maximum number of messages to return, which is the length
+  * of each of the <i>topicNames</i>, <i>topicLens</i> and <i>messages</i> arrays.
+  * @param topicNames An array of pointers which is filled in with the topics
+  * of the messages received.
+  * @param topicLens An array which is filled in with the length of each topic
+  * (see the <i>topicLen</i> parameter of MQTTClient_receive()).
+  * @param messages An array of pointers which is filled in with the messages
+  * received.
+  * @param count The address of an integer which is set to the number of
+  * messages received. It is 0 if the timeout expires.
+  * @param timeout The length of time to wait for a message in milliseconds. 
+  * @return ::MQTTCLIENT_SUCCESS if messages are received or the timeout
+  * expired, or ::MQTTCLIENT_TOPICNAME_TRUNCATED if any of the topics
+  * received contain embedded NULL characters. An error code is returned if
+  * there was a problem trying to receive messages; any messages received
+  * before the problem are still returned in the arrays, and must be freed.
+  */
+DLLExport int MQTTClient_receiveMany(MQTTClient handle, int max, char** topicNames, int* topicLens,
+		MQTTClient_message** messages, int* count, unsigned long timeout);
+
 /**
   * This function frees memory allocated to an MQTT message, including the 
-  * additional memory allocated to the message payload. The client application
-  * calls this function when the message has been fully processed. <b>Important 
+  * additional memory allocated to the message payload. The payload of a QoS0 or
+  * QoS1 message can refer directly to the data as it was read from the network,
+  * in which case freeing the message releases that data instead. The client
+  * application calls this function when the message has been fully processed,
+  * and must not use the payload afterwards. <b>Important 
   * note:</b> This function does not free the memory allocated to a message 
   * topic string. It is the responsibility of the client application to free 
   * this memory using the MQTTClient_free() library function.
@@ -764,6 +975,9 @@ DLLExport void MQTTClient_destroy(MQTTClient* handle);
   * application using callbacks registered with the library by the call to
   * MQTTClient_setCallbacks() (see MQTTClient_messageArrived(), 
   * MQTTClient_connectionLost() and MQTTClient_deliveryComplete()).
+  * The number of background threads can be set with MQTTClient_setIOThreads(),
+  * and messages can be delivered on threads of their own with
+  * MQTTClient_setCallbackThreads().
   *
   * @page wildcard Subscription wildcards
   * Every MQTT message includes a topic that classifies it. MQTT servers use 
@@ -87,7 +87,7 @@ pf new_packets[] =
 void* MQTTPacket_Factory(int socket, int* error)
 {
 	char* data = NULL;
-	static Header header;
+	Header header;
 	int remaining_length, ptype;
 	void* pack = NULL;
 	int actual_len = 0;
@@ -168,8 +168,7 @@ int MQTTPacket_send(int socket, Header header, char* buffer, int buflen)
 	}
 #endif
 	rc = Socket_putdatas(socket, buf, buf0len, 1, &buffer, &buflen);
-	if (rc != TCPSOCKET_INTERRUPTED)
-	  free(buf);
+	free(buf);
 
 	FUNC_EXIT_RC(rc);
 	return rc;
@@ -206,8 +205,7 @@ int MQTTPacket_sends(int socket, Header header, int count, char** buffers, int*
 	}
 #endif
 	rc = Socket_putdatas(socket, buf, buf0len, count, buffers, buflens);
-	if (rc != TCPSOCKET_INTERRUPTED)
-	  free(buf);
+	free(buf);
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
@@ -491,8 +489,8 @@ int MQTTPacket_send_ack(int type, int msgid, int dup, int socket)
 	header.bits.type = type;
 	header.bits.dup = dup;
 	writeInt(&ptr, msgid);
-	if ((rc = MQTTPacket_send(socket, header, buf, 2)) != TCPSOCKET_INTERRUPTED)
-		free(buf);
+	rc = MQTTPacket_send(socket, header, buf, 2);
+	free(buf);
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
@@ -637,8 +635,7 @@ int MQTTPacket_send_publish(Publish* pack, int dup, int qos, int retained, int s
 		ptr = topiclen;
 		writeInt(&ptr, lens[1]);
 		rc = MQTTPacket_sends(socket, header, 4, bufs, lens);
-		if (rc != TCPSOCKET_INTERRUPTED)
-			free(buf);
+		free(buf);
 	}
 	else
 	{
@@ -648,8 +645,7 @@ int MQTTPacket_send_publish(Publish* pack, int dup, int qos, int retained, int s
 		writeInt(&ptr, lens[1]);
 		rc = MQTTPacket_sends(socket, header, 3, bufs, lens);
 	}
-	if (rc != TCPSOCKET_INTERRUPTED)
-		free(topiclen);
+	free(topiclen);
 	if (qos == 0)
 		Log(LOG_PROTOCOL, 27, NULL, socket, clientID, retained, rc);
 	else
@@ -660,6 +656,83 @@ int MQTTPacket_send_publish(Publish* pack, int dup, int qos, int retained, int s
 }
 
 
+/**
+ * Send several MQTT PUBLISH packets, unretained and not duplicates, in one system call write.
+ * QoS 1 and 2 packets are persisted first, one by one, just as MQTTPacket_send_publish does.
+ * @param count the number of packets, at most SOCKET_MAX_BUFFERS / 4
+ * @param packs the publish data for each packet, with message ids assigned where qos > 0
+ * @param qoss the qos of each packet
+ * @param socket the open socket to send the data to
+ * @param clientID the string client identifier, only used for tracing
+ * @return the completion code (e.g. TCPSOCKET_COMPLETE)
+ */
+int MQTTPacket_send_publishes(int count, Publish* packs, int* qoss, int socket, char* clientID)
+{
+	/* per packet: header byte, up to 4 remaining length bytes, topic length, message id */
+	char* headers = malloc(count * 9);
+	char** bufs = malloc(count * 4 * sizeof(char*));
+	int* lens = malloc(count * 4 * sizeof(int));
+	int i, nbufs = 0;
+	int rc = -1;
+
+	FUNC_ENTRY;
+	for (i = 0; i < count; ++i)
+	{
+		char* hdr = &headers[i * 9];
+		char* ptr = NULL;
+		Header header;
+		int topiclen = strlen(packs[i].topic);
+		int hdrlen;
+
+		header.byte = 0;
+		header.bits.type = PUBLISH;
+		header.bits.qos = qoss[i];
+		hdr[0] = header.byte;
+		hdrlen = 1 + MQTTPacket_encode(&hdr[1], 2 + topiclen + ((qoss[i] > 0) ? 2 : 0) + packs[i].payloadlen);
+		ptr = &hdr[hdrlen];
+		writeInt(&ptr, topiclen);
+
+		bufs[nbufs] = hdr;
+		lens[nbufs++] = hdrlen + 2;
+		bufs[nbufs] = packs[i].topic;
+		lens[nbufs++] = topiclen;
+		if (qoss[i] > 0)
+		{
+			writeInt(&ptr, packs[i].msgId);
+			bufs[nbufs] = &hdr[hdrlen + 2];
+			lens[nbufs++] = 2;
+		}
+		bufs[nbufs] = packs[i].payload;
+		lens[nbufs++] = packs[i].payloadlen;
+#if !defined(NO_PERSISTENCE)
+		if (qoss[i] > 0)
+		{
+			char* pbufs[4] = {&hdr[hdrlen], packs[i].topic, &hdr[hdrlen + 2], packs[i].payload};
+			int plens[4] = {2, topiclen, 2, packs[i].payloadlen};
+
+			MQTTPersistence_put(socket, hdr, hdrlen, 4, pbufs, plens, PUBLISH, packs[i].msgId, 0);
+		}
+#endif
+	}
+
+	rc = Socket_putdatav(socket, nbufs, bufs, lens);
+
+	for (i = 0; i < count; ++i)
+	{
+		if (qoss[i] == 0)
+			Log(LOG_PROTOCOL, 27, NULL, socket, clientID, 0, rc);
+		else
+			Log(LOG_PROTOCOL, 10, NULL, socket, clientID, packs[i].msgId, qoss[i], 0, rc,
+					min(20, packs[i].payloadlen), packs[i].payload);
+	}
+	free(headers);
+	free(bufs);
+	free(lens);
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
 /**
  * Free allocated storage for a various packet tyoes
  * @param pack pointer to the suback packet structure
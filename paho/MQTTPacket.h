@@ -211,6 +211,7 @@ int MQTTPacket_send_disconnect(int socket, char* clientID);
 void* MQTTPacket_publish(unsigned char aHeader, char* data, int datalen);
 void MQTTPacket_freePublish(Publish* pack);
 int MQTTPacket_send_publish(Publish* pack, int dup, int qos, int retained, int socket, char* clientID);
+int MQTTPacket_send_publishes(int count, Publish* packs, int* qoss, int socket, char* clientID);
 int MQTTPacket_send_puback(int msgid, int socket, char* clientID);
 void* MQTTPacket_ack(unsigned char aHeader, char* data, int datalen);
 
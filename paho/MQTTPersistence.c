@@ -235,6 +235,8 @@ int MQTTPersistence_restore(Clients *c)
 	}
 
 	MQTTPersistence_wrapMsgID(c);
+	MQTTProtocol_reindexInbound(c);
+	MQTTProtocol_reindexOutbound(c);
 
 	FUNC_EXIT_RC(rc);
 	return rc;
@@ -290,10 +292,12 @@ void MQTTPersistence_insertInOrder(List* list, void* content, int size)
 	ListElement* current = NULL;
 
 	FUNC_ENTRY;
-	while(ListNextElement(list, &current) != NULL && index == NULL)
+	/* search from the end, as the messages mostly come in order */
+	while(ListPrevElement(list, &current) != NULL)
 	{
-		if ( ((Messages*)content)->msgid < ((Messages*)current->content)->msgid )
-			index = current;
+		if ( ((Messages*)content)->msgid > ((Messages*)current->content)->msgid )
+			break;
+		index = current;
 	}
 
 	ListInsert(list, content, size, index);
@@ -319,7 +323,6 @@ int MQTTPersistence_put(int socket, char* buf0, int buf0len, int count,
 								 char** buffers, int* buflens, int htype, int msgId, int scr )
 {
 	int rc = 0;
-	extern ClientStates* bstate;
 	int nbufs, i;
 	int* lens = NULL;
 	char** bufs = NULL;
@@ -327,7 +330,7 @@ int MQTTPersistence_put(int socket, char* buf0, int buf0len, int count,
 	Clients* client = NULL;
 
 	FUNC_ENTRY;
-	client = (Clients*)(ListFindItem(bstate->clients, &socket, clientSocketCompare)->content);
+	client = MQTTProtocol_findClient(socket);
 	if (client->persistence != NULL)
 	{
 		key = malloc(MESSAGE_FILENAME_LENGTH + 1);
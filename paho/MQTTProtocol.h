@@ -21,17 +21,8 @@
 
 typedef struct
 {
-	int socket;
-	Publications* p;
-} pending_write;
-
-
-typedef struct
-{
-	List publications;
 	unsigned int msgs_received;
 	unsigned int msgs_sent;
-	List pending_writes; /* for qos 0 writes not complete */
 } MQTTProtocol;
 
 
@@ -26,6 +26,7 @@
 #endif
 #include "SocketBuffer.h"
 #include "StackTrace.h"
+#include "Thread.h"
 #include "Heap.h"
 
 #if !defined(min)
@@ -36,7 +37,7 @@ void Protocol_processPublication(Publish* publish, Clients* client);
 void MQTTProtocol_closeSession(Clients* client, int sendwill);
 
 extern MQTTProtocol state;
-extern ClientStates* bstate;
+extern mutex_type mqttclient_mutex;
 
 /**
  * List callback function for comparing Message structures by message id
@@ -60,32 +61,223 @@ int messageIDCompare(void* a, void* b)
 int MQTTProtocol_assignMsgId(Clients* client)
 {
 	FUNC_ENTRY;
-	++(client->msgID);
-	while (ListFindItem(client->outboundMsgs, &(client->msgID), messageIDCompare) != NULL)
-		++(client->msgID);
-	if (client->msgID == MAX_MSG_ID + 1)
-		client->msgID = 1;
+	do
+	{
+		if (++(client->msgID) > MAX_MSG_ID)
+			client->msgID = 1;
+	}
+	while (MQTTProtocol_findOutbound(client, client->msgID) != NULL);
 	FUNC_EXIT_RC(client->msgID);
 	return client->msgID;
 }
 
 
-void MQTTProtocol_storeQoS0(Clients* pubclient, Publish* publish)
+/*
+ * The outbound message list can be as long as the in-flight window, which may be up to the
+ * whole message id space, and the inbound list holds every QoS 2 message the server has
+ * not yet released, so both are indexed by message id in open addressing hash tables.
+ * Message ids are handed out in sequence, so the id itself spreads well across the slots.
+ */
+
+static ListElement* MQTTProtocol_findIndexed(ListElement** index, int size, int msgid)
+{
+	ListElement* rc = NULL;
+
+	if (size > 0)
+	{
+		int mask = size - 1;
+		int i = msgid & mask;
+
+		while (index[i] != NULL)
+		{
+			if (((Messages*)(index[i]->content))->msgid == msgid)
+			{
+				rc = index[i];
+				break;
+			}
+			i = (i + 1) & mask;
+		}
+	}
+	return rc;
+}
+
+
+static void MQTTProtocol_insertIndexed(ListElement** index, int size, ListElement* el)
+{
+	int mask = size - 1;
+	int i = ((Messages*)(el->content))->msgid & mask;
+
+	while (index[i] != NULL)
+		i = (i + 1) & mask;
+	index[i] = el;
+}
+
+
+/**
+ * Rebuild a message index from its list, resizing it to suit the number of messages
+ * @param list the message list
+ * @param index the index, reallocated if its size changes
+ * @param size the number of slots in the index, a power of 2
+ */
+static void MQTTProtocol_reindex(List* list, ListElement*** index, int* size)
+{
+	ListElement* current = NULL;
+	int newSize = 16;
+
+	while (newSize < list->count * 4)
+		newSize *= 2;
+	if (newSize != *size)
+	{
+		if (*index)
+			free(*index);
+		*index = malloc(sizeof(ListElement*) * newSize);
+		*size = newSize;
+	}
+	memset(*index, '\0', sizeof(ListElement*) * newSize);
+	while (ListNextElement(list, &current))
+		MQTTProtocol_insertIndexed(*index, newSize, current);
+}
+
+
+/**
+ * Remove a message from its list and index, freeing the message
+ * @param list the message list
+ * @param index the index
+ * @param size the number of slots in the index
+ * @param el the element of the list to remove
+ */
+static void MQTTProtocol_removeIndexed(List* list, ListElement** index, int size, ListElement* el)
+{
+	int mask = size - 1;
+	int i = ((Messages*)(el->content))->msgid & mask;
+	int j;
+
+	while (index[i] != el)
+		i = (i + 1) & mask;
+	/* close the gap, moving back any later entries which would no longer be found */
+	for (j = (i + 1) & mask; index[j] != NULL; j = (j + 1) & mask)
+	{
+		int home = ((Messages*)(index[j]->content))->msgid & mask;
+
+		if (((j - home) & mask) >= ((j - i) & mask))
+		{
+			index[i] = index[j];
+			i = j;
+		}
+	}
+	index[i] = NULL;
+
+	list->current = el; /* so that ListRemove finds it without a search */
+	ListRemove(list, el->content);
+}
+
+
+/**
+ * Find an outbound message by message id
+ * @param client the client
+ * @param msgid the message id
+ * @return the element of client->outboundMsgs holding the message, or NULL
+ */
+ListElement* MQTTProtocol_findOutbound(Clients* client, int msgid)
+{
+	return MQTTProtocol_findIndexed(client->outboundIndex, client->outboundIndexSize, msgid);
+}
+
+
+/**
+ * Rebuild the outbound message index from the list, resizing it to suit the number of
+ * messages.  Called when the list has been changed other than through the functions here.
+ * @param client the client
+ */
+void MQTTProtocol_reindexOutbound(Clients* client)
+{
+	FUNC_ENTRY;
+	MQTTProtocol_reindex(client->outboundMsgs, &client->outboundIndex, &client->outboundIndexSize);
+	FUNC_EXIT;
+}
+
+
+/**
+ * Index an element which has just been added to the outbound message list
+ * @param client the client
+ * @param el the new element of client->outboundMsgs
+ */
+void MQTTProtocol_indexOutbound(Clients* client, ListElement* el)
+{
+	FUNC_ENTRY;
+	if (client->outboundMsgs->count * 2 > client->outboundIndexSize)
+		MQTTProtocol_reindexOutbound(client); /* includes el */
+	else
+		MQTTProtocol_insertIndexed(client->outboundIndex, client->outboundIndexSize, el);
+	FUNC_EXIT;
+}
+
+
+/**
+ * Remove a message from the outbound message list and its index, freeing the message.
+ * The publication it refers to must already have been dealt with.
+ * @param client the client
+ * @param el the element of client->outboundMsgs to remove
+ */
+void MQTTProtocol_removeOutbound(Clients* client, ListElement* el)
 {
-	int len;
-	pending_write* pw = NULL;
+	FUNC_ENTRY;
+	MQTTProtocol_removeIndexed(client->outboundMsgs, client->outboundIndex, client->outboundIndexSize, el);
+	FUNC_EXIT;
+}
 
+
+/**
+ * Find an inbound QoS 2 message by message id
+ * @param client the client
+ * @param msgid the message id
+ * @return the element of client->inboundMsgs holding the message, or NULL
+ */
+ListElement* MQTTProtocol_findInbound(Clients* client, int msgid)
+{
+	return MQTTProtocol_findIndexed(client->inboundIndex, client->inboundIndexSize, msgid);
+}
+
+
+/**
+ * Rebuild the inbound message index from the list.  Called when the list has been changed
+ * other than through the functions here.
+ * @param client the client
+ */
+void MQTTProtocol_reindexInbound(Clients* client)
+{
 	FUNC_ENTRY;
-	/* store the publication until the write is finished */
-	pw = malloc(sizeof(pending_write));
-	Log(TRACE_MIN, 12, NULL);
-	pw->p = MQTTProtocol_storePublication(publish, &len);
-	pw->socket = pubclient->socket;
-	ListAppend(&(state.pending_writes), pw, sizeof(pending_write)+len);
-	/* we don't copy QoS 0 messages unless we have to, so now we have to tell the socket buffer where
-	the saved copy is */
-	if (SocketBuffer_updateWrite(pw->socket, pw->p->topic, pw->p->payload) == NULL)
-		Log(LOG_SEVERE, 0, "Error updating write");
+	MQTTProtocol_reindex(client->inboundMsgs, &client->inboundIndex, &client->inboundIndexSize);
+	FUNC_EXIT;
+}
+
+
+/**
+ * Index an element which has just been added to the inbound message list
+ * @param client the client
+ * @param el the new element of client->inboundMsgs
+ */
+void MQTTProtocol_indexInbound(Clients* client, ListElement* el)
+{
+	FUNC_ENTRY;
+	if (client->inboundMsgs->count * 2 > client->inboundIndexSize)
+		MQTTProtocol_reindexInbound(client); /* includes el */
+	else
+		MQTTProtocol_insertIndexed(client->inboundIndex, client->inboundIndexSize, el);
+	FUNC_EXIT;
+}
+
+
+/**
+ * Remove a message from the inbound message list and its index, freeing the message.
+ * The publication it refers to must already have been dealt with.
+ * @param client the client
+ * @param el the element of client->inboundMsgs to remove
+ */
+void MQTTProtocol_removeInbound(Clients* client, ListElement* el)
+{
+	FUNC_ENTRY;
+	MQTTProtocol_removeIndexed(client->inboundMsgs, client->inboundIndex, client->inboundIndexSize, el);
 	FUNC_EXIT;
 }
 
@@ -104,8 +296,6 @@ int MQTTProtocol_startPublishCommon(Clients* pubclient, Publish* publish, int qo
 
 	FUNC_ENTRY;
 	rc = MQTTPacket_send_publish(publish, 0, qos, retained, pubclient->socket, pubclient->clientID);
-	if (qos == 0 && rc == TCPSOCKET_INTERRUPTED)
-		MQTTProtocol_storeQoS0(pubclient, publish);
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
@@ -131,6 +321,7 @@ int MQTTProtocol_startPublish(Clients* pubclient, Publish* publish, int qos, int
 		p.msgId = publish->msgId = MQTTProtocol_assignMsgId(pubclient);
 		*mm = MQTTProtocol_createMessage(publish, mm, qos, retained);
 		ListAppend(pubclient->outboundMsgs, *mm, (*mm)->len);
+		MQTTProtocol_indexOutbound(pubclient, pubclient->outboundMsgs->last);
 		/* we change these pointers to the saved message location just in case the packet could not be written
 		entirely; the socket buffer will use these locations to finish writing the packet */
 		p.payload = (*mm)->publish->payload;
@@ -142,6 +333,39 @@ int MQTTProtocol_startPublish(Clients* pubclient, Publish* publish, int qos, int
 }
 
 
+/**
+ * Start several new publish exchanges at once, writing all the packets to the socket together.
+ * @param pubclient the client to send the publications to
+ * @param count the number of publications, at most SOCKET_MAX_BUFFERS / 4
+ * @param publishes the publication data, which is given message ids where qos > 0
+ * @param qoss the MQTT QoS to use for each publication
+ * @param mms - returns the messages stored for each publication, NULL where qos is 0
+ * @return the completion code
+ */
+int MQTTProtocol_startPublishes(Clients* pubclient, int count, Publish* publishes, int* qoss, Messages** mms)
+{
+	int rc = 0;
+	int i;
+
+	FUNC_ENTRY;
+	for (i = 0; i < count; ++i)
+	{
+		mms[i] = NULL;
+		if (qoss[i] > 0)
+		{
+			publishes[i].msgId = MQTTProtocol_assignMsgId(pubclient);
+			mms[i] = MQTTProtocol_createMessage(&publishes[i], &mms[i], qoss[i], 0);
+			ListAppend(pubclient->outboundMsgs, mms[i], mms[i]->len);
+			MQTTProtocol_indexOutbound(pubclient, pubclient->outboundMsgs->last);
+		}
+	}
+	/* the packets are copied by the socket layer if they cannot all be written now */
+	rc = MQTTPacket_send_publishes(count, publishes, qoss, pubclient->socket, pubclient->clientID);
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
 /**
  * Copy and store message data for retries
  * @param publish the publication data
@@ -208,7 +432,6 @@ Publications* MQTTProtocol_storePublication(Publish* publish, int* len)
 	memcpy(p->payload, publish->payload, p->payloadlen);
 	*len += publish->payloadlen;
 
-	ListAppend(&(state.publications), p, *len);
 	FUNC_EXIT;
 	return p;
 }
@@ -224,7 +447,7 @@ void MQTTProtocol_removePublication(Publications* p)
 	{
 		free(p->payload);
 		free(p->topic);
-		ListRemove(&(state.publications), p);
+		free(p);
 	}
 	FUNC_EXIT;
 }
@@ -243,7 +466,7 @@ int MQTTProtocol_handlePublishes(void* pack, int sock)
 	int rc = TCPSOCKET_COMPLETE;
 
 	FUNC_ENTRY;
-	client = (Clients*)(ListFindItem(bstate->clients, &sock, clientSocketCompare)->content);
+	client = MQTTProtocol_findClient(sock);
 	clientid = client->clientID;
 	Log(LOG_PROTOCOL, 11, NULL, sock, clientid, publish->msgId, publish->header.bits.qos,
 					publish->header.bits.retain, min(20, publish->payloadlen), publish->payload);
@@ -269,14 +492,14 @@ int MQTTProtocol_handlePublishes(void* pack, int sock)
 		m->qos = publish->header.bits.qos;
 		m->retain = publish->header.bits.retain;
 		m->nextMessageType = PUBREL;
-		if ( ( listElem = ListFindItem(client->inboundMsgs, &(m->msgid), messageIDCompare) ) != NULL )
+		if ( ( listElem = MQTTProtocol_findInbound(client, m->msgid) ) != NULL )
 		{   /* discard queued publication with same msgID that the current incoming message */
 			Messages* msg = (Messages*)(listElem->content);
 			MQTTProtocol_removePublication(msg->publish);
-			ListInsert(client->inboundMsgs, m, sizeof(Messages) + len, listElem);
-			ListRemove(client->inboundMsgs, msg);
-		} else
-			ListAppend(client->inboundMsgs, m, sizeof(Messages) + len);
+			MQTTProtocol_removeInbound(client, listElem);
+		}
+		ListAppend(client->inboundMsgs, m, sizeof(Messages) + len);
+		MQTTProtocol_indexInbound(client, client->inboundMsgs->last);
 		rc = MQTTPacket_send_pubrec(publish->msgId, sock, client->clientID);
 		publish->topic = NULL;
 	}
@@ -295,18 +518,19 @@ int MQTTProtocol_handlePubacks(void* pack, int sock)
 {
 	Puback* puback = (Puback*)pack;
 	Clients* client = NULL;
+	ListElement* el = NULL;
 	int rc = TCPSOCKET_COMPLETE;
 
 	FUNC_ENTRY;
-	client = (Clients*)(ListFindItem(bstate->clients, &sock, clientSocketCompare)->content);
+	client = MQTTProtocol_findClient(sock);
 	Log(LOG_PROTOCOL, 14, NULL, sock, client->clientID, puback->msgId);
 
 	/* look for the message by message id in the records of outbound messages for this client */
-	if (ListFindItem(client->outboundMsgs, &(puback->msgId), messageIDCompare) == NULL)
+	if ((el = MQTTProtocol_findOutbound(client, puback->msgId)) == NULL)
 		Log(TRACE_MIN, 3, NULL, "PUBACK", client->clientID, puback->msgId);
 	else
 	{
-		Messages* m = (Messages*)(client->outboundMsgs->current->content);
+		Messages* m = (Messages*)(el->content);
 		if (m->qos != 1)
 			Log(TRACE_MIN, 4, NULL, "PUBACK", client->clientID, puback->msgId, m->qos);
 		else
@@ -316,7 +540,7 @@ int MQTTProtocol_handlePubacks(void* pack, int sock)
 				rc = MQTTPersistence_remove(client, PERSISTENCE_PUBLISH_SENT, m->qos, puback->msgId);
 			#endif
 			MQTTProtocol_removePublication(m->publish);
-			ListRemove(client->outboundMsgs, m);
+			MQTTProtocol_removeOutbound(client, el);
 		}
 	}
 	free(pack);
@@ -335,22 +559,22 @@ int MQTTProtocol_handlePubrecs(void* pack, int sock)
 {
 	Pubrec* pubrec = (Pubrec*)pack;
 	Clients* client = NULL;
+	ListElement* el = NULL;
 	int rc = TCPSOCKET_COMPLETE;
 
 	FUNC_ENTRY;
-	client = (Clients*)(ListFindItem(bstate->clients, &sock, clientSocketCompare)->content);
+	client = MQTTProtocol_findClient(sock);
 	Log(LOG_PROTOCOL, 15, NULL, sock, client->clientID, pubrec->msgId);
 
 	/* look for the message by message id in the records of outbound messages for this client */
-	client->outboundMsgs->current = NULL;
-	if (ListFindItem(client->outboundMsgs, &(pubrec->msgId), messageIDCompare) == NULL)
+	if ((el = MQTTProtocol_findOutbound(client, pubrec->msgId)) == NULL)
 	{
 		if (pubrec->header.bits.dup == 0)
 			Log(TRACE_MIN, 3, NULL, "PUBREC", client->clientID, pubrec->msgId);
 	}
 	else
 	{
-		Messages* m = (Messages*)(client->outboundMsgs->current->content);
+		Messages* m = (Messages*)(el->content);
 		if (m->qos != 2)
 		{
 			if (pubrec->header.bits.dup == 0)
@@ -384,14 +608,15 @@ int MQTTProtocol_handlePubrels(void* pack, int sock)
 {
 	Pubrel* pubrel = (Pubrel*)pack;
 	Clients* client = NULL;
+	ListElement* el = NULL;
 	int rc = TCPSOCKET_COMPLETE;
 
 	FUNC_ENTRY;
-	client = (Clients*)(ListFindItem(bstate->clients, &sock, clientSocketCompare)->content);
+	client = MQTTProtocol_findClient(sock);
 	Log(LOG_PROTOCOL, 17, NULL, sock, client->clientID, pubrel->msgId);
 
 	/* look for the message by message id in the records of inbound messages for this client */
-	if (ListFindItem(client->inboundMsgs, &(pubrel->msgId), messageIDCompare) == NULL)
+	if ((el = MQTTProtocol_findInbound(client, pubrel->msgId)) == NULL)
 	{
 		if (pubrel->header.bits.dup == 0)
 			Log(TRACE_MIN, 3, NULL, "PUBREL", client->clientID, pubrel->msgId);
@@ -401,7 +626,7 @@ int MQTTProtocol_handlePubrels(void* pack, int sock)
 	}
 	else
 	{
-		Messages* m = (Messages*)(client->inboundMsgs->current->content);
+		Messages* m = (Messages*)(el->content);
 		if (m->qos != 2)
 			Log(TRACE_MIN, 4, NULL, "PUBREL", client->clientID, pubrel->msgId, m->qos);
 		else if (m->nextMessageType != PUBREL)
@@ -423,8 +648,8 @@ int MQTTProtocol_handlePubrels(void* pack, int sock)
 			#if !defined(NO_PERSISTENCE)
 				rc = MQTTPersistence_remove(client, PERSISTENCE_PUBLISH_RECEIVED, m->qos, pubrel->msgId);
 			#endif
-			ListRemove(&(state.publications), m->publish);
-			ListRemove(client->inboundMsgs, m);
+			free(m->publish); /* the topic and payload now belong to the message queue */
+			MQTTProtocol_removeInbound(client, el);
 			++(state.msgs_received);
 		}
 	}
@@ -444,21 +669,22 @@ int MQTTProtocol_handlePubcomps(void* pack, int sock)
 {
 	Pubcomp* pubcomp = (Pubcomp*)pack;
 	Clients* client = NULL;
+	ListElement* el = NULL;
 	int rc = TCPSOCKET_COMPLETE;
 
 	FUNC_ENTRY;
-	client = (Clients*)(ListFindItem(bstate->clients, &sock, clientSocketCompare)->content);
+	client = MQTTProtocol_findClient(sock);
 	Log(LOG_PROTOCOL, 19, NULL, sock, client->clientID, pubcomp->msgId);
 
 	/* look for the message by message id in the records of outbound messages for this client */
-	if (ListFindItem(client->outboundMsgs, &(pubcomp->msgId), messageIDCompare) == NULL)
+	if ((el = MQTTProtocol_findOutbound(client, pubcomp->msgId)) == NULL)
 	{
 		if (pubcomp->header.bits.dup == 0)
 			Log(TRACE_MIN, 3, NULL, "PUBCOMP", client->clientID, pubcomp->msgId);
 	}
 	else
 	{
-		Messages* m = (Messages*)(client->outboundMsgs->current->content);
+		Messages* m = (Messages*)(el->content);
 		if (m->qos != 2)
 			Log(TRACE_MIN, 4, NULL, "PUBCOMP", client->clientID, pubcomp->msgId, m->qos);
 		else
@@ -472,7 +698,7 @@ int MQTTProtocol_handlePubcomps(void* pack, int sock)
 					rc = MQTTPersistence_remove(client, PERSISTENCE_PUBLISH_SENT, m->qos, pubcomp->msgId);
 				#endif
 				MQTTProtocol_removePublication(m->publish);
-				ListRemove(client->outboundMsgs, m);
+				MQTTProtocol_removeOutbound(client, el);
 				(++state.msgs_sent);
 			}
 		}
@@ -484,26 +710,19 @@ int MQTTProtocol_handlePubcomps(void* pack, int sock)
 
 
 /**
- * MQTT protocol keepAlive processing.  Sends PINGREQ packets as required.
+ * MQTT protocol keepAlive processing.  Sends a PINGREQ packet if one is due.
  * @param now current time
+ * @param client the client to check, locked by the caller
  */
-void MQTTProtocol_keepalive(time_t now)
+void MQTTProtocol_keepalive(time_t now, Clients* client)
 {
-	ListElement* current = NULL;
-
 	FUNC_ENTRY;
-	ListNextElement(bstate->clients, &current);
-	while (current)
+	if (client->connected && client->keepAliveInterval > 0
+			&& (difftime(now, client->lastContact) >= client->keepAliveInterval))
 	{
-		Clients* client =	(Clients*)(current->content);
-		ListNextElement(bstate->clients, &current);
-		if (client->connected && client->keepAliveInterval > 0
-				&& (difftime(now, client->lastContact) >= client->keepAliveInterval))
-		{
-			MQTTPacket_send_pingreq(client->socket, client->clientID);
-			client->lastContact = now;
-			client->ping_outstanding = 1;
-		}
+		MQTTPacket_send_pingreq(client->socket, client->clientID);
+		client->lastContact = now;
+		client->ping_outstanding = 1;
 	}
 	FUNC_EXIT;
 }
@@ -548,11 +767,7 @@ void MQTTProtocol_retries(time_t now, Clients* client)
 					client = NULL;
 				}
 				else
-				{
-					if (m->qos == 0 && rc == TCPSOCKET_INTERRUPTED)
-						MQTTProtocol_storeQoS0(client, &publish);
 					time(&(m->lastTouch));
-				}
 			}
 			else if (m->qos && m->nextMessageType == PUBCOMP)
 			{
@@ -579,31 +794,24 @@ exit:
 /**
  * MQTT retry protocol and socket pending writes processing.
  * @param now current time
+ * @param client the client to check, locked by the caller
  * @param doRetry boolean - retries as well as pending writes?
  */
-void MQTTProtocol_retry(time_t now, int doRetry)
+void MQTTProtocol_retry(time_t now, Clients* client, int doRetry)
 {
-	ListElement* current = NULL;
-
 	FUNC_ENTRY;
-	ListNextElement(bstate->clients, &current);
-	/* look through the outbound message list of each client, checking to see if a retry is necessary */
-	while (current)
+	if (client->connected == 0)
+		goto exit;
+	if (client->good == 0)
 	{
-		Clients* client = (Clients*)(current->content);
-		ListNextElement(bstate->clients, &current);
-		if (client->connected == 0)
-			continue;
-		if (client->good == 0)
-		{
-			MQTTProtocol_closeSession(client, 1);
-			continue;
-		}
-		if (Socket_noPendingWrites(client->socket) == 0)
-			continue;
-		if (doRetry)
-			MQTTProtocol_retries(now, client);
+		MQTTProtocol_closeSession(client, 1);
+		goto exit;
 	}
+	if (Socket_outputFull(client->socket))
+		goto exit;
+	if (doRetry)
+		MQTTProtocol_retries(now, client);
+exit:
 	FUNC_EXIT;
 }
 
@@ -619,6 +827,10 @@ void MQTTProtocol_freeClient(Clients* client)
 	MQTTProtocol_freeMessageList(client->outboundMsgs);
 	MQTTProtocol_freeMessageList(client->inboundMsgs);
 	ListFree(client->messageQueue);
+	if (client->outboundIndex)
+		free(client->outboundIndex);
+	if (client->inboundIndex)
+		free(client->inboundIndex);
 	free(client->clientID);
 	/*if (client->will != NULL)
 	{
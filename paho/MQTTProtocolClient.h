@@ -24,6 +24,7 @@
 
 int MQTTProtocol_assignMsgId(Clients* client);
 int MQTTProtocol_startPublish(Clients* pubclient, Publish* publish, int qos, int retained, Messages** m);
+int MQTTProtocol_startPublishes(Clients* pubclient, int count, Publish* publishes, int* qoss, Messages** mms);
 Messages* MQTTProtocol_createMessage(Publish* publish, Messages** mm, int qos, int retained);
 Publications* MQTTProtocol_storePublication(Publish* publish, int* len);
 int messageIDCompare(void* a, void* b);
@@ -35,8 +36,19 @@ int MQTTProtocol_handlePubrecs(void* pack, int sock);
 int MQTTProtocol_handlePubrels(void* pack, int sock);
 int MQTTProtocol_handlePubcomps(void* pack, int sock);
 
-void MQTTProtocol_keepalive(time_t);
-void MQTTProtocol_retry(time_t, int);
+Clients* MQTTProtocol_findClient(int sock);
+
+ListElement* MQTTProtocol_findOutbound(Clients* client, int msgid);
+void MQTTProtocol_indexOutbound(Clients* client, ListElement* el);
+void MQTTProtocol_reindexOutbound(Clients* client);
+void MQTTProtocol_removeOutbound(Clients* client, ListElement* el);
+ListElement* MQTTProtocol_findInbound(Clients* client, int msgid);
+void MQTTProtocol_indexInbound(Clients* client, ListElement* el);
+void MQTTProtocol_reindexInbound(Clients* client);
+void MQTTProtocol_removeInbound(Clients* client, ListElement* el);
+
+void MQTTProtocol_keepalive(time_t now, Clients* client);
+void MQTTProtocol_retry(time_t now, Clients* client, int doRetry);
 void MQTTProtocol_freeClient(Clients* client);
 void MQTTProtocol_emptyMessageList(List* msgList);
 void MQTTProtocol_freeMessageList(List* msgList);
@@ -24,18 +24,20 @@
 #include "Heap.h"
 
 extern MQTTProtocol state;
-extern ClientStates* bstate;
+
+/** size of the buffer MQTTProtocol_addressPort copies a host name or address into */
+#define MQTTPROTOCOL_ADDRESS_LEN (MAXHOSTNAMELEN + 1)
 
 
 /**
  * Separates an address:port into two separate values
  * @param ip_address the input string
  * @param port the returned port integer
+ * @param buf buffer of MQTTPROTOCOL_ADDRESS_LEN chars the address can be copied into
  * @return the address string
  */
-char* MQTTProtocol_addressPort(char* ip_address, int* port)
+char* MQTTProtocol_addressPort(char* ip_address, int* port, char* buf)
 {
-	static char buf[INET6_ADDRSTRLEN+1];
 	char* pos = strrchr(ip_address, ':'); /* reverse find to allow for ':' in IPv6 addresses */
 	int len;
 
@@ -48,11 +50,17 @@ char* MQTTProtocol_addressPort(char* ip_address, int* port)
 
 	if (pos)
 	{
-		int len = pos - ip_address;
+		len = pos - ip_address;
+		if (len >= MQTTPROTOCOL_ADDRESS_LEN)
+			len = MQTTPROTOCOL_ADDRESS_LEN - 1;
 		*port = atoi(pos+1);
 		strncpy(buf, ip_address, len);
 		buf[len] = '\0';
 		pos = buf;
+
+		len = strlen(buf);
+		if (len > 0 && buf[len - 1] == ']')
+			buf[len - 1] = '\0';
 	}
 	else
 	{
@@ -60,10 +68,6 @@ char* MQTTProtocol_addressPort(char* ip_address, int* port)
 	  pos = ip_address;
 	}
 
-	len = strlen(buf);
-	if (buf[len - 1] == ']')
-		buf[len - 1] = '\0';
-
 	FUNC_EXIT;
 	return pos;
 }
@@ -84,13 +88,14 @@ int MQTTProtocol_connect(char* ip_address, Clients* aClient)
 {
 	int rc, port;
 	char* addr;
+	char buf[MQTTPROTOCOL_ADDRESS_LEN];
 
 	FUNC_ENTRY;
 	aClient->good = 1;
 	time(&(aClient->lastContact));
 
-	addr = MQTTProtocol_addressPort(ip_address, &port);
-	rc = Socket_new(addr, port, &(aClient->socket));
+	addr = MQTTProtocol_addressPort(ip_address, &port, buf);
+	rc = Socket_new(addr, port, &(aClient->socket), aClient);
 	if (rc == EINPROGRESS || rc == EWOULDBLOCK)
 		aClient->connect_state = 1; /* TCP connect called */
 	else if (rc == 0)
@@ -118,7 +123,7 @@ int MQTTProtocol_handlePingresps(void* pack, int sock)
 	int rc = TCPSOCKET_COMPLETE;
 
 	FUNC_ENTRY;
-	client = (Clients*)(ListFindItem(bstate->clients, &sock, clientSocketCompare)->content);
+	client = MQTTProtocol_findClient(sock);
 	Log(LOG_PROTOCOL, 21, NULL, sock, client->clientID);
 	client->ping_outstanding = 0;
 	FUNC_EXIT_RC(rc);
@@ -158,7 +163,7 @@ int MQTTProtocol_handleSubacks(void* pack, int sock)
 	int rc = TCPSOCKET_COMPLETE;
 
 	FUNC_ENTRY;
-	client = (Clients*)(ListFindItem(bstate->clients, &sock, clientSocketCompare)->content);
+	client = MQTTProtocol_findClient(sock);
 	Log(LOG_PROTOCOL, 23, NULL, sock, client->clientID, suback->msgId);
 	MQTTPacket_freeSuback(suback);
 	FUNC_EXIT_RC(rc);
@@ -197,7 +202,7 @@ int MQTTProtocol_handleUnsubacks(void* pack, int sock)
 	int rc = TCPSOCKET_COMPLETE;
 
 	FUNC_ENTRY;
-	client = (Clients*)(ListFindItem(bstate->clients, &sock, clientSocketCompare)->content);
+	client = MQTTProtocol_findClient(sock);
 	Log(LOG_PROTOCOL, 24, NULL, sock, client->clientID, unsuback->msgId);
 	free(unsuback);
 	FUNC_EXIT_RC(rc);
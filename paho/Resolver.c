@@ -0,0 +1,252 @@
+/*******************************************************************************
+ * Copyright (c) 2009, 2012 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *
+ * Contributors:
+ *    Ian Craggs - initial API and implementation and/or initial documentation
+ *******************************************************************************/
+
+/**
+ * @file
+ * \brief Host name resolution, with a cache shared by all clients
+ *
+ * getaddrinfo can block for as long as a DNS server takes to answer, and every connect
+ * needs an address, so resolved names are kept for a time to live, and all the clients
+ * connecting to one broker share a single lookup.  While a name is being looked up, other
+ * threads wanting it wait for that lookup rather than starting their own.  Failures are
+ * not kept, so the next connect after one tries again.
+ */
+#include "Resolver.h"
+#include "LinkedList.h"
+#include "Log.h"
+#include "StackTrace.h"
+#include "Thread.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if !defined(WIN32)
+#include <netdb.h>
+#endif
+
+#include "Heap.h"
+
+/**
+ * The return code of a lookup which is still in progress
+ */
+#define RESOLVER_PENDING -9999
+
+/**
+ * A name in the cache
+ */
+typedef struct
+{
+	char* name;
+	int rc; /**< getaddrinfo's return code, or RESOLVER_PENDING while the lookup is in progress */
+	Resolver_address address; /**< the address, if rc is 0 */
+	time_t expires; /**< when the address is to be looked up again */
+} resolver_entry;
+
+static List* entries = NULL;
+static int ttl = RESOLVER_DEFAULT_TTL;
+
+/**
+ * Guards the cache.  resolver_cond is signalled, with the mutex held, when a lookup ends.
+ */
+#if defined(WIN32)
+mutex_type resolver_mutex;
+cond_type resolver_cond;
+#else
+static pthread_mutex_t resolver_mutex_store = PTHREAD_MUTEX_INITIALIZER;
+static mutex_type resolver_mutex = &resolver_mutex_store;
+static pthread_cond_t resolver_cond_store = PTHREAD_COND_INITIALIZER;
+static cond_type resolver_cond = &resolver_cond_store;
+#endif
+
+
+/**
+ * Initialize the resolver module
+ */
+void Resolver_initialize(void)
+{
+	FUNC_ENTRY;
+	Thread_lock_mutex(resolver_mutex);
+	if (entries == NULL)
+		entries = ListInitialize();
+	Thread_unlock_mutex(resolver_mutex);
+	FUNC_EXIT;
+}
+
+
+/**
+ * Terminate the resolver module, emptying the cache
+ */
+void Resolver_terminate(void)
+{
+	ListElement* current = NULL;
+
+	FUNC_ENTRY;
+	Thread_lock_mutex(resolver_mutex);
+	if (entries)
+	{
+		while (ListNextElement(entries, &current))
+			free(((resolver_entry*)(current->content))->name);
+		ListFree(entries);
+		entries = NULL;
+	}
+	Thread_unlock_mutex(resolver_mutex);
+	FUNC_EXIT;
+}
+
+
+/**
+ * Set how long resolved names are kept for.  Names already in the cache keep the time they
+ * were given.
+ * @param seconds the time to live in seconds, or 0 to look names up on every connect
+ */
+void Resolver_setTTL(int seconds)
+{
+	Thread_lock_mutex(resolver_mutex);
+	ttl = (seconds < 0) ? 0 : seconds;
+	Thread_unlock_mutex(resolver_mutex);
+}
+
+
+/**
+ * Look a host name up with getaddrinfo, preferring an IPv4 address
+ * @param name the host name or address string
+ * @param address returns the address
+ * @return 0 on success, otherwise the getaddrinfo return code, or -1 if there was no
+ * address of a known family
+ */
+static int Resolver_getaddrinfo(char* name, Resolver_address* address)
+{
+	struct addrinfo *result = NULL;
+	struct addrinfo hints = {0, AF_UNSPEC, SOCK_STREAM, IPPROTO_TCP, 0, NULL, NULL, NULL};
+	int rc;
+
+	FUNC_ENTRY;
+	if ((rc = getaddrinfo(name, NULL, &hints, &result)) == 0)
+	{
+		struct addrinfo* res = result;
+
+		/* prefer ip4 addresses */
+		while (res)
+		{
+			if (res->ai_family == AF_INET)
+				break;
+			res = res->ai_next;
+		}
+		if (res == NULL)
+			res = result;
+
+		address->family = res->ai_family;
+#if defined(AF_INET6)
+		if (res->ai_family == AF_INET6)
+			address->addr6 = ((struct sockaddr_in6*)(res->ai_addr))->sin6_addr;
+		else
+#endif
+		if (res->ai_family == AF_INET)
+			address->addr = ((struct sockaddr_in*)(res->ai_addr))->sin_addr;
+		else
+			rc = -1;
+		freeaddrinfo(result);
+	}
+	else
+		Log(TRACE_MIN, -1, "getaddrinfo failed for addr %s with rc %d", name, rc);
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Find a name in the cache, with the mutex held
+ * @param name the host name
+ * @return the cache entry, or NULL
+ */
+static resolver_entry* Resolver_find_locked(char* name)
+{
+	ListElement* current = NULL;
+
+	if (entries == NULL)
+		return NULL;
+	while (ListNextElement(entries, &current))
+	{
+		if (strcmp(((resolver_entry*)(current->content))->name, name) == 0)
+			return (resolver_entry*)(current->content);
+	}
+	return NULL;
+}
+
+
+/**
+ * Resolve a host name to an address, from the cache if it is there and has not expired.
+ * Called without any other lock held, as a lookup can take a long time.
+ * @param name the host name or address string
+ * @param address returns the address
+ * @return 0 on success, otherwise the getaddrinfo return code, or -1 if there was no
+ * address of a known family
+ */
+int Resolver_lookup(char* name, Resolver_address* address)
+{
+	resolver_entry* entry = NULL;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	Thread_lock_mutex(resolver_mutex);
+	if (entries == NULL || ttl == 0)
+	{
+		Thread_unlock_mutex(resolver_mutex);
+		rc = Resolver_getaddrinfo(name, address);
+		goto exit;
+	}
+
+	if ((entry = Resolver_find_locked(name)) != NULL && entry->rc == RESOLVER_PENDING)
+	{	/* another thread is looking the name up, so take its answer, whatever it is */
+		while (entry != NULL && entry->rc == RESOLVER_PENDING)
+		{
+			Thread_wait_cond(resolver_cond, resolver_mutex, 1000L);
+			entry = Resolver_find_locked(name);
+		}
+		if (entry != NULL)
+		{
+			if ((rc = entry->rc) == 0)
+				*address = entry->address;
+			Thread_unlock_mutex(resolver_mutex);
+			goto exit;
+		}
+	}
+	else if (entry != NULL && entry->rc == 0 && time(NULL) < entry->expires)
+	{
+		*address = entry->address;
+		Thread_unlock_mutex(resolver_mutex);
+		goto exit;
+	}
+
+	if (entry == NULL)
+	{
+		entry = malloc(sizeof(resolver_entry));
+		entry->name = malloc(strlen(name) + 1);
+		strcpy(entry->name, name);
+		ListAppend(entries, entry, sizeof(resolver_entry) + strlen(name) + 1);
+	}
+	entry->rc = RESOLVER_PENDING;
+	Thread_unlock_mutex(resolver_mutex);
+
+	rc = Resolver_getaddrinfo(name, address);
+
+	Thread_lock_mutex(resolver_mutex);
+	entry->rc = rc;
+	entry->expires = (rc == 0) ? time(NULL) + ttl : 0;
+	if (rc == 0)
+		entry->address = *address;
+	Thread_signal_cond(resolver_cond);
+	Thread_unlock_mutex(resolver_mutex);
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
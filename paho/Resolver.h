@@ -0,0 +1,46 @@
+/*******************************************************************************
+ * Copyright (c) 2009, 2012 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *
+ * Contributors:
+ *    Ian Craggs - initial API and implementation and/or initial documentation
+ *******************************************************************************/
+
+#if !defined(RESOLVER_H)
+#define RESOLVER_H
+
+#if defined(WIN32)
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <sys/socket.h>
+#include <netinet/in.h>
+#endif
+
+/**
+ * The default number of seconds a resolved host name is kept for
+ */
+#define RESOLVER_DEFAULT_TTL 60
+
+/**
+ * The address a host name resolved to
+ */
+typedef struct
+{
+	int family; /**< AF_INET or AF_INET6 */
+	struct in_addr addr; /**< the address, if family is AF_INET */
+#if defined(AF_INET6)
+	struct in6_addr addr6; /**< the address, if family is AF_INET6 */
+#endif
+} Resolver_address;
+
+void Resolver_initialize(void);
+void Resolver_terminate(void);
+void Resolver_setTTL(int seconds);
+int Resolver_lookup(char* name, Resolver_address* address);
+
+#endif
@@ -21,8 +21,10 @@
 #include "Socket.h"
 #include "Log.h"
 #include "SocketBuffer.h"
+#include "Resolver.h"
 #include "Messages.h"
 #include "StackTrace.h"
+#include "Thread.h"
 
 #include <stdlib.h>
 #include <string.h>
@@ -32,20 +34,111 @@
 #include "Heap.h"
 
 int Socket_close_only(int socket);
-int Socket_continueWrites(fd_set* pwset);
+int Socket_continueWrite(int socket);
+#if !defined(USE_EPOLL)
+int Socket_continueWrites(Sockets* s, fd_set* pwset, List** completed);
+#endif
 
 #if defined(WIN32)
 #define iov_len len
 #define iov_base buf
+#define Socket_yield() SwitchToThread()
 #else
 #include <sys/uio.h>
+#include <sched.h>
+#define Socket_yield() sched_yield()
+#endif
+
+/**
+ * The socket data for the module, in shards.  Each socket belongs to one shard, chosen by
+ * its number, so that a thread per shard can wait for and work on its own sockets without
+ * contending with the others.
+ */
+static Sockets* shards = NULL;
+static int shardCount = 0;
+static Socket_writeComplete* writecomplete = NULL;
+static int highWaterMark = SOCKET_HIGH_WATER_MARK;
+static int busyPoll = 0; /* if > 0, microseconds for SO_BUSY_POLL, and spin instead of sleeping */
+static int noDelay = 0; /* boolean - turn Nagle's algorithm off on new sockets, with or without busyPoll */
+
+/**
+ * Guards the first shard; each of the others has its own mutex.  A shard's mutex is not
+ * held while waiting in select, or while writing to a socket with no write pending, as
+ * only the thread holding the client's lock does that.
+ */
+#if defined(WIN32)
+mutex_type socket_mutex;
+#else
+static pthread_mutex_t socket_mutex_store = PTHREAD_MUTEX_INITIALIZER;
+static mutex_type socket_mutex = &socket_mutex_store;
 #endif
 
+static int Socket_noPendingWrites_locked(Sockets* s, int socket);
+static void Socket_wakeup(Sockets* s);
+static void Socket_addPendingWrite_locked(Sockets* s, int socket);
+static int Socket_outputFull_locked(Sockets* s, int socket);
+static void Socket_flush_locked(Sockets* s, int socket, List** completed);
+static void Socket_setBuffered(int socket, int buffered);
+static int Socket_nextBuffered_locked(Sockets* s);
+static void Socket_writeDone_locked(Sockets* s, int socket, List** completed);
+static void Socket_quickAck(int socket);
+#if defined(USE_EPOLL)
+static void Socket_watch_locked(Sockets* s, int socket);
+#endif
+
+
+/**
+ * Find the shard a socket belongs to
+ * @param socket the socket
+ * @return the shard
+ */
+static Sockets* Socket_shard(int socket)
+{
+	return &shards[socket % shardCount];
+}
+
+
+/**
+ * Turn busy polling on or off.  With it on, waiting for sockets spins on non-blocking checks
+ * instead of sleeping in the kernel, yielding to other runnable threads on each pass so that
+ * they are not starved where processors are short.  New sockets are also set up for low
+ * latency: Nagle's algorithm off, delayed acknowledgements off, and SO_BUSY_POLL where the
+ * system has it.
+ * @param usecs microseconds for SO_BUSY_POLL, or 0 to turn busy polling off
+ */
+void Socket_setBusyPoll(int usecs)
+{
+	busyPoll = (usecs < 0) ? 0 : usecs;
+}
+
+
+/**
+ * Turn Nagle's algorithm off, or back on, for new sockets.  Busy polling turns it off
+ * regardless.
+ * @param on boolean - set TCP_NODELAY on new sockets
+ */
+void Socket_setNoDelay(int on)
+{
+	noDelay = on;
+}
+
+
 /**
- * Structure to hold all socket data for the module
+ * A clock in milliseconds for timing waits which spin rather than sleep
+ * @return the time in milliseconds, from an arbitrary start
  */
-static Sockets s;
-static fd_set wset;
+static long Socket_millis(void)
+{
+#if defined(WIN32)
+	return (long)GetTickCount();
+#else
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return now.tv_sec * 1000L + now.tv_usec / 1000L;
+#endif
+}
+
 
 /**
  * Set a socket non-blocking, OS independently
@@ -99,11 +192,52 @@ int Socket_error(char* aString, int sock)
 }
 
 
+/**
+ * Set the options which cut latency on a new socket: TCP_NODELAY if asked for or busy
+ * polling is on, and the busy polling options with it.  They are only hints to the TCP
+ * stack, so failures are traced and otherwise ignored.
+ * @param socket the socket
+ */
+static void Socket_setLowLatency(int socket)
+{
+	int on = 1;
+
+	if ((noDelay || busyPoll > 0) && setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, (char*)&on, sizeof(on)) != 0)
+		Socket_error("setsockopt TCP_NODELAY", socket);
+	if (busyPoll == 0)
+		return;
+#if defined(SO_BUSY_POLL)
+	if (setsockopt(socket, SOL_SOCKET, SO_BUSY_POLL, (char*)&busyPoll, sizeof(busyPoll)) != 0)
+		Socket_error("setsockopt SO_BUSY_POLL", socket);
+#endif
+	Socket_quickAck(socket);
+}
+
+
+/**
+ * Ask for data received on a socket to be acknowledged straight away.  Linux turns quick
+ * acknowledgements off again by itself, so this is repeated after every read.
+ * @param socket the socket
+ */
+static void Socket_quickAck(int socket)
+{
+#if defined(TCP_QUICKACK)
+	int on = 1;
+
+	if (busyPoll > 0)
+		setsockopt(socket, IPPROTO_TCP, TCP_QUICKACK, (char*)&on, sizeof(on));
+#endif
+}
+
+
 /**
  * Initialize the socket module
+ * @param count the number of shards to divide the sockets between, at least 1
  */
-void Socket_outInitialize()
+void Socket_outInitialize(int count)
 {
+	int i;
+
 #if defined(WIN32)
 	WORD    winsockVer = 0x0202;
 	WSADATA wsd;
@@ -116,28 +250,107 @@ void Socket_outInitialize()
 #endif
 
 	SocketBuffer_initialize();
-	s.clientsds = ListInitialize();
-	s.connect_pending = ListInitialize();
-	s.write_pending = ListInitialize();
-	s.cur_clientsds = NULL;
-	FD_ZERO(&(s.rset));														/* Initialize the descriptor set */
-	FD_ZERO(&(s.pending_wset));
-	s.maxfdp1 = 0;
-	memcpy((void*)&(s.rset_saved), (void*)&(s.rset), sizeof(s.rset_saved));
+	Resolver_initialize();
+	shardCount = (count < 1) ? 1 : count;
+	shards = malloc(sizeof(Sockets) * shardCount);
+	memset(shards, '\0', sizeof(Sockets) * shardCount);
+	for (i = 0; i < shardCount; ++i)
+	{
+		Sockets* s = &shards[i];
+
+		s->mutex = (i == 0) ? socket_mutex : Thread_create_mutex();
+		s->buffered = ListInitialize();
+		s->wakeup[0] = s->wakeup[1] = -1;
+		s->selecting = 0;
+#if defined(USE_EPOLL)
+		/* changes to an epoll set are seen by a thread already waiting on it, so no wakeup pipe */
+		if ((s->epfd = epoll_create(SOCKET_EPOLL_EVENTS)) == SOCKET_ERROR)
+			Socket_error("epoll_create", 0);
+		s->nevents = s->cur_event = 0;
+#else
+		s->clientsds = ListInitialize();
+		s->connect_pending = ListInitialize();
+		s->write_pending = ListInitialize();
+		s->cur_clientsds = NULL;
+		FD_ZERO(&(s->rset));														/* Initialize the descriptor set */
+		FD_ZERO(&(s->pending_wset));
+		s->maxfdp1 = 0;
+		memcpy((void*)&(s->rset_saved), (void*)&(s->rset), sizeof(s->rset_saved));
+#endif
+#if !defined(WIN32) && !defined(USE_EPOLL)
+		if (pipe(s->wakeup) == 0)
+		{
+			Socket_setnonblocking(s->wakeup[0]);
+			Socket_setnonblocking(s->wakeup[1]);
+		}
+		else
+			s->wakeup[0] = s->wakeup[1] = -1;
+#endif
+	}
 	FUNC_EXIT;
 }
 
 
+/**
+ * Get the number of shards the sockets are divided between
+ * @return the number of shards
+ */
+int Socket_shards(void)
+{
+	return shardCount;
+}
+
+
+/**
+ * Get the shard a socket belongs to, which is the one Socket_getReadySocket must be asked
+ * for to find out when the socket is ready
+ * @param socket the socket
+ * @return the shard number, from 0 to Socket_shards() - 1
+ */
+int Socket_shardOf(int socket)
+{
+	return socket % shardCount;
+}
+
+
 /**
  * Terminate the socket module
  */
 void Socket_outTerminate()
 {
+	int i;
+
 	FUNC_ENTRY;
-	ListFree(s.connect_pending);
-	ListFree(s.write_pending);
-	ListFree(s.clientsds);
+	for (i = 0; i < shardCount; ++i)
+	{
+		Sockets* s = &shards[i];
+
+		ListFree(s->buffered);
+		if (s->entries)
+			free(s->entries);
+#if defined(USE_EPOLL)
+		if (s->epfd != SOCKET_ERROR)
+			close(s->epfd);
+#else
+		ListFree(s->connect_pending);
+		ListFree(s->write_pending);
+		ListFree(s->clientsds);
+#endif
+#if !defined(WIN32)
+		if (s->wakeup[0] != -1)
+		{
+			close(s->wakeup[0]);
+			close(s->wakeup[1]);
+		}
+#endif
+		if (i > 0)
+			Thread_destroy_mutex(s->mutex);
+	}
+	free(shards);
+	shards = NULL;
+	shardCount = 0;
 	SocketBuffer_terminate();
+	Resolver_terminate();
 #if defined(WIN32)
 	WSACleanup();
 #endif
@@ -146,22 +359,143 @@ void Socket_outTerminate()
 
 
 /**
- * Add a socket to the list of socket to check with select
+ * Find the entry for a socket in its shard, with the shard's mutex held
+ * @param s the shard the socket belongs to
+ * @param socket the socket
+ * @param create boolean - make room for the entry if there is none yet
+ * @return the entry, or NULL if there is none and create is not set
+ */
+static Socket_entry* Socket_entry_locked(Sockets* s, int socket, int create)
+{
+	int index = socket / shardCount;
+
+	if (index >= s->entrieslen)
+	{
+		int newlen = (s->entrieslen == 0) ? 64 : s->entrieslen;
+
+		if (!create)
+			return NULL;
+		while (newlen <= index)
+			newlen *= 2;
+		if (s->entries == NULL)
+			s->entries = malloc(sizeof(Socket_entry) * newlen);
+		else
+			s->entries = realloc(s->entries, sizeof(Socket_entry) * newlen);
+		memset(&s->entries[s->entrieslen], '\0', sizeof(Socket_entry) * (newlen - s->entrieslen));
+		s->entrieslen = newlen;
+	}
+	return &s->entries[index];
+}
+
+
+/**
+ * Check the flags of a socket, with the shard's mutex held
+ * @param s the shard the socket belongs to
+ * @param socket the socket
+ * @param flags the flags to check
+ * @return boolean - is any of them set?
+ */
+static int Socket_isSet_locked(Sockets* s, int socket, int flags)
+{
+	Socket_entry* entry = Socket_entry_locked(s, socket, 0);
+
+	return entry != NULL && (entry->flags & flags) != 0;
+}
+
+
+/**
+ * Set or clear flags of a socket, with the shard's mutex held
+ * @param s the shard the socket belongs to
+ * @param socket the socket
+ * @param flags the flags to change
+ * @param on boolean - set them, rather than clear them
+ */
+static void Socket_set_locked(Sockets* s, int socket, int flags, int on)
+{
+	Socket_entry* entry = Socket_entry_locked(s, socket, on);
+
+	if (entry == NULL)
+		;
+	else if (on)
+		entry->flags |= flags;
+	else
+		entry->flags &= ~flags;
+}
+
+
+/**
+ * Record the owner of a socket, with the shard's mutex held
+ * @param s the shard the socket belongs to
+ * @param socket the socket
+ * @param owner the owner, or NULL for none
+ */
+static void Socket_setOwner_locked(Sockets* s, int socket, void* owner)
+{
+	Socket_entry* entry = Socket_entry_locked(s, socket, owner != NULL);
+
+	if (entry)
+		entry->owner = owner;
+}
+
+
+/**
+ * Find the owner of a socket, as given to Socket_new, without searching
+ * @param socket the socket
+ * @return the owner, or NULL if the socket has none
+ */
+void* Socket_getOwner(int socket)
+{
+	Sockets* s = NULL;
+	Socket_entry* entry = NULL;
+	void* owner = NULL;
+
+	if (socket <= 0 || shardCount == 0)
+		return NULL;
+	s = Socket_shard(socket);
+	Thread_lock_mutex(s->mutex);
+	if ((entry = Socket_entry_locked(s, socket, 0)) != NULL)
+		owner = entry->owner;
+	Thread_unlock_mutex(s->mutex);
+	return owner;
+}
+
+
+/**
+ * Add a socket to the list of socket to check with select.  Called with the shard's mutex held.
+ * @param s the shard the socket belongs to
  * @param newSd the new socket to add
  */
-int Socket_addSocket(int newSd)
+static int Socket_addSocket(Sockets* s, int newSd)
 {
 	int rc = 0;
 
 	FUNC_ENTRY;
-	if (ListFindItem(s.clientsds, &newSd, intcompare) == NULL) /* make sure we don't add the same socket twice */
+	if (!Socket_isSet_locked(s, newSd, SOCKET_ADDED)) /* make sure we don't add the same socket twice */
 	{
-		int* pnewSd = (int*)malloc(sizeof(newSd));
-		*pnewSd = newSd;
-		ListAppend(s.clientsds, pnewSd, sizeof(newSd));
-		FD_SET(newSd, &(s.rset_saved));
-		s.maxfdp1 = max(s.maxfdp1, newSd + 1);
+		Socket_set_locked(s, newSd, SOCKET_ADDED, 1);
+		++(s->count);
+#if defined(USE_EPOLL)
+		{
+			struct epoll_event event;
+
+			memset(&event, '\0', sizeof(event));
+			event.events = EPOLLIN;
+			event.data.fd = newSd;
+			if (epoll_ctl(s->epfd, EPOLL_CTL_ADD, newSd, &event) == SOCKET_ERROR)
+				Socket_error("epoll_ctl add", newSd);
+		}
+#else
+		{
+			int* pnewSd = (int*)malloc(sizeof(newSd));
+
+			*pnewSd = newSd;
+			ListAppend(s->clientsds, pnewSd, sizeof(newSd));
+		}
+		FD_SET(newSd, &(s->rset_saved));
+		s->maxfdp1 = max(s->maxfdp1, newSd + 1);
+#endif
 		rc = Socket_setnonblocking(newSd);
+		Socket_wakeup(s);
 	}
 	else
 		Log(TRACE_MIN, -1, "addSocket: socket %d already in the list", newSd);
@@ -171,80 +505,287 @@ int Socket_addSocket(int newSd)
 }
 
 
+#if defined(USE_EPOLL)
+/**
+ * Set what epoll watches a socket for: always reading, and writing only while a connect
+ * or a write is pending, so that writeable sockets do not wake the shard for nothing.
+ * Called with the shard's mutex held.
+ * @param s the shard the socket belongs to
+ * @param socket the socket
+ */
+static void Socket_watch_locked(Sockets* s, int socket)
+{
+	struct epoll_event event;
+
+	memset(&event, '\0', sizeof(event));
+	event.events = EPOLLIN;
+	if (Socket_isSet_locked(s, socket, SOCKET_WRITE_PENDING | SOCKET_CONNECT_PENDING))
+		event.events |= EPOLLOUT;
+	event.data.fd = socket;
+	if (epoll_ctl(s->epfd, EPOLL_CTL_MOD, socket, &event) == SOCKET_ERROR)
+		Socket_error("epoll_ctl mod", socket);
+}
+
+
+/**
+ * Work through the events from the last epoll_wait on a shard, finishing connects and pending
+ * writes, until a socket with data to read is found.  Called with the shard's mutex held.
+ * @param s the shard
+ * @param completed returns a list of the sockets whose pending writes are now complete
+ * @return the socket next ready, or 0 if none of the events left is for a ready socket
+ */
+static int Socket_nextEvent_locked(Sockets* s, List** completed)
+{
+	int rc = 0;
+
+	while (rc == 0 && s->cur_event < s->nevents)
+	{
+		struct epoll_event* event = &s->events[(s->cur_event)++];
+		int socket = event->data.fd;
+
+		if (socket == SOCKET_ERROR)
+			continue; /* closed since epoll_wait returned */
+		if (event->events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+		{
+			if (Socket_isSet_locked(s, socket, SOCKET_CONNECT_PENDING))
+			{	/* the connect has finished, one way or the other, and the client finds out which */
+				Socket_set_locked(s, socket, SOCKET_CONNECT_PENDING, 0);
+				Socket_watch_locked(s, socket);
+				rc = socket;
+				break;
+			}
+			if (Socket_isSet_locked(s, socket, SOCKET_WRITE_PENDING))
+				Socket_flush_locked(s, socket, completed);
+		}
+		/* don't accept work from a client while the work already sent back is piling up */
+		if ((event->events & (EPOLLIN | EPOLLERR | EPOLLHUP)) && !Socket_outputFull_locked(s, socket))
+			rc = socket;
+	}
+	return rc;
+}
+#else
 /**
  * Don't accept work from a client unless it is accepting work back, i.e. its socket is writeable
  * this seems like a reasonable form of flow control, and practically, seems to work.
+ * @param s the shard the socket belongs to
  * @param socket the socket to check
  * @param read_set the socket read set (see select doc)
  * @param write_set the socket write set (see select doc)
  * @return boolean - is the socket ready to go?
  */
-int isReady(int socket, fd_set* read_set, fd_set* write_set)
+static int isReady(Sockets* s, int socket, fd_set* read_set, fd_set* write_set)
 {
 	int rc = 1;
 
 	FUNC_ENTRY;
-	if  (ListFindItem(s.connect_pending, &socket, intcompare) && FD_ISSET(socket, write_set))
-		ListRemoveItem(s.connect_pending, &socket, intcompare);
+	if (Socket_isSet_locked(s, socket, SOCKET_CONNECT_PENDING) && FD_ISSET(socket, write_set))
+	{
+		Socket_set_locked(s, socket, SOCKET_CONNECT_PENDING, 0);
+		ListRemoveItem(s->connect_pending, &socket, intcompare);
+	}
 	else
-		rc = FD_ISSET(socket, read_set) && FD_ISSET(socket, write_set) && Socket_noPendingWrites(socket);
+		rc = FD_ISSET(socket, read_set) && FD_ISSET(socket, write_set) && !Socket_outputFull_locked(s, socket);
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
+#endif
+
+
+/**
+ * Set the function to be called when a pending write has been completed
+ * @param fn the callback, or NULL for none
+ */
+void Socket_setWriteCompleteCallback(Socket_writeComplete* fn)
+{
+	writecomplete = fn;
+}
 
 
+#if defined(USE_EPOLL)
 /**
- *  Returns the next socket ready for communications as indicated by select
+ *  Returns the next socket ready for communications in a shard, as indicated by epoll
+ *  @param shard the shard to look at, from 0 to Socket_shards() - 1
+ *  @param more_work flag to indicate more work is waiting, and thus a timeout value of 0 should
+ *  be used for the wait
+ *  @param tp the timeout to be used for the wait, unless overridden
+ *  @return the socket next ready, or 0 if none is ready
+ */
+int Socket_getReadySocket(int shard, int more_work, struct timeval *tp)
+{
+	int rc = 0;
+	Sockets* s = NULL;
+	List* completed = NULL;
+	int timeout = 1000, waited = 0; /* milliseconds */
+
+	FUNC_ENTRY;
+	if (shard < 0 || shard >= shardCount)
+	{
+		FUNC_EXIT_RC(rc);
+		return rc;
+	}
+	s = &shards[shard];
+	Thread_lock_mutex(s->mutex);
+	if (s->count == 0)
+		goto exit;
+	if ((rc = Socket_nextBuffered_locked(s)) != 0)
+		goto exit; /* packets already received are read before waiting for more */
+
+	if (more_work)
+		timeout = 0;
+	else if (tp)
+		timeout = tp->tv_sec * 1000 + (tp->tv_usec + 999) / 1000;
+
+	while ((rc = Socket_nextEvent_locked(s, &completed)) == 0 && !waited)
+	{
+		struct epoll_event events[SOCKET_EPOLL_EVENTS];
+		int count;
+
+		++(s->selecting);
+		Thread_unlock_mutex(s->mutex);
+		if (busyPoll > 0)
+		{	/* spin until something is ready or the timeout expires, letting other threads run */
+			long deadline = Socket_millis() + timeout;
+
+			while ((count = epoll_wait(s->epfd, events, SOCKET_EPOLL_EVENTS, 0)) == 0 && Socket_millis() < deadline)
+				Socket_yield();
+		}
+		else
+			count = epoll_wait(s->epfd, events, SOCKET_EPOLL_EVENTS, timeout);
+		Thread_lock_mutex(s->mutex);
+		--(s->selecting);
+		if (count == SOCKET_ERROR)
+		{
+			Socket_error("epoll_wait", 0);
+			goto exit;
+		}
+		Log(TRACE_MAX, -1, "Return code %d from epoll_wait", count);
+		memcpy(s->events, events, sizeof(struct epoll_event) * count);
+		s->nevents = count;
+		s->cur_event = 0;
+		waited = 1;
+	}
+exit:
+	Thread_unlock_mutex(s->mutex);
+	if (completed)
+	{
+		ListElement* cur = NULL;
+
+		while (ListNextElement(completed, &cur))
+		{
+			if (writecomplete)
+				(*writecomplete)(*(int*)(cur->content));
+		}
+		ListFree(completed);
+	}
+	FUNC_EXIT_RC(rc);
+	return rc;
+} /* end getReadySocket */
+#else
+/**
+ *  Returns the next socket ready for communications in a shard, as indicated by select
+ *  @param shard the shard to look at, from 0 to Socket_shards() - 1
  *  @param more_work flag to indicate more work is waiting, and thus a timeout value of 0 should
  *  be used for the select
  *  @param tp the timeout to be used for the select, unless overridden
  *  @return the socket next ready, or 0 if none is ready
  */
-int Socket_getReadySocket(int more_work, struct timeval *tp)
+int Socket_getReadySocket(int shard, int more_work, struct timeval *tp)
 {
 	int rc = 0;
+	Sockets* s = NULL;
+	List* completed = NULL;
 	static struct timeval zero = {0L, 0L}; /* 0 seconds */
 	static struct timeval one = {1L, 0L}; /* 1 second */
 	struct timeval timeout = one;
 
 	FUNC_ENTRY;
-	if (s.clientsds->count == 0)
+	if (shard < 0 || shard >= shardCount)
+	{
+		FUNC_EXIT_RC(rc);
+		return rc;
+	}
+	s = &shards[shard];
+	Thread_lock_mutex(s->mutex);
+	if (s->count == 0)
 		goto exit;
+	if ((rc = Socket_nextBuffered_locked(s)) != 0)
+		goto exit; /* packets already received are read before waiting for more */
 
 	if (more_work)
 		timeout = zero;
 	else if (tp)
 		timeout = *tp;
 
-	while (s.cur_clientsds != NULL)
+	while (s->cur_clientsds != NULL)
 	{
-		if (isReady(*((int*)(s.cur_clientsds->content)), &(s.rset), &wset))
+		if (isReady(s, *((int*)(s->cur_clientsds->content)), &(s->rset), &(s->wset)))
 			break;
-		ListNextElement(s.clientsds, &s.cur_clientsds);
+		ListNextElement(s->clientsds, &s->cur_clientsds);
 	}
 
-	if (s.cur_clientsds == NULL)
+	if (s->cur_clientsds == NULL)
 	{
-		int rc1;
-		fd_set pwset;
+		int rc1, maxfdp1 = s->maxfdp1;
+		fd_set rset, pwset;
 
-		memcpy((void*)&(s.rset), (void*)&(s.rset_saved), sizeof(s.rset));
-		memcpy((void*)&(pwset), (void*)&(s.pending_wset), sizeof(pwset));
-		if ((rc = select(s.maxfdp1, &(s.rset), &pwset, NULL, &timeout)) == SOCKET_ERROR)
+		memcpy((void*)&(rset), (void*)&(s->rset_saved), sizeof(rset));
+		memcpy((void*)&(pwset), (void*)&(s->pending_wset), sizeof(pwset));
+		if (s->connect_pending->count > 0)
+		{
+			ListElement* cur = NULL;
+
+			/* wait for connects to complete too, not just for incoming data */
+			while (ListNextElement(s->connect_pending, &cur))
+				FD_SET(*(int*)(cur->content), &pwset);
+		}
+		if (s->wakeup[0] != -1)
+		{
+			FD_SET(s->wakeup[0], &rset);
+			maxfdp1 = max(maxfdp1, s->wakeup[0] + 1);
+		}
+		++(s->selecting);
+		Thread_unlock_mutex(s->mutex);
+		if (busyPoll > 0)
+		{	/* spin until something is ready or the timeout expires, letting other threads run */
+			long deadline = Socket_millis() + timeout.tv_sec * 1000L + timeout.tv_usec / 1000L;
+			fd_set rset_wait = rset, pwset_wait = pwset;
+
+			while ((rc = select(maxfdp1, &(rset), &pwset, NULL, &zero)) == 0 && Socket_millis() < deadline)
+			{
+				rset = rset_wait;
+				pwset = pwset_wait;
+				Socket_yield();
+			}
+		}
+		else
+			rc = select(maxfdp1, &(rset), &pwset, NULL, &timeout);
+		Thread_lock_mutex(s->mutex);
+		--(s->selecting);
+		if (rc == SOCKET_ERROR)
 		{
 			Socket_error("read select", 0);
 			goto exit;
 		}
+		if (s->wakeup[0] != -1 && FD_ISSET(s->wakeup[0], &rset))
+		{
+			char buf[32];
+
+			while (read(s->wakeup[0], buf, sizeof(buf)) > 0)
+				;
+			FD_CLR(s->wakeup[0], &rset);
+			--rc;
+		}
 		Log(TRACE_MAX, -1, "Return code %d from read select", rc);
+		memcpy((void*)&(s->rset), (void*)&(rset), sizeof(s->rset));
 
-		if (Socket_continueWrites(&pwset) == SOCKET_ERROR)
+		if (Socket_continueWrites(s, &pwset, &completed) == SOCKET_ERROR)
 		{
 			rc = 0;
 			goto exit;
 		}
 
-		memcpy((void*)&wset, (void*)&(s.rset_saved), sizeof(wset));
-		if ((rc1 = select(s.maxfdp1, NULL, &(wset), NULL, &zero)) == SOCKET_ERROR)
+		memcpy((void*)&(s->wset), (void*)&(s->rset_saved), sizeof(s->wset));
+		if ((rc1 = select(s->maxfdp1, NULL, &(s->wset), NULL, &zero)) == SOCKET_ERROR)
 		{
 			Socket_error("write select", 0);
 			rc = rc1;
@@ -255,27 +796,81 @@ int Socket_getReadySocket(int more_work, struct timeval *tp)
 		if (rc == 0 && rc1 == 0)
 			goto exit; /* no work to do */
 
-		s.cur_clientsds = s.clientsds->first;
-		while (s.cur_clientsds != NULL)
+		s->cur_clientsds = s->clientsds->first;
+		while (s->cur_clientsds != NULL)
 		{
-			int cursock = *((int*)(s.cur_clientsds->content));
-			if (isReady(cursock, &(s.rset), &wset))
+			int cursock = *((int*)(s->cur_clientsds->content));
+			if (isReady(s, cursock, &(s->rset), &(s->wset)))
 				break;
-			ListNextElement(s.clientsds, &s.cur_clientsds);
+			ListNextElement(s->clientsds, &s->cur_clientsds);
 		}
 	}
 
-	if (s.cur_clientsds == NULL)
+	if (s->cur_clientsds == NULL)
 		rc = 0;
 	else
 	{
-		rc = *((int*)(s.cur_clientsds->content));
-		ListNextElement(s.clientsds, &s.cur_clientsds);
+		rc = *((int*)(s->cur_clientsds->content));
+		ListNextElement(s->clientsds, &s->cur_clientsds);
 	}
 exit:
+	Thread_unlock_mutex(s->mutex);
+	if (completed)
+	{
+		ListElement* cur = NULL;
+
+		while (ListNextElement(completed, &cur))
+		{
+			if (writecomplete)
+				(*writecomplete)(*(int*)(cur->content));
+		}
+		ListFree(completed);
+	}
 	FUNC_EXIT_RC(rc);
 	return rc;
 } /* end getReadySocket */
+#endif
+
+
+/**
+ *  Receives as much data as there is room for into a socket's input buffer, unless enough
+ *  is buffered already.  If there is still not enough, the read goes back to the start of
+ *  the packet, to be tried again when more data has arrived.
+ *  @param socket the socket to read from
+ *  @param bytes the number of bytes wanted from the current read position
+ *  @param actual_len the number of bytes buffered from the current read position, returned
+ *  @param rc completion code, returned: TCPSOCKET_COMPLETE if the bytes wanted are buffered
+ *  @return the data at the current read position
+ */
+static char* Socket_receive(int socket, int bytes, int* actual_len, int* rc)
+{
+	int room = 0;
+	char* buf = SocketBuffer_getQueuedData(socket, bytes, actual_len, &room);
+
+	if (*actual_len >= bytes)
+		*rc = TCPSOCKET_COMPLETE;
+	else if ((*rc = recv(socket, buf + (*actual_len), (size_t)room, 0)) == SOCKET_ERROR)
+	{
+		int err = Socket_error("recv - receive", socket);
+		if (err == EWOULDBLOCK || err == EAGAIN)
+			*rc = TCPSOCKET_INTERRUPTED;
+	}
+	else if (*rc == 0)
+		*rc = SOCKET_ERROR; 	/* The return value from recv is 0 when the peer has performed an orderly shutdown. */
+	else
+	{
+		Socket_quickAck(socket);
+		SocketBuffer_queued(socket, *rc);
+		*actual_len += *rc;
+		*rc = (*actual_len >= bytes) ? TCPSOCKET_COMPLETE : TCPSOCKET_INTERRUPTED;
+	}
+	if (*rc == TCPSOCKET_INTERRUPTED)
+	{
+		SocketBuffer_interrupted(socket);
+		Socket_setBuffered(socket, 0);
+	}
+	return buf;
+}
 
 
 /**
@@ -286,28 +881,15 @@ exit:
  */
 int Socket_getch(int socket, char* c)
 {
-	int rc = SOCKET_ERROR;
+	int rc = SOCKET_ERROR, actual_len = 0;
 
 	FUNC_ENTRY;
 	if ((rc = SocketBuffer_getQueuedChar(socket, c)) != SOCKETBUFFER_INTERRUPTED)
 		goto exit;
 
-	if ((rc = recv(socket, c, (size_t)1, 0)) == SOCKET_ERROR)
-	{
-		int err = Socket_error("recv - getch", socket);
-		if (err == EWOULDBLOCK || err == EAGAIN)
-		{
-			rc = TCPSOCKET_INTERRUPTED;
-			SocketBuffer_interrupted(socket, 0);
-		}
-	}
-	else if (rc == 0)
-		rc = SOCKET_ERROR; 	/* The return value from recv is 0 when the peer has performed an orderly shutdown. */
-	else if (rc == 1)
-	{
-		SocketBuffer_queueChar(socket, *c);
-		rc = TCPSOCKET_COMPLETE;
-	}
+	Socket_receive(socket, 1, &actual_len, &rc);
+	if (rc == TCPSOCKET_COMPLETE)
+		rc = SocketBuffer_getQueuedChar(socket, c);
 exit:
 	FUNC_EXIT_RC(rc);
 	return rc;
@@ -315,54 +897,105 @@ exit:
 
 
 /**
- *  Attempts to read a number of bytes from a socket, non-blocking. If a previous read did not
- *  finish, then retrieve that data.
+ *  Attempts to read a number of bytes from a socket, non-blocking, completing the packet
+ *  whose header has been read with Socket_getch.  If the bytes have not all arrived, the
+ *  packet is read again from its start next time.
  *  @param socket the socket to read from
  *  @param bytes the number of bytes to read
  *  @param actual_len the actual number of bytes read
- *  @return completion code
+ *  @return the data, which stays valid until the socket is next read, or NULL on error
  */
 char *Socket_getdata(int socket, int bytes, int* actual_len)
 {
-	int rc;
+	int rc, more = 0;
 	char* buf;
 
 	FUNC_ENTRY;
-	if (bytes == 0)
+	buf = Socket_receive(socket, bytes, actual_len, &rc);
+	if (rc == SOCKET_ERROR)
+		buf = NULL;
+	else if (rc == TCPSOCKET_COMPLETE)
 	{
-		buf = SocketBuffer_complete(socket);
-		goto exit;
+		buf = SocketBuffer_complete(socket, bytes, &more);
+		*actual_len = bytes;
+		Socket_setBuffered(socket, more > 0);
+	}
+	else /* we didn't read the whole packet */
+		Log(TRACE_MAX, -1, "%d bytes expected but %d bytes now received", bytes, *actual_len);
+	FUNC_EXIT;
+	return buf;
+}
+
+
+/**
+ * Record whether a socket has data buffered beyond the packets already read, so that
+ * Socket_getReadySocket returns it without waiting for more data to arrive
+ * @param socket the socket
+ * @param buffered boolean - is there data buffered?
+ */
+static void Socket_setBuffered(int socket, int buffered)
+{
+	Sockets* s = Socket_shard(socket);
+
+	Thread_lock_mutex(s->mutex);
+	if (buffered == Socket_isSet_locked(s, socket, SOCKET_BUFFERED))
+		; /* no change, so no need to look through the list */
+	else if (!buffered)
+		ListRemoveItem(s->buffered, &socket, intcompare);
+	else
+	{
+		int* pnewSd = (int*)malloc(sizeof(int));
+
+		*pnewSd = socket;
+		ListAppend(s->buffered, pnewSd, sizeof(int));
 	}
+	Socket_set_locked(s, socket, SOCKET_BUFFERED, buffered);
+	Thread_unlock_mutex(s->mutex);
+}
+
 
-	buf = SocketBuffer_getQueuedData(socket, bytes, actual_len);
+/**
+ * Find the next socket in a shard which has data buffered, and does not have output queued
+ * up to the high-water mark.  Called with the shard's mutex held.
+ * @param s the shard
+ * @return the socket, or 0 if there is none
+ */
+static int Socket_nextBuffered_locked(Sockets* s)
+{
+	int rc = 0;
+	ListElement* cur = NULL;
 
-	if ((rc = recv(socket, buf + (*actual_len), (size_t)(bytes - (*actual_len)), 0)) == SOCKET_ERROR)
+	while (ListNextElement(s->buffered, &cur))
 	{
-		rc = Socket_error("recv - getdata", socket);
-		if (rc != EAGAIN && rc != EWOULDBLOCK)
+		int* socket = (int*)(cur->content);
+
+		if (!Socket_outputFull_locked(s, *socket))
 		{
-			buf = NULL;
-			goto exit;
+			rc = *socket;
+			/* to the back of the list, so that each socket with data buffered takes its turn */
+			ListDetach(s->buffered, socket);
+			ListAppend(s->buffered, socket, sizeof(int));
+			break;
 		}
 	}
-	else if (rc == 0) /* rc 0 means the other end closed the socket, albeit "gracefully" */
-	{
-		buf = NULL;
-		goto exit;
-	}
-	else
-		*actual_len += rc;
+	return rc;
+}
 
-	if (*actual_len == bytes)
-		SocketBuffer_complete(socket);
-	else /* we didn't read the whole packet */
+
+/**
+ * Interrupt any thread waiting in select on a shard, so that it picks up changes to the
+ * shard's socket sets.  Called with the shard's mutex held.
+ * @param s the shard
+ */
+static void Socket_wakeup(Sockets* s)
+{
+	if (s->selecting > 0 && s->wakeup[1] != -1)
 	{
-		SocketBuffer_interrupted(socket, *actual_len);
-		Log(TRACE_MAX, -1, "%d bytes expected but %d bytes now received", bytes, *actual_len);
+		char c = 0;
+
+		if (write(s->wakeup[1], &c, 1) != 1)
+			; /* the pipe is full, so a wakeup is already pending */
 	}
-exit:
-	FUNC_EXIT;
-	return buf;
 }
 
 
@@ -372,8 +1005,140 @@ exit:
  */
 int Socket_noPendingWrites(int socket)
 {
-	int cursock = socket;
-	return ListFindItem(s.write_pending, &cursock, intcompare) == NULL;
+	Sockets* s = Socket_shard(socket);
+	int rc;
+
+	Thread_lock_mutex(s->mutex);
+	rc = Socket_noPendingWrites_locked(s, socket);
+	Thread_unlock_mutex(s->mutex);
+	return rc;
+}
+
+
+/**
+ *  Indicate whether any data is pending outbound for a socket, with the shard's mutex held.
+ *  @return boolean - true == data pending.
+ */
+static int Socket_noPendingWrites_locked(Sockets* s, int socket)
+{
+	return !Socket_isSet_locked(s, socket, SOCKET_WRITE_PENDING);
+}
+
+
+/**
+ *  Indicate whether the output queued for a socket has reached the high-water mark, so that
+ *  no more work should be taken on for it until some has been written.
+ *  @param socket the socket
+ *  @return boolean - true == the output queue is full.
+ */
+int Socket_outputFull(int socket)
+{
+	Sockets* s = Socket_shard(socket);
+	int rc;
+
+	Thread_lock_mutex(s->mutex);
+	rc = Socket_outputFull_locked(s, socket);
+	Thread_unlock_mutex(s->mutex);
+	return rc;
+}
+
+
+/**
+ *  Indicate whether the output queued for a socket has reached the high-water mark, with the
+ *  shard's mutex held.
+ *  @return boolean - true == the output queue is full.
+ */
+static int Socket_outputFull_locked(Sockets* s, int socket)
+{
+	return !Socket_noPendingWrites_locked(s, socket) && SocketBuffer_queuedWrites(socket) >= highWaterMark;
+}
+
+
+/**
+ *  Set the number of bytes of output which can be queued for a socket before Socket_outputFull
+ *  reports it full.  Output is still queued beyond the mark, but no more input is read from
+ *  the socket, and the MQTT client waits before publishing to it.
+ *  @param bytes the high-water mark, at least 1
+ */
+void Socket_setHighWaterMark(int bytes)
+{
+	highWaterMark = (bytes < 1) ? 1 : bytes;
+}
+
+
+/**
+ *  Record that a socket has output queued, so that it is written when the socket is next
+ *  writeable.  Called with the shard's mutex held.
+ *  @param s the shard the socket belongs to
+ *  @param socket the socket
+ */
+static void Socket_addPendingWrite_locked(Sockets* s, int socket)
+{
+	Socket_set_locked(s, socket, SOCKET_WRITE_PENDING, 1);
+#if defined(USE_EPOLL)
+	Socket_watch_locked(s, socket);
+#else
+	{
+		int* sockmem = (int*)malloc(sizeof(int));
+
+		*sockmem = socket;
+		ListAppend(s->write_pending, sockmem, sizeof(int));
+	}
+	FD_SET(socket, &(s->pending_wset));
+#endif
+	Socket_wakeup(s);
+}
+
+
+/**
+ *  Tidy up after a socket's queued output has all been written, with the shard's mutex held
+ *  @param s the shard
+ *  @param socket the socket
+ *  @param completed returns a list of the sockets whose writes are now complete, created
+ *  if there are any, so that they can be reported once the socket lock is released
+ */
+static void Socket_writeDone_locked(Sockets* s, int socket, List** completed)
+{
+	int* sockmem = (int*)malloc(sizeof(int));
+
+	*sockmem = socket;
+	if (*completed == NULL)
+		*completed = ListInitialize();
+	ListAppend(*completed, sockmem, sizeof(int));
+	Socket_set_locked(s, socket, SOCKET_WRITE_PENDING, 0);
+#if defined(USE_EPOLL)
+	Socket_watch_locked(s, socket);
+#else
+	if (!ListRemoveItem(s->write_pending, &socket, intcompare))
+		Log(LOG_SEVERE, -1, "Failed to remove pending write from list");
+	FD_CLR(socket, &(s->pending_wset));
+#endif
+}
+
+
+/**
+ *  Write what can be written of a socket's queued output, now that the socket is writeable.
+ *  Called with the shard's mutex held.
+ *  @param s the shard
+ *  @param socket the socket, which has a write pending
+ *  @param completed returns a list of the sockets whose writers should be woken: those whose
+ *  output is all written, and those whose output has dropped below the high-water mark
+ */
+static void Socket_flush_locked(Sockets* s, int socket, List** completed)
+{
+	int full = Socket_outputFull_locked(s, socket);
+
+	if (Socket_continueWrite(socket))
+		Socket_writeDone_locked(s, socket, completed);
+	else if (full && !Socket_outputFull_locked(s, socket))
+	{
+		int* sockmem = (int*)malloc(sizeof(int));
+
+		*sockmem = socket;
+		if (*completed == NULL)
+			*completed = ListInitialize();
+		ListAppend(*completed, sockmem, sizeof(int));
+	}
 }
 
 
@@ -417,58 +1182,107 @@ int Socket_writev(int socket, iobuf* iovecs, int count, unsigned long* bytes)
 
 
 /**
- *  Attempts to write a series of buffers to a socket in *one* system call so that they are
- *  sent as one packet.
+ *  Writes buffers to a socket in one system call, or queues them behind any output already
+ *  waiting for the socket.  What cannot be written straight away is copied to the socket's
+ *  output queue and written when the socket is next writeable, so the caller keeps its buffers.
  *  @param socket the socket to write to
- *  @param buf0 the first buffer
- *  @param buf0len the length of data in the first buffer
+ *  @param iovecs the buffers
  *  @param count number of buffers
- *  @param buffers an array of buffers to write
- *  @param buflens an array of corresponding buffer lengths
- *  @return completion code, especially TCPSOCKET_INTERRUPTED
+ *  @param total the total length of the buffers
+ *  @return completion code: TCPSOCKET_COMPLETE once the data is written or queued
  */
-int Socket_putdatas(int socket, char* buf0, int buf0len, int count, char** buffers, int* buflens)
+static int Socket_write(int socket, iobuf* iovecs, int count, int total)
 {
+	Sockets* s = Socket_shard(socket);
 	unsigned long bytes = 0L;
-	iobuf iovecs[5];
-	int rc = TCPSOCKET_INTERRUPTED, i, total = buf0len;
+	int rc = TCPSOCKET_COMPLETE;
 
 	FUNC_ENTRY;
-	if (!Socket_noPendingWrites(socket))
-	{
-		Log(LOG_SEVERE, -1, "Trying to write to socket %d for which there is already pending output", socket);
-		rc = SOCKET_ERROR;
+	Thread_lock_mutex(s->mutex);
+	if (!Socket_noPendingWrites_locked(s, socket))
+	{	/* behind what is already queued, which is written when the socket is writeable */
+		SocketBuffer_queueWrite(socket, count, iovecs, 0);
+		Thread_unlock_mutex(s->mutex);
 		goto exit;
 	}
+	/* only the thread holding the client's lock writes to the socket, so it can write unlocked */
+	Thread_unlock_mutex(s->mutex);
 
-	for (i = 0; i < count; i++)
-		total += buflens[i];
+	if ((rc = Socket_writev(socket, iovecs, count, &bytes)) != SOCKET_ERROR)
+	{
+		if (bytes != total)
+		{
+			Log(TRACE_MIN, -1, "Partial write: %ld bytes of %d actually written on socket %d",
+					bytes, total, socket);
+			Thread_lock_mutex(s->mutex);
+			SocketBuffer_queueWrite(socket, count, iovecs, bytes);
+			Socket_addPendingWrite_locked(s, socket);
+			Thread_unlock_mutex(s->mutex);
+		}
+		rc = TCPSOCKET_COMPLETE;
+	}
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ *  Writes a series of buffers to a socket in *one* system call so that they are sent as one
+ *  packet.  The caller keeps ownership of all the buffers: if the write is not complete, what
+ *  remains is copied and finished when the socket is next writeable.
+ *  @param socket the socket to write to
+ *  @param buf0 the first buffer
+ *  @param buf0len the length of data in the first buffer
+ *  @param count number of buffers, at most 4
+ *  @param buffers an array of buffers to write
+ *  @param buflens an array of corresponding buffer lengths
+ *  @return completion code: TCPSOCKET_COMPLETE or SOCKET_ERROR
+ */
+int Socket_putdatas(int socket, char* buf0, int buf0len, int count, char** buffers, int* buflens)
+{
+	iobuf iovecs[5];
+	int rc, i, total = buf0len;
 
+	FUNC_ENTRY;
 	iovecs[0].iov_base = buf0;
 	iovecs[0].iov_len = buf0len;
 	for (i = 0; i < count; i++)
 	{
 		iovecs[i+1].iov_base = buffers[i];
 		iovecs[i+1].iov_len = buflens[i];
+		total += buflens[i];
 	}
+	rc = Socket_write(socket, iovecs, count+1, total);
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
 
-	if ((rc = Socket_writev(socket, iovecs, count+1, &bytes)) != SOCKET_ERROR)
+/**
+ *  Writes a series of buffers, which may hold several packets, to a socket in one system call.
+ *  As with Socket_putdatas, the caller keeps ownership of all the buffers.
+ *  @param socket the socket to write to
+ *  @param count number of buffers, no more than SOCKET_MAX_BUFFERS
+ *  @param buffers an array of buffers to write
+ *  @param buflens an array of corresponding buffer lengths
+ *  @return completion code: TCPSOCKET_COMPLETE or SOCKET_ERROR
+ */
+int Socket_putdatav(int socket, int count, char** buffers, int* buflens)
+{
+	iobuf* iovecs = NULL;
+	int rc, i, total = 0;
+
+	FUNC_ENTRY;
+	iovecs = malloc(sizeof(iobuf) * count);
+	for (i = 0; i < count; i++)
 	{
-		if (bytes == total)
-			rc = TCPSOCKET_COMPLETE;
-		else
-		{
-			int* sockmem = (int*)malloc(sizeof(int));
-			Log(TRACE_MIN, -1, "Partial write: %ld bytes of %d actually written on socket %d",
-					bytes, total, socket);
-			SocketBuffer_pendingWrite(socket, count+1, iovecs, total, bytes);
-			*sockmem = socket;
-			ListAppend(s.write_pending, sockmem, sizeof(int));
-			FD_SET(socket, &(s.pending_wset));
-			rc = TCPSOCKET_INTERRUPTED;
-		}
+		iovecs[i].iov_base = buffers[i];
+		iovecs[i].iov_len = buflens[i];
+		total += buflens[i];
 	}
-exit:
+	rc = Socket_write(socket, iovecs, count, total);
+	free(iovecs);
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
@@ -507,32 +1321,66 @@ int Socket_close_only(int socket)
  */
 void Socket_close(int socket)
 {
+	Sockets* s = Socket_shard(socket);
+
 	FUNC_ENTRY;
+	Thread_lock_mutex(s->mutex);
+	if (!Socket_noPendingWrites_locked(s, socket))
+		Socket_continueWrite(socket); /* a last try, so that a final packet such as DISCONNECT has a chance */
+#if defined(USE_EPOLL)
+	{
+		int i;
+
+		if (epoll_ctl(s->epfd, EPOLL_CTL_DEL, socket, NULL) == SOCKET_ERROR)
+			Socket_error("epoll_ctl del", socket);
+		for (i = s->cur_event; i < s->nevents; ++i)
+		{
+			if (s->events[i].data.fd == socket)
+				s->events[i].data.fd = SOCKET_ERROR; /* the number could be reused before the event is looked at */
+		}
+	}
+#endif
 	Socket_close_only(socket);
-	FD_CLR(socket, &(s.rset_saved));
-	if (FD_ISSET(socket, &(s.pending_wset)))
-		FD_CLR(socket, &(s.pending_wset));
-	if (s.cur_clientsds != NULL && *(int*)(s.cur_clientsds->content) == socket)
-		s.cur_clientsds = s.cur_clientsds->next;
-	ListRemoveItem(s.connect_pending, &socket, intcompare);
-	ListRemoveItem(s.write_pending, &socket, intcompare);
+#if !defined(USE_EPOLL)
+	FD_CLR(socket, &(s->rset_saved));
+	if (FD_ISSET(socket, &(s->pending_wset)))
+		FD_CLR(socket, &(s->pending_wset));
+	Socket_wakeup(s); /* so that select is not left waiting on the closed socket */
+	if (s->cur_clientsds != NULL && *(int*)(s->cur_clientsds->content) == socket)
+		s->cur_clientsds = s->cur_clientsds->next;
+	if (Socket_isSet_locked(s, socket, SOCKET_CONNECT_PENDING))
+		ListRemoveItem(s->connect_pending, &socket, intcompare);
+	if (Socket_isSet_locked(s, socket, SOCKET_WRITE_PENDING))
+		ListRemoveItem(s->write_pending, &socket, intcompare);
+	ListRemoveItem(s->clientsds, &socket, intcompare);
+#endif
+	if (Socket_isSet_locked(s, socket, SOCKET_BUFFERED))
+		ListRemoveItem(s->buffered, &socket, intcompare);
 	SocketBuffer_cleanup(socket);
 
-	if (ListRemoveItem(s.clientsds, &socket, intcompare))
+	if (Socket_isSet_locked(s, socket, SOCKET_ADDED))
+	{
+		--(s->count);
 		Log(TRACE_MIN, -1, "Removed socket %d", socket);
+	}
 	else
 		Log(TRACE_MIN, -1, "Failed to remove socket %d", socket);
-	if (socket + 1 >= s.maxfdp1)
+	Socket_set_locked(s, socket, ~0, 0);
+	Socket_setOwner_locked(s, socket, NULL);
+#if !defined(USE_EPOLL)
+	if (socket + 1 >= s->maxfdp1)
 	{
-		/* now we have to reset s.maxfdp1 */
+		/* now we have to reset s->maxfdp1 */
 		ListElement* cur_clientsds = NULL;
 
-		s.maxfdp1 = 0;
-		while (ListNextElement(s.clientsds, &cur_clientsds))
-			s.maxfdp1 = max(*((int*)(cur_clientsds->content)), s.maxfdp1);
-		++(s.maxfdp1);
-		Log(TRACE_MAX, -1, "Reset max fdp1 to %d", s.maxfdp1);
+		s->maxfdp1 = 0;
+		while (ListNextElement(s->clientsds, &cur_clientsds))
+			s->maxfdp1 = max(*((int*)(cur_clientsds->content)), s->maxfdp1);
+		++(s->maxfdp1);
+		Log(TRACE_MAX, -1, "Reset max fdp1 to %d", s->maxfdp1);
 	}
+#endif
+	Thread_unlock_mutex(s->mutex);
 	FUNC_EXIT;
 }
 
@@ -542,9 +1390,10 @@ void Socket_close(int socket)
  *  @param addr the address string
  *  @param port the TCP port
  *  @param sock returns the new socket
+ *  @param owner the owner of the socket, returned by Socket_getOwner until the socket is closed
  *  @return completion code
  */
-int Socket_new(char* addr, int port, int* sock)
+int Socket_new(char* addr, int port, int* sock, void* owner)
 {
 	int type = SOCK_STREAM;
 	struct sockaddr_in address;
@@ -557,8 +1406,7 @@ int Socket_new(char* addr, int port, int* sock)
 #else
 	sa_family_t family = AF_INET;
 #endif
-	struct addrinfo *result = NULL;
-	struct addrinfo hints = {0, AF_UNSPEC, SOCK_STREAM, IPPROTO_TCP, 0, NULL, NULL, NULL};
+	Resolver_address resolved;
 
 	FUNC_ENTRY;
 	*sock = -1;
@@ -566,43 +1414,25 @@ int Socket_new(char* addr, int port, int* sock)
 	if (addr[0] == '[')
 	  ++addr;
 
-	if ((rc = getaddrinfo(addr, NULL, &hints, &result)) == 0)
+	if ((rc = Resolver_lookup(addr, &resolved)) == 0)
 	{
-		struct addrinfo* res = result;
-
-		/* prefer ip4 addresses */
-		while (res)
-		{
-			if (res->ai_family == AF_INET)
-			{
-				result = res;
-				break;
-			}
-			res = res->ai_next;
-		}
-
 #if defined(AF_INET6)
-		if (result->ai_family == AF_INET6)
+		if (resolved.family == AF_INET6)
 		{
+			memset(&address6, '\0', sizeof(address6));
 			address6.sin6_port = htons(port);
 			address6.sin6_family = family = AF_INET6;
-			address6.sin6_addr = ((struct sockaddr_in6*)(result->ai_addr))->sin6_addr;
+			address6.sin6_addr = resolved.addr6;
 		}
 		else
 #endif
-		if (result->ai_family == AF_INET)
 		{
+			memset(&address, '\0', sizeof(address));
 			address.sin_port = htons(port);
 			address.sin_family = family = AF_INET;
-			address.sin_addr = ((struct sockaddr_in*)(result->ai_addr))->sin_addr;
+			address.sin_addr = resolved.addr;
 		}
-		else
-			rc = -1;
-
-    freeaddrinfo(result);
 	}
-  else
-  	Log(TRACE_MIN, -1, "getaddrinfo failed for addr %s with rc %d", addr, rc);
 
 	if (rc != 0)
 		Log(LOG_ERROR, -1, "%s is not a valid IP address", addr);
@@ -613,8 +1443,15 @@ int Socket_new(char* addr, int port, int* sock)
 			rc = Socket_error("socket", *sock);
 		else
 		{
+			Sockets* s = Socket_shard(*sock);
+
 			Log(TRACE_MIN, -1, "New socket %d for %s, port %d",	*sock, addr, port);
-			if (Socket_addSocket(*sock) == SOCKET_ERROR)
+			Socket_setLowLatency(*sock);
+			Thread_lock_mutex(s->mutex);
+			Socket_setOwner_locked(s, *sock, owner);
+			rc = Socket_addSocket(s, *sock);
+			Thread_unlock_mutex(s->mutex);
+			if (rc == SOCKET_ERROR)
 				rc = Socket_error("setnonblocking", *sock);
 			else
 			{
@@ -629,9 +1466,20 @@ int Socket_new(char* addr, int port, int* sock)
 					rc = Socket_error("connect", *sock);
 				if (rc == EINPROGRESS || rc == EWOULDBLOCK)
 				{
-					int* pnewSd = (int*)malloc(sizeof(int));
-					*pnewSd = *sock;
-					ListAppend(s.connect_pending, pnewSd, sizeof(int));
+					Thread_lock_mutex(s->mutex);
+					Socket_set_locked(s, *sock, SOCKET_CONNECT_PENDING, 1);
+#if defined(USE_EPOLL)
+					Socket_watch_locked(s, *sock);
+#else
+					{
+						int* pnewSd = (int*)malloc(sizeof(int));
+
+						*pnewSd = *sock;
+						ListAppend(s->connect_pending, pnewSd, sizeof(int));
+					}
+#endif
+					Socket_wakeup(s);
+					Thread_unlock_mutex(s->mutex);
 					Log(TRACE_MIN, 15, "Connect pending");
 				}
 			}
@@ -643,92 +1491,62 @@ int Socket_new(char* addr, int port, int* sock)
 
 
 /**
- *  Continue an outstanding write for a particular socket
+ *  Write as much as possible of the output queued for a socket, with the shard's mutex held
  *  @param socket that socket
- *  @return completion code
+ *  @return completion code: boolean - is all the queued output written? - or SOCKET_ERROR
  */
 int Socket_continueWrite(int socket)
 {
-	int rc = 0;
-	pending_writes* pw;
-	unsigned long curbuflen = 0L, /* cumulative total of buffer lengths */
-		bytes;
-	int curbuf = -1, i;
-	iobuf iovecs1[5];
+	int rc = 0, count;
+	unsigned long bytes = 0L;
+	iobuf iovecs[2];
 
 	FUNC_ENTRY;
-	pw = SocketBuffer_getWrite(socket);
-
-	for (i = 0; i < pw->count; ++i)
-	{
-		if (pw->bytes <= curbuflen)
-		{ /* if previously written length is less than the buffer we are currently looking at,
-				add the whole buffer */
-			iovecs1[++curbuf].iov_len = pw->iovecs[i].iov_len;
-			iovecs1[curbuf].iov_base = pw->iovecs[i].iov_base;
-		}
-		else if (pw->bytes < curbuflen + pw->iovecs[i].iov_len)
-		{ /* if previously written length is in the middle of the buffer we are currently looking at,
-				add some of the buffer */
-			int offset = pw->bytes - curbuflen;
-			iovecs1[++curbuf].iov_len = pw->iovecs[i].iov_len - offset;
-			iovecs1[curbuf].iov_base = pw->iovecs[i].iov_base + offset;
-			break;
-		}
-		curbuflen += pw->iovecs[i].iov_len;
-	}
-
-	if ((rc = Socket_writev(socket, iovecs1, curbuf+1, &bytes)) != SOCKET_ERROR)
-	{
-		pw->bytes += bytes;
-		if ((rc = (pw->bytes == pw->total)))
-		{  /* topic and payload buffers are freed elsewhere, when all references to them have been removed */
-			free(pw->iovecs[0].iov_base);
-			free(pw->iovecs[1].iov_base);
-			if (pw->count == 5)
-				free(pw->iovecs[3].iov_base);
-			Log(TRACE_MIN, -1, "ContinueWrite: partial write now complete for socket %d", socket);
-		}
-		else
-			Log(TRACE_MIN, -1, "ContinueWrite wrote +%lu bytes on socket %d", bytes, socket);
-	}
+	if ((count = SocketBuffer_getWrite(socket, iovecs)) == 0)
+		rc = 1;
+	else if ((rc = Socket_writev(socket, iovecs, count, &bytes)) == SOCKET_ERROR)
+		SocketBuffer_wrote(socket, SocketBuffer_queuedWrites(socket)); /* the socket is broken, so this would never be written */
+	else if ((rc = (SocketBuffer_wrote(socket, bytes) == 0)))
+		Log(TRACE_MIN, -1, "ContinueWrite: queued output now written for socket %d", socket);
+	else
+		Log(TRACE_MIN, -1, "ContinueWrite wrote +%lu bytes on socket %d", bytes, socket);
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
 
 
+#if !defined(USE_EPOLL)
 /**
- *  Continue any outstanding writes for a socket set
+ *  Continue any outstanding writes for a socket set, with the shard's mutex held
+ *  @param s the shard
  *  @param pwset the set of sockets
+ *  @param completed returns a list of the sockets whose writes are now complete, created
+ *  if there are any, so that they can be reported once the socket lock is released
  *  @return completion code
  */
-int Socket_continueWrites(fd_set* pwset)
+int Socket_continueWrites(Sockets* s, fd_set* pwset, List** completed)
 {
 	int rc1 = 0;
-	ListElement* curpending = s.write_pending->first;
+	ListElement* curpending = s->write_pending->first;
 
 	FUNC_ENTRY;
 	while (curpending)
 	{
 		int socket = *(int*)(curpending->content);
-		if (FD_ISSET(socket, pwset) && Socket_continueWrite(socket))
+		if (FD_ISSET(socket, pwset))
 		{
-			if (!SocketBuffer_writeComplete(socket))
-				Log(LOG_SEVERE, -1, "Failed to remove pending write from socket buffer list");
-			FD_CLR(socket, &(s.pending_wset));
-			if (!ListRemove(s.write_pending, curpending->content))
-			{
-				Log(LOG_SEVERE, -1, "Failed to remove pending write from list");
-				ListNextElement(s.write_pending, &curpending);
-			}
-			curpending = s.write_pending->current;
+			ListElement* next = curpending->next;
+
+			Socket_flush_locked(s, socket, completed);
+			curpending = next;
 		}
 		else
-			ListNextElement(s.write_pending, &curpending);
+			ListNextElement(s->write_pending, &curpending);
 	}
 	FUNC_EXIT_RC(rc1);
 	return rc1;
 }
+#endif
 
 
 /**
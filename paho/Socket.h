@@ -41,6 +41,16 @@
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#endif
+
+/*
+ * On Linux the shards wait for their sockets with epoll rather than select, which has no
+ * limit on socket numbers and costs nothing for idle sockets.  Define NO_EPOLL to use select.
+ */
+#if defined(__linux__) && !defined(NO_EPOLL)
+#define USE_EPOLL
+#include <sys/epoll.h>
 #endif
 
 /** socket operation completed successfully */
@@ -62,6 +72,43 @@
 #endif
 
 #include "LinkedList.h"
+#include "Thread.h"
+
+/**
+ * The most buffers which can be written in one call of Socket_putdatav
+ */
+#if defined(IOV_MAX)
+#define SOCKET_MAX_BUFFERS IOV_MAX
+#else
+#define SOCKET_MAX_BUFFERS 1024
+#endif
+
+/**
+ * The default number of bytes of output which can be queued for a socket before it counts as full
+ */
+#define SOCKET_HIGH_WATER_MARK 65536
+
+/**
+ * The most events each shard takes from one epoll_wait
+ */
+#define SOCKET_EPOLL_EVENTS 64
+
+/**
+ * Flags recorded for each socket in a shard's entries
+ */
+#define SOCKET_ADDED 0x01 /**< the socket is one of the shard's */
+#define SOCKET_CONNECT_PENDING 0x02 /**< a connect is pending */
+#define SOCKET_WRITE_PENDING 0x04 /**< output is queued, to be written when the socket is writeable */
+#define SOCKET_BUFFERED 0x08 /**< data has been received but not yet read */
+
+/**
+ * What a shard knows about one of its sockets
+ */
+typedef struct
+{
+	void* owner; /**< the owner given to Socket_new, or NULL */
+	int flags; /**< SOCKET_ADDED and the other socket flags */
+} Socket_entry;
 
 /*BE
 def FD_SET
@@ -88,27 +135,58 @@ BE*/
  */
 typedef struct
 {
+#if defined(USE_EPOLL)
+	int epfd; /**< epoll descriptor: every socket for reading, and for writing while a connect or write is pending */
+	struct epoll_event events[SOCKET_EPOLL_EVENTS]; /**< events from the last epoll_wait */
+	int nevents; /**< the number of entries in events */
+	int cur_event; /**< the next entry in events to look at (iterator) */
+#else
 	fd_set rset, /**< socket read set (see select doc) */
 		rset_saved; /**< saved socket read set */
 	int maxfdp1; /**< max descriptor used +1 (again see select doc) */
-	List* clientsds; /**< list of client socket descriptors */
 	ListElement* cur_clientsds; /**< current client socket descriptor (iterator) */
+	fd_set pending_wset; /**< socket pending write set for select */
+	fd_set wset; /**< sockets found writeable by the last select */
+	List* clientsds; /**< list of client socket descriptors */
 	List* connect_pending; /**< list of sockets for which a connect is pending */
 	List* write_pending; /**< list of sockets for which a write is pending */
-	fd_set pending_wset; /**< socket pending write set for select */
+#endif
+	int count; /**< the number of sockets in the shard */
+	List* buffered; /**< list of sockets with data received but not yet read, in the order they take turns */
+	Socket_entry* entries; /**< the owner and flags of each socket, indexed by socket number divided by the
+								number of shards, so that finding out about a socket never means a search */
+	int entrieslen; /**< the number of entries */
+	mutex_type mutex; /**< guards this structure */
+	int wakeup[2]; /**< pipe which interrupts select when the sets above change, -1 if none, as with epoll */
+	int selecting; /**< count of threads waiting in select */
 } Sockets;
 
 
-void Socket_outInitialize(void);
+/**
+ * Called, with no locks held, when output which had to be queued for a socket has all been
+ * written, or has dropped back below the high-water mark
+ */
+typedef void Socket_writeComplete(int socket);
+
+void Socket_outInitialize(int count);
+int Socket_shards(void);
+int Socket_shardOf(int socket);
+void Socket_setWriteCompleteCallback(Socket_writeComplete* fn);
 void Socket_outTerminate(void);
-int Socket_getReadySocket(int more_work, struct timeval *tp);
+int Socket_getReadySocket(int shard, int more_work, struct timeval *tp);
 int Socket_getch(int socket, char* c);
 char *Socket_getdata(int socket, int bytes, int* actual_len);
 int Socket_putdatas(int socket, char* buf0, int buf0len, int count, char** buffers, int* buflens);
+int Socket_putdatav(int socket, int count, char** buffers, int* buflens);
 void Socket_close(int socket);
-int Socket_new(char* addr, int port, int* socket);
+int Socket_new(char* addr, int port, int* socket, void* owner);
+void* Socket_getOwner(int socket);
 
 int Socket_noPendingWrites(int socket);
+int Socket_outputFull(int socket);
+void Socket_setHighWaterMark(int bytes);
+void Socket_setBusyPoll(int usecs);
+void Socket_setNoDelay(int on);
 char* Socket_getpeer(int sock);
 
 #endif /* SOCKET_H */
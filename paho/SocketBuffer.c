@@ -21,10 +21,12 @@
 #include "Log.h"
 #include "Messages.h"
 #include "StackTrace.h"
+#include "Thread.h"
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <memory.h>
+#include <string.h>
 
 #include "Heap.h"
 
@@ -34,64 +36,122 @@
 #endif
 
 /**
- * Default input queue buffer
+ * The input buffer of each socket which has been read from, indexed by socket number
  */
-static socket_queue* def_queue;
+static socket_queue** queues = NULL;
+static int queueslen = 0;
 
 /**
- * List of queued input buffers
+ * The output waiting to be written to each socket, indexed by socket number
  */
-static List* queues;
+static output_queue** outputs = NULL;
+static int outputslen = 0;
 
 /**
- * List of queued write buffers
+ * Guards the queues and outputs tables.  A socket's own input queue is only used by the
+ * thread reading that socket, so the data is read into it without the lock held; its output
+ * queue is guarded by the mutex of the socket's shard in the Socket module.
  */
-static List writes;
+#if defined(WIN32)
+mutex_type socketbuffer_mutex;
+#else
+static pthread_mutex_t socketbuffer_mutex_store = PTHREAD_MUTEX_INITIALIZER;
+static mutex_type socketbuffer_mutex = &socketbuffer_mutex_store;
+#endif
+
+/**
+ * The header of an input buffer.  Messages given to the application can refer to the data
+ * in a buffer rather than to a copy of it, so buffers are reference counted: the socket's
+ * queue holds one reference while it reads into the buffer, and each message holds one.
+ * Data which a message refers to is never moved, so a buffer with more than one reference
+ * is only added to; when it is full, what is left unread is copied to a new buffer.
+ */
+typedef struct
+{
+	int refs; /**< the number of references to the buffer */
+	int pad; /**< keeps the data which follows the header aligned */
+} buffer_header;
+
+#define SocketBuffer_header(buf) ((buffer_header*)(buf) - 1)
+
 
 /**
- * List callback function for comparing socket_queues by socket
- * @param a first integer value
- * @param b second integer value
- * @return boolean indicating whether a and b are equal
+ * Allocate a new input buffer, with one reference for the caller
+ * @param len the length of the buffer
+ * @return the buffer data
  */
-int socketcompare(void* a, void* b)
+static char* SocketBuffer_newBuffer(int len)
 {
-	return ((socket_queue*)a)->socket == *(int*)b;
+	buffer_header* header = malloc(sizeof(buffer_header) + len);
+
+	header->refs = 1;
+	return (char*)(header + 1);
 }
 
 
 /**
- * Create a new default queue when one has just been used.
+ * Release a reference to an input buffer, freeing it if it was the last one.  Must be called
+ * with the socketbuffer mutex held.
+ * @param buf the buffer data
  */
-void SocketBuffer_newDefQ(void)
+static void SocketBuffer_release_locked(char* buf)
 {
-	def_queue = malloc(sizeof(socket_queue));
-	def_queue->buflen = 1000;
-	def_queue->buf = malloc(def_queue->buflen);
-	def_queue->socket = def_queue->index = def_queue->buflen = def_queue->datalen = 0;
+	buffer_header* header = SocketBuffer_header(buf);
+
+	if (--(header->refs) == 0)
+		free(header);
 }
 
 
 /**
- * Initialize the socketBuffer module
+ * Find the input queue for a socket.  Must be called with the socketbuffer mutex held.
+ * @param socket the socket
+ * @param create boolean - create the queue if the socket does not have one yet
+ * @return the queue, or NULL
  */
-void SocketBuffer_initialize(void)
+static socket_queue* SocketBuffer_getQueue(int socket, int create)
 {
-	FUNC_ENTRY;
-	SocketBuffer_newDefQ();
-	queues = ListInitialize();
-	ListZero(&writes);
-	FUNC_EXIT;
+	socket_queue* queue = NULL;
+
+	if (socket >= 0 && socket < queueslen)
+		queue = queues[socket];
+	if (queue == NULL && create)
+	{
+		if (socket >= queueslen)
+		{
+			int newlen = (queueslen == 0) ? 64 : queueslen;
+
+			while (newlen <= socket)
+				newlen *= 2;
+			if (queues == NULL)
+				queues = malloc(sizeof(socket_queue*) * newlen);
+			else
+				queues = realloc(queues, sizeof(socket_queue*) * newlen);
+			memset(&queues[queueslen], '\0', sizeof(socket_queue*) * (newlen - queueslen));
+			queueslen = newlen;
+		}
+		queue = malloc(sizeof(socket_queue));
+		queue->socket = socket;
+		queue->start = queue->index = queue->datalen = 0;
+		queue->buflen = SOCKETBUFFER_READ_SIZE;
+		queue->buf = SocketBuffer_newBuffer(queue->buflen);
+		queues[socket] = queue;
+	}
+	return queue;
 }
 
 
 /**
- * Free the default queue memory
+ * Initialize the socketBuffer module
  */
-void SocketBuffer_freeDefQ(void)
+void SocketBuffer_initialize(void)
 {
-	free(def_queue->buf);
-	free(def_queue);
+	FUNC_ENTRY;
+	queues = NULL;
+	queueslen = 0;
+	outputs = NULL;
+	outputslen = 0;
+	FUNC_EXIT;
 }
 
 
@@ -100,14 +160,34 @@ void SocketBuffer_freeDefQ(void)
  */
 void SocketBuffer_terminate(void)
 {
-	ListElement* cur = NULL;
-	ListEmpty(&writes);
+	int i;
 
 	FUNC_ENTRY;
-	while (ListNextElement(queues, &cur))
-		free(((socket_queue*)(cur->content))->buf);
-	ListFree(queues);
-	SocketBuffer_freeDefQ();
+	for (i = 0; i < queueslen; ++i)
+	{
+		if (queues[i])
+		{
+			SocketBuffer_release_locked(queues[i]->buf);
+			free(queues[i]);
+		}
+	}
+	if (queues)
+		free(queues);
+	queues = NULL;
+	queueslen = 0;
+	for (i = 0; i < outputslen; ++i)
+	{
+		if (outputs[i])
+		{
+			if (outputs[i]->buf)
+				free(outputs[i]->buf);
+			free(outputs[i]);
+		}
+	}
+	if (outputs)
+		free(outputs);
+	outputs = NULL;
+	outputslen = 0;
 	FUNC_EXIT;
 }
 
@@ -118,261 +198,417 @@ void SocketBuffer_terminate(void)
  */
 void SocketBuffer_cleanup(int socket)
 {
+	socket_queue* queue = NULL;
+
 	FUNC_ENTRY;
-	if (ListFindItem(queues, &socket, socketcompare))
+	Thread_lock_mutex(socketbuffer_mutex);
+	if ((queue = SocketBuffer_getQueue(socket, 0)) != NULL)
+	{
+		SocketBuffer_release_locked(queue->buf);
+		free(queue);
+		queues[socket] = NULL;
+	}
+	if (socket >= 0 && socket < outputslen && outputs[socket])
 	{
-		free(((socket_queue*)(queues->current->content))->buf);
-		ListRemove(queues, queues->current->content);
+		if (outputs[socket]->buf)
+			free(outputs[socket]->buf);
+		free(outputs[socket]);
+		outputs[socket] = NULL;
 	}
-	if (def_queue->socket == socket)
-		def_queue->socket = def_queue->index = def_queue->headerlen = def_queue->datalen = 0;
+	Thread_unlock_mutex(socketbuffer_mutex);
 	FUNC_EXIT;
 }
 
 
 /**
- * Get any queued data for a specific socket
+ * Get the data buffered for a socket from the current read position, making room to receive
+ * more if less than the number of bytes wanted is buffered
  * @param socket the socket to get queued data for
- * @param bytes the number of bytes of data to retrieve
- * @param actual_len the actual length returned
- * @return the actual data
+ * @param bytes the number of bytes of data wanted
+ * @param actual_len returns the number of bytes buffered, which may be more than wanted
+ * @param room returns the number of bytes which can be received after those buffered, at
+ * least enough to make up the bytes wanted
+ * @return the data
  */
-char* SocketBuffer_getQueuedData(int socket, int bytes, int* actual_len)
+char* SocketBuffer_getQueuedData(int socket, int bytes, int* actual_len, int* room)
 {
 	socket_queue* queue = NULL;
 
 	FUNC_ENTRY;
-	if (ListFindItem(queues, &socket, socketcompare))
-	{  /* if there is queued data for this socket, add any data read to it */
-		queue = (socket_queue*)(queues->current->content);
-		*actual_len = queue->datalen;
-	}
-	else
-	{
-		*actual_len = 0;
-		queue = def_queue;
-	}
-	if (bytes > queue->buflen)
+	Thread_lock_mutex(socketbuffer_mutex);
+	queue = SocketBuffer_getQueue(socket, 1);
+	if (queue->datalen - queue->index < bytes)
 	{
-		if (queue->datalen > 0)
-		{
-			void* newmem = malloc(bytes);
-			memcpy(newmem, queue->buf, queue->datalen);
-			free(queue->buf);
-			queue->buf = newmem;
+		int refs = SocketBuffer_header(queue->buf)->refs;
+
+		if (queue->start == queue->datalen && refs == 1)
+		{	/* all read, so start again at the beginning, of a buffer of the usual size */
+			queue->start = queue->index = queue->datalen = 0;
+			if (queue->buflen > SOCKETBUFFER_READ_SIZE && bytes <= SOCKETBUFFER_READ_SIZE)
+			{
+				SocketBuffer_release_locked(queue->buf);
+				queue->buflen = SOCKETBUFFER_READ_SIZE;
+				queue->buf = SocketBuffer_newBuffer(queue->buflen);
+			}
+		}
+		if (queue->index + bytes > queue->buflen ||
+			(queue->start > 0 && queue->buflen - queue->datalen < SOCKETBUFFER_READ_SIZE / 4))
+		{	/* move what is not yet read to the beginning of a buffer large enough for the rest */
+			int keep = queue->datalen - queue->start;
+			int newlen = (queue->index - queue->start) + bytes;
+
+			if (newlen < SOCKETBUFFER_READ_SIZE)
+				newlen = SOCKETBUFFER_READ_SIZE;
+			if (refs > 1)
+			{
+				char* newmem = SocketBuffer_newBuffer(newlen);
+
+				memcpy(newmem, queue->buf + queue->start, keep);
+				SocketBuffer_release_locked(queue->buf);
+				queue->buf = newmem;
+			}
+			else
+			{
+				if (newlen > queue->buflen)
+				{
+					buffer_header* header = realloc(SocketBuffer_header(queue->buf), sizeof(buffer_header) + newlen);
+					queue->buf = (char*)(header + 1);
+				}
+				else
+					newlen = queue->buflen;
+				memmove(queue->buf, queue->buf + queue->start, keep);
+			}
+			queue->buflen = newlen;
+			queue->index -= queue->start;
+			queue->datalen -= queue->start;
+			queue->start = 0;
 		}
-		else
-			queue->buf = realloc(queue->buf, bytes);
-		queue->buflen = bytes;
 	}
+	Thread_unlock_mutex(socketbuffer_mutex);
 
+	*actual_len = queue->datalen - queue->index;
+	*room = queue->buflen - queue->datalen;
 	FUNC_EXIT;
-	return queue->buf;
+	return queue->buf + queue->index;
 }
 
 
 /**
- * Get any queued character for a specific socket
+ * Record data just received into the room made by SocketBuffer_getQueuedData
+ * @param socket the socket the data was received from
+ * @param len the number of bytes received
+ */
+void SocketBuffer_queued(int socket, int len)
+{
+	socket_queue* queue = NULL;
+
+	FUNC_ENTRY;
+	Thread_lock_mutex(socketbuffer_mutex);
+	queue = SocketBuffer_getQueue(socket, 1);
+	Thread_unlock_mutex(socketbuffer_mutex);
+	queue->datalen += len;
+	FUNC_EXIT;
+}
+
+
+/**
+ * Read the next buffered character for a specific socket
  * @param socket the socket to get queued data for
  * @param c the character returned if any
- * @return completion code
+ * @return completion code, SOCKETBUFFER_INTERRUPTED if no character is buffered
  */
 int SocketBuffer_getQueuedChar(int socket, char* c)
 {
 	int rc = SOCKETBUFFER_INTERRUPTED;
+	socket_queue* queue = NULL;
 
 	FUNC_ENTRY;
-	if (ListFindItem(queues, &socket, socketcompare))
-	{  /* if there is queued data for this socket, read that first */
-		socket_queue* queue = (socket_queue*)(queues->current->content);
-		if (queue->index < queue->headerlen)
-		{
-			*c = queue->fixed_header[(queue->index)++];
-			Log(TRACE_MAX, -1, "index is now %d, headerlen %d", queue->index, queue->headerlen);
-			rc = SOCKETBUFFER_COMPLETE;
-			goto exit;
-		}
-		else if (queue->index > 4)
-		{
-			Log(LOG_FATAL, -1, "header is already at full length");
-			rc = SOCKET_ERROR;
-			goto exit;
-		}
+	Thread_lock_mutex(socketbuffer_mutex);
+	queue = SocketBuffer_getQueue(socket, 0);
+	Thread_unlock_mutex(socketbuffer_mutex);
+	if (queue && queue->index < queue->datalen)
+	{
+		*c = queue->buf[(queue->index)++];
+		rc = SOCKETBUFFER_COMPLETE;
 	}
-exit:
 	FUNC_EXIT_RC(rc);
 	return rc;  /* there was no queued char if rc is SOCKETBUFFER_INTERRUPTED*/
 }
 
 
 /**
- * A socket read was interrupted so we need to queue data
- * @param socket the socket to get queued data for
- * @param actual_len the actual length of data that was read
+ * A packet could not be read completely from the data received so far, so go back to its
+ * start, to be read again when more data has arrived
+ * @param socket the socket being read
  */
-void SocketBuffer_interrupted(int socket, int actual_len)
+void SocketBuffer_interrupted(int socket)
 {
 	socket_queue* queue = NULL;
 
 	FUNC_ENTRY;
-	if (ListFindItem(queues, &socket, socketcompare))
-		queue = (socket_queue*)(queues->current->content);
-	else /* new saved queue */
-	{
-		queue = def_queue;
-		ListAppend(queues, def_queue, sizeof(socket_queue)+def_queue->buflen);
-		SocketBuffer_newDefQ();
-	}
-	queue->index = 0;
-	queue->datalen = actual_len;
+	Thread_lock_mutex(socketbuffer_mutex);
+	queue = SocketBuffer_getQueue(socket, 0);
+	Thread_unlock_mutex(socketbuffer_mutex);
+	if (queue)
+		queue->index = queue->start;
 	FUNC_EXIT;
 }
 
 
 /**
- * A socket read has now completed so we can get rid of the queue
- * @param socket the socket for which the operation is now complete
- * @return pointer to the default queue data
+ * Take a reference to the input buffer holding data just read from a socket, so that the
+ * data stays valid after the socket is next read
+ * @param socket the socket the data was read from
+ * @param data the data, which must have been returned by the last read of the socket
+ * @return the buffer, to be passed to SocketBuffer_release, or NULL if the data is not in
+ * the socket's input buffer
  */
-char* SocketBuffer_complete(int socket)
+char* SocketBuffer_hold(int socket, char* data)
 {
+	socket_queue* queue = NULL;
+	char* buf = NULL;
+
 	FUNC_ENTRY;
-	if (ListFindItem(queues, &socket, socketcompare))
+	Thread_lock_mutex(socketbuffer_mutex);
+	queue = SocketBuffer_getQueue(socket, 0);
+	if (queue && data >= queue->buf && data <= queue->buf + queue->buflen)
 	{
-		socket_queue* queue = (socket_queue*)(queues->current->content);
-		SocketBuffer_freeDefQ();
-		def_queue = queue;
-		ListDetach(queues, queue);
+		buf = queue->buf;
+		++(SocketBuffer_header(buf)->refs);
 	}
-	def_queue->socket = def_queue->index = def_queue->headerlen = def_queue->datalen = 0;
+	Thread_unlock_mutex(socketbuffer_mutex);
 	FUNC_EXIT;
-	return def_queue->buf;
+	return buf;
 }
 
 
 /**
- * A socket operation had now completed so we can get rid of the queue
- * @param socket the socket for which the operation is now complete
- * @param c the character to queue
+ * Release a reference to an input buffer taken by SocketBuffer_hold
+ * @param buf the buffer
  */
-void SocketBuffer_queueChar(int socket, char c)
+void SocketBuffer_release(char* buf)
 {
-	int error = 0;
-	socket_queue* curq = def_queue;
-
 	FUNC_ENTRY;
-	if (ListFindItem(queues, &socket, socketcompare))
-		curq = (socket_queue*)(queues->current->content);
-	else if (def_queue->socket == 0)
-	{
-		def_queue->socket = socket;
-		def_queue->index = def_queue->datalen = 0;
-	}
-	else if (def_queue->socket != socket)
-	{
-		Log(LOG_FATAL, -1, "attempt to reuse socket queue");
-		error = 1;
-	}
-	if (curq->index > 4)
-	{
-		Log(LOG_FATAL, -1, "socket queue fixed_header field full");
-		error = 1;
-	}
-	if (!error)
-	{
-		curq->fixed_header[(curq->index)++] = c;
-		curq->headerlen = curq->index;
-	}
-	Log(TRACE_MAX, -1, "queueChar: index is now %d, headerlen %d", curq->index, curq->headerlen);
+	Thread_lock_mutex(socketbuffer_mutex);
+	SocketBuffer_release_locked(buf);
+	Thread_unlock_mutex(socketbuffer_mutex);
 	FUNC_EXIT;
 }
 
 
 /**
- * A socket write was interrupted so store the remaining data
- * @param socket the socket for which the write was interrupted
- * @param count the number of iovec buffers
- * @param iovecs buffer array
- * @param total total data length to be written
- * @param bytes actual data length that was written
+ * A packet has now been read completely, its remaining bytes being the next in the buffer
+ * @param socket the socket for which the operation is now complete
+ * @param bytes the number of bytes of the packet left to read, at most the number buffered
+ * @param more returns the number of bytes buffered after the packet
+ * @return pointer to the packet's remaining bytes, which stay valid until the socket is next read
  */
-void SocketBuffer_pendingWrite(int socket, int count, iobuf* iovecs, int total, int bytes)
+char* SocketBuffer_complete(int socket, int bytes, int* more)
 {
-	int i = 0;
-	pending_writes* pw = NULL;
+	socket_queue* queue = NULL;
+	char* data = NULL;
 
 	FUNC_ENTRY;
-	/* store the buffers until the whole packet is written */
-	pw = malloc(sizeof(pending_writes));
-	pw->socket = socket;
-	pw->bytes = bytes;
-	pw->total = total;
-	pw->count = count;
-	for (i = 0; i < count; i++)
-		pw->iovecs[i] = iovecs[i];
-	ListAppend(&writes, pw, sizeof(pw) + total);
+	Thread_lock_mutex(socketbuffer_mutex);
+	queue = SocketBuffer_getQueue(socket, 1);
+	Thread_unlock_mutex(socketbuffer_mutex);
+	data = queue->buf + queue->index;
+	queue->index += bytes;
+	queue->start = queue->index;
+	*more = queue->datalen - queue->start;
 	FUNC_EXIT;
+	return data;
 }
 
 
 /**
- * List callback function for comparing pending_writes by socket
- * @param a first integer value
- * @param b second integer value
- * @return boolean indicating whether a and b are equal
+ * Find the output queue for a socket.  Must be called with the socketbuffer mutex held.
+ * @param socket the socket
+ * @param create boolean - create the queue if the socket does not have one yet
+ * @return the queue, or NULL
  */
-int pending_socketcompare(void* a, void* b)
+static output_queue* SocketBuffer_getOutput(int socket, int create)
 {
-	return ((pending_writes*)a)->socket == *(int*)b;
+	output_queue* queue = NULL;
+
+	if (socket >= 0 && socket < outputslen)
+		queue = outputs[socket];
+	if (queue == NULL && create)
+	{
+		if (socket >= outputslen)
+		{
+			int newlen = (outputslen == 0) ? 64 : outputslen;
+
+			while (newlen <= socket)
+				newlen *= 2;
+			if (outputs == NULL)
+				outputs = malloc(sizeof(output_queue*) * newlen);
+			else
+				outputs = realloc(outputs, sizeof(output_queue*) * newlen);
+			memset(&outputs[outputslen], '\0', sizeof(output_queue*) * (newlen - outputslen));
+			outputslen = newlen;
+		}
+		queue = malloc(sizeof(output_queue));
+		memset(queue, '\0', sizeof(output_queue));
+		queue->socket = socket;
+		outputs[socket] = queue;
+	}
+	return queue;
 }
 
 
 /**
- * Get any queued write data for a specific socket
- * @param socket the socket to get queued data for
- * @return pointer to the queued data or NULL
+ * Copy data to the end of an output ring, which has room for it
+ * @param queue the output queue
+ * @param data the data
+ * @param len the length of the data
  */
-pending_writes* SocketBuffer_getWrite(int socket)
+static void SocketBuffer_copyOut(output_queue* queue, char* data, int len)
 {
-	ListElement* le = ListFindItem(&writes, &socket, pending_socketcompare);
-	return (le) ? (pending_writes*)(le->content) : NULL;
+	int pos = (queue->start + queue->len) % queue->buflen;
+	int first = (len < queue->buflen - pos) ? len : queue->buflen - pos;
+
+	memcpy(queue->buf + pos, data, first);
+	if (len > first)
+		memcpy(queue->buf, data + first, len - first);
+	queue->len += len;
 }
 
 
 /**
- * A socket write has now completed so we can get rid of the queue
- * @param socket the socket for which the operation is now complete
- * @return completion code, boolean - was the queue removed?
+ * Queue data to be written to a socket when it is next writeable, after anything already
+ * queued.  The data is copied, so the caller keeps its buffers.
+ * @param socket the socket
+ * @param count the number of iovec buffers
+ * @param iovecs the buffers
+ * @param skip the number of bytes at the start of the buffers which have already been written
+ * @return the number of bytes now queued for the socket
+ */
+int SocketBuffer_queueWrite(int socket, int count, iobuf* iovecs, unsigned long skip)
+{
+	output_queue* queue = NULL;
+	int i, add = 0;
+
+	FUNC_ENTRY;
+	Thread_lock_mutex(socketbuffer_mutex);
+	queue = SocketBuffer_getOutput(socket, 1);
+	Thread_unlock_mutex(socketbuffer_mutex);
+	for (i = 0; i < count; i++)
+		add += iovecs[i].iov_len;
+	add -= skip;
+	if (queue->len + add > queue->buflen)
+	{	/* move what is queued to the beginning of a larger ring */
+		int newlen = (queue->buflen < SOCKETBUFFER_WRITE_SIZE) ? SOCKETBUFFER_WRITE_SIZE : queue->buflen;
+		char* newbuf = NULL;
+		int len = queue->len;
+
+		while (newlen < queue->len + add)
+			newlen *= 2;
+		newbuf = malloc(newlen);
+		if (len > 0)
+		{
+			int first = (len < queue->buflen - queue->start) ? len : queue->buflen - queue->start;
+
+			memcpy(newbuf, queue->buf + queue->start, first);
+			memcpy(newbuf + first, queue->buf, len - first);
+		}
+		if (queue->buf)
+			free(queue->buf);
+		queue->buf = newbuf;
+		queue->buflen = newlen;
+		queue->start = 0;
+	}
+	for (i = 0; i < count; i++)
+	{
+		int len = iovecs[i].iov_len;
+
+		if (skip >= len)
+			skip -= len;
+		else
+		{
+			SocketBuffer_copyOut(queue, (char*)iovecs[i].iov_base + skip, len - skip);
+			skip = 0;
+		}
+	}
+	FUNC_EXIT_RC(queue->len);
+	return queue->len;
+}
+
+
+/**
+ * Get the output queued for a socket, in at most two buffers because the queue is a ring
+ * @param socket the socket
+ * @param iovecs returns the buffers, an array of two
+ * @return the number of buffers, 0 if there is nothing queued
  */
-int SocketBuffer_writeComplete(int socket)
+int SocketBuffer_getWrite(int socket, iobuf* iovecs)
 {
-	return ListRemoveItem(&writes, &socket, pending_socketcompare);
+	output_queue* queue = NULL;
+	int count = 0;
+
+	Thread_lock_mutex(socketbuffer_mutex);
+	queue = SocketBuffer_getOutput(socket, 0);
+	Thread_unlock_mutex(socketbuffer_mutex);
+	if (queue && queue->len > 0)
+	{
+		int first = (queue->len < queue->buflen - queue->start) ? queue->len : queue->buflen - queue->start;
+
+		iovecs[count].iov_base = queue->buf + queue->start;
+		iovecs[count++].iov_len = first;
+		if (queue->len > first)
+		{
+			iovecs[count].iov_base = queue->buf;
+			iovecs[count++].iov_len = queue->len - first;
+		}
+	}
+	return count;
 }
 
 
 /**
- * Update the queued write data for a socket in the case of QoS 0 messages.
- * @param socket the socket for which the operation is now complete
- * @param topic the topic of the QoS 0 write
- * @param payload the payload of the QoS 0 write
- * @return pointer to the updated queued data structure, or NULL
+ * Remove output which has now been written from the front of a socket's queue.  The ring
+ * is freed when it is empty, as most sockets have nothing queued most of the time.
+ * @param socket the socket
+ * @param bytes the number of bytes written
+ * @return the number of bytes still queued
  */
-pending_writes* SocketBuffer_updateWrite(int socket, char* topic, char* payload)
+int SocketBuffer_wrote(int socket, int bytes)
 {
-	pending_writes* pw = NULL;
-	ListElement* le = NULL;
+	output_queue* queue = NULL;
+	int rc = 0;
 
-	FUNC_ENTRY;
-	if ((le = ListFindItem(&writes, &socket, pending_socketcompare)) != NULL)
+	Thread_lock_mutex(socketbuffer_mutex);
+	queue = SocketBuffer_getOutput(socket, 0);
+	Thread_unlock_mutex(socketbuffer_mutex);
+	if (queue)
 	{
-		pw = (pending_writes*)(le->content);
-		if (pw->count == 4)
+		if (bytes > queue->len)
+			bytes = queue->len;
+		queue->len -= bytes;
+		queue->start = (queue->len == 0) ? 0 : (queue->start + bytes) % queue->buflen;
+		if (queue->len == 0 && queue->buf)
 		{
-			pw->iovecs[2].iov_base = topic;
-			pw->iovecs[3].iov_base = payload;
+			free(queue->buf);
+			queue->buf = NULL;
+			queue->buflen = 0;
 		}
+		rc = queue->len;
 	}
+	return rc;
+}
 
-	FUNC_EXIT;
-	return pw;
+
+/**
+ * Get the number of bytes of output queued for a socket
+ * @param socket the socket
+ * @return the number of bytes
+ */
+int SocketBuffer_queuedWrites(int socket)
+{
+	output_queue* queue = NULL;
+
+	Thread_lock_mutex(socketbuffer_mutex);
+	queue = SocketBuffer_getOutput(socket, 0);
+	Thread_unlock_mutex(socketbuffer_mutex);
+	return (queue) ? queue->len : 0;
 }
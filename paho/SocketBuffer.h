@@ -25,22 +25,31 @@
 	typedef struct iovec iobuf;
 #endif
 
+/**
+ * The input buffer of a socket.  Data is received into it in as large pieces as will fit,
+ * and packets are read from it one at a time.
+ */
 typedef struct
 {
 	int socket;
-	int index, headerlen;
-	char fixed_header[5];	/**< header plus up to 4 length bytes */
-	int buflen, 			/**< total length of the buffer */
-		datalen; 			/**< current length of data in buf */
+	int start,				/**< offset in buf of the packet being read */
+		index,				/**< offset in buf of the next byte to read */
+		datalen,			/**< offset in buf of the end of the data received */
+		buflen; 			/**< total length of the buffer */
 	char* buf;
 } socket_queue;
 
+/**
+ * The output of a socket which could not be written straight away, in a ring buffer
+ */
 typedef struct
 {
-	int socket, total, count;
-	unsigned long bytes;
-	iobuf iovecs[5];
-} pending_writes;
+	int socket;
+	int start,				/**< offset in buf of the first byte not yet written */
+		len,				/**< the number of bytes waiting to be written */
+		buflen;				/**< total length of the buffer, 0 when there is none */
+	char* buf;
+} output_queue;
 
 #define SOCKETBUFFER_COMPLETE 0
 #if !defined(SOCKET_ERROR)
@@ -48,18 +57,25 @@ typedef struct
 #endif
 #define SOCKETBUFFER_INTERRUPTED -2 /* must be the same value as TCPSOCKET_INTERRUPTED */
 
+/** the size of a socket's input buffer, unless a packet needs more */
+#define SOCKETBUFFER_READ_SIZE 8192
+/** the smallest output ring, which grows as output is queued */
+#define SOCKETBUFFER_WRITE_SIZE 4096
+
 void SocketBuffer_initialize(void);
 void SocketBuffer_terminate(void);
 void SocketBuffer_cleanup(int socket);
-char* SocketBuffer_getQueuedData(int socket, int bytes, int* actual_len);
+char* SocketBuffer_getQueuedData(int socket, int bytes, int* actual_len, int* room);
+void SocketBuffer_queued(int socket, int len);
 int SocketBuffer_getQueuedChar(int socket, char* c);
-void SocketBuffer_interrupted(int socket, int actual_len);
-char* SocketBuffer_complete(int socket);
-void SocketBuffer_queueChar(int socket, char c);
+void SocketBuffer_interrupted(int socket);
+char* SocketBuffer_complete(int socket, int bytes, int* more);
+char* SocketBuffer_hold(int socket, char* data);
+void SocketBuffer_release(char* buf);
 
-void SocketBuffer_pendingWrite(int socket, int count, iobuf* iovecs, int total, int bytes);
-pending_writes* SocketBuffer_getWrite(int socket);
-int SocketBuffer_writeComplete(int socket);
-pending_writes* SocketBuffer_updateWrite(int socket, char* topic, char* payload);
+int SocketBuffer_queueWrite(int socket, int count, iobuf* iovecs, unsigned long skip);
+int SocketBuffer_getWrite(int socket, iobuf* iovecs);
+int SocketBuffer_wrote(int socket, int bytes);
+int SocketBuffer_queuedWrites(int socket);
 
 #endif
@@ -58,22 +58,44 @@ typedef struct
 
 static int thread_count = 0;
 static threadEntry threads[MAX_THREADS];
-static threadEntry *cur_thread = NULL;
 
 #if defined(WIN32)
 mutex_type stack_mutex;
 #else
 static pthread_mutex_t stack_mutex_store = PTHREAD_MUTEX_INITIALIZER;
 static mutex_type stack_mutex = &stack_mutex_store;
+
+/* each thread's entry is remembered here, so the mutex is only needed to register a thread */
+static pthread_key_t stack_key;
+static pthread_once_t stack_key_once = PTHREAD_ONCE_INIT;
+static threadEntry untracked; /**< marks threads for which there was no room in threads */
+
+static void StackTrace_createKey(void)
+{
+	pthread_key_create(&stack_key, NULL);
+}
 #endif
 
 
-int setStack(int create)
+/**
+ * Find the calling thread's stack entry.  Each entry is only changed by its own thread,
+ * so only the registration of a new thread is done under the stack mutex.
+ * @param create boolean - register the thread if it has no entry yet
+ * @return the thread's entry, or NULL if there is none
+ */
+static threadEntry* setStack(int create)
 {
 	int i = -1;
 	thread_id_type curid = Thread_getid();
+	threadEntry* cur_thread = NULL;
+
+#if !defined(WIN32)
+	pthread_once(&stack_key_once, StackTrace_createKey);
+	if ((cur_thread = pthread_getspecific(stack_key)) != NULL)
+		return (cur_thread == &untracked) ? NULL : cur_thread;
+#endif
 
-	cur_thread = NULL;
+	Thread_lock_mutex(stack_mutex);
 	for (i = 0; i < MAX_THREADS && i < thread_count; ++i)
 	{
 		if (threads[i].id == curid)
@@ -91,14 +113,23 @@ int setStack(int create)
 		cur_thread->current_depth = 0;
 		++thread_count;
 	}
-	return cur_thread != NULL; /* good == 1 */
+	Thread_unlock_mutex(stack_mutex);
+
+#if !defined(WIN32)
+	if (cur_thread != NULL)
+		pthread_setspecific(stack_key, cur_thread);
+	else if (create)
+		pthread_setspecific(stack_key, &untracked);
+#endif
+	return cur_thread;
 }
 
 void StackTrace_entry(const char* name, int line, int trace_level)
 {
-	Thread_lock_mutex(stack_mutex);
-	if (!setStack(1))
-		goto exit;
+	threadEntry* cur_thread = NULL;
+
+	if ((cur_thread = setStack(1)) == NULL)
+		return;
 	if (trace_level != -1)
 		Log_stackTrace(trace_level, 9, cur_thread->id, cur_thread->current_depth, name, line, NULL);
 	strncpy(cur_thread->callstack[cur_thread->current_depth].name, name, sizeof(cur_thread->callstack[0].name)-1);
@@ -107,16 +138,15 @@ void StackTrace_entry(const char* name, int line, int trace_level)
 		cur_thread->maxdepth = cur_thread->current_depth;
 	if (cur_thread->current_depth >= MAX_STACK_DEPTH)
 		Log(LOG_FATAL, -1, "Max stack depth exceeded");
-exit:
-	Thread_unlock_mutex(stack_mutex);
 }
 
 
 void StackTrace_exit(const char* name, int line, void* rc, int trace_level)
 {
-	Thread_lock_mutex(stack_mutex);
-	if (!setStack(0))
-		goto exit;
+	threadEntry* cur_thread = NULL;
+
+	if ((cur_thread = setStack(0)) == NULL)
+		return;
 	if (--(cur_thread->current_depth) < 0)
 		Log(LOG_FATAL, -1, "Minimum stack depth exceeded for thread %lu", cur_thread->id);
 	if (strncmp(cur_thread->callstack[cur_thread->current_depth].name, name, sizeof(cur_thread->callstack[0].name)-1) != 0)
@@ -128,8 +158,6 @@ void StackTrace_exit(const char* name, int line, void* rc, int trace_level)
 		else
 			Log_stackTrace(trace_level, 11, cur_thread->id, cur_thread->current_depth, name, line, (int*)rc);
 	}
-exit:
-	Thread_unlock_mutex(stack_mutex);
 }
 
 
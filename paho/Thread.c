@@ -62,6 +62,28 @@ thread_type Thread_start(thread_fn fn, void* parameter)
 }
 
 
+/**
+ * Wait for a thread started with Thread_start to end, and release it
+ * @param thread the thread
+ * @return completion code
+ */
+int Thread_join(thread_type thread)
+{
+	int rc = 0;
+
+	FUNC_ENTRY;
+	#if defined(WIN32)
+		if (WaitForSingleObject(thread, INFINITE) == WAIT_FAILED)
+			rc = GetLastError();
+		CloseHandle(thread);
+	#else
+		rc = pthread_join(thread, NULL);
+	#endif
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
 /**
  * Create a new mutex
  * @return the new mutex
@@ -158,10 +180,127 @@ thread_id_type Thread_getid()
 }
 
 
+#if !defined(WIN32)
 /**
- * Create a new semaphore
+ * Work out the absolute time a timed wait should end, as pthread_cond_timedwait wants
+ * @param ts the end time, returned
+ * @param timeout the length of the wait in milliseconds
+ */
+static void Thread_deadline(struct timespec* ts, long timeout)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	ts->tv_sec = now.tv_sec + timeout / 1000;
+	ts->tv_nsec = (now.tv_usec + (timeout % 1000) * 1000L) * 1000L;
+	if (ts->tv_nsec >= 1000000000L)
+	{
+		ts->tv_sec += 1;
+		ts->tv_nsec -= 1000000000L;
+	}
+}
+#endif
+
+
+/**
+ * Create a new condition variable
  * @return the new condition variable
  */
+cond_type Thread_create_cond()
+{
+	cond_type cond = NULL;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	#if defined(WIN32)
+		cond = CreateEvent(NULL, FALSE, FALSE, NULL);
+	#else
+		cond = malloc(sizeof(pthread_cond_t));
+		rc = pthread_cond_init(cond, NULL);
+	#endif
+	FUNC_EXIT_RC(rc);
+	return cond;
+}
+
+
+/**
+ * Wait for a condition variable to be signalled, for at most timeout milliseconds.
+ * The mutex must be locked by the caller; it is released while waiting and locked again
+ * before returning.  As with any condition variable, the caller should check the state it
+ * is waiting for again afterwards, as the wakeup may have been for something else.
+ * @param cond the condition variable
+ * @param mutex the mutex which guards the state being waited for
+ * @param timeout the maximum time to wait in milliseconds
+ * @return 0 if signalled, non-zero if the wait timed out or failed
+ */
+int Thread_wait_cond(cond_type cond, mutex_type mutex, long timeout)
+{
+	int rc = 0;
+#if !defined(WIN32)
+	struct timespec ts;
+#endif
+
+	FUNC_ENTRY;
+	#if defined(WIN32)
+		/* an event is not tied to the mutex, so a signal just before the wait starts can be
+		 * missed; the timeout bounds the delay that causes */
+		ReleaseMutex(mutex);
+		rc = WaitForSingleObject(cond, timeout);
+		WaitForSingleObject(mutex, INFINITE);
+	#else
+		Thread_deadline(&ts, timeout);
+		rc = pthread_cond_timedwait(cond, mutex, &ts);
+	#endif
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Wake all the threads waiting on a condition variable.  To be sure of waking a thread
+ * which is just about to wait, hold the mutex it waits with while signalling.
+ * @param cond the condition variable
+ * @return completion code
+ */
+int Thread_signal_cond(cond_type cond)
+{
+	int rc = 0;
+
+	#if defined(WIN32)
+		if (SetEvent(cond) == 0)
+			rc = GetLastError();
+	#else
+		rc = pthread_cond_broadcast(cond);
+	#endif
+	return rc;
+}
+
+
+/**
+ * Destroy a condition variable which has already been created
+ * @param cond the condition variable
+ * @return completion code
+ */
+int Thread_destroy_cond(cond_type cond)
+{
+	int rc = 0;
+
+	FUNC_ENTRY;
+	#if defined(WIN32)
+		rc = CloseHandle(cond);
+	#else
+		rc = pthread_cond_destroy(cond);
+		free(cond);
+	#endif
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Create a new semaphore
+ * @return the new semaphore
+ */
 sem_type Thread_create_sem()
 {
 	sem_type sem = NULL;
@@ -176,8 +315,10 @@ sem_type Thread_create_sem()
 		        NULL                // object name
 		        );
 	#else
-	  sem = malloc(sizeof(sem_t));
-	  rc = sem_init(sem, 0, 0);
+		sem = malloc(sizeof(sem_type_struct));
+		sem->value = 0;
+		if ((rc = pthread_mutex_init(&sem->mutex, NULL)) == 0)
+			rc = pthread_cond_init(&sem->cond, NULL);
 	#endif
 	FUNC_EXIT_RC(rc);
 	return sem;
@@ -185,42 +326,34 @@ sem_type Thread_create_sem()
 
 
 /**
- * Lock a mutex which has already been created, block until ready
- * @param mutex the mutex
- * @return completion code
+ * Wait for a semaphore to be posted, for at most timeout milliseconds.  The waiter is woken
+ * as soon as the semaphore is posted.
+ * @param sem the semaphore
+ * @param timeout the maximum time to wait in milliseconds
+ * @return 0 if the semaphore was taken, non-zero if the wait timed out or failed
  */
-int Thread_wait_sem(sem_type sem)
+int Thread_wait_sem(sem_type sem, long timeout)
 {
-/* sem_timedwait is the obvious call to use, but seemed not to work on the Viper,
- * so I've used trywait in a loop instead. Ian Craggs 23/7/2010
- */
 	int rc = -1;
-	int timeout = 10; /* seconds */
-#define USE_TRYWAIT
-#if defined(USE_TRYWAIT)
-	int i = 0;
-	int interval = 10000;
-	int count = (1000000 / interval) * timeout;
-#elif !defined(WIN32)
+#if !defined(WIN32)
 	struct timespec ts;
 #endif
 
 	FUNC_ENTRY;
 	#if defined(WIN32)
-		rc = WaitForSingleObject(sem, timeout*1000L);
-	#elif defined(USE_TRYWAIT)
-		while (++i < count && (rc = sem_trywait(sem)) != 0)
-		{
-			if (rc == -1 && ((rc = errno) != EAGAIN))
-				break;
-			usleep(interval); /* microseconds - .1 of a second */
-		}
+		rc = WaitForSingleObject(sem, timeout);
 	#else
-		if (clock_gettime(CLOCK_REALTIME, &ts) != -1)
+		Thread_deadline(&ts, timeout);
+		pthread_mutex_lock(&sem->mutex);
+		rc = 0;
+		while (sem->value == 0 && rc == 0)
+			rc = pthread_cond_timedwait(&sem->cond, &sem->mutex, &ts);
+		if (sem->value > 0)
 		{
-			ts.tv_sec += timeout;
-		    rc = sem_timedwait(sem, &ts);
+			--(sem->value);
+			rc = 0;
 		}
+		pthread_mutex_unlock(&sem->mutex);
 	#endif
 
  	FUNC_EXIT_RC(rc);
@@ -234,7 +367,10 @@ int Thread_check_sem(sem_type sem)
 	return WaitForSingleObject(sem, 0) == WAIT_OBJECT_0;
 #else
 	int semval = -1;
-	sem_getvalue(sem, &semval);
+
+	pthread_mutex_lock(&sem->mutex);
+	semval = sem->value;
+	pthread_mutex_unlock(&sem->mutex);
 	return semval > 0;
 #endif
 }
@@ -254,8 +390,10 @@ int Thread_post_sem(sem_type sem)
 		if (SetEvent(sem) == 0)
 			rc = GetLastError();
 	#else
-		if (sem_post(sem) == -1)
-			rc = errno;
+		pthread_mutex_lock(&sem->mutex);
+		++(sem->value);
+		rc = pthread_cond_signal(&sem->cond);
+		pthread_mutex_unlock(&sem->mutex);
 	#endif
 
  	FUNC_EXIT_RC(rc);
@@ -275,7 +413,8 @@ int Thread_destroy_sem(sem_type sem)
 	#if defined(WIN32)
 		rc = CloseHandle(sem);
 	#else
-		rc = sem_destroy(sem);
+		pthread_cond_destroy(&sem->cond);
+		rc = pthread_mutex_destroy(&sem->mutex);
 		free(sem);
 	#endif
 	FUNC_EXIT_RC(rc);
@@ -302,11 +441,11 @@ thread_return_type secondary(void* n)
 	sem_type sem = n;
 
 	printf("Secondary thread about to wait\n");
-	rc = Thread_wait_sem(sem);
+	rc = Thread_wait_sem(sem, 10000);
 	printf("Secondary thread returned from wait %d\n", rc);
 
 	printf("Secondary thread about to wait\n");
-	rc = Thread_wait_sem(sem);
+	rc = Thread_wait_sem(sem, 10000);
 	printf("Secondary thread returned from wait %d\n", rc);
 	printf("Secondary check sem %d\n", Thread_check_sem(sem));
 
@@ -24,18 +24,19 @@
 	#define sem_type HANDLE
 #else
 	#include <pthread.h>
-	#include <semaphore.h>
 	#define thread_type pthread_t
 	#define thread_id_type pthread_t
 	#define thread_return_type void*
 	typedef thread_return_type (*thread_fn)(void*);
 	#define mutex_type pthread_mutex_t*
-	typedef struct { pthread_cond_t cond; pthread_mutex_t mutex; } cond_type_struct;
-	typedef cond_type_struct *cond_type;
-	typedef sem_t *sem_type;
+	typedef pthread_cond_t *cond_type;
+	/* counting semaphore with a timed wait, which unnamed POSIX semaphores don't give on all platforms */
+	typedef struct { pthread_mutex_t mutex; pthread_cond_t cond; int value; } sem_type_struct;
+	typedef sem_type_struct *sem_type;
 #endif
 
 thread_type Thread_start(thread_fn, void*);
+int Thread_join(thread_type thread);
 
 mutex_type Thread_create_mutex();
 int Thread_lock_mutex(mutex_type);
@@ -44,8 +45,13 @@ void Thread_destroy_mutex(mutex_type);
 
 thread_id_type Thread_getid();
 
+cond_type Thread_create_cond();
+int Thread_wait_cond(cond_type cond, mutex_type mutex, long timeout);
+int Thread_signal_cond(cond_type cond);
+int Thread_destroy_cond(cond_type cond);
+
 sem_type Thread_create_sem();
-int Thread_wait_sem(sem_type sem);
+int Thread_wait_sem(sem_type sem, long timeout);
 int Thread_check_sem(sem_type sem);
 int Thread_post_sem(sem_type sem);
 int Thread_destroy_sem(sem_type sem);